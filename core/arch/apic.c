@@ -2,23 +2,44 @@
 
 #include <core/arch/apic.h>
 #include <core/arch/idt.h>
+#include <core/arch/epoch.h>
 #include <core/arch/io.h>
+#include <core/arch/pit.h>
+#include <core/arch/tsc.h>
+#include <core/arch/msr.h>
+#include <core/arch/percpu.h>
+#include <core/arch/smp.h>
+#include <core/arch/work_queue.h>
+#include <core/arch/softirq.h>
 #include <core/kernel/kstd.h>
 #include <core/kernel/tty.h>
+#include <core/kernel/mem/vmm.h>
+#include <core/kernel/hrtimer.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <log.h>
 
-// PIT constants for calibration
-#define PIT_FREQUENCY            1193182
-#define PIT_CMD                  0x43
-#define PIT_CHANNEL0             0x40
 #define CALIBRATION_MS           10
 
 static bool lapic_enabled = false;
 static uint32_t lapic_ticks_per_ms = 0;
 static volatile uint64_t apic_uptime_ms = 0;
 
+/*
+ * With the TSC as clock the timer is one-shot, through the TSC-deadline MSR
+ * or the LAPIC count, and is always armed for the earliest of: the next
+ * hrtimer, the next 1ms housekeeping tick and an idle CPU's wake-by time.
+ * While the BSP idles the housekeeping tick is off, so an idle system
+ * takes interrupts only for timers that are actually due. Without a
+ * calibrated TSC there is no clock to sleep against and the timer stays
+ * periodic.
+ */
+static apic_timer_mode_t timer_mode = APIC_TIMER_MODE_PERIODIC;
+static ktime_t           tick_next;
+static bool              tick_stopped;
+static ktime_t           idle_wake_by = KTIME_MAX;
+static apic_timer_stats_t timer_stats;
+
 static inline uint32_t lapic_read(uint32_t offset) {
     return *(volatile uint32_t*)(LAPIC_BASE + offset);
 }
@@ -42,28 +63,14 @@ static void pic_disable(void) {
 
 // Calibrate LAPIC timer against PIT channel 0 (~10ms window)
 static uint32_t lapic_calibrate(void) {
-    const uint16_t pit_ticks = (uint16_t)((uint32_t)PIT_FREQUENCY * CALIBRATION_MS / 1000);
-
-    // Program PIT channel 0: mode 0 (one-shot), lo/hi byte, binary
-    outb(PIT_CMD, 0x30);
-    outb(PIT_CHANNEL0, (uint8_t)(pit_ticks & 0xFF));
-    outb(PIT_CHANNEL0, (uint8_t)(pit_ticks >> 8));
+    pit_oneshot_start(CALIBRATION_MS);
 
     // Start LAPIC timer in one-shot mode with max count
     lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
     lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_ONESHOT | APIC_TIMER_VECTOR);
     lapic_write(LAPIC_TIMER_INITCNT, 0xFFFFFFFF);
 
-    // Wait for PIT countdown (detect wrap-around through 0)
-    uint16_t last = 0xFFFF;
-    while (true) {
-        outb(PIT_CMD, 0x00); // latch channel 0
-        uint8_t lo = inb(PIT_CHANNEL0);
-        uint8_t hi = inb(PIT_CHANNEL0);
-        uint16_t curr = lo | ((uint16_t)hi << 8);
-        if (curr == 0 || curr > last) break;
-        last = curr;
-    }
+    pit_oneshot_wait();
 
     uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRCNT);
     lapic_write(LAPIC_TIMER_INITCNT, 0);
@@ -71,12 +78,60 @@ static uint32_t lapic_calibrate(void) {
     return elapsed / CALIBRATION_MS;
 }
 
+// Work that needs doing about once a millisecond whichever mode the timer is in
+static inline void apic_tick(void) {
+    vmm_sync_tlb();
+    epoch_quiescent();
+}
+
+// LAPIC count that runs out at `t`; past the counter's range the timer fires early and is re-armed
+static uint32_t lapic_count_until(ktime_t t) {
+    ktime_t now = ktime_get();
+    uint64_t delta = t > now ? t - now : 0;
+    uint64_t ticks = delta * lapic_ticks_per_ms / NSEC_PER_MSEC;
+    return ticks == 0 ? 1 : ticks > UINT32_MAX ? UINT32_MAX : (uint32_t)ticks;
+}
+
+// Caller has interrupts off; this programs the BSP's housekeeping timer. Expired
+// hrtimers waiting for their softirq are left out, or the timer would fire at once.
+static void apic_timer_program(bool hrtimers) {
+    ktime_t next = hrtimers ? hrtimer_next_expiry() : KTIME_MAX;
+    if (!tick_stopped && tick_next < next) next = tick_next;
+    if (idle_wake_by < next) next = idle_wake_by;
+
+    if (timer_mode == APIC_TIMER_MODE_DEADLINE) {
+        // Writing 0 disarms the deadline
+        wrmsr(MSR_TSC_DEADLINE, next == KTIME_MAX ? 0 : tsc_from_ktime(next));
+        return;
+    }
+
+    lapic_write(LAPIC_TIMER_INITCNT, next == KTIME_MAX ? 0 : lapic_count_until(next));
+}
+
 // LAPIC timer ISR
 static void __attribute__((interrupt, target("general-regs-only")))
 apic_timer_handler(interrupt_frame_t* frame) {
     (void)frame;
-    apic_uptime_ms++;
+    timer_stats.interrupts++;
+    if (timer_mode != APIC_TIMER_MODE_PERIODIC) {
+        ktime_t now = ktime_get();
+        if (!tick_stopped && now >= tick_next) {
+            timer_stats.ticks++;
+            apic_tick();
+            tick_next += NSEC_PER_MSEC;
+            if (tick_next <= now) tick_next = now + NSEC_PER_MSEC;
+        }
+        bool expired = hrtimer_next_expiry() <= now;
+        if (expired) raise_softirq(SOFTIRQ_HRTIMER);
+        apic_timer_program(!expired);
+    } else {
+        timer_stats.ticks++;
+        apic_uptime_ms++;
+        apic_tick();
+        if (hrtimer_next_expiry() <= ktime_get()) raise_softirq(SOFTIRQ_HRTIMER);
+    }
     lapic_write(LAPIC_EOI, 0);
+    softirq_irq_exit();
 }
 
 bool apic_init(void) {
@@ -103,11 +158,28 @@ bool apic_init(void) {
 
     LOG_INFO("APIC: Timer frequency: %u ticks/ms\n", lapic_ticks_per_ms);
 
-    // Install ISR and start periodic timer (1ms period)
     idt_install_handler(APIC_TIMER_VECTOR, apic_timer_handler);
-    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
-    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
-    lapic_write(LAPIC_TIMER_INITCNT, lapic_ticks_per_ms);
+    if (tsc_available() && tsc_deadline_supported()) {
+        // The LVT write has to land before the first deadline is armed
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | APIC_TIMER_VECTOR);
+        __asm__ volatile("mfence" ::: "memory");
+        timer_mode = APIC_TIMER_MODE_DEADLINE;
+        tick_next = ktime_get() + NSEC_PER_MSEC;
+        apic_timer_program(true);
+        LOG_INFO("APIC: Timer in TSC-deadline mode\n");
+    } else if (tsc_available()) {
+        lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | APIC_TIMER_VECTOR);
+        timer_mode = APIC_TIMER_MODE_ONESHOT;
+        tick_next = ktime_get() + NSEC_PER_MSEC;
+        apic_timer_program(true);
+        LOG_INFO("APIC: Timer in one-shot mode\n");
+    } else {
+        // Periodic timer, 1ms period
+        lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+        lapic_write(LAPIC_TIMER_INITCNT, lapic_ticks_per_ms);
+    }
 
     lapic_enabled = true;
     __asm__ volatile("sti");
@@ -115,6 +187,25 @@ bool apic_init(void) {
     return true;
 }
 
+/*
+ * Enables an AP's own LAPIC so it can take IPIs. Its timer is one-shot
+ * and disarmed: apic_idle_while() arms it only to bound a halt, and it
+ * fires on WQ_IPI_VECTOR, whose handler just EOIs, so the housekeeping
+ * stays on the BSP.
+ */
+bool apic_ap_init(void) {
+    if (!lapic_enabled) return false;
+
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SVR_SPURIOUS_VEC);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | WQ_IPI_VECTOR);
+    lapic_write(LAPIC_TIMER_INITCNT, 0);
+    return true;
+}
+
 bool apic_available(void) {
     return lapic_enabled;
 }
@@ -124,5 +215,84 @@ void apic_eoi(void) {
 }
 
 uint64_t apic_get_uptime_ms(void) {
-    return apic_uptime_ms;
+    return timer_mode != APIC_TIMER_MODE_PERIODIC ? ktime_get_ms() : apic_uptime_ms;
+}
+
+void apic_timer_reprogram(void) {
+    if (timer_mode == APIC_TIMER_MODE_PERIODIC) return;
+
+    // A BSP idling without a tick would not see the new timer; any vector that only EOIs wakes it
+    if (this_cpu_id() != 0) {
+        percpu_t* bsp = percpu_get(0);
+        if (__atomic_load_n(&bsp->idle, __ATOMIC_SEQ_CST))
+            smp_send_ipi(bsp->lapic_id, WQ_IPI_VECTOR);
+        return;
+    }
+
+    uint64_t flags;
+    __asm__ volatile ("pushfq; popq %0; cli" : "=r"(flags) :: "memory");
+    apic_timer_program(true);
+    if (flags & (1ULL << 9))   // IF was set on entry
+        __asm__ volatile ("sti" ::: "memory");
+}
+
+void apic_idle(ktime_t wake_by) {
+    apic_idle_while(wake_by, NULL, 0);
+}
+
+void apic_idle_while(ktime_t wake_by, const volatile uint32_t* word, uint32_t value) {
+    uint64_t flags;
+    __asm__ volatile ("pushfq; popq %0; cli" : "=r"(flags) :: "memory");
+
+    // The periodic tick cannot be stopped; it still ends the hlt within a millisecond
+    bool bsp = this_cpu_id() == 0;
+    bool nohz = timer_mode != APIC_TIMER_MODE_PERIODIC && bsp;
+    // An AP has no tick, only the one-shot count apic_ap_init() left disarmed
+    bool ap_timer = !bsp && wake_by != KTIME_MAX;
+    percpu_t* cpu = this_cpu();
+
+    // Idle CPUs are skipped by TLB shootdowns and grace periods, and catch up below
+    __atomic_store_n(&cpu->idle, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    ktime_t start = ktime_get();
+    if (nohz) {
+        tick_stopped = true;
+        idle_wake_by = wake_by;
+        apic_timer_program(true);
+    }
+    if (ap_timer)
+        lapic_write(LAPIC_TIMER_INITCNT, lapic_count_until(wake_by));
+    timer_stats.idle_entries++;
+
+    // sti only takes effect after hlt, so a wake-up cannot slip in between.
+    // Softirqs raised since the caller last looked are work, not a reason to sleep.
+    if (!softirq_pending() && (!word || __atomic_load_n(word, __ATOMIC_ACQUIRE) == value))
+        __asm__ volatile ("sti; hlt; cli" ::: "memory");
+
+    __atomic_store_n(&cpu->idle, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (ap_timer)
+        lapic_write(LAPIC_TIMER_INITCNT, 0);
+
+    ktime_t now = ktime_get();
+    timer_stats.idle_ns += now - start;
+    if (nohz) {
+        tick_stopped = false;
+        idle_wake_by = KTIME_MAX;
+        tick_next = now + NSEC_PER_MSEC;
+        apic_timer_program(true);
+    }
+    apic_tick();
+
+    if (flags & (1ULL << 9))
+        __asm__ volatile ("sti" ::: "memory");
+}
+
+apic_timer_mode_t apic_timer_mode(void) {
+    return timer_mode;
+}
+
+void apic_timer_get_stats(apic_timer_stats_t* out) {
+    *out = timer_stats;
 }
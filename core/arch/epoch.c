@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/arch/epoch.h>
+#include <core/arch/percpu.h>
+#include <core/arch/smp.h>
+#include <core/kernel/sync/waitqueue.h>
+#include <log.h>
+
+#define EPOCH_STALL_MS  1000    // Warn about a CPU holding up a grace period this long
+
+static volatile uint64_t epoch_global = 1;
+
+/*
+ * Only the CPU itself reads its nesting count, so no fence is needed: the
+ * loads of a finished read section are ordered before this store.
+ */
+void epoch_quiescent(void) {
+    percpu_t* cpu = this_cpu();
+    if (cpu->epoch_nest) return;
+    __atomic_store_n(&cpu->epoch_qs, __atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+}
+
+static bool cpu_passed(uint32_t cpu_id, uint64_t target) {
+    percpu_t* cpu = percpu_get(cpu_id);
+    if (__atomic_load_n(&cpu->epoch_qs, __ATOMIC_ACQUIRE) >= target) return true;
+    // Halted CPUs hold no references and see the new version when they wake
+    return __atomic_load_n(&cpu->idle, __ATOMIC_SEQ_CST) != 0;
+}
+
+void epoch_synchronize(void) {
+    percpu_t* self = this_cpu();
+    if (self->epoch_nest) {
+        LOG_ERROR("epoch: synchronize from inside a read section on cpu%u\n", self->cpu_id);
+        return;
+    }
+
+    // Everything published before this point is older than `target`
+    uint64_t target = __atomic_add_fetch(&epoch_global, 1, __ATOMIC_SEQ_CST);
+    epoch_quiescent();
+
+    uint64_t deadline = wait_deadline(EPOCH_STALL_MS);
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (i == self->cpu_id) continue;
+        while (cpus[i].state == CPU_STATE_ONLINE && !cpu_passed(i, target)) {
+            if (deadline != WAIT_FOREVER && wait_expired(deadline)) {
+                LOG_WARN("epoch: cpu%u has not left its read section for %u ms\n",
+                         i, EPOCH_STALL_MS);
+                deadline = WAIT_FOREVER;
+            }
+            wait_yield();
+        }
+    }
+}
@@ -4,6 +4,7 @@
 
 static idt_entry_t idt_table[IDT_SIZE];
 static idtr_t      idt_idtr;
+static uint32_t    idt_next_dynamic = IDT_DYNAMIC_FIRST;
 
 #define EXC_NOERR(fn, msg)                                                     \
     static void __attribute__((interrupt, target("general-regs-only")))        \
@@ -92,4 +93,15 @@ void idt_load(void) {
 
 void idt_install_handler(uint8_t vector, void* handler) {
     idt_set_entry(vector, handler);
-}
\ No newline at end of file
+}
+
+uint8_t idt_alloc_vector(void* handler) {
+    uint32_t vector;
+    do {
+        vector = __atomic_fetch_add(&idt_next_dynamic, 1, __ATOMIC_RELAXED);
+        if (vector > IDT_DYNAMIC_LAST) return 0;
+    } while (vector == SYSCALL_INTERRUPT);   // The syscall gate sits inside the range
+
+    idt_set_entry((uint8_t)vector, handler);
+    return (uint8_t)vector;
+}
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/arch/percpu.h>
+#include <core/arch/smp.h>
+#include <core/arch/msr.h>
+
+static percpu_t percpu_areas[MAX_CPUS];
+
+// Called by each CPU for itself; the BSP calls it before anything allocates
+void percpu_init(uint32_t cpu_id, uint32_t lapic_id, struct cpu_info* info) {
+    if (cpu_id >= MAX_CPUS) return;
+
+    percpu_t* area = &percpu_areas[cpu_id];
+    area->self     = area;
+    area->cpu_id   = cpu_id;
+    area->lapic_id = lapic_id;
+    area->info     = info;
+
+    wrmsr(MSR_GS_BASE, (uint64_t)(uintptr_t)area);
+}
+
+percpu_t* percpu_get(uint32_t cpu_id) {
+    if (cpu_id >= MAX_CPUS) return NULL;
+    return &percpu_areas[cpu_id];
+}
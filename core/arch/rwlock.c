@@ -0,0 +1,62 @@
+#include <core/arch/rwlock.h>
+#include <core/arch/pause.h>
+#include <stddef.h>
+
+void rwlock_init(rwlock_t* lock) {
+    lock->state = 0;
+    lock->stats = NULL;
+}
+
+void rwlock_init_named(rwlock_t* lock, const char* name) {
+    rwlock_init(lock);
+    lock->stats = lock_stats_register(name);
+}
+
+void read_lock(rwlock_t* lock) {
+    uint64_t spins = 0;
+
+    for (;;) {
+        uint32_t old = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if (!(old & (RWLOCK_WRITER | RWLOCK_PENDING)) &&
+            __atomic_compare_exchange_n(&lock->state, &old, old + 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        cpu_relax();
+        spins++;
+    }
+
+    if (lock->stats)
+        lock_stats_acquired(lock->stats, spins, false);
+}
+
+void read_unlock(rwlock_t* lock) {
+    __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+}
+
+void write_lock(rwlock_t* lock) {
+    uint64_t spins = 0;
+
+    for (;;) {
+        uint32_t old = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        // Free apart from a pending flag, which may be ours or another writer's
+        if ((old & ~RWLOCK_PENDING) == 0 &&
+            __atomic_compare_exchange_n(&lock->state, &old, RWLOCK_WRITER, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        if (!(old & RWLOCK_PENDING))
+            __atomic_fetch_or(&lock->state, RWLOCK_PENDING, __ATOMIC_RELAXED);
+        cpu_relax();
+        spins++;
+    }
+
+    if (lock->stats)
+        lock_stats_acquired(lock->stats, spins, true);
+}
+
+void write_unlock(rwlock_t* lock) {
+    if (lock->stats)
+        lock_stats_released(lock->stats);
+
+    // Other writers still waiting re-raise RWLOCK_PENDING on their next spin
+    __atomic_fetch_and(&lock->state, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+}
@@ -1,10 +1,15 @@
 #include <core/arch/smp.h>
 #include <core/arch/idt.h>
 #include <core/arch/work_queue.h>
+#include <core/arch/percpu.h>
 #include <core/kernel/mem.h>
 #include <core/kernel/mem/slab.h>
 #include <core/kernel/mem/cpu_pool.h>
+#include <core/kernel/mem/vmm.h>
+#include <core/kernel/mem/scratch.h>
 #include <core/kernel/kstd.h>
+#include <core/kernel/boottime.h>
+#include <core/arch/delay.h>
 #include <core/arch/io.h>
 #include <log.h>
 #include <limine.h>
@@ -15,28 +20,21 @@ cpu_info_t       cpus[MAX_CPUS];
 volatile uint32_t cpu_count  = 0;
 volatile uint32_t cpus_online = 0;
 
+// Bring-up latency: from handing the AP its entry point to it reaching ap_entry's end
+static uint64_t ap_start_tsc[MAX_CPUS];
+static uint64_t ap_online_tsc[MAX_CPUS];
+
 #define LAPIC_BASE      0xFEE00000ULL
-#define LAPIC_ID        0x020
 #define LAPIC_ICR_LO    0x300
 #define LAPIC_ICR_HI    0x310
 
-static inline uint32_t lapic_read(uint32_t reg) {
-    volatile uint32_t* addr = (volatile uint32_t*)(LAPIC_BASE + reg);
-    return *addr;
-}
-
 static inline void lapic_write(uint32_t reg, uint32_t val) {
     volatile uint32_t* addr = (volatile uint32_t*)(LAPIC_BASE + reg);
     *addr = val;
 }
 
 uint32_t smp_current_cpu_id(void) {
-    uint32_t lapic_id = lapic_read(LAPIC_ID) >> 24;
-    for (uint32_t i = 0; i < cpu_count; i++) {
-        if (cpus[i].lapic_id == lapic_id)
-            return cpus[i].cpu_id;
-    }
-    return 0;
+    return this_cpu_id();
 }
 
 void smp_send_ipi(uint32_t lapic_id, uint8_t vector) {
@@ -53,23 +51,24 @@ void smp_halt_all(void) {
 }
 
 static void ap_entry(struct limine_mp_info* info) {
+    cpu_info_t* cpu = (cpu_info_t*)info->extra_argument;
+    percpu_init(cpu->cpu_id, cpu->lapic_id, cpu);
+
     idt_load();
 
-    cpu_info_t* cpu = (cpu_info_t*)info->extra_argument;
     cpu->state      = CPU_STATE_ONLINE;
     cpu->ready      = 1;
 
     slab_cpu_init(cpu->cpu_id);
     cpu_pool_init(cpu->cpu_id);
+    scratch_cpu_init(cpu->cpu_id);
 
+    __atomic_store_n(&ap_online_tsc[cpu->cpu_id], rdtsc(), __ATOMIC_RELEASE);
     __atomic_fetch_add(&cpus_online, 1, __ATOMIC_SEQ_CST);
 
     LOG_INFO("smp: AP %u online (lapic_id=%u)\n", cpu->cpu_id, cpu->lapic_id);
 
-    while (1) {
-        wq_run(cpu->cpu_id);
-        __asm__ volatile("pause");
-    }
+    wq_worker_loop();
 }
 
 void smp_init(struct limine_mp_response* mp) {
@@ -81,6 +80,7 @@ void smp_init(struct limine_mp_response* mp) {
         cpus[0].lapic_id = 0;
         cpus[0].state    = CPU_STATE_ONLINE;
         cpus[0].ready    = 1;
+        percpu_init(0, 0, &cpus[0]);
         return;
     }
 
@@ -89,16 +89,23 @@ void smp_init(struct limine_mp_response* mp) {
 
     LOG_INFO("smp: %u CPU(s) found\n", cpu_count);
 
-    for (uint32_t i = 0; i < cpu_count; i++) {
-        struct limine_mp_info* info = mp->cpus[i];
+    // The BSP is always cpu0: it has been using that per-CPU area since boot
+    uint32_t next_id = 1;
+    for (uint32_t n = 0; n < cpu_count; n++) {
+        struct limine_mp_info* info = mp->cpus[n];
+        bool is_bsp = (info->lapic_id == mp->bsp_lapic_id);
+        uint32_t i = is_bsp ? 0 : next_id++;
+        if (i >= cpu_count) continue;
+
         cpus[i].cpu_id   = i;
         cpus[i].lapic_id = info->lapic_id;
         cpus[i].ready    = 0;
 
-        if (info->lapic_id == mp->bsp_lapic_id) {
+        if (is_bsp) {
             cpus[i].state  = CPU_STATE_ONLINE;
             cpus[i].ready  = 1;
             cpus[i].stack  = NULL;
+            percpu_init(0, info->lapic_id, &cpus[0]);
             __atomic_fetch_add(&cpus_online, 1, __ATOMIC_SEQ_CST);
             LOG_INFO("smp: BSP cpu%u online (lapic_id=%u)\n", i, info->lapic_id);
             continue;
@@ -114,6 +121,7 @@ void smp_init(struct limine_mp_response* mp) {
         cpus[i].state = CPU_STATE_STARTING;
 
         info->extra_argument = (uint64_t)&cpus[i];
+        ap_start_tsc[i]      = rdtsc();
         info->goto_address   = ap_entry;
     }
 
@@ -125,6 +133,15 @@ void smp_init(struct limine_mp_response* mp) {
         LOG_WARN("smp: only %u/%u CPUs came online\n", cpus_online, cpu_count);
     else
         LOG_INFO("smp: all %u CPUs online\n", cpus_online);
+
+    int parent = boottime_current();
+    for (uint32_t i = 1; i < cpu_count; i++) {
+        // An AP that timed out has no online stamp and is left out
+        if (__atomic_load_n(&ap_online_tsc[i], __ATOMIC_ACQUIRE) == 0) continue;
+        char name[12] = "ap";
+        itoa((int)i, name + 2, 10);
+        boottime_record(name, parent, i, ap_start_tsc[i], ap_online_tsc[i]);
+    }
 }
 
 uint32_t smp_cpu_count(void) {
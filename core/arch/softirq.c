@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/arch/softirq.h>
+#include <core/arch/smp.h>
+#include <core/arch/tsc.h>
+#include <core/arch/epoch.h>
+#include <core/kernel/mem/vmm.h>
+#include <stddef.h>
+
+const char* const softirq_names[SOFTIRQ_COUNT] = {
+    [SOFTIRQ_HRTIMER] = "hrtimer",
+    [SOFTIRQ_BLOCK]   = "block",
+};
+
+static softirq_fn_t softirq_handlers[SOFTIRQ_COUNT];
+
+// Each CPU only writes its own row
+static softirq_stats_t softirq_stats[MAX_CPUS];
+
+static inline uint32_t softirq_take(void) {
+    uint32_t pending = 0;
+    __asm__ volatile("xchgl %0, %%gs:%c1" : "+r"(pending) : "i"(offsetof(percpu_t, softirq_pending)) : "memory");
+    return pending;
+}
+
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile ("pushfq; popq %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if (flags & (1ULL << 9))   // IF was set on entry
+        __asm__ volatile ("sti" ::: "memory");
+}
+
+void softirq_register(uint32_t nr, softirq_fn_t fn) {
+    if (nr < SOFTIRQ_COUNT)
+        softirq_handlers[nr] = fn;
+}
+
+/*
+ * Entered with interrupts off and softirq_disable raised by the caller.
+ * Bits are taken with interrupts off, then handled with them on, so an
+ * interrupt during a handler only adds bits for the next pass.
+ */
+static void softirq_do(void) {
+    percpu_t* cpu = this_cpu();
+    softirq_stats_t* st = &softirq_stats[cpu->cpu_id];
+    ktime_t end = ktime_get() + SOFTIRQ_BUDGET_NS;
+
+    for (uint32_t pass = 0; pass < SOFTIRQ_MAX_RESTART; pass++) {
+        uint32_t pending = softirq_take();
+        if (!pending) return;
+
+        __asm__ volatile ("sti" ::: "memory");
+        while (pending) {
+            uint32_t nr = (uint32_t)__builtin_ctz(pending);
+            pending &= pending - 1;
+            if (softirq_handlers[nr]) {
+                softirq_handlers[nr]();
+                st->runs[nr]++;
+            }
+        }
+        __asm__ volatile ("cli" ::: "memory");
+
+        if (ktime_get() >= end) break;
+    }
+
+    if (softirq_pending()) st->deferred++;
+}
+
+void softirq_irq_exit(void) {
+    percpu_t* cpu = this_cpu();
+    // Nested inside a running pass or a bh-disabled section: that owner picks the bits up
+    if (cpu->softirq_disable || !cpu->softirq_pending) return;
+
+    /*
+     * Woken from hlt: TLB purges and grace periods have been skipping this
+     * CPU, so catch up before a handler touches vmalloc or epoch memory.
+     * The hlt loop would clear the flag anyway once the interrupt returns.
+     */
+    if (__atomic_load_n(&cpu->idle, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&cpu->idle, 0, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        vmm_sync_tlb();
+        epoch_quiescent();
+    }
+
+    cpu->softirq_disable++;
+    softirq_do();
+    cpu->softirq_disable--;
+}
+
+void softirq_run(void) {
+    uint64_t flags = irq_save();
+    percpu_t* cpu = this_cpu();
+    if ((flags & (1ULL << 9)) && !cpu->softirq_disable && cpu->softirq_pending) {
+        cpu->softirq_disable++;
+        softirq_do();
+        cpu->softirq_disable--;
+    }
+    irq_restore(flags);
+}
+
+void local_bh_enable(void) {
+    __asm__ volatile("decl %%gs:%c0" : : "i"(offsetof(percpu_t, softirq_disable)) : "memory");
+    if (softirq_pending())
+        softirq_run();
+}
+
+int softirq_get_stats(uint32_t cpu_id, softirq_stats_t* out) {
+    if (cpu_id >= MAX_CPUS || !out) return -1;
+    *out = softirq_stats[cpu_id];
+    return 0;
+}
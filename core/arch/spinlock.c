@@ -1,51 +1,110 @@
 #include <core/arch/spinlock.h>
+#include <core/arch/pause.h>
+#include <core/arch/delay.h>
+#include <core/kernel/kstd.h>
+
+static lock_stats_t lock_stats_table[LOCK_STATS_MAX];
+static uint32_t lock_stats_used;
 
 void spinlock_init(spinlock_t* lock) {
-    lock->lock = 0;
+    lock->word = 0;
+    lock->stats = NULL;
+}
+
+void spinlock_init_named(spinlock_t* lock, const char* name) {
+    spinlock_init(lock);
+    lock->stats = lock_stats_register(name);
 }
 
 void spinlock_acquire(spinlock_t* lock) {
-    while (1) {
-        // Test and set operation using x86 atomic exchange
-        uint32_t expected = 0;
-        uint32_t new_value = 1;
-
-        __asm__ volatile (
-            "lock cmpxchgl %2, %1"
-            : "+a" (expected), "+m" (lock->lock)
-            : "r" (new_value)
-            : "cc", "memory"
-        );
-
-        if (expected == 0) {
-            // Successfully acquired the lock
-            break;
-        }
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    uint64_t spins = 0;
 
-        // Spin while waiting
-        __asm__ volatile ("pause" ::: "memory");
+    uint16_t owner;
+    while ((owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE)) != ticket) {
+        // Back off in proportion to our place in the queue
+        for (uint16_t i = (uint16_t)(ticket - owner); i > 0; i--) {
+            cpu_relax();
+            spins++;
+        }
     }
+
+    if (lock->stats)
+        lock_stats_acquired(lock->stats, spins, true);
 }
 
 void spinlock_release(spinlock_t* lock) {
-    __asm__ volatile (
-        "movl $0, %0"
-        : "=m" (lock->lock)
-        : "m" (lock->lock)
-        : "memory"
-    );
+    if (lock->stats)
+        lock_stats_released(lock->stats);
+
+    // Only the holder writes `owner`, so a plain increment is enough
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
 }
 
 bool spinlock_try_acquire(spinlock_t* lock) {
-    uint32_t expected = 0;
-    uint32_t new_value = 1;
+    uint32_t old = __atomic_load_n(&lock->word, __ATOMIC_RELAXED);
+    uint16_t owner = (uint16_t)old;
+    uint16_t next = (uint16_t)(old >> 16);
+    if (owner != next) return false;
+
+    uint32_t taken = ((uint32_t)(uint16_t)(next + 1) << 16) | owner;
+    if (!__atomic_compare_exchange_n(&lock->word, &old, taken, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return false;
+
+    if (lock->stats)
+        lock_stats_acquired(lock->stats, 0, true);
+    return true;
+}
+
+uint64_t spinlock_acquire_irqsave(spinlock_t* lock) {
+    uint64_t flags;
+    __asm__ volatile ("pushfq; popq %0; cli" : "=r"(flags) :: "memory");
+    spinlock_acquire(lock);
+    return flags;
+}
 
-    __asm__ volatile (
-        "lock cmpxchgl %2, %1"
-        : "+a" (expected), "+m" (lock->lock)
-        : "r" (new_value)
-        : "cc", "memory"
-    );
+void spinlock_release_irqrestore(spinlock_t* lock, uint64_t flags) {
+    spinlock_release(lock);
+    if (flags & (1ULL << 9))   // IF was set on entry
+        __asm__ volatile ("sti" ::: "memory");
+}
+
+lock_stats_t* lock_stats_register(const char* name) {
+    uint32_t slot = __atomic_fetch_add(&lock_stats_used, 1, __ATOMIC_RELAXED);
+    if (slot >= LOCK_STATS_MAX) {
+        __atomic_store_n(&lock_stats_used, LOCK_STATS_MAX, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    lock_stats_t* stats = &lock_stats_table[slot];
+    memset(stats, 0, sizeof(*stats));
+    strcpy_safe(stats->name, name, sizeof(stats->name));
+    return stats;
+}
+
+uint32_t lock_stats_count(void) {
+    uint32_t n = __atomic_load_n(&lock_stats_used, __ATOMIC_RELAXED);
+    return n < LOCK_STATS_MAX ? n : LOCK_STATS_MAX;
+}
+
+lock_stats_t* lock_stats_get(uint32_t index) {
+    return index < lock_stats_count() ? &lock_stats_table[index] : NULL;
+}
+
+// Shared readers count acquisitions and waits but leave hold times to writers
+void lock_stats_acquired(lock_stats_t* stats, uint64_t spins, bool exclusive) {
+    __atomic_fetch_add(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    if (spins) {
+        __atomic_fetch_add(&stats->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats->spins, spins, __ATOMIC_RELAXED);
+    }
+    if (exclusive)
+        stats->hold_start = rdtsc();
+}
 
-    return expected == 0;
+void lock_stats_released(lock_stats_t* stats) {
+    uint64_t held = rdtsc() - stats->hold_start;
+    if (held > stats->max_hold)
+        stats->max_hold = held;
 }
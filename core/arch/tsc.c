@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/arch/tsc.h>
+#include <core/arch/cpuid.h>
+#include <core/arch/delay.h>
+#include <core/arch/pit.h>
+#include <core/arch/apic.h>
+#include <core/arch/pause.h>
+#include <log.h>
+
+#define TSC_CALIBRATION_MS  50
+
+static uint64_t tsc_hz;
+static uint64_t tsc_base;           // TSC at ktime 0
+static uint64_t tsc_ns_mult;        // ns = cycles * tsc_ns_mult >> 32
+static uint64_t tsc_cyc_mult;       // cycles = ns * tsc_cyc_mult >> 32
+static bool     tsc_deadline;
+
+static uint64_t tsc_hz_from_cpuid(void) {
+    cpuid_result_t r;
+    cpuid(0, 0, &r);
+    if (r.eax < 0x15) return 0;
+
+    // Leaf 0x15: TSC = crystal * ebx / eax; many CPUs leave the crystal rate out
+    cpuid(0x15, 0, &r);
+    if (r.eax == 0 || r.ebx == 0 || r.ecx == 0) return 0;
+    return (uint64_t)r.ecx * r.ebx / r.eax;
+}
+
+static uint64_t tsc_hz_from_pit(void) {
+    pit_oneshot_start(TSC_CALIBRATION_MS);
+    uint64_t start = rdtsc_serialized();
+    pit_oneshot_wait();
+    uint64_t end = rdtsc_serialized();
+    return (end - start) * 1000 / TSC_CALIBRATION_MS;
+}
+
+void tsc_init(void) {
+    cpuid_result_t r;
+    cpuid(0x80000000, 0, &r);
+    bool invariant = false;
+    if (r.eax >= 0x80000007) {
+        cpuid(0x80000007, 0, &r);
+        invariant = (r.edx >> 8) & 1;
+    }
+    cpuid(1, 0, &r);
+    bool deadline = (r.ecx >> 24) & 1;
+
+    uint64_t hz = tsc_hz_from_cpuid();
+    const char* source = "cpuid";
+    if (hz == 0) {
+        hz = tsc_hz_from_pit();
+        source = "pit";
+    }
+    if (hz < 1000000) {
+        LOG_ERROR("tsc: calibration failed, keeping the APIC tick as the clock\n");
+        return;
+    }
+
+    tsc_ns_mult  = (NSEC_PER_SEC << 32) / hz;
+    tsc_cyc_mult = ((hz / 1000) << 32) / (NSEC_PER_SEC / 1000);
+    tsc_deadline = deadline;
+    tsc_base     = rdtsc();
+    __atomic_store_n(&tsc_hz, hz, __ATOMIC_RELEASE);
+
+    if (!invariant)
+        LOG_WARN("tsc: not invariant, the clock may drift with frequency changes\n");
+    LOG_INFO("tsc: %u kHz (%s), deadline timer %s\n", (uint32_t)(hz / 1000), source,
+             deadline ? "supported" : "not supported");
+}
+
+bool tsc_available(void) {
+    return __atomic_load_n(&tsc_hz, __ATOMIC_ACQUIRE) != 0;
+}
+
+bool tsc_deadline_supported(void) {
+    return tsc_deadline;
+}
+
+uint64_t tsc_get_hz(void) {
+    return tsc_hz;
+}
+
+uint64_t tsc_cycles_to_ns(uint64_t cycles) {
+    return (uint64_t)(((unsigned __int128)cycles * tsc_ns_mult) >> 32);
+}
+
+ktime_t ktime_get(void) {
+    if (!tsc_available())
+        return apic_get_uptime_ms() * NSEC_PER_MSEC;
+
+    // A CPU whose TSC is a few cycles behind the BSP's must not see time before 0
+    uint64_t now = rdtsc();
+    return now > tsc_base ? tsc_cycles_to_ns(now - tsc_base) : 0;
+}
+
+uint64_t tsc_from_ktime(ktime_t t) {
+    return tsc_base + (uint64_t)(((unsigned __int128)t * tsc_cyc_mult) >> 32);
+}
+
+void ndelay(uint64_t ns) {
+    if (!tsc_available()) {
+        busy_delay((uint32_t)(ns / 10 + 1));
+        return;
+    }
+    uint64_t end = rdtsc() + (uint64_t)(((unsigned __int128)ns * tsc_cyc_mult) >> 32);
+    while (rdtsc() < end)
+        cpu_relax();
+}
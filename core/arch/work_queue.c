@@ -1,81 +1,332 @@
 #include <core/arch/work_queue.h>
 #include <core/arch/smp.h>
 #include <core/arch/spinlock.h>
+#include <core/arch/percpu.h>
+#include <core/arch/softirq.h>
+#include <core/arch/apic.h>
+#include <core/arch/idt.h>
+#include <core/arch/pause.h>
+#include <core/arch/epoch.h>
+#include <core/kernel/mem/slab.h>
+#include <core/kernel/mem/vmm.h>
 #include <log.h>
 
-cpu_work_queue_t cpu_wqs[MAX_CPUS];
+/*
+ * Work items live in a slab cache, so submission only fails when memory
+ * does. Pinned items go to the target CPU's mailbox; everything else is
+ * balanced by stealing: an AP submitting work keeps it on its own deque,
+ * other callers feed a shared injection queue, and idle CPUs look at both
+ * before halting. APs run work with interrupts disabled and only take them
+ * while halted, which keeps the deque owner side free of reentrancy.
+ */
+
+static cpu_work_queue_t cpu_wqs[MAX_CPUS];
+static kmem_cache_t*    work_cache;
+
+static spinlock_t       inject_lock;
+static work_item_t*     inject_head;
+static work_item_t*     inject_tail;
+static volatile uint32_t inject_count;
+
+/* ---- Chase-Lev deque ---- */
+
+// Owner only
+static bool deque_push(cpu_work_queue_t* wq, work_item_t* item) {
+    int64_t b = __atomic_load_n(&wq->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&wq->top, __ATOMIC_ACQUIRE);
+    if (b - t >= WQ_DEQUE_SIZE) return false;
+
+    __atomic_store_n(&wq->deque[b & (WQ_DEQUE_SIZE - 1)], item, __ATOMIC_RELAXED);
+    __atomic_store_n(&wq->bottom, b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Owner only; races stealers for the last item
+static work_item_t* deque_pop(cpu_work_queue_t* wq) {
+    int64_t b = __atomic_load_n(&wq->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&wq->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&wq->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        __atomic_store_n(&wq->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    work_item_t* item = __atomic_load_n(&wq->deque[b & (WQ_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (t == b) {
+        if (!__atomic_compare_exchange_n(&wq->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            item = NULL;
+        __atomic_store_n(&wq->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return item;
+}
+
+// Any CPU; gives up on a lost race rather than retrying
+static work_item_t* deque_steal(cpu_work_queue_t* wq) {
+    int64_t t = __atomic_load_n(&wq->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&wq->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return NULL;
+
+    work_item_t* item = __atomic_load_n(&wq->deque[t & (WQ_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&wq->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return item;
+}
+
+static inline uint32_t deque_size(cpu_work_queue_t* wq) {
+    int64_t t = __atomic_load_n(&wq->top, __ATOMIC_ACQUIRE);
+    int64_t b = __atomic_load_n(&wq->bottom, __ATOMIC_ACQUIRE);
+    return b > t ? (uint32_t)(b - t) : 0;
+}
+
+/* ---- Mailbox and injection queue ---- */
+
+static void mailbox_push(cpu_work_queue_t* wq, work_item_t* item) {
+    // Counted first so the owner's decrement can never run ahead of it
+    __atomic_fetch_add(&wq->mailbox_count, 1, __ATOMIC_RELAXED);
+    work_item_t* head = __atomic_load_n(&wq->mailbox, __ATOMIC_RELAXED);
+    do {
+        item->next = head;
+    } while (!__atomic_compare_exchange_n(&wq->mailbox, &head, item, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Takes the whole stack and reverses it into submission order
+static work_item_t* mailbox_take(cpu_work_queue_t* wq) {
+    if (!__atomic_load_n(&wq->mailbox, __ATOMIC_RELAXED)) return NULL;
+
+    work_item_t* item = __atomic_exchange_n(&wq->mailbox, NULL, __ATOMIC_ACQUIRE);
+    work_item_t* list = NULL;
+    while (item) {
+        work_item_t* next = item->next;
+        item->next = list;
+        list = item;
+        item = next;
+    }
+    return list;
+}
+
+static void inject_push(work_item_t* item) {
+    item->next = NULL;
+    uint64_t flags = spinlock_acquire_irqsave(&inject_lock);
+    if (inject_tail)
+        inject_tail->next = item;
+    else
+        inject_head = item;
+    inject_tail = item;
+    __atomic_fetch_add(&inject_count, 1, __ATOMIC_RELAXED);
+    spinlock_release_irqrestore(&inject_lock, flags);
+}
+
+static work_item_t* inject_pop(void) {
+    if (!__atomic_load_n(&inject_count, __ATOMIC_RELAXED)) return NULL;
+
+    uint64_t flags = spinlock_acquire_irqsave(&inject_lock);
+    work_item_t* item = inject_head;
+    if (item) {
+        inject_head = item->next;
+        if (!inject_head) inject_tail = NULL;
+        __atomic_fetch_sub(&inject_count, 1, __ATOMIC_RELAXED);
+    }
+    spinlock_release_irqrestore(&inject_lock, flags);
+    return item;
+}
+
+/* ---- Wake-ups ---- */
+
+static void __attribute__((interrupt, target("general-regs-only")))
+wq_ipi_handler(interrupt_frame_t* frame) {
+    (void)frame;
+    // Nothing to do: the point was to bring the CPU out of hlt
+    apic_eoi();
+}
+
+static inline bool cpu_idle(uint32_t cpu_id) {
+    return __atomic_load_n(&percpu_get(cpu_id)->idle, __ATOMIC_SEQ_CST) != 0;
+}
+
+static void wake_cpu(uint32_t cpu_id) {
+    // Pairs with the fence in wq_worker_loop(): either the CPU sees the work or we see it idle
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (cpu_idle(cpu_id))
+        smp_send_ipi(cpus[cpu_id].lapic_id, WQ_IPI_VECTOR);
+}
+
+static void wake_one(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t self = this_cpu_id();
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        // The BSP also halts when idle, but it never runs queued work
+        if (i == self || cpus[i].state != CPU_STATE_ONLINE || !cpu_wqs[i].worker) continue;
+        if (cpu_idle(i)) {
+            smp_send_ipi(cpus[i].lapic_id, WQ_IPI_VECTOR);
+            return;
+        }
+    }
+}
+
+/* ---- Interface ---- */
 
 void wq_init(void) {
-    for (uint32_t i = 0; i < MAX_CPUS; i++) {
-        cpu_wqs[i].head = 0;
-        cpu_wqs[i].tail = 0;
-        spinlock_init(&cpu_wqs[i].lock);
+    spinlock_init(&inject_lock);
+    inject_head = inject_tail = NULL;
+    inject_count = 0;
+
+    work_cache = kmem_cache_create("work_item", sizeof(work_item_t), 0, NULL);
+    if (!work_cache)
+        LOG_ERROR("wq: cannot create work item cache\n");
+
+    idt_install_handler(WQ_IPI_VECTOR, wq_ipi_handler);
+}
+
+static work_item_t* work_alloc(work_fn_t fn, void* arg) {
+    if (!fn) return NULL;
+    work_item_t* item = kmem_cache_alloc(work_cache);
+    if (!item) {
+        LOG_WARN("wq: out of memory for work item\n");
+        return NULL;
     }
+    item->fn   = fn;
+    item->arg  = arg;
+    item->next = NULL;
+    return item;
 }
 
 int wq_submit(uint32_t cpu_id, work_fn_t fn, void* arg) {
     if (cpu_id >= cpu_count) return -1;
-    if (!fn) return -1;
 
-    cpu_work_queue_t* wq = &cpu_wqs[cpu_id];
-    spinlock_acquire(&wq->lock);
+    work_item_t* item = work_alloc(fn, arg);
+    if (!item) return -1;
 
-    uint32_t next = (wq->tail + 1) % WQ_MAX_ITEMS;
-    if (next == wq->head) {
-        spinlock_release(&wq->lock);
-        LOG_WARN("wq: cpu%u queue full\n", cpu_id);
-        return -1;
-    }
+    mailbox_push(&cpu_wqs[cpu_id], item);
+    if (cpu_id != this_cpu_id())
+        wake_cpu(cpu_id);
+    return 0;
+}
 
-    wq->items[wq->tail].fn  = fn;
-    wq->items[wq->tail].arg = arg;
-    wq->tail = next;
+int wq_submit_any(work_fn_t fn, void* arg) {
+    work_item_t* item = work_alloc(fn, arg);
+    if (!item) return -1;
 
-    spinlock_release(&wq->lock);
+    cpu_work_queue_t* wq = &cpu_wqs[this_cpu_id()];
+    if (!wq->worker || !deque_push(wq, item))
+        inject_push(item);
 
+    wake_one();
     return 0;
 }
 
-void wq_run(uint32_t cpu_id) {
-    if (cpu_id >= MAX_CPUS) return;
+static void run_item(cpu_work_queue_t* wq, work_item_t* item) {
+    work_fn_t fn = item->fn;
+    void* arg    = item->arg;
+    kmem_cache_free(work_cache, item);
+
+    fn(arg);
+    wq->executed++;
+    epoch_quiescent();
+}
+
+static work_item_t* steal_any(uint32_t self) {
+    // Start past ourselves so thieves spread over different victims
+    for (uint32_t n = 1; n < cpu_count; n++) {
+        uint32_t victim = (self + n) % cpu_count;
+        if (cpus[victim].state != CPU_STATE_ONLINE) continue;
+        work_item_t* item = deque_steal(&cpu_wqs[victim]);
+        if (item) return item;
+    }
+    return NULL;
+}
+
+uint32_t wq_run(uint32_t cpu_id) {
+    // Only the owner may run its mailbox and the bottom of its deque
+    if (cpu_id >= MAX_CPUS || cpu_id != this_cpu_id()) return 0;
     cpu_work_queue_t* wq = &cpu_wqs[cpu_id];
+    uint32_t ran = 0;
 
-    while (1) {
-        spinlock_acquire(&wq->lock);
-        if (wq->head == wq->tail) {
-            spinlock_release(&wq->lock);
-            break;
+    for (;;) {
+        work_item_t* list = mailbox_take(wq);
+        if (list) {
+            while (list) {
+                work_item_t* next = list->next;
+                __atomic_fetch_sub(&wq->mailbox_count, 1, __ATOMIC_RELAXED);
+                run_item(wq, list);
+                ran++;
+                list = next;
+            }
+            continue;
         }
-        work_item_t item = wq->items[wq->head];
-        wq->head = (wq->head + 1) % WQ_MAX_ITEMS;
-        spinlock_release(&wq->lock);
 
-        item.fn(item.arg);
+        work_item_t* item = deque_pop(wq);
+        if (!item) item = inject_pop();
+        if (!item) {
+            item = steal_any(cpu_id);
+            if (item) wq->stolen++;
+        }
+        if (!item) break;
+
+        run_item(wq, item);
+        ran++;
     }
+    return ran;
 }
 
-int wq_submit_any(work_fn_t fn, void* arg) {
-    uint32_t best_cpu  = UINT32_MAX;
-    uint32_t min_items = WQ_MAX_ITEMS + 1;
-
+// Cheap check for anything wq_run() would find; may report work that gets stolen first
+static bool work_available(uint32_t self) {
+    if (__atomic_load_n(&cpu_wqs[self].mailbox, __ATOMIC_ACQUIRE)) return true;
+    if (__atomic_load_n(&inject_count, __ATOMIC_ACQUIRE)) return true;
     for (uint32_t i = 0; i < cpu_count; i++) {
-        if (cpus[i].state != CPU_STATE_ONLINE) continue;
-        cpu_work_queue_t* wq = &cpu_wqs[i];
-        uint32_t pending = (wq->tail - wq->head + WQ_MAX_ITEMS) % WQ_MAX_ITEMS;
-        if (pending < min_items) {
-            min_items = pending;
-            best_cpu  = i;
+        if (cpus[i].state == CPU_STATE_ONLINE && deque_size(&cpu_wqs[i]))
+            return true;
+    }
+    return false;
+}
+
+void wq_worker_loop(void) {
+    uint32_t self = this_cpu_id();
+    percpu_t* cpu = this_cpu();
+    cpu_wqs[self].worker = true;
+
+    // Without a LAPIC nobody can send the wake-up IPI, so keep polling
+    bool can_halt = apic_available() && apic_ap_init();
+
+    for (;;) {
+        vmm_sync_tlb();
+        epoch_quiescent();
+        softirq_run();
+        if (wq_run(self)) continue;
+
+        if (!can_halt) {
+            cpu_relax();
+            continue;
+        }
+
+        __atomic_store_n(&cpu->idle, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!work_available(self) && !softirq_pending()) {
+            // sti only takes effect after hlt, so an IPI cannot slip in between
+            __asm__ volatile("sti; hlt; cli" ::: "memory");
         }
+        __atomic_store_n(&cpu->idle, 0, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
     }
-    if (best_cpu == UINT32_MAX) return -1;
-    return wq_submit(best_cpu, fn, arg);
 }
 
 uint32_t wq_pending(uint32_t cpu_id) {
     if (cpu_id >= MAX_CPUS) return 0;
     cpu_work_queue_t* wq = &cpu_wqs[cpu_id];
-    spinlock_acquire(&wq->lock);
-    uint32_t n = (wq->tail - wq->head + WQ_MAX_ITEMS) % WQ_MAX_ITEMS;
-    spinlock_release(&wq->lock);
-    return n;
+    return __atomic_load_n(&wq->mailbox_count, __ATOMIC_RELAXED) + deque_size(wq);
+}
+
+int wq_get_stats(uint32_t cpu_id, wq_cpu_stats_t* out) {
+    if (cpu_id >= cpu_count || !out) return -1;
+    cpu_work_queue_t* wq = &cpu_wqs[cpu_id];
+    out->executed = __atomic_load_n(&wq->executed, __ATOMIC_RELAXED);
+    out->stolen   = __atomic_load_n(&wq->stolen, __ATOMIC_RELAXED);
+    out->queued   = wq_pending(cpu_id);
+    out->idle     = cpu_idle(cpu_id);
+    return 0;
 }
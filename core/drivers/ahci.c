@@ -1,15 +1,27 @@
 // SPDX-License-Identifier: GPL-3.0-only
 
 #include <core/drivers/ahci.h>
+#include <core/drivers/pci.h>
 #include <core/fs/block.h>
+#include <core/fs/bio.h>
 #include <core/kernel/mem/allocator.h>
 #include <core/arch/io.h>
+#include <core/arch/spinlock.h>
+#include <core/kernel/sync/completion.h>
+#include <core/kernel/sync/waitqueue.h>
+#include <core/kernel/kstd.h>
 #include <log.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
 
+#define AHCI_PRDT_PER_CMD   8
+#define AHCI_CMD_LIST_SIZE  (AHCI_CMD_SLOTS * sizeof(hba_cmd_header_t))
+#define AHCI_CMD_TBL_SIZE   (sizeof(hba_cmd_tbl_t) + AHCI_PRDT_PER_CMD * sizeof(hba_prdt_entry_t))
+#define AHCI_CMD_TBL_ORDER  1   // 32 tables of 256 bytes
+#define AHCI_CMD_TIMEOUT_MS 2000
+
 static hba_mem_t* abar = NULL;
 
 static inline uint64_t virt_to_phys(void* virt) {
@@ -27,6 +39,16 @@ typedef struct {
     hba_cmd_tbl_t*   cmd_tbl[AHCI_CMD_SLOTS];
     uint64_t         sector_count;
     int              port_num;
+    completion_t     done;          // Signalled when the issued slot clears or the port faults
+    uint32_t         issued;        // Slot mask of the synchronous command in flight
+    int              status;
+    // Block-layer requests, one per command slot; `lock` guards them and the slot registers
+    spinlock_t       lock;
+    bool             ncq;           // Native Command Queuing: the drive reorders up to 32 commands
+    uint32_t         slot_mask;     // Slots the HBA and drive both support
+    uint32_t         active;        // Slots with a request in flight
+    blk_request_t*   slot_rq[AHCI_CMD_SLOTS];
+    uint64_t         slot_deadline[AHCI_CMD_SLOTS];
 } ahci_port_t;
 
 #define AHCI_MAX_DEVICES 8
@@ -44,51 +66,12 @@ static inline uint32_t mmio_read32(volatile uint32_t* addr) {
     return val;
 }
 
-static uint32_t pci_read32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
-    uint32_t addr = (1U << 31) | ((uint32_t)bus << 16) | ((uint32_t)slot << 11)
-                  | ((uint32_t)func << 8) | (offset & 0xFC);
-    outl(PCI_CONFIG_ADDR, addr);
-    return inl(PCI_CONFIG_DATA);
-}
-
-static void pci_write32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t val) {
-    uint32_t addr = (1U << 31) | ((uint32_t)bus << 16) | ((uint32_t)slot << 11)
-                  | ((uint32_t)func << 8) | (offset & 0xFC);
-    outl(PCI_CONFIG_ADDR, addr);
-    outl(PCI_CONFIG_DATA, val);
-}
-
 static uint64_t pci_find_ahci(void) {
-    for (uint16_t bus = 0; bus < 256; bus++) {
-        for (uint8_t slot = 0; slot < 32; slot++) {
-            for (uint8_t func = 0; func < 8; func++) {
-                uint32_t id = pci_read32(bus, slot, func, 0x00);
-                if (id == 0xFFFFFFFF || id == 0)
-                    continue;
-
-                uint32_t class_reg = pci_read32(bus, slot, func, 0x08);
-                uint8_t class_code = (class_reg >> 24) & 0xFF;
-                uint8_t subclass   = (class_reg >> 16) & 0xFF;
-
-                if (class_code == PCI_CLASS_STORAGE && subclass == PCI_SUBCLASS_AHCI) {
-                    uint32_t bar5 = pci_read32(bus, slot, func, 0x24);
-
-                    uint32_t cmd = pci_read32(bus, slot, func, 0x04);
-                    cmd |= (1 << 1) | (1 << 2);
-                    pci_write32(bus, slot, func, 0x04, cmd);
-
-                    return (uint64_t)(bar5 & 0xFFFFF000);
-                }
-
-                if (func == 0) {
-                    uint32_t hdr = pci_read32(bus, slot, func, 0x0C);
-                    if (!((hdr >> 16) & 0x80))
-                        break;
-                }
-            }
-        }
-    }
-    return 0;
+    const pci_device_t* dev = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_AHCI, PCI_ANY, 0);
+    if (!dev) return 0;
+
+    pci_enable_mmio_dma(dev);
+    return (uint64_t)(dev->bar[5] & 0xFFFFF000);
 }
 
 static int ahci_port_type(hba_port_t* port) {
@@ -142,55 +125,77 @@ static int ahci_find_free_slot(hba_port_t* port) {
     return -1;
 }
 
-static void ahci_port_rebase(ahci_port_t* dev) {
+static int ahci_port_rebase(ahci_port_t* dev) {
     hba_port_t* port = dev->port;
 
     ahci_stop_cmd(port);
 
-    void* cmd_base = kmalloc(1024);
-    memset(cmd_base, 0, 1024);
+    // Command list (1 KiB aligned) and received-FIS area (256 B aligned) share a page
+    uint64_t cmd_phys;
+    void* cmd_base = kalloc_pages(0, KALLOC_ZERO, &cmd_phys);
+    if (!cmd_base) return -1;
     dev->cmd_list = (hba_cmd_header_t*)cmd_base;
-    uint64_t cmd_phys = virt_to_phys(cmd_base);
     mmio_write32(&port->clb, (uint32_t)cmd_phys);
     mmio_write32(&port->clbu, (uint32_t)(cmd_phys >> 32));
 
-    void* fis = kmalloc(256);
-    memset(fis, 0, 256);
-    dev->fis_base = fis;
-    uint64_t fis_phys = virt_to_phys(fis);
+    uint64_t fis_phys = cmd_phys + AHCI_CMD_LIST_SIZE;
+    dev->fis_base = (uint8_t*)cmd_base + AHCI_CMD_LIST_SIZE;
     mmio_write32(&port->fb, (uint32_t)fis_phys);
     mmio_write32(&port->fbu, (uint32_t)(fis_phys >> 32));
 
+    uint64_t tbl_phys;
+    uint8_t* tbl_base = kalloc_pages(AHCI_CMD_TBL_ORDER, KALLOC_ZERO, &tbl_phys);
+    if (!tbl_base) {
+        kfree_pages(cmd_base);
+        return -1;
+    }
+
     hba_cmd_header_t* hdr = dev->cmd_list;
     for (int i = 0; i < AHCI_CMD_SLOTS; i++) {
-        hdr[i].prdtl = 8;
-        void* tbl = kmalloc(256 + 8 * sizeof(hba_prdt_entry_t));
-        memset(tbl, 0, 256 + 8 * sizeof(hba_prdt_entry_t));
-        dev->cmd_tbl[i] = (hba_cmd_tbl_t*)tbl;
-        uint64_t tbl_phys = virt_to_phys(tbl);
-        hdr[i].ctba  = (uint32_t)tbl_phys;
-        hdr[i].ctbau = (uint32_t)(tbl_phys >> 32);
+        hdr[i].prdtl = AHCI_PRDT_PER_CMD;
+        dev->cmd_tbl[i] = (hba_cmd_tbl_t*)(tbl_base + i * AHCI_CMD_TBL_SIZE);
+        uint64_t slot_phys = tbl_phys + i * AHCI_CMD_TBL_SIZE;
+        hdr[i].ctba  = (uint32_t)slot_phys;
+        hdr[i].ctbau = (uint32_t)(slot_phys >> 32);
     }
 
     mmio_write32(&port->serr, 0xFFFFFFFF);
     mmio_write32(&port->is, 0xFFFFFFFF);
 
     ahci_start_cmd(port);
+    return 0;
+}
+
+// Poll hook standing in for the port interrupt: completes once the slot retires or faults
+static void ahci_poll_port(void* arg) {
+    ahci_port_t* dev = (ahci_port_t*)arg;
+    if (!dev->issued) return;
+
+    if (mmio_read32(&dev->port->is) & HBA_PxIS_TFES) {
+        dev->status = -1;
+    } else if (!(mmio_read32(&dev->port->ci) & dev->issued)) {
+        dev->status = 0;
+    } else {
+        return;
+    }
+
+    dev->issued = 0;
+    complete(&dev->done);
 }
 
 static int ahci_issue_cmd(ahci_port_t* dev, int slot) {
     hba_port_t* port = dev->port;
 
+    reinit_completion(&dev->done);
+    dev->issued = 1u << slot;
     mmio_write32(&port->ci, 1 << slot);
 
-    for (int spin = 0; spin < 1000000; spin++) {
-        if (!(mmio_read32(&port->ci) & (1 << slot)))
-            return 0;
-        if (mmio_read32(&port->is) & HBA_PxIS_TFES)
-            return -1;
+    if (!wait_for_completion_polled(&dev->done, ahci_poll_port, dev, AHCI_CMD_TIMEOUT_MS)) {
+        dev->issued = 0;
+        return -1;
     }
 
-    return -1;
+    return dev->status;
 }
 
 static int ahci_identify(ahci_port_t* dev) {
@@ -209,11 +214,10 @@ static int ahci_identify(ahci_port_t* dev) {
     hba_cmd_tbl_t* tbl = dev->cmd_tbl[slot];
     memset(tbl, 0, sizeof(hba_cmd_tbl_t) + sizeof(hba_prdt_entry_t));
 
-    uint8_t* ident_buf = kmalloc(512);
+    uint64_t ident_phys;
+    uint8_t* ident_buf = kalloc_pages(0, KALLOC_ZERO, &ident_phys);
     if (!ident_buf) return -1;
-    memset(ident_buf, 0, 512);
 
-    uint64_t ident_phys = virt_to_phys(ident_buf);
     tbl->prdt_entry[0].dba  = (uint32_t)ident_phys;
     tbl->prdt_entry[0].dbau = (uint32_t)(ident_phys >> 32);
     tbl->prdt_entry[0].dbc  = 511;
@@ -227,7 +231,7 @@ static int ahci_identify(ahci_port_t* dev) {
     fis->device   = 0;
 
     if (ahci_issue_cmd(dev, slot) < 0) {
-        kfree(ident_buf);
+        kfree_pages(ident_buf);
         return -1;
     }
 
@@ -239,86 +243,168 @@ static int ahci_identify(ahci_port_t* dev) {
         dev->sector_count = *lba28;
     }
 
-    kfree(ident_buf);
+    // Words 75/76: NCQ queue depth and support; the HBA has its own slot count
+    uint32_t cap = mmio_read32(&abar->cap);
+    uint32_t slots = ((cap >> HBA_CAP_NCS_SHIFT) & 0x1F) + 1;
+    uint16_t qdepth = *(uint16_t*)(ident_buf + 150);
+    uint16_t sata_cap = *(uint16_t*)(ident_buf + 152);
+    dev->ncq = (cap & HBA_CAP_SNCQ) && (sata_cap & ATA_SATA_CAP_NCQ);
+    if (dev->ncq && (uint32_t)(qdepth & 0x1F) + 1 < slots)
+        slots = (qdepth & 0x1F) + 1;
+    dev->slot_mask = slots == AHCI_CMD_SLOTS ? 0xFFFFFFFFu : (1u << slots) - 1;
+
+    kfree_pages(ident_buf);
     return 0;
 }
 
-static int ahci_rw(ahci_port_t* dev, uint64_t lba, size_t count, void* buf, bool write) {
-    hba_port_t* port = dev->port;
-    uint8_t* ptr = (uint8_t*)buf;
-
-    while (count > 0) {
-        size_t chunk = (count > 128) ? 128 : count;
+static int ahci_fill_prdt(hba_cmd_tbl_t* tbl, uint8_t* buf, uint64_t bytes) {
+    int prdt_idx = 0;
+
+    while (bytes > 0) {
+        if (prdt_idx == AHCI_PRDT_PER_CMD) return -1;
+        uint64_t seg = (bytes > 0x400000) ? 0x400000 : bytes;
+        uint64_t p_phys = virt_to_phys(buf);
+        tbl->prdt_entry[prdt_idx].dba  = (uint32_t)p_phys;
+        tbl->prdt_entry[prdt_idx].dbau = (uint32_t)(p_phys >> 32);
+        tbl->prdt_entry[prdt_idx].dbc  = (uint32_t)(seg - 1);
+        tbl->prdt_entry[prdt_idx].i    = (bytes - seg == 0) ? 1 : 0;
+        bytes -= seg;
+        buf += seg;
+        prdt_idx++;
+    }
 
-        mmio_write32(&port->is, 0xFFFFFFFF);
+    return prdt_idx;
+}
 
-        int slot = ahci_find_free_slot(port);
-        if (slot < 0) return -1;
-
-        hba_cmd_header_t* hdr = &dev->cmd_list[slot];
-        hdr->cfl   = sizeof(fis_reg_h2d_t) / sizeof(uint32_t);
-        hdr->w     = write ? 1 : 0;
-        hdr->c     = 1;
-        hdr->prdtl = 0;
-
-        hba_cmd_tbl_t* tbl = dev->cmd_tbl[slot];
-
-        size_t bytes_left = chunk * AHCI_SECTOR_SIZE;
-        uint8_t* p = ptr;
-        int prdt_idx = 0;
-
-        while (bytes_left > 0) {
-            size_t seg = (bytes_left > 0x400000) ? 0x400000 : bytes_left;
-            uint64_t p_phys = virt_to_phys(p);
-            tbl->prdt_entry[prdt_idx].dba  = (uint32_t)p_phys;
-            tbl->prdt_entry[prdt_idx].dbau = (uint32_t)(p_phys >> 32);
-            tbl->prdt_entry[prdt_idx].dbc  = (uint32_t)(seg - 1);
-            tbl->prdt_entry[prdt_idx].i    = (bytes_left - seg == 0) ? 1 : 0;
-            bytes_left -= seg;
-            p += seg;
-            prdt_idx++;
-        }
+/*
+ * Issues a request in the lowest free slot and returns without waiting.
+ * With NCQ the drive itself holds every queued command and may reorder
+ * them; without it the HBA still accepts one command per slot and runs
+ * them back to back, which saves the round trip between commands.
+ */
+static int ahci_submit(struct block_device* bdev, blk_request_t* rq) {
+    ahci_port_t* ap = (ahci_port_t*)bdev->private_data;
+    if (rq->lba + rq->count > ap->sector_count)
+        return -EINVAL;
+
+    uint64_t flags = spinlock_acquire_irqsave(&ap->lock);
+    uint32_t free = ap->slot_mask & ~ap->active;
+    if (!free) {
+        spinlock_release_irqrestore(&ap->lock, flags);
+        return -EBUSY;
+    }
+    int slot = __builtin_ctz(free);
+    bool write = rq->op == BIO_WRITE;
+
+    hba_cmd_tbl_t* tbl = ap->cmd_tbl[slot];
+    int prdtl = ahci_fill_prdt(tbl, (uint8_t*)rq->buf, (uint64_t)rq->count * AHCI_SECTOR_SIZE);
+    if (prdtl < 0) {
+        spinlock_release_irqrestore(&ap->lock, flags);
+        return -EINVAL;
+    }
 
-        hdr->prdtl = (uint16_t)prdt_idx;
+    hba_cmd_header_t* hdr = &ap->cmd_list[slot];
+    hdr->cfl   = sizeof(fis_reg_h2d_t) / sizeof(uint32_t);
+    hdr->w     = write ? 1 : 0;
+    hdr->c     = 1;
+    hdr->prdtl = (uint16_t)prdtl;
 
-        fis_reg_h2d_t* fis = (fis_reg_h2d_t*)tbl->cfis;
-        memset(fis, 0, sizeof(fis_reg_h2d_t));
-        fis->fis_type = FIS_TYPE_REG_H2D;
-        fis->c        = 1;
+    uint64_t lba = rq->lba;
+    fis_reg_h2d_t* fis = (fis_reg_h2d_t*)tbl->cfis;
+    memset(fis, 0, sizeof(fis_reg_h2d_t));
+    fis->fis_type = FIS_TYPE_REG_H2D;
+    fis->c        = 1;
+    fis->device   = 1 << 6;
+    fis->lba0     = (uint8_t)(lba);
+    fis->lba1     = (uint8_t)(lba >> 8);
+    fis->lba2     = (uint8_t)(lba >> 16);
+    fis->lba3     = (uint8_t)(lba >> 24);
+    fis->lba4     = (uint8_t)(lba >> 32);
+    fis->lba5     = (uint8_t)(lba >> 40);
+    if (ap->ncq) {
+        // FPDMA QUEUED carries the count in the feature field and the tag in the count field
+        fis->command  = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+        fis->featurel = (uint8_t)(rq->count);
+        fis->featureh = (uint8_t)(rq->count >> 8);
+        fis->countl   = (uint8_t)(slot << 3);
+    } else {
         fis->command  = write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX;
-        fis->device   = 1 << 6;
-        fis->lba0     = (uint8_t)(lba);
-        fis->lba1     = (uint8_t)(lba >> 8);
-        fis->lba2     = (uint8_t)(lba >> 16);
-        fis->lba3     = (uint8_t)(lba >> 24);
-        fis->lba4     = (uint8_t)(lba >> 32);
-        fis->lba5     = (uint8_t)(lba >> 40);
-        fis->countl   = (uint8_t)(chunk);
-        fis->counth   = (uint8_t)(chunk >> 8);
-
-        if (ahci_issue_cmd(dev, slot) < 0)
-            return -1;
-
-        ptr   += chunk * AHCI_SECTOR_SIZE;
-        lba   += chunk;
-        count -= chunk;
+        fis->countl   = (uint8_t)(rq->count);
+        fis->counth   = (uint8_t)(rq->count >> 8);
     }
 
+    ap->slot_rq[slot] = rq;
+    ap->slot_deadline[slot] = wait_deadline(AHCI_CMD_TIMEOUT_MS);
+    ap->active |= 1u << slot;
+    if (ap->ncq)
+        mmio_write32(&ap->port->sact, 1u << slot);
+    mmio_write32(&ap->port->ci, 1u << slot);
+
+    spinlock_release_irqrestore(&ap->lock, flags);
     return 0;
 }
 
-static int ahci_read_blocks(struct block_device* dev, uint64_t lba, size_t count, void* buf) {
-    ahci_port_t* ap = (ahci_port_t*)dev->private_data;
-    if (lba + count > ap->sector_count)
-        return -1;
-    return ahci_rw(ap, lba, count, buf, false);
-}
+/*
+ * Completion reaper standing in for the port interrupt. A slot is done
+ * once its CI and SACT bits clear. A task-file error or a command past its
+ * deadline stops the port, which aborts everything still outstanding, so
+ * those requests fail with -EIO and the port restarts empty. Requests are
+ * finished after the lock is dropped, since finishing one may submit the
+ * next.
+ */
+static void ahci_poll(struct block_device* bdev) {
+    ahci_port_t* ap = (ahci_port_t*)bdev->private_data;
+    hba_port_t* port = ap->port;
+    struct { blk_request_t* rq; int status; } reaped[AHCI_CMD_SLOTS];
+    uint32_t n = 0;
+
+    uint64_t flags = spinlock_acquire_irqsave(&ap->lock);
+    if (!ap->active) {
+        spinlock_release_irqrestore(&ap->lock, flags);
+        return;
+    }
 
-static int ahci_write_blocks(struct block_device* dev, uint64_t lba, size_t count, const void* buf) {
-    ahci_port_t* ap = (ahci_port_t*)dev->private_data;
-    if (lba + count > ap->sector_count)
-        return -1;
-    return ahci_rw(ap, lba, count, (void*)buf, true);
+    uint32_t is = mmio_read32(&port->is);
+    if (is)
+        mmio_write32(&port->is, is);
+    uint32_t pending = ap->active & (mmio_read32(&port->ci) | mmio_read32(&port->sact));
+    uint32_t finished = ap->active & ~pending;
+
+    bool restart = (is & HBA_PxIS_TFES) != 0;
+    if (restart) {
+        LOG_ERROR("AHCI: Port %d task file error (tfd=0x%x)\n", ap->port_num, mmio_read32(&port->tfd));
+    } else {
+        for (uint32_t m = pending; m; m &= m - 1) {
+            int slot = __builtin_ctz(m);
+            if (wait_expired(ap->slot_deadline[slot])) {
+                LOG_ERROR("AHCI: Port %d command %d timed out\n", ap->port_num, slot);
+                restart = true;
+                break;
+            }
+        }
+    }
+    uint32_t failed = restart ? pending : 0;
+
+    for (uint32_t m = finished | failed; m; m &= m - 1) {
+        int slot = __builtin_ctz(m);
+        reaped[n].rq = ap->slot_rq[slot];
+        reaped[n].status = (failed & (1u << slot)) ? -EIO : 0;
+        n++;
+        ap->slot_rq[slot] = NULL;
+    }
+    ap->active &= ~(finished | failed);
+
+    if (restart) {
+        // Clearing ST drops CI and SACT; the error state goes with SERR and IS
+        ahci_stop_cmd(port);
+        mmio_write32(&port->serr, 0xFFFFFFFF);
+        mmio_write32(&port->is, 0xFFFFFFFF);
+        ahci_start_cmd(port);
+    }
+    spinlock_release_irqrestore(&ap->lock, flags);
+
+    for (uint32_t i = 0; i < n; i++)
+        blk_end_request(reaped[i].rq, reaped[i].status);
 }
 
 void ahci_init(void) {
@@ -354,15 +440,22 @@ void ahci_init(void) {
         ahci_port_t* ap = &ahci_devices[dev_idx];
         ap->port     = port;
         ap->port_num = i;
+        ap->issued   = 0;
+        ap->active   = 0;
+        init_completion(&ap->done);
+        spinlock_init_named(&ap->lock, "ahci_port");
 
-        ahci_port_rebase(ap);
+        if (ahci_port_rebase(ap) < 0) {
+            LOG_WARN("AHCI: Failed to allocate command memory for port %d\n", i);
+            continue;
+        }
 
         if (ahci_identify(ap) < 0) {
             LOG_WARN("AHCI: Failed to identify port %d\n", i);
             continue;
         }
 
-        LOG_DEBUG("AHCI: Port %d — %llu sectors\n", i, ap->sector_count);
+        LOG_DEBUG("AHCI: Port %d — %llu sectors%s\n", i, ap->sector_count, ap->ncq ? ", NCQ" : "");
 
         char name[8];
         name[0] = 's'; name[1] = 'd';
@@ -370,8 +463,10 @@ void ahci_init(void) {
         name[3] = '\0';
 
         block_device_ops_t ops = {
-            .read_blocks  = ahci_read_blocks,
-            .write_blocks = ahci_write_blocks,
+            .read_blocks  = blk_read_blocks,
+            .write_blocks = blk_write_blocks,
+            .submit       = ahci_submit,
+            .poll         = ahci_poll,
         };
 
         register_block_device(name, AHCI_SECTOR_SIZE, ap->sector_count, &ops, ap);
@@ -4,11 +4,17 @@
 #include <core/kernel/kstd.h>
 #include <core/kernel/vge/fb.h>
 #include <core/arch/io.h>
+#include <core/arch/epoch.h>
+#include <core/arch/apic.h>
+#include <core/arch/softirq.h>
+#include <core/arch/tsc.h>
 #include <core/kernel/nvm/nvm.h>
+#include <core/fs/block.h>
 #include <stdbool.h>
 
 #define KEYBOARD_DATA_PORT    0x60
 #define KEYBOARD_STATUS_PORT  0x64
+#define KEYBOARD_IDLE_POLL_MS 10
 
 #define HOTKEY_MOD_SHIFT 1
 #define HOTKEY_MOD_CTRL  2
@@ -195,9 +201,17 @@ bool keyboard_has_char(void) {
 }
 
 char keyboard_getchar(void) {    
+    // The shell idles here, so this also stands in for the tick when there is no APIC
     while (!keyboard_has_char()) {
         keyboard_poll();
         nvm_scheduler_tick();
+        epoch_quiescent();
+        softirq_run();
+        bcache_writeback();
+
+        // The controller is polled, not interrupt-driven, so an idle CPU still wakes to look at it
+        if (apic_available() && !nvm_has_runnable())
+            apic_idle(ktime_get() + KEYBOARD_IDLE_POLL_MS * NSEC_PER_MSEC);
     }
     return keyboard_buffer_pop();
 }
@@ -1,80 +1,162 @@
 // SPDX-License-Identifier: GPL-3.0-only
 
 #include <core/drivers/nvme.h>
+#include <core/drivers/pci.h>
 #include <core/fs/block.h>
+#include <core/fs/bio.h>
+#include <core/arch/spinlock.h>
+#include <core/arch/apic.h>
+#include <core/arch/idt.h>
+#include <core/arch/percpu.h>
+#include <core/arch/smp.h>
+#include <core/arch/softirq.h>
 #include <core/kernel/mem/allocator.h>
+#include <core/kernel/mem/vmm.h>
 #include <core/kernel/kstd.h>
+#include <core/kernel/sync/completion.h>
+#include <core/kernel/sync/mutex.h>
 #include <log.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
 
-#define PCI_CONFIG_ADDR 0xCF8
-#define PCI_CONFIG_DATA 0xCFC
-#define PCI_CLASS_NVME  0x010802
+#define PCI_CLASS_STORAGE   0x01
+#define PCI_SUBCLASS_NVM    0x08
+#define PCI_PROG_IF_NVME    0x02
 
 #define VIRT_TO_PHYS(addr) ((uint64_t)(addr) - get_hhdm_offset())
 
-static inline void outl(uint16_t port, uint32_t val) {
-    __asm__ volatile("outl %0, %1" :: "a"(val), "Nd"(port));
-}
+#define NVME_CMD_TIMEOUT_MS 2000
 
-static inline uint32_t inl(uint16_t port) {
-    uint32_t val;
-    __asm__ volatile("inl %1, %0" : "=a"(val) : "Nd"(port));
-    return val;
-}
-
-static uint32_t pci_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
-    uint32_t addr = (1u << 31) | ((uint32_t)bus << 16) |
-                    ((uint32_t)slot << 11) | ((uint32_t)func << 8) |
-                    (offset & 0xFC);
-    outl(PCI_CONFIG_ADDR, addr);
-    return inl(PCI_CONFIG_DATA);
-}
+static const pci_device_t* nvme_pci = NULL;
 
 static uint64_t nvme_find_bar(void) {
-    for (uint8_t slot = 0; slot < 32; slot++) {
-        uint32_t id = pci_read(0, slot, 0, 0x00);
-        if (id == 0xFFFFFFFF) continue;
-
-        uint32_t class_rev = pci_read(0, slot, 0, 0x08);
-        uint32_t class_code = class_rev >> 8;
+    const pci_device_t* dev = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_NVM, PCI_PROG_IF_NVME, 0);
+    if (!dev) return 0;
+    nvme_pci = dev;
 
-        if (class_code == PCI_CLASS_NVME) {
-            LOG_DEBUG("NVMe: found at PCI 00:%02x.0 (class=0x%x)\n", slot, class_code);
-
-            uint32_t bar0_lo = pci_read(0, slot, 0, 0x10);
-            uint32_t bar0_hi = pci_read(0, slot, 0, 0x14);
-
-            uint64_t bar = ((uint64_t)bar0_hi << 32) | (bar0_lo & ~0xFu);
-            return bar;
-        }
-    }
-    return 0;
+    LOG_DEBUG("NVMe: found at PCI %d:%d.%d\n", dev->bus, dev->slot, dev->func);
+    return ((uint64_t)dev->bar[1] << 32) | (dev->bar[0] & ~0xFu);
 }
 
 static volatile nvme_controller_regs_t* nvme_regs = NULL;
 static nvme_command_t* admin_sq = NULL;
 static nvme_completion_t* admin_cq = NULL;
-static nvme_command_t* io_sq = NULL;
-static nvme_completion_t* io_cq = NULL;
 
 static uint16_t admin_sq_tail = 0;
 static uint16_t admin_cq_head = 0;
-static uint16_t io_sq_tail = 0;
-static uint16_t io_cq_head = 0;
-static uint16_t command_id = 0;
 static uint8_t admin_cq_phase = 1;
-static uint8_t io_cq_phase = 1;
+
+// Admin commands run one at a time, at init or from a reset; their completion carries the status back
+static mutex_t      admin_mutex;
+static completion_t admin_done;
+static uint16_t admin_status = 0;
+static uint32_t admin_result = 0;
+
+/*
+ * One I/O queue pair per CPU, as many as the controller grants; CPU c
+ * submits to queue c % io_queue_count. Only the owning CPU posts to a
+ * queue, so its lock is uncontended unless another CPU is reaping it.
+ *
+ * Commands are tagged with their slot index and free tags are kept on a
+ * stack. A full ring keeps one entry empty, so there are never more
+ * commands than ring entries. A command that times out gets the whole
+ * controller reset: the controller may still be writing its buffer, and
+ * only a disabled one is known to have stopped, so nothing in flight is
+ * failed before that.
+ */
+#define NVME_MAX_IO_QUEUES  16
+#define NVME_IO_SLOTS       (NVME_IO_QUEUE_SIZE - 1)
+#define NVME_POLL_BATCH     32      // Completions finished per pass of nvme_reap()
+
+/*
+ * Data pointers. A buffer is translated page by page, so it only has to
+ * be contiguous in the kernel's address space. PRPs take any dword-aligned
+ * buffer; one that is not goes out as an SGL if the controller accepts
+ * byte-aligned ones, or through a bounce buffer if it does not, or if it
+ * needs more descriptors than a slot's list holds.
+ *
+ * Each slot owns one list, a PRP list or a single SGL segment. Lists are
+ * a power of two so none crosses a page, which would chain a PRP list.
+ * 512 bytes is 64 PRP entries, 256 KiB; a BLK_MAX_REQUEST_BYTES request
+ * spans at most 33 pages, which takes PRP1 and 32 list entries.
+ */
+#define NVME_MAX_DATA_PAGES  (BLK_MAX_REQUEST_BYTES / NVME_PAGE_SIZE + 1)  // Pages an unaligned request spans
+#define NVME_SLOT_LIST_BYTES 512
+#define NVME_SGL_MAX_DESC    (NVME_SLOT_LIST_BYTES / sizeof(nvme_sgl_desc_t))
+
+#if NVME_SLOT_LIST_BYTES / 8 < NVME_MAX_DATA_PAGES - 1
+#error "A slot's PRP list cannot cover the largest request"
+#endif
+#define NVME_BOUNCE_BUFFERS  8      // BLK_MAX_REQUEST_BYTES each, shared by all queues
+
+typedef struct {
+    blk_request_t* rq;
+    uint64_t       deadline;
+    void*          list;            // NVME_SLOT_LIST_BYTES carved from the queue's pool at setup
+    uint8_t*       bounce;          // Stands in for rq->buf, or NULL
+    bool           busy;
+} nvme_io_slot_t;
+
+typedef struct {
+    spinlock_t          lock;
+    uint16_t            qid;
+    uint16_t            depth;      // Entries per ring, at most NVME_IO_QUEUE_SIZE
+    nvme_command_t*     sq;
+    nvme_completion_t*  cq;
+    uint16_t            sq_tail;
+    uint16_t            cq_head;
+    uint8_t             cq_phase;
+    uint16_t            nfree;
+    volatile uint32_t   inflight;   // Busy slots
+    uint16_t            free_tags[NVME_IO_SLOTS];
+    nvme_io_slot_t      slots[NVME_IO_SLOTS];
+} nvme_io_queue_t;
+
+static nvme_io_queue_t* io_queues[NVME_MAX_IO_QUEUES];
+static uint32_t         io_queue_count = 0;
+
+#define NVME_LIVE       0
+#define NVME_RESETTING  1   // Submissions wait; the next task-context poll resets
+#define NVME_DEAD       2   // The reset failed; everything fails
+
+static volatile uint32_t ctrl_state = NVME_LIVE;
+static uint16_t          reset_qid, reset_tag;  // The timeout that asked for the reset
+
+/*
+ * With MSI-X each queue's completions interrupt the CPU that owns it, on
+ * one shared vector, and the ISR hands the reaping to SOFTIRQ_BLOCK. The
+ * admin queue stays polled: it only runs at init, and its entry is left
+ * masked. Any namespace will do for the softirq, since nvme_poll() reaps
+ * every queue.
+ */
+static pci_msix_t      msix;
+static bool            io_irq = false;
+static uint8_t         io_irq_vector = 0;
+static block_device_t* io_irq_dev = NULL;
+
+static bool       io_sgl = false;   // Byte-aligned SGLs accepted
+static uint16_t   io_oncs = 0;      // Optional commands: Dataset Management, Write Zeroes
+static bool       io_vwc = false;   // Volatile write cache, so flushes mean something
+static uint8_t*   bounce_pool = NULL;
+static uint32_t   bounce_free = 0;  // Free buffers of bounce_pool, by bit
+static spinlock_t bounce_lock;
 
 typedef struct {
     uint32_t nsid;
+    uint32_t index;                 // Into ns_devs
     uint64_t block_count;
     uint32_t block_size;
 } nvme_namespace_t;
 
-static uint64_t* prp_list_buf = NULL;
+/*
+ * Tags and bounce buffers are shared by every namespace, so a request one
+ * refused with -EBUSY may be waiting on another's completion. Its bit is
+ * set under the lock of whatever ran out, and the next reap that frees
+ * something reruns its queue.
+ */
+static block_device_t*   ns_devs[NVME_MAX_NAMESPACES];
+static volatile uint32_t ns_starved;
 
 static inline void mmio_write32(volatile uint32_t* addr, uint32_t value) {
     *addr = value;
@@ -111,54 +193,68 @@ static void nvme_write_doorbell(uint32_t queue_id, uint32_t value, bool is_sq) {
 }
 
 static int nvme_wait_ready(bool ready_state, uint32_t timeout_ms) {
-    for (uint32_t i = 0; i < timeout_ms * 100; i++) {
+    uint64_t deadline = wait_deadline(timeout_ms);
+    for (;;) {
         uint32_t csts = mmio_read32(&nvme_regs->csts);
         bool is_ready = (csts & NVME_CSTS_RDY) != 0;
 
         if (is_ready == ready_state) {
             return 0;
         }
-
-        for (volatile int j = 0; j < 1000; j++);
+        if (wait_expired(deadline)) {
+            return -1;
+        }
+        wait_yield();
     }
+}
 
-    return -1;
+/*
+ * Completion-queue reapers. Without interrupts they run as the poll hook of
+ * the submitter's wait; each one consumes the entry the controller posted
+ * and completes the waiting command.
+ */
+static void nvme_poll_admin_cq(void* arg) {
+    (void)arg;
+    volatile nvme_completion_t* cqe = &admin_cq[admin_cq_head];
+    if ((cqe->status & 1) != admin_cq_phase) return;
+
+    admin_status = (cqe->status >> 1) & 0x7FFF;
+    admin_result = cqe->dw0;
+    admin_cq_head = (admin_cq_head + 1) % NVME_ADMIN_QUEUE_SIZE;
+    if (admin_cq_head == 0) {
+        admin_cq_phase = !admin_cq_phase;
+    }
+    nvme_write_doorbell(0, admin_cq_head, false);
+    complete(&admin_done);
 }
 
-static int nvme_submit_admin_command(nvme_command_t* cmd) {
+// Caller holds admin_mutex
+static int nvme_admin_command_locked(nvme_command_t* cmd) {
     uint16_t slot = admin_sq_tail;
     memcpy(&admin_sq[slot], cmd, sizeof(nvme_command_t));
 
+    reinit_completion(&admin_done);
     admin_sq_tail = (admin_sq_tail + 1) % NVME_ADMIN_QUEUE_SIZE;
     nvme_write_doorbell(0, admin_sq_tail, true);
 
-    for (int timeout = 0; timeout < 10000; timeout++) {
-        nvme_completion_t* cqe = &admin_cq[admin_cq_head];
-        uint8_t phase = (cqe->status >> 0) & 1;
-
-        if (phase == admin_cq_phase) {
-            uint16_t status_code = (cqe->status >> 1) & 0x7FFF;
-            admin_cq_head = (admin_cq_head + 1) % NVME_ADMIN_QUEUE_SIZE;
-
-            if (admin_cq_head == 0) {
-                admin_cq_phase = !admin_cq_phase;
-            }
-
-            nvme_write_doorbell(0, admin_cq_head, false);
-
-            if (status_code != 0) {
-                LOG_ERROR("NVMe admin command failed with status: 0x%x\n", status_code);
-                return -1;
-            }
-
-            return 0;
-        }
+    if (!wait_for_completion_polled(&admin_done, nvme_poll_admin_cq, NULL, NVME_CMD_TIMEOUT_MS)) {
+        LOG_ERROR("NVMe admin command timeout\n");
+        return -1;
+    }
 
-        for (volatile int i = 0; i < 1000; i++);
+    if (admin_status != 0) {
+        LOG_ERROR("NVMe admin command failed with status: 0x%x\n", admin_status);
+        return -1;
     }
 
-    LOG_ERROR("NVMe admin command timeout\n");
-    return -1;
+    return 0;
+}
+
+static int nvme_submit_admin_command(nvme_command_t* cmd) {
+    mutex_lock(&admin_mutex);
+    int rc = nvme_admin_command_locked(cmd);
+    mutex_unlock(&admin_mutex);
+    return rc;
 }
 
 static int nvme_identify_active_namespaces(void* data) {
@@ -171,6 +267,16 @@ static int nvme_identify_active_namespaces(void* data) {
     return nvme_submit_admin_command(&cmd);
 }
 
+static int nvme_identify_controller(void* data) {
+    nvme_command_t cmd = {0};
+    cmd.cdw0 = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = 0;
+    cmd.prp1 = VIRT_TO_PHYS(data);
+    cmd.cdw10 = NVME_IDENTIFY_CNS_CONTROLLER;
+
+    return nvme_submit_admin_command(&cmd);
+}
+
 static int nvme_identify_namespace(uint32_t ns_id, void* data) {
     nvme_command_t cmd = {0};
     cmd.cdw0 = NVME_ADMIN_IDENTIFY;
@@ -181,14 +287,33 @@ static int nvme_identify_namespace(uint32_t ns_id, void* data) {
     return nvme_submit_admin_command(&cmd);
 }
 
-static int nvme_create_io_completion_queue(uint16_t qid, uint16_t size, void* buffer) {
+// Asks for `wanted` I/O queue pairs and returns how many the controller granted; caller holds admin_mutex
+static uint32_t nvme_request_queue_count(uint32_t wanted) {
+    nvme_command_t cmd = {0};
+    cmd.cdw0 = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+    cmd.cdw11 = ((wanted - 1) << 16) | (wanted - 1);
+
+    if (nvme_admin_command_locked(&cmd) < 0)
+        return 1;
+
+    // Both counts come back zero-based, and may exceed what was asked for
+    uint32_t sqs = (admin_result & 0xFFFF) + 1;
+    uint32_t cqs = (admin_result >> 16) + 1;
+    uint32_t granted = sqs < cqs ? sqs : cqs;
+    return granted < wanted ? granted : wanted;
+}
+
+static int nvme_create_io_completion_queue(uint16_t qid, uint16_t size, void* buffer, bool irq, uint16_t vector) {
     nvme_command_t cmd = {0};
     cmd.cdw0 = NVME_ADMIN_CREATE_CQ;
     cmd.prp1 = VIRT_TO_PHYS(buffer);
     cmd.cdw10 = ((uint32_t)(size - 1) << 16) | qid;
     cmd.cdw11 = NVME_QUEUE_PHYS_CONTIG;
+    if (irq)
+        cmd.cdw11 |= ((uint32_t)vector << 16) | NVME_CQ_IRQ_ENABLED;
 
-    return nvme_submit_admin_command(&cmd);
+    return nvme_admin_command_locked(&cmd);
 }
 
 static int nvme_create_io_submission_queue(uint16_t qid, uint16_t cqid, uint16_t size, void* buffer) {
@@ -198,7 +323,7 @@ static int nvme_create_io_submission_queue(uint16_t qid, uint16_t cqid, uint16_t
     cmd.cdw10 = ((uint32_t)(size - 1) << 16) | qid;
     cmd.cdw11 = (cqid << 16) | NVME_QUEUE_PHYS_CONTIG;
 
-    return nvme_submit_admin_command(&cmd);
+    return nvme_admin_command_locked(&cmd);
 }
 
 static int nvme_reset_controller(void) {
@@ -240,181 +365,582 @@ static int nvme_enable_controller(void) {
     return 0;
 }
 
-static void* alloc_page_aligned(size_t size) {
-    void* raw = kmalloc(size + 4096);
-    if (!raw) return NULL;
-    return (void*)(((uintptr_t)raw + 4095) & ~(uintptr_t)4095);
+// Queues and identify buffers must be page aligned and physically contiguous
+static void* nvme_alloc_dma(size_t size) {
+    uint32_t order = 0;
+    while (((size_t)4096 << order) < size)
+        order++;
+    return kalloc_pages(order, KALLOC_ZERO, NULL);
 }
 
-static int nvme_setup_admin_queues(void) {
-    admin_sq = alloc_page_aligned(NVME_ADMIN_QUEUE_SIZE * sizeof(nvme_command_t));
-    admin_cq = alloc_page_aligned(NVME_ADMIN_QUEUE_SIZE * sizeof(nvme_completion_t));
-
-    if (!admin_sq || !admin_cq) {
-        LOG_ERROR("NVMe: Failed to allocate admin queues\n");
-        return -1;
-    }
-
-    memset(admin_sq, 0, NVME_ADMIN_QUEUE_SIZE * sizeof(nvme_command_t));
+// With the controller disabled; starts both admin rings over
+static void nvme_program_admin_queues(void) {
+    admin_sq_tail = 0;
+    admin_cq_head = 0;
+    admin_cq_phase = 1;
     memset(admin_cq, 0, NVME_ADMIN_QUEUE_SIZE * sizeof(nvme_completion_t));
 
     uint32_t aqa = ((NVME_ADMIN_QUEUE_SIZE - 1) << 16) | (NVME_ADMIN_QUEUE_SIZE - 1);
     mmio_write32(&nvme_regs->aqa, aqa);
     mmio_write64(&nvme_regs->asq, VIRT_TO_PHYS(admin_sq));
     mmio_write64(&nvme_regs->acq, VIRT_TO_PHYS(admin_cq));
+}
+
+static int nvme_setup_admin_queues(void) {
+    admin_sq = nvme_alloc_dma(NVME_ADMIN_QUEUE_SIZE * sizeof(nvme_command_t));
+    admin_cq = nvme_alloc_dma(NVME_ADMIN_QUEUE_SIZE * sizeof(nvme_completion_t));
 
+    if (!admin_sq || !admin_cq) {
+        LOG_ERROR("NVMe: Failed to allocate admin queues\n");
+        return -1;
+    }
+
+    nvme_program_admin_queues();
     LOG_DEBUG("NVMe: Admin queues configured\n");
     return 0;
 }
 
-static int nvme_setup_io_queues(void) {
-    io_sq = alloc_page_aligned(NVME_IO_QUEUE_SIZE * sizeof(nvme_command_t));
-    io_cq = alloc_page_aligned(NVME_IO_QUEUE_SIZE * sizeof(nvme_completion_t));
-
-    if (!io_sq || !io_cq) {
-        LOG_ERROR("NVMe: Failed to allocate I/O queues\n");
-        return -1;
+static nvme_io_queue_t* nvme_alloc_io_queue(uint16_t qid, uint16_t depth) {
+    nvme_io_queue_t* q = kmalloc(sizeof(nvme_io_queue_t));
+    if (!q) return NULL;
+    memset(q, 0, sizeof(nvme_io_queue_t));
+
+    q->sq = nvme_alloc_dma(depth * sizeof(nvme_command_t));
+    q->cq = nvme_alloc_dma(depth * sizeof(nvme_completion_t));
+    // Lists are set aside now, since commands may also be built from SOFTIRQ_BLOCK
+    uint8_t* list_pool = nvme_alloc_dma((depth - 1) * NVME_SLOT_LIST_BYTES);
+    if (!q->sq || !q->cq || !list_pool) {
+        if (q->sq) kfree_pages(q->sq);
+        if (q->cq) kfree_pages(q->cq);
+        if (list_pool) kfree_pages(list_pool);
+        kfree(q);
+        return NULL;
     }
 
-    memset(io_sq, 0, NVME_IO_QUEUE_SIZE * sizeof(nvme_command_t));
-    memset(io_cq, 0, NVME_IO_QUEUE_SIZE * sizeof(nvme_completion_t));
+    spinlock_init_named(&q->lock, "nvme_io");
+    q->qid = qid;
+    q->depth = depth;
+    q->cq_phase = 1;
+    for (uint16_t i = 0; i < depth - 1; i++) {
+        q->slots[i].list = list_pool + i * NVME_SLOT_LIST_BYTES;
+        // Popped from the end, so tag 0 goes first
+        q->free_tags[i] = (uint16_t)(depth - 2 - i);
+    }
+    q->nfree = depth - 1;
+    return q;
+}
 
-    if (nvme_create_io_completion_queue(1, NVME_IO_QUEUE_SIZE, io_cq) < 0) {
-        LOG_ERROR("NVMe: Failed to create I/O completion queue\n");
+// MSI-X entry `qid` goes to CPU qid - 1; a one-entry table shares entry 0. Caller holds admin_mutex.
+static int nvme_create_io_queue(nvme_io_queue_t* q) {
+    uint16_t vector = msix.size > q->qid ? q->qid : 0;
+    if (nvme_create_io_completion_queue(q->qid, q->depth, q->cq, io_irq, vector) < 0) {
+        LOG_ERROR("NVMe: Failed to create I/O completion queue %u\n", q->qid);
         return -1;
     }
 
-    if (nvme_create_io_submission_queue(1, 1, NVME_IO_QUEUE_SIZE, io_sq) < 0) {
-        LOG_ERROR("NVMe: Failed to create I/O submission queue\n");
+    if (nvme_create_io_submission_queue(q->qid, q->qid, q->depth, q->sq) < 0) {
+        LOG_ERROR("NVMe: Failed to create I/O submission queue %u\n", q->qid);
         return -1;
     }
+    return 0;
+}
+
+static int nvme_setup_io_queues(uint32_t count, uint16_t depth) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t qid = (uint16_t)(i + 1);
+        nvme_io_queue_t* q = nvme_alloc_io_queue(qid, depth);
+        if (!q) {
+            LOG_ERROR("NVMe: Failed to allocate I/O queue %u\n", qid);
+            break;
+        }
+
+        uint16_t vector = msix.size > qid ? qid : 0;
+        if (nvme_create_io_queue(q) < 0)
+            break;
+
+        if (io_irq)
+            pci_msix_route(&msix, vector, percpu_get(i)->lapic_id, io_irq_vector);
+        io_queues[i] = q;
+        io_queue_count = i + 1;
+    }
 
-    prp_list_buf = alloc_page_aligned(4096);
-    if (!prp_list_buf) {
-        LOG_ERROR("NVMe: Failed to allocate PRP list buffer\n");
+    if (io_queue_count == 0)
         return -1;
-    }
 
-    LOG_DEBUG("NVMe: I/O queues created\n");
+    LOG_DEBUG("NVMe: %u I/O queue pair(s) of %u entries created\n", io_queue_count, depth);
     return 0;
 }
 
-static void nvme_setup_prp(nvme_command_t* cmd, uint64_t buf_phys, size_t count, uint32_t block_size) {
-    uint64_t total_bytes = (uint64_t)count * block_size;
-    uint64_t pages = (total_bytes + 4095) / 4096;
+// Physical address of each page `buf` touches, the first with its offset; false if one is unmapped
+static bool nvme_translate(const uint8_t* buf, uint32_t bytes, uint64_t* phys, uint32_t* pages) {
+    uintptr_t first = (uintptr_t)buf & ~(uintptr_t)(NVME_PAGE_SIZE - 1);
+    uintptr_t end = (uintptr_t)buf + bytes;
+    uint32_t n = 0;
+    for (uintptr_t page = first; page < end; page += NVME_PAGE_SIZE) {
+        uint64_t pa = vmm_virt_to_phys(page == first ? (uintptr_t)buf : page);
+        if (!pa) return false;
+        phys[n++] = pa;
+    }
+    *pages = n;
+    return true;
+}
+
+// Physically contiguous runs in `phys`; every page after the first starts on a boundary
+static uint32_t nvme_count_runs(const uint64_t* phys, uint32_t pages) {
+    uint32_t runs = 1;
+    for (uint32_t i = 1; i < pages; i++)
+        if (phys[i] != (phys[i - 1] & ~(uint64_t)(NVME_PAGE_SIZE - 1)) + NVME_PAGE_SIZE)
+            runs++;
+    return runs;
+}
 
-    cmd->prp1 = buf_phys;
+static void nvme_setup_prp(nvme_command_t* cmd, nvme_io_slot_t* slot, const uint64_t* phys, uint32_t pages) {
+    cmd->prp1 = phys[0];
 
     if (pages <= 1) {
         cmd->prp2 = 0;
     } else if (pages == 2) {
-        cmd->prp2 = buf_phys + 4096;
+        cmd->prp2 = phys[1];
     } else {
-        for (uint64_t i = 1; i < pages; i++) {
-            prp_list_buf[i - 1] = buf_phys + i * 4096;
+        uint64_t* list = slot->list;
+        for (uint32_t i = 1; i < pages; i++) {
+            list[i - 1] = phys[i];
         }
-        cmd->prp2 = VIRT_TO_PHYS(prp_list_buf);
+        cmd->prp2 = VIRT_TO_PHYS(list);
     }
 }
 
-static int nvme_submit_and_wait(nvme_command_t* cmd) {
-    uint16_t slot = io_sq_tail;
-    memcpy(&io_sq[slot], cmd, sizeof(nvme_command_t));
+// One data block descriptor per run, in the command itself if there is only one
+static void nvme_setup_sgl(nvme_command_t* cmd, nvme_io_slot_t* slot, const uint64_t* phys,
+                           uint32_t pages, uint32_t bytes) {
+    nvme_sgl_desc_t* list = slot->list;
+    uint32_t runs = 0;
+    uint32_t left = bytes;
+    for (uint32_t i = 0; i < pages; i++) {
+        uint32_t in_page = NVME_PAGE_SIZE - (uint32_t)(phys[i] & (NVME_PAGE_SIZE - 1));
+        uint32_t len = left < in_page ? left : in_page;
+        if (runs > 0 && list[runs - 1].addr + list[runs - 1].length == phys[i]) {
+            list[runs - 1].length += len;
+        } else {
+            memset(&list[runs], 0, sizeof(nvme_sgl_desc_t));
+            list[runs].addr = phys[i];
+            list[runs].length = len;
+            list[runs].id = NVME_SGL_DATA_BLOCK;
+            runs++;
+        }
+        left -= len;
+    }
 
-    io_sq_tail = (io_sq_tail + 1) % NVME_IO_QUEUE_SIZE;
-    nvme_write_doorbell(1, io_sq_tail, true);
+    nvme_sgl_desc_t* dptr = (nvme_sgl_desc_t*)&cmd->prp1;
+    if (runs == 1) {
+        *dptr = list[0];
+    } else {
+        memset(dptr, 0, sizeof(nvme_sgl_desc_t));
+        dptr->addr = VIRT_TO_PHYS(list);
+        dptr->length = runs * sizeof(nvme_sgl_desc_t);
+        dptr->id = NVME_SGL_LAST_SEGMENT;
+    }
+    cmd->cdw0 |= NVME_CMD_PSDT_SGL;
+}
 
-    for (int timeout = 0; timeout < 10000; timeout++) {
-        nvme_completion_t* cqe = &io_cq[io_cq_head];
-        if ((cqe->status & 1) == io_cq_phase) {
-            uint16_t status_code = (cqe->status >> 1) & 0x7FFF;
-            io_cq_head = (io_cq_head + 1) % NVME_IO_QUEUE_SIZE;
+static inline void nvme_mark_starved(nvme_namespace_t* ns) {
+    __atomic_fetch_or(&ns_starved, 1u << ns->index, __ATOMIC_SEQ_CST);
+}
 
-            if (io_cq_head == 0) {
-                io_cq_phase = !io_cq_phase;
-            }
+static void nvme_kick_starved(void) {
+    uint32_t starved = __atomic_exchange_n(&ns_starved, 0, __ATOMIC_SEQ_CST);
+    while (starved) {
+        uint32_t i = (uint32_t)__builtin_ctz(starved);
+        starved &= starved - 1;
+        if (ns_devs[i]) blk_kick(ns_devs[i]);
+    }
+}
 
-            nvme_write_doorbell(1, io_cq_head, false);
+// The bounce pool is shared, and requests are also submitted from SOFTIRQ_BLOCK
+static uint8_t* nvme_bounce_get(nvme_namespace_t* ns) {
+    uint64_t flags = spinlock_acquire_irqsave(&bounce_lock);
+    uint8_t* buf = NULL;
+    if (bounce_free) {
+        uint32_t i = (uint32_t)__builtin_ctz(bounce_free);
+        bounce_free &= ~(1u << i);
+        buf = bounce_pool + (size_t)i * BLK_MAX_REQUEST_BYTES;
+    } else {
+        nvme_mark_starved(ns);
+    }
+    spinlock_release_irqrestore(&bounce_lock, flags);
+    return buf;
+}
 
-            if (status_code != 0) {
-                LOG_ERROR("NVMe: I/O command failed with status 0x%x\n", status_code);
-                return -1;
-            }
+static void nvme_bounce_put(uint8_t* buf) {
+    uint32_t i = (uint32_t)((buf - bounce_pool) / BLK_MAX_REQUEST_BYTES);
+    uint64_t flags = spinlock_acquire_irqsave(&bounce_lock);
+    bounce_free |= 1u << i;
+    spinlock_release_irqrestore(&bounce_lock, flags);
+}
 
-            return 0;
-        }
+static inline nvme_io_queue_t* nvme_local_queue(void) {
+    return io_queues[this_cpu_id() % io_queue_count];
+}
 
-        for (volatile int i = 0; i < 1000; i++);
+/*
+ * Resolves a read or write's buffer to the pages the command will point
+ * at. An unaligned buffer the controller cannot take as an SGL is swapped
+ * for a bounce buffer, returned in `bounce`; -EBUSY if none is free.
+ */
+static int nvme_map_request(nvme_namespace_t* ns, blk_request_t* rq, uint32_t bytes, uint64_t* phys,
+                            uint32_t* pages, bool* sgl, uint8_t** bounce) {
+    if (!nvme_translate(rq->buf, bytes, phys, pages)) {
+        LOG_ERROR("NVMe: buffer not mapped (buf=%p)\n", rq->buf);
+        return -EINVAL;
     }
+    if (!((uintptr_t)rq->buf & 3)) return 0;
 
-    LOG_ERROR("NVMe: I/O command timeout\n");
-    return -1;
+    if (io_sgl && nvme_count_runs(phys, *pages) <= NVME_SGL_MAX_DESC) {
+        *sgl = true;
+        return 0;
+    }
+    if (!bounce_pool) {
+        LOG_ERROR("NVMe: buffer not dword-aligned (buf=%p)\n", rq->buf);
+        return -EINVAL;
+    }
+    uint8_t* buf = nvme_bounce_get(ns);
+    if (!buf) return -EBUSY;
+    if (rq->op == BIO_WRITE)
+        memcpy(buf, rq->buf, bytes);
+    *pages = (bytes + NVME_PAGE_SIZE - 1) / NVME_PAGE_SIZE;
+    for (uint32_t i = 0; i < *pages; i++)
+        phys[i] = VIRT_TO_PHYS(buf) + (uint64_t)i * NVME_PAGE_SIZE;
+    *bounce = buf;
+    return 0;
 }
 
-static int nvme_read_blocks(struct block_device* dev, uint64_t lba, size_t count, void* buf) {
+static int nvme_submit(struct block_device* dev, blk_request_t* rq) {
     nvme_namespace_t* ns = (nvme_namespace_t*)dev->private_data;
-    if (lba + count > ns->block_count) {
-        return -1;
+    uint32_t bytes = rq->count * ns->block_size;
+
+    uint64_t phys[NVME_MAX_DATA_PAGES];
+    uint32_t pages = 0;
+    bool sgl = false;
+    uint8_t* bounce = NULL;
+    if (rq->op == BIO_READ || rq->op == BIO_WRITE) {
+        int rc = nvme_map_request(ns, rq, bytes, phys, &pages, &sgl, &bounce);
+        if (rc != 0) return rc;
     }
-    if ((uintptr_t)buf & 0xFFF) {
-        LOG_ERROR("NVMe: read buffer not page-aligned (buf=%p)\n", buf);
-        return -1;
+
+    // Interrupts stay off from here to the doorbell, so this CPU's queue is ours alone
+    nvme_io_queue_t* q = nvme_local_queue();
+    uint64_t flags = spinlock_acquire_irqsave(&q->lock);
+    // Read under the lock the reset takes to empty the queue, so nothing slips in behind it
+    uint32_t state = __atomic_load_n(&ctrl_state, __ATOMIC_ACQUIRE);
+    if (q->nfree == 0 || state != NVME_LIVE) {
+        if (state != NVME_DEAD) nvme_mark_starved(ns);
+        spinlock_release_irqrestore(&q->lock, flags);
+        if (bounce) nvme_bounce_put(bounce);
+        return state == NVME_DEAD ? -EIO : -EBUSY;
+    }
+    uint16_t tag = q->free_tags[--q->nfree];
+    nvme_io_slot_t* slot = &q->slots[tag];
+    slot->busy = true;
+    slot->rq = rq;
+    slot->bounce = bounce;
+    slot->deadline = wait_deadline(NVME_CMD_TIMEOUT_MS);
+    q->inflight++;
+
+    nvme_command_t* cmd = &q->sq[q->sq_tail];
+    memset(cmd, 0, sizeof(nvme_command_t));
+    cmd->nsid = ns->nsid;
+    switch (rq->op) {
+    case BIO_FLUSH:
+        cmd->cdw0 = NVME_CMD_FLUSH;
+        break;
+    case BIO_DISCARD: {
+        // One deallocate range, in the slot's list
+        nvme_dsm_range_t* range = slot->list;
+        memset(range, 0, sizeof(nvme_dsm_range_t));
+        range->nlb = rq->count;
+        range->slba = rq->lba;
+        cmd->cdw0 = NVME_CMD_DSM;
+        cmd->prp1 = VIRT_TO_PHYS(range);
+        cmd->cdw10 = 0;
+        cmd->cdw11 = NVME_DSM_DEALLOCATE;
+        break;
     }
+    case BIO_WRITE_ZEROES:
+        cmd->cdw0 = NVME_CMD_WRITE_ZEROES;
+        cmd->cdw10 = (uint32_t)(rq->lba & 0xFFFFFFFF);
+        cmd->cdw11 = (uint32_t)(rq->lba >> 32);
+        cmd->cdw12 = (rq->count - 1) & 0xFFFF;
+        break;
+    default:
+        cmd->cdw0 = rq->op == BIO_WRITE ? NVME_CMD_WRITE : NVME_CMD_READ;
+        cmd->cdw10 = (uint32_t)(rq->lba & 0xFFFFFFFF);
+        cmd->cdw11 = (uint32_t)(rq->lba >> 32);
+        cmd->cdw12 = (rq->count - 1) & 0xFFFF;
+        if (sgl)
+            nvme_setup_sgl(cmd, slot, phys, pages, bytes);
+        else
+            nvme_setup_prp(cmd, slot, phys, pages);
+        break;
+    }
+    cmd->cdw0 |= (uint32_t)tag << 16;
 
-    while (count > 0) {
-        size_t blocks_this_cmd = (count > 256) ? 256 : count;
+    q->sq_tail = (q->sq_tail + 1) % q->depth;
+    nvme_write_doorbell(q->qid, q->sq_tail, true);
+    spinlock_release_irqrestore(&q->lock, flags);
+    return 0;
+}
+
+// A bounce buffer still on the slot goes back to the pool; the reaper takes it first to copy out of it
+static inline void nvme_release_slot(nvme_io_queue_t* q, uint16_t tag) {
+    nvme_io_slot_t* slot = &q->slots[tag];
+    if (slot->bounce) {
+        nvme_bounce_put(slot->bounce);
+        slot->bounce = NULL;
+    }
+    slot->busy = false;
+    slot->rq = NULL;
+    q->free_tags[q->nfree++] = tag;
+    q->inflight--;
+}
 
-        nvme_command_t cmd = {0};
-        cmd.cdw0 = NVME_CMD_READ | ((uint32_t)(command_id++) << 16);
-        cmd.nsid = ns->nsid;
-        cmd.cdw10 = (uint32_t)(lba & 0xFFFFFFFF);
-        cmd.cdw11 = (uint32_t)(lba >> 32);
-        cmd.cdw12 = (blocks_this_cmd - 1) & 0xFFFF;
-        nvme_setup_prp(&cmd, VIRT_TO_PHYS(buf), blocks_this_cmd, ns->block_size);
+// Fails every command still on `q`; the controller must be disabled, so none of them is moving data
+static void nvme_fail_queue(nvme_io_queue_t* q) {
+    struct { blk_request_t* rq; uint8_t* bounce; } failed[NVME_POLL_BATCH];
+    for (;;) {
+        uint32_t n = 0;
+        uint64_t flags = spinlock_acquire_irqsave(&q->lock);
+        for (uint16_t tag = 0; tag < q->depth - 1 && n < NVME_POLL_BATCH; tag++) {
+            nvme_io_slot_t* slot = &q->slots[tag];
+            if (!slot->busy) continue;
+            failed[n].rq = slot->rq;
+            failed[n].bounce = slot->bounce;
+            slot->bounce = NULL;
+            n++;
+            nvme_release_slot(q, tag);
+        }
+        if (n == 0) {
+            // Empty now, so both rings can start over once the queue is created again
+            q->sq_tail = 0;
+            q->cq_head = 0;
+            q->cq_phase = 1;
+            memset(q->cq, 0, q->depth * sizeof(nvme_completion_t));
+        }
+        spinlock_release_irqrestore(&q->lock, flags);
+        if (n == 0) return;
 
-        if (nvme_submit_and_wait(&cmd) < 0) {
-            return -1;
+        for (uint32_t i = 0; i < n; i++) {
+            if (failed[i].bounce) nvme_bounce_put(failed[i].bounce);
+            blk_end_request(failed[i].rq, -EIO);
         }
+    }
+}
 
-        buf = (void*)((uint64_t)buf + blocks_this_cmd * ns->block_size);
-        lba += blocks_this_cmd;
-        count -= blocks_this_cmd;
+/*
+ * Runs in task context once a command has timed out, from whoever polls
+ * next; the caller holds admin_mutex. Disabling the controller stops all
+ * of its DMA; only then are the commands in flight failed, and the queues
+ * are created again on the re-enabled controller. A controller that will
+ * not even disable keeps its commands, since their buffers may still be
+ * written.
+ */
+static void nvme_reset_locked(void) {
+    LOG_ERROR("NVMe: I/O command %u on queue %u timed out, resetting the controller\n",
+              reset_tag, reset_qid);
+
+    bool ok = nvme_reset_controller() == 0;
+    if (ok) {
+        for (uint32_t i = 0; i < io_queue_count; i++)
+            nvme_fail_queue(io_queues[i]);
+
+        nvme_program_admin_queues();
+        ok = nvme_enable_controller() == 0 &&
+             nvme_request_queue_count(io_queue_count) == io_queue_count;
+        for (uint32_t i = 0; ok && i < io_queue_count; i++)
+            ok = nvme_create_io_queue(io_queues[i]) == 0;
     }
 
-    return 0;
+    if (ok) {
+        LOG_WARN("NVMe: Controller reset, I/O resumed\n");
+        __atomic_store_n(&ctrl_state, NVME_LIVE, __ATOMIC_RELEASE);
+    } else {
+        LOG_ERROR("NVMe: Controller reset failed, I/O to it now fails\n");
+        __atomic_store_n(&ctrl_state, NVME_DEAD, __ATOMIC_RELEASE);
+    }
 }
 
-static int nvme_write_blocks(struct block_device* dev, uint64_t lba, size_t count, const void* buf) {
-    nvme_namespace_t* ns = (nvme_namespace_t*)dev->private_data;
-    if (lba + count > ns->block_count) {
-        return -1;
+/*
+ * A pending reset runs here, on the task that is waiting for its I/O,
+ * rather than on the work queue: nothing has to allocate from the softirq
+ * that noticed the timeout, and the reset happens even when no worker is
+ * free to take it. Whoever gets admin_mutex first runs it; the others keep
+ * polling until the state leaves RESETTING.
+ */
+static void nvme_run_pending_reset(void) {
+    if (in_softirq() || !mutex_trylock(&admin_mutex)) return;
+    bool ran = __atomic_load_n(&ctrl_state, __ATOMIC_ACQUIRE) == NVME_RESETTING;
+    if (ran) nvme_reset_locked();
+    mutex_unlock(&admin_mutex);
+    if (!ran) return;
+
+    // Requests refused meanwhile are waiting; start them, or fail them if the controller is gone
+    for (uint32_t i = 0; i < NVME_MAX_NAMESPACES; i++) {
+        block_device_t* dev = __atomic_load_n(&ns_devs[i], __ATOMIC_ACQUIRE);
+        if (dev) blk_kick(dev);
     }
-    if ((uintptr_t)buf & 0xFFF) {
-        LOG_ERROR("NVMe: write buffer not page-aligned (buf=%p)\n", buf);
-        return -1;
+}
+
+// The first timeout seen while the controller is live asks for one reset; may be SOFTIRQ_BLOCK
+static void nvme_schedule_reset(uint16_t qid, uint32_t tag) {
+    uint32_t live = NVME_LIVE;
+    if (!__atomic_compare_exchange_n(&ctrl_state, &live, NVME_RESETTING, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return;
+    reset_qid = qid;
+    reset_tag = (uint16_t)tag;
+}
+
+/*
+ * Completion reaper for one queue, run from SOFTIRQ_BLOCK after an
+ * interrupt and by whoever waits on the device. Requests are finished
+ * after the lock is dropped, since finishing one may submit the next.
+ * Reads that went through a bounce buffer are copied out there too.
+ * Returns how many it finished; a full batch means there may be more.
+ */
+static uint32_t nvme_reap(nvme_io_queue_t* q) {
+    struct { blk_request_t* rq; uint8_t* bounce; int status; } reaped[NVME_POLL_BATCH];
+    uint32_t n = 0;
+    bool consumed = false;
+
+    uint64_t flags = spinlock_acquire_irqsave(&q->lock);
+    while (n < NVME_POLL_BATCH) {
+        volatile nvme_completion_t* cqe = &q->cq[q->cq_head];
+        uint16_t status = cqe->status;
+        if ((status & 1) != q->cq_phase) break;
+
+        uint16_t tag = cqe->command_id;
+        q->cq_head = (q->cq_head + 1) % q->depth;
+        if (q->cq_head == 0) {
+            q->cq_phase = !q->cq_phase;
+        }
+        consumed = true;
+
+        if (tag >= q->depth - 1 || !q->slots[tag].busy) {
+            LOG_WARN("NVMe: completion for idle command %u on queue %u\n", tag, q->qid);
+            continue;
+        }
+        nvme_io_slot_t* slot = &q->slots[tag];
+        status = (status >> 1) & 0x7FFF;
+        if (status != 0)
+            LOG_ERROR("NVMe: I/O command failed with status 0x%x\n", status);
+        reaped[n].rq = slot->rq;
+        reaped[n].bounce = slot->bounce;
+        reaped[n].status = status ? -EIO : 0;
+        slot->bounce = NULL;
+        n++;
+        nvme_release_slot(q, tag);
+    }
+    if (consumed) {
+        nvme_write_doorbell(q->qid, q->cq_head, false);
     }
 
-    while (count > 0) {
-        size_t blocks_this_cmd = (count > 256) ? 256 : count;
+    int expired = -1;
+    if (__atomic_load_n(&ctrl_state, __ATOMIC_ACQUIRE) == NVME_LIVE) {
+        for (uint32_t i = 0; i < (uint32_t)(q->depth - 1); i++) {
+            if (q->slots[i].busy && wait_expired(q->slots[i].deadline)) {
+                expired = (int)i;
+                break;
+            }
+        }
+    }
+    spinlock_release_irqrestore(&q->lock, flags);
 
-        nvme_command_t cmd = {0};
-        cmd.cdw0 = NVME_CMD_WRITE | ((uint32_t)(command_id++) << 16);
-        cmd.nsid = ns->nsid;
-        cmd.cdw10 = (uint32_t)(lba & 0xFFFFFFFF);
-        cmd.cdw11 = (uint32_t)(lba >> 32);
-        cmd.cdw12 = (blocks_this_cmd - 1) & 0xFFFF;
-        nvme_setup_prp(&cmd, VIRT_TO_PHYS(buf), blocks_this_cmd, ns->block_size);
+    if (expired >= 0)
+        nvme_schedule_reset(q->qid, (uint32_t)expired);
 
-        if (nvme_submit_and_wait(&cmd) < 0) {
-            return -1;
+    for (uint32_t i = 0; i < n; i++) {
+        blk_request_t* rq = reaped[i].rq;
+        if (reaped[i].bounce) {
+            if (rq->op == BIO_READ && reaped[i].status == 0)
+                memcpy(rq->buf, reaped[i].bounce, (size_t)rq->count * rq->dev->block_size);
+            nvme_bounce_put(reaped[i].bounce);
         }
+        blk_end_request(rq, reaped[i].status);
+    }
+    if (consumed || n > 0)
+        nvme_kick_starved();
+    return n;
+}
 
-        buf = (const void*)((uint64_t)buf + blocks_this_cmd * ns->block_size);
-        lba += blocks_this_cmd;
-        count -= blocks_this_cmd;
+// The calling CPU's own queue first; the others only if something is in flight on them
+static void nvme_poll(struct block_device* dev) {
+    (void)dev;
+    if (__atomic_load_n(&ctrl_state, __ATOMIC_ACQUIRE) == NVME_RESETTING)
+        nvme_run_pending_reset();
+
+    uint32_t count = io_queue_count;
+    uint32_t local = this_cpu_id() % count;
+    for (uint32_t i = 0; i < count; i++) {
+        nvme_io_queue_t* q = io_queues[(local + i) % count];
+        if (__atomic_load_n(&q->inflight, __ATOMIC_ACQUIRE) == 0) continue;
+        while (nvme_reap(q) == NVME_POLL_BATCH)
+            ;
     }
+}
 
-    return 0;
+static void __attribute__((interrupt, target("general-regs-only")))
+nvme_irq_handler(interrupt_frame_t* frame) {
+    (void)frame;
+    // MSI-X is edge-triggered and each entry is exclusive, so there is nothing to acknowledge
+    if (io_irq_dev)
+        blk_complete_irq(io_irq_dev);
+    apic_eoi();
+    softirq_irq_exit();
+}
+
+// Falls back to polling, silently, if any step is missing
+static void nvme_setup_msix(void) {
+    if (!apic_available() || !nvme_pci) return;
+    if (pci_msix_enable(nvme_pci, &msix) < 0) {
+        LOG_DEBUG("NVMe: No MSI-X capability, completions are polled\n");
+        return;
+    }
+
+    io_irq_vector = idt_alloc_vector(nvme_irq_handler);
+    if (!io_irq_vector) {
+        LOG_WARN("NVMe: No free interrupt vector, completions are polled\n");
+        return;
+    }
+    io_irq = true;
+    LOG_DEBUG("NVMe: MSI-X table of %u entries on vector 0x%x\n", msix.size, io_irq_vector);
+}
+
+/*
+ * Reads the controller's transfer limit, SGL support and optional
+ * commands, and sets aside the bounce pool. Returns the largest request it can take in one command.
+ */
+static uint32_t nvme_setup_data_transfer(uint64_t cap) {
+    uint32_t max_bytes = BLK_MAX_REQUEST_BYTES;
+    nvme_identify_controller_t* id = nvme_alloc_dma(sizeof(nvme_identify_controller_t));
+    if (id && nvme_identify_controller(id) == 0) {
+        uint32_t mpsmin = (uint32_t)((cap & NVME_CAP_MPSMIN_MASK) >> NVME_CAP_MPSMIN_SHIFT);
+        uint64_t limit = (uint64_t)NVME_PAGE_SIZE << mpsmin << id->mdts;
+        if (id->mdts && id->mdts < 20 && limit < max_bytes)
+            max_bytes = (uint32_t)limit;
+        io_sgl = (id->sgls & NVME_SGLS_SUPPORT_MASK) == NVME_SGLS_BYTE_ALIGNED;
+        io_oncs = id->oncs;
+        io_vwc = (id->vwc & NVME_VWC_PRESENT) != 0;
+    }
+    if (id) kfree_pages(id);
+
+    bounce_pool = nvme_alloc_dma(NVME_BOUNCE_BUFFERS * BLK_MAX_REQUEST_BYTES);
+    if (bounce_pool)
+        bounce_free = (1u << NVME_BOUNCE_BUFFERS) - 1;
+    else
+        LOG_WARN("NVMe: No bounce buffers, unaligned transfers will fail\n");
+
+    LOG_DEBUG("NVMe: %u bytes per command, SGLs %s, ONCS 0x%x, VWC %s\n", max_bytes,
+              io_sgl ? "on" : "off", io_oncs, io_vwc ? "on" : "off");
+    return max_bytes;
 }
 
 void nvme_init(void) {
@@ -437,6 +963,10 @@ void nvme_init(void) {
 
     LOG_DEBUG("NVMe: Controller found, CAP=0x%llx\n", cap);
 
+    mutex_init(&admin_mutex);
+    init_completion(&admin_done);
+    spinlock_init_named(&bounce_lock, "nvme_bounce");
+
     if (nvme_reset_controller() < 0) {
         return;
     }
@@ -449,31 +979,58 @@ void nvme_init(void) {
         return;
     }
 
-    uint32_t* ns_list = alloc_page_aligned(4096);
+    uint32_t max_bytes = nvme_setup_data_transfer(cap);
+
+    uint32_t* ns_list = nvme_alloc_dma(4096);
     if (!ns_list) {
         LOG_ERROR("NVMe: Failed to allocate namespace list buffer\n");
         return;
     }
 
-    memset(ns_list, 0, 4096);
-
     if (nvme_identify_active_namespaces(ns_list) < 0) {
         LOG_ERROR("NVMe: Failed to identify active namespaces\n");
+        kfree_pages(ns_list);
         return;
     }
 
-    if (nvme_setup_io_queues() < 0) {
+    // One queue pair per CPU, bounded by the controller, the driver and the MSI-X table
+    uint32_t queues = smp_cpu_count();
+    if (queues == 0) queues = 1;
+    if (queues > NVME_MAX_IO_QUEUES) queues = NVME_MAX_IO_QUEUES;
+    mutex_lock(&admin_mutex);
+    queues = nvme_request_queue_count(queues);
+
+    // Entry 0 is the admin queue's; with a one-entry table every queue shares it, and one CPU
+    nvme_setup_msix();
+    if (io_irq) {
+        uint32_t entries = msix.size > 1 ? (uint32_t)msix.size - 1 : 1;
+        if (queues > entries) queues = entries;
+    }
+
+    uint32_t mqes = (uint32_t)(cap & NVME_CAP_MQES_MASK) + 1;
+    uint16_t depth = mqes < NVME_IO_QUEUE_SIZE ? (uint16_t)mqes : NVME_IO_QUEUE_SIZE;
+
+    int rc = nvme_setup_io_queues(queues, depth);
+    mutex_unlock(&admin_mutex);
+    if (rc < 0) {
+        kfree_pages(ns_list);
         return;
     }
 
     block_device_ops_t ops = {
-        .read_blocks = nvme_read_blocks,
-        .write_blocks = nvme_write_blocks,
+        .read_blocks  = blk_read_blocks,
+        .write_blocks = blk_write_blocks,
+        .submit       = nvme_submit,
+        .poll         = nvme_poll,
+        .flush        = io_vwc ? blk_flush : NULL,
+        .discard      = (io_oncs & NVME_ONCS_DSM) ? blk_discard : NULL,
+        .write_zeroes = (io_oncs & NVME_ONCS_WRITE_ZEROES) ? blk_write_zeroes : NULL,
     };
 
-    uint8_t* ns_data = alloc_page_aligned(4096);
+    uint8_t* ns_data = nvme_alloc_dma(4096);
     if (!ns_data) {
         LOG_ERROR("NVMe: Failed to allocate namespace identify buffer\n");
+        kfree_pages(ns_list);
         return;
     }
 
@@ -502,6 +1059,7 @@ void nvme_init(void) {
         }
 
         ns->nsid = id;
+        ns->index = (uint32_t)i;
         ns->block_count = nsze;
         ns->block_size = block_size;
 
@@ -512,10 +1070,23 @@ void nvme_init(void) {
         strcat(name, nsid_str);
 
         register_block_device(name, block_size, nsze, &ops, ns);
+        block_device_t* bdev = find_block_device(name);
+        if (bdev && max_bytes < BLK_MAX_REQUEST_BYTES)
+            blk_set_max_request_bytes(bdev, max_bytes);
+        __atomic_store_n(&ns_devs[i], bdev, __ATOMIC_RELEASE);
+        if (io_irq && bdev) {
+            // Queue owners halt while they wait; reaping on any CPU wakes them, and their timer catches timeouts
+            blk_set_irq_cpus(bdev, (1ULL << io_queue_count) - 1);
+            if (!io_irq_dev)
+                __atomic_store_n(&io_irq_dev, bdev, __ATOMIC_RELEASE);
+        }
         LOG_DEBUG("NVMe: Registered %s (%llu blocks)\n", name, nsze);
         registered++;
     }
 
+    kfree_pages(ns_data);
+    kfree_pages(ns_list);
+
     if (registered == 0) {
         LOG_ERROR("NVMe: No namespaces found\n");
         return;
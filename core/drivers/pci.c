@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/drivers/pci.h>
+#include <core/arch/io.h>
+#include <core/arch/spinlock.h>
+#include <core/arch/apic.h>
+#include <core/kernel/mem/allocator.h>
+#include <log.h>
+#include <stddef.h>
+
+static pci_device_t pci_devices[PCI_MAX_DEVICES];
+static uint32_t pci_count = 0;
+static uint8_t pci_bus_seen[256 / 8];
+
+// The address/data port pair is one shared window, so every access holds the lock across both
+static spinlock_t pci_config_lock;
+
+static inline uint32_t pci_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    return (1u << 31) | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) |
+           ((uint32_t)func << 8) | (offset & 0xFC);
+}
+
+uint32_t pci_config_read32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    uint64_t flags = spinlock_acquire_irqsave(&pci_config_lock);
+    outl(PCI_CONFIG_ADDR, pci_address(bus, slot, func, offset));
+    uint32_t val = inl(PCI_CONFIG_DATA);
+    spinlock_release_irqrestore(&pci_config_lock, flags);
+    return val;
+}
+
+void pci_config_write32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t val) {
+    uint64_t flags = spinlock_acquire_irqsave(&pci_config_lock);
+    outl(PCI_CONFIG_ADDR, pci_address(bus, slot, func, offset));
+    outl(PCI_CONFIG_DATA, val);
+    spinlock_release_irqrestore(&pci_config_lock, flags);
+}
+
+static void pci_scan_bus(uint8_t bus);
+
+static void pci_add_function(uint8_t bus, uint8_t slot, uint8_t func, uint32_t id) {
+    uint32_t class_reg = pci_config_read32(bus, slot, func, PCI_REG_CLASS);
+    uint8_t header = (pci_config_read32(bus, slot, func, PCI_REG_HEADER) >> 16) & 0xFF;
+
+    if (pci_count < PCI_MAX_DEVICES) {
+        pci_device_t* dev = &pci_devices[pci_count++];
+        dev->bus         = bus;
+        dev->slot        = slot;
+        dev->func        = func;
+        dev->header_type = header;
+        dev->vendor_id   = id & 0xFFFF;
+        dev->device_id   = id >> 16;
+        dev->class_code  = class_reg >> 24;
+        dev->subclass    = (class_reg >> 16) & 0xFF;
+        dev->prog_if     = (class_reg >> 8) & 0xFF;
+        dev->revision    = class_reg & 0xFF;
+
+        // Bridges only have two BARs; the rest of their header is bus numbers and windows
+        int bars = (header & 0x7F) == 0 ? 6 : (header & 0x7F) == 1 ? 2 : 0;
+        for (int i = 0; i < 6; i++)
+            dev->bar[i] = i < bars ? pci_config_read32(bus, slot, func, PCI_REG_BAR0 + 4 * i) : 0;
+    } else {
+        LOG_WARN("pci: device table full, ignoring %d:%d.%d\n", bus, slot, func);
+    }
+
+    if ((class_reg >> 24) == PCI_CLASS_BRIDGE && ((class_reg >> 16) & 0xFF) == PCI_SUBCLASS_PCI_BRIDGE) {
+        uint8_t secondary = (pci_config_read32(bus, slot, func, PCI_REG_BUSES) >> 8) & 0xFF;
+        if (secondary != 0) pci_scan_bus(secondary);
+    }
+}
+
+static void pci_scan_bus(uint8_t bus) {
+    if (pci_bus_seen[bus / 8] & (1 << (bus % 8))) return;
+    pci_bus_seen[bus / 8] |= 1 << (bus % 8);
+
+    for (uint8_t slot = 0; slot < 32; slot++) {
+        uint32_t id = pci_config_read32(bus, slot, 0, PCI_REG_ID);
+        if ((id & 0xFFFF) == 0xFFFF) continue;
+
+        pci_add_function(bus, slot, 0, id);
+
+        uint8_t header = (pci_config_read32(bus, slot, 0, PCI_REG_HEADER) >> 16) & 0xFF;
+        if (!(header & 0x80)) continue;
+
+        for (uint8_t func = 1; func < 8; func++) {
+            id = pci_config_read32(bus, slot, func, PCI_REG_ID);
+            if ((id & 0xFFFF) == 0xFFFF) continue;
+            pci_add_function(bus, slot, func, id);
+        }
+    }
+}
+
+void pci_init(void) {
+    spinlock_init_named(&pci_config_lock, "pci_config");
+    pci_count = 0;
+    for (size_t i = 0; i < sizeof(pci_bus_seen); i++) pci_bus_seen[i] = 0;
+
+    // A multi-function host bridge has one host controller, and one root bus, per function
+    uint8_t header = (pci_config_read32(0, 0, 0, PCI_REG_HEADER) >> 16) & 0xFF;
+    if (header & 0x80) {
+        for (uint8_t func = 0; func < 8; func++) {
+            if ((pci_config_read32(0, 0, func, PCI_REG_ID) & 0xFFFF) != 0xFFFF)
+                pci_scan_bus(func);
+        }
+    } else {
+        pci_scan_bus(0);
+    }
+
+    LOG_INFO("pci: %d device(s) found\n", pci_count);
+}
+
+uint32_t pci_device_count(void) {
+    return pci_count;
+}
+
+const pci_device_t* pci_get_device(uint32_t index) {
+    return index < pci_count ? &pci_devices[index] : NULL;
+}
+
+const pci_device_t* pci_find_class(uint8_t class_code, uint8_t subclass, uint8_t prog_if, uint32_t nth) {
+    for (uint32_t i = 0; i < pci_count; i++) {
+        const pci_device_t* dev = &pci_devices[i];
+        if (dev->class_code != class_code) continue;
+        if (subclass != PCI_ANY && dev->subclass != subclass) continue;
+        if (prog_if != PCI_ANY && dev->prog_if != prog_if) continue;
+        if (nth-- == 0) return dev;
+    }
+    return NULL;
+}
+
+void pci_enable_mmio_dma(const pci_device_t* dev) {
+    // The upper half is the status register, whose bits clear when written as 1
+    uint32_t cmd = pci_config_read32(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND) & 0xFFFF;
+    cmd |= PCI_CMD_MEMORY | PCI_CMD_BUS_MASTER;
+    pci_config_write32(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND, cmd);
+}
+
+uint8_t pci_find_capability(const pci_device_t* dev, uint8_t cap_id) {
+    uint32_t status = pci_config_read32(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND);
+    if (!(status & PCI_STATUS_CAP_LIST)) return 0;
+
+    uint8_t ptr = pci_config_read32(dev->bus, dev->slot, dev->func, PCI_REG_CAP_PTR) & 0xFC;
+    // The list lives in the 192 bytes after the header; the bound stops a looping one
+    for (int hops = 0; ptr >= 0x40 && hops < 48; hops++) {
+        uint32_t cap = pci_config_read32(dev->bus, dev->slot, dev->func, ptr);
+        if ((cap & 0xFF) == cap_id) return ptr;
+        ptr = (cap >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+static void pci_msix_write_ctrl(const pci_device_t* dev, uint8_t cap, uint16_t ctrl) {
+    uint32_t reg = pci_config_read32(dev->bus, dev->slot, dev->func, cap);
+    reg = (reg & 0xFFFF) | ((uint32_t)ctrl << 16);
+    pci_config_write32(dev->bus, dev->slot, dev->func, cap, reg);
+}
+
+int pci_msix_enable(const pci_device_t* dev, pci_msix_t* msix) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+    if (!cap) return -1;
+
+    uint16_t ctrl = pci_config_read32(dev->bus, dev->slot, dev->func, cap) >> 16;
+    uint32_t table = pci_config_read32(dev->bus, dev->slot, dev->func, cap + 4);
+    uint8_t bir = table & 0x7;
+    if (bir > 5) return -1;
+
+    uint64_t base = dev->bar[bir] & ~0xFull;
+    if ((dev->bar[bir] & 0x6) == 0x4 && bir < 5)   // 64-bit memory BAR
+        base |= (uint64_t)dev->bar[bir + 1] << 32;
+
+    msix->cap = cap;
+    msix->size = (ctrl & 0x7FF) + 1;
+    msix->table = (volatile uint32_t*)(uintptr_t)(base + (table & ~0x7u) + get_hhdm_offset());
+
+    // Enable under the function mask, so no entry fires half-programmed
+    pci_msix_write_ctrl(dev, cap, ctrl | PCI_MSIX_CTRL_ENABLE | PCI_MSIX_CTRL_MASK_ALL);
+    for (uint16_t i = 0; i < msix->size; i++)
+        pci_msix_mask(msix, i, true);
+    pci_msix_write_ctrl(dev, cap, (ctrl | PCI_MSIX_CTRL_ENABLE) & ~PCI_MSIX_CTRL_MASK_ALL);
+
+    uint32_t cmd = pci_config_read32(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND) & 0xFFFF;
+    pci_config_write32(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND, cmd | PCI_CMD_INTX_DISABLE);
+    return 0;
+}
+
+void pci_msix_mask(pci_msix_t* msix, uint16_t entry, bool masked) {
+    if (entry >= msix->size) return;
+    volatile uint32_t* e = msix->table + entry * (PCI_MSIX_ENTRY_SIZE / 4);
+    uint32_t ctrl = e[3];
+    e[3] = masked ? ctrl | PCI_MSIX_VECTOR_MASKED : ctrl & ~PCI_MSIX_VECTOR_MASKED;
+    (void)e[3];     // Read back so the write has landed before the caller moves on
+}
+
+void pci_msix_route(pci_msix_t* msix, uint16_t entry, uint32_t lapic_id, uint8_t vector) {
+    if (entry >= msix->size) return;
+    volatile uint32_t* e = msix->table + entry * (PCI_MSIX_ENTRY_SIZE / 4);
+
+    pci_msix_mask(msix, entry, true);
+    e[0] = (uint32_t)LAPIC_BASE | ((lapic_id & 0xFF) << 12);
+    e[1] = 0;
+    e[2] = vector;
+    pci_msix_mask(msix, entry, false);
+}
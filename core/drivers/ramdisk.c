@@ -30,6 +30,21 @@ static int ramdisk_write_blocks(struct block_device* dev, uint64_t lba, size_t c
     return 0;
 }
 
+// The image is the medium itself: nothing to flush, and discarded blocks read back as zeroes
+static int ramdisk_flush(struct block_device* dev) {
+    (void)dev;
+    return 0;
+}
+
+static int ramdisk_write_zeroes(struct block_device* dev, uint64_t lba, size_t count) {
+    ramdisk_t* rd = (ramdisk_t*)dev->private_data;
+    uint64_t offset = lba * RAMDISK_BLOCK_SIZE;
+    size_t   bytes  = count * RAMDISK_BLOCK_SIZE;
+    if (offset + bytes > rd->size) return -EINVAL;
+    memset((uint8_t*)rd->image + offset, 0, bytes);
+    return 0;
+}
+
 void ramdisk_register(const char* name, void* image, size_t size) {
     ramdisk_t* rd = kmalloc(sizeof(ramdisk_t));
     if (!rd) return;
@@ -39,6 +54,9 @@ void ramdisk_register(const char* name, void* image, size_t size) {
     block_device_ops_t ops = {
         .read_blocks  = ramdisk_read_blocks,
         .write_blocks = ramdisk_write_blocks,
+        .flush        = ramdisk_flush,
+        .discard      = ramdisk_write_zeroes,
+        .write_zeroes = ramdisk_write_zeroes,
     };
     register_block_device(name, RAMDISK_BLOCK_SIZE, size / RAMDISK_BLOCK_SIZE, &ops, rd);
 }
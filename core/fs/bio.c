@@ -0,0 +1,460 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/fs/bio.h>
+#include <core/kernel/kstd.h>
+#include <core/kernel/mem/slab.h>
+#include <core/kernel/sync/completion.h>
+#include <core/kernel/sync/waitqueue.h>
+#include <core/arch/spinlock.h>
+#include <core/arch/softirq.h>
+#include <core/arch/percpu.h>
+#include <log.h>
+#include <string.h>
+
+#define BLK_SYNC_BIOS   8                   // Bios a synchronous call keeps in flight
+#define BLK_IRQ_WAIT_NS (10 * 1000000ULL)   // Longest halt between timeout checks
+
+/*
+ * Per-device request queue. Requests wait on `head` sorted by LBA until
+ * the driver takes them. One CPU at a time dispatches; anything that would
+ * give it more work while it runs sets `rerun` instead. The lock is taken
+ * with interrupts off because completions may arrive from SOFTIRQ_BLOCK.
+ */
+typedef struct blk_queue {
+    spinlock_t        lock;
+    blk_request_t*    head;
+    uint32_t          plugged;
+    bool              running;
+    bool              rerun;
+    uint64_t          irq_cpus;     /**< CPUs a completion interrupt reaches */
+    uint32_t          max_bytes;    /**< Largest request, at most BLK_MAX_REQUEST_BYTES */
+    blk_queue_stats_t stats;
+} blk_queue_t;
+
+static blk_queue_t   blk_queues[MAX_BLOCK_DEVICES];
+static kmem_cache_t* request_cache;
+static uint32_t      blk_irq_pending;   // Devices, by index, for SOFTIRQ_BLOCK to poll
+
+static inline blk_queue_t* blk_queue(block_device_t* dev) {
+    return &blk_queues[dev - get_block_devices()];
+}
+
+static void blk_softirq(void) {
+    uint32_t pending = __atomic_exchange_n(&blk_irq_pending, 0, __ATOMIC_ACQUIRE);
+    block_device_t* devices = get_block_devices();
+    while (pending) {
+        uint32_t i = (uint32_t)__builtin_ctz(pending);
+        pending &= pending - 1;
+        blk_poll(&devices[i]);
+    }
+}
+
+void bio_init(void) {
+    for (int i = 0; i < MAX_BLOCK_DEVICES; i++) {
+        spinlock_init_named(&blk_queues[i].lock, "blk_queue");
+        blk_queues[i].max_bytes = BLK_MAX_REQUEST_BYTES;
+    }
+    request_cache = kmem_cache_create("blk_request", sizeof(blk_request_t), 0, NULL);
+    if (!request_cache)
+        LOG_ERROR("bio: failed to create request cache\n");
+    softirq_register(SOFTIRQ_BLOCK, blk_softirq);
+}
+
+// The slab is not interrupt-safe, and requests are also freed from SOFTIRQ_BLOCK
+static blk_request_t* blk_request_alloc(void) {
+    local_bh_disable();
+    blk_request_t* rq = kmem_cache_alloc(request_cache);
+    local_bh_enable();
+    return rq;
+}
+
+static void blk_request_free(blk_request_t* rq) {
+    local_bh_disable();
+    kmem_cache_free(request_cache, rq);
+    local_bh_enable();
+}
+
+static inline void bio_fail(bio_t* bio, int status) {
+    bio->status = status;
+    bio->end_io(bio);
+}
+
+static inline bool bio_has_data(uint32_t op) {
+    return op == BIO_READ || op == BIO_WRITE;
+}
+
+// A device without the op fails such bios; those with `submit` advertise theirs the same way
+static bool blk_supports(block_device_t* dev, uint32_t op) {
+    switch (op) {
+    case BIO_READ:         return dev->ops.submit || dev->ops.read_blocks;
+    case BIO_WRITE:        return dev->ops.submit || dev->ops.write_blocks;
+    case BIO_FLUSH:        return dev->ops.flush != NULL;
+    case BIO_DISCARD:      return dev->ops.discard != NULL;
+    case BIO_WRITE_ZEROES: return dev->ops.write_zeroes != NULL;
+    default:               return false;
+    }
+}
+
+// For drivers without `submit`
+static int blk_run_sync(block_device_t* dev, blk_request_t* rq) {
+    switch (rq->op) {
+    case BIO_READ:         return dev->ops.read_blocks(dev, rq->lba, rq->count, rq->buf);
+    case BIO_WRITE:        return dev->ops.write_blocks(dev, rq->lba, rq->count, rq->buf);
+    case BIO_FLUSH:        return dev->ops.flush(dev);
+    case BIO_DISCARD:      return dev->ops.discard(dev, rq->lba, rq->count);
+    case BIO_WRITE_ZEROES: return dev->ops.write_zeroes(dev, rq->lba, rq->count);
+    default:               return -EINVAL;
+    }
+}
+
+// Appends or prepends `bio` to a queued request it continues on disk and, if it has data, in memory
+static bool blk_try_merge(blk_queue_t* q, bio_t* bio) {
+    if (bio->op == BIO_FLUSH) return false;
+    uint32_t bs = bio->dev->block_size;
+    uint8_t* buf = bio->buf;
+    bool data = bio_has_data(bio->op);
+
+    for (blk_request_t* rq = q->head; rq; rq = rq->next) {
+        if (rq->op != bio->op) continue;
+        if (data ? (uint64_t)(rq->count + bio->count) * bs > q->max_bytes
+                 : rq->count + bio->count > BLK_MAX_NODATA_BLOCKS) continue;
+
+        if (!data) {
+            if (rq->lba + rq->count == bio->lba) {
+                rq->bio_tail->next = bio;
+                rq->bio_tail = bio;
+                rq->count += bio->count;
+                return true;
+            }
+            if (bio->lba + bio->count == rq->lba) {
+                bio->next = rq->bio;
+                rq->bio = bio;
+                rq->lba = bio->lba;
+                rq->count += bio->count;
+                return true;
+            }
+            continue;
+        }
+
+        if (rq->lba + rq->count == bio->lba && (uint8_t*)rq->buf + (uint64_t)rq->count * bs == buf) {
+            rq->bio_tail->next = bio;
+            rq->bio_tail = bio;
+            rq->count += bio->count;
+            return true;
+        }
+        if (bio->lba + bio->count == rq->lba && buf + (uint64_t)bio->count * bs == rq->buf) {
+            bio->next = rq->bio;
+            rq->bio = bio;
+            rq->lba = bio->lba;
+            rq->buf = bio->buf;
+            rq->count += bio->count;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Stable: a request goes after any with the same LBA, so those keep submission order
+static void blk_insert_sorted(blk_queue_t* q, blk_request_t* rq) {
+    blk_request_t** link = &q->head;
+    while (*link && (*link)->lba <= rq->lba)
+        link = &(*link)->next;
+    rq->next = *link;
+    *link = rq;
+}
+
+static void blk_run_queue(block_device_t* dev) {
+    blk_queue_t* q = blk_queue(dev);
+    uint64_t flags = spinlock_acquire_irqsave(&q->lock);
+    if (q->running) {
+        q->rerun = true;
+        spinlock_release_irqrestore(&q->lock, flags);
+        return;
+    }
+    q->running = true;
+
+    for (;;) {
+        blk_request_t* rq = q->plugged ? NULL : q->head;
+        if (!rq) break;
+
+        q->head = rq->next;
+        rq->next = NULL;
+        q->rerun = false;
+        q->stats.queued--;
+        q->stats.requests++;
+        if (++q->stats.in_flight > q->stats.max_in_flight)
+            q->stats.max_in_flight = q->stats.in_flight;
+        spinlock_release_irqrestore(&q->lock, flags);
+
+        if (dev->ops.submit) {
+            int rc = dev->ops.submit(dev, rq);
+            if (rc == -EBUSY) {
+                flags = spinlock_acquire_irqsave(&q->lock);
+                rq->next = q->head;
+                q->head = rq;
+                q->stats.queued++;
+                q->stats.requests--;
+                q->stats.in_flight--;
+                q->stats.busy++;
+                // Unless a completion came in meanwhile, the next one restarts the queue
+                if (!q->rerun) break;
+                continue;
+            }
+            if (rc != 0)
+                blk_end_request(rq, rc);
+        } else {
+            blk_end_request(rq, blk_run_sync(dev, rq));
+        }
+
+        flags = spinlock_acquire_irqsave(&q->lock);
+    }
+
+    q->running = false;
+    spinlock_release_irqrestore(&q->lock, flags);
+}
+
+void bio_submit(bio_t* bio) {
+    block_device_t* dev = bio->dev;
+    bio->status = 0;
+    bio->next = NULL;
+
+    bool valid;
+    if (!dev) {
+        valid = false;
+    } else if (bio->op == BIO_FLUSH) {
+        valid = bio->lba == 0 && bio->count == 0;
+    } else {
+        valid = bio->count != 0 && bio->lba + bio->count <= dev->total_blocks &&
+                (bio_has_data(bio->op)
+                    ? bio->buf && (uint64_t)bio->count * dev->block_size <= blk_max_request_bytes(dev)
+                    : bio->count <= BLK_MAX_NODATA_BLOCKS);
+    }
+    if (!valid) {
+        bio_fail(bio, -EINVAL);
+        return;
+    }
+    if (!blk_supports(dev, bio->op)) {
+        bio_fail(bio, bio_has_data(bio->op) ? -EROFS : -ENOSYS);
+        return;
+    }
+
+    // Allocated up front so the slab is never entered with the queue lock held
+    blk_request_t* rq = blk_request_alloc();
+    if (!rq) {
+        bio_fail(bio, -ENOMEM);
+        return;
+    }
+
+    blk_queue_t* q = blk_queue(dev);
+    uint64_t flags = spinlock_acquire_irqsave(&q->lock);
+    q->stats.bios++;
+    bool merged = blk_try_merge(q, bio);
+    if (merged) {
+        q->stats.merged++;
+    } else {
+        rq->dev = dev;
+        rq->op = bio->op;
+        rq->lba = bio->lba;
+        rq->count = bio->count;
+        rq->buf = bio->buf;
+        rq->bio = bio;
+        rq->bio_tail = bio;
+        rq->driver_data = NULL;
+        blk_insert_sorted(q, rq);
+        q->stats.queued++;
+    }
+    bool plugged = q->plugged != 0;
+    spinlock_release_irqrestore(&q->lock, flags);
+
+    if (merged)
+        blk_request_free(rq);
+    if (!plugged)
+        blk_run_queue(dev);
+}
+
+void blk_plug(block_device_t* dev) {
+    blk_queue_t* q = blk_queue(dev);
+    uint64_t flags = spinlock_acquire_irqsave(&q->lock);
+    q->plugged++;
+    spinlock_release_irqrestore(&q->lock, flags);
+}
+
+void blk_unplug(block_device_t* dev) {
+    blk_queue_t* q = blk_queue(dev);
+    uint64_t flags = spinlock_acquire_irqsave(&q->lock);
+    bool run = --q->plugged == 0;
+    spinlock_release_irqrestore(&q->lock, flags);
+    if (run)
+        blk_run_queue(dev);
+}
+
+void blk_poll(block_device_t* dev) {
+    if (dev->ops.poll)
+        dev->ops.poll(dev);
+}
+
+void blk_set_irq_cpus(block_device_t* dev, uint64_t cpus) {
+    __atomic_store_n(&blk_queue(dev)->irq_cpus, cpus, __ATOMIC_RELEASE);
+}
+
+void blk_set_max_request_bytes(block_device_t* dev, uint32_t bytes) {
+    if (bytes > BLK_MAX_REQUEST_BYTES) bytes = BLK_MAX_REQUEST_BYTES;
+    if (bytes < dev->block_size) bytes = dev->block_size;
+    __atomic_store_n(&blk_queue(dev)->max_bytes, bytes, __ATOMIC_RELEASE);
+}
+
+uint32_t blk_max_request_bytes(block_device_t* dev) {
+    return __atomic_load_n(&blk_queue(dev)->max_bytes, __ATOMIC_ACQUIRE);
+}
+
+void blk_complete_irq(block_device_t* dev) {
+    blk_queue_t* q = blk_queue(dev);
+    __atomic_fetch_add(&q->stats.irqs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&blk_irq_pending, 1u << (dev - get_block_devices()), __ATOMIC_RELEASE);
+    raise_softirq(SOFTIRQ_BLOCK);
+}
+
+void blk_end_request(blk_request_t* rq, int status) {
+    block_device_t* dev = rq->dev;
+    blk_queue_t* q = blk_queue(dev);
+    bio_t* bio = rq->bio;
+
+    uint64_t flags = spinlock_acquire_irqsave(&q->lock);
+    q->stats.in_flight--;
+    spinlock_release_irqrestore(&q->lock, flags);
+    blk_request_free(rq);
+
+    while (bio) {
+        bio_t* next = bio->next;
+        bio->next = NULL;
+        bio_fail(bio, status);
+        bio = next;
+    }
+
+    // A hardware slot just came free
+    blk_run_queue(dev);
+}
+
+void blk_kick(block_device_t* dev) {
+    blk_run_queue(dev);
+}
+
+typedef struct {
+    completion_t done;
+} blk_batch_t;
+
+static void blk_batch_end(bio_t* bio) {
+    complete(&((blk_batch_t*)bio->private)->done);
+}
+
+int bio_submit_batch(bio_t* bios, uint32_t n) {
+    if (n == 0) return 0;
+    if (n > BLK_BATCH_MAX) return -EINVAL;
+
+    block_device_t* dev = bios[0].dev;
+    blk_batch_t batch;
+    init_completion(&batch.done);
+
+    if (dev) blk_plug(dev);
+    for (uint32_t i = 0; i < n; i++) {
+        bios[i].end_io = blk_batch_end;
+        bios[i].private = &batch;
+        bio_submit(&bios[i]);
+    }
+    if (dev) blk_unplug(dev);
+
+    /*
+     * The bios may live on the caller's stack, so there is no giving up
+     * here; drivers time commands out. On a CPU the device interrupts, the
+     * wait halts until the interrupt and the poll only catches timeouts.
+     */
+    bool irq = dev && (__atomic_load_n(&blk_queue(dev)->irq_cpus, __ATOMIC_ACQUIRE) & (1ULL << this_cpu_id()));
+    for (uint32_t i = 0; i < n; i++) {
+        for (;;) {
+            uint32_t seq = waitqueue_seq(&batch.done.wait);
+            if (dev) blk_poll(dev);
+            if (try_wait_for_completion(&batch.done)) break;
+            if (irq)
+                waitqueue_idle(&batch.done.wait, seq, BLK_IRQ_WAIT_NS);
+            else
+                wait_yield();
+        }
+    }
+
+    for (uint32_t i = 0; i < n; i++)
+        if (bios[i].status) return bios[i].status;
+    return 0;
+}
+
+static int blk_rw_sync(block_device_t* dev, uint32_t op, uint64_t lba, size_t count, uint8_t* buf) {
+    if (!dev || !buf) return -EINVAL;
+    uint32_t per_bio = blk_max_request_bytes(dev) / dev->block_size;
+    if (per_bio == 0) return -EINVAL;
+
+    bio_t bios[BLK_SYNC_BIOS];
+    while (count > 0) {
+        uint32_t n = 0;
+        for (; n < BLK_SYNC_BIOS && count > 0; n++) {
+            uint32_t chunk = count > per_bio ? per_bio : (uint32_t)count;
+            bio_setup(&bios[n], dev, op, lba, chunk, buf, NULL, NULL);
+            lba += chunk;
+            count -= chunk;
+            buf += (uint64_t)chunk * dev->block_size;
+        }
+        int rc = bio_submit_batch(bios, n);
+        if (rc != 0) return rc;
+    }
+    return 0;
+}
+
+int blk_read_blocks(block_device_t* dev, uint64_t lba, size_t count, void* buf) {
+    return blk_rw_sync(dev, BIO_READ, lba, count, buf);
+}
+
+int blk_write_blocks(block_device_t* dev, uint64_t lba, size_t count, const void* buf) {
+    return blk_rw_sync(dev, BIO_WRITE, lba, count, (uint8_t*)buf);
+}
+
+static int blk_nodata_sync(block_device_t* dev, uint32_t op, uint64_t lba, size_t count) {
+    if (!dev) return -EINVAL;
+
+    bio_t bios[BLK_SYNC_BIOS];
+    if (op == BIO_FLUSH) {
+        bio_setup(&bios[0], dev, op, 0, 0, NULL, NULL, NULL);
+        return bio_submit_batch(bios, 1);
+    }
+
+    while (count > 0) {
+        uint32_t n = 0;
+        for (; n < BLK_SYNC_BIOS && count > 0; n++) {
+            uint32_t chunk = count > BLK_MAX_NODATA_BLOCKS ? BLK_MAX_NODATA_BLOCKS : (uint32_t)count;
+            bio_setup(&bios[n], dev, op, lba, chunk, NULL, NULL, NULL);
+            lba += chunk;
+            count -= chunk;
+        }
+        int rc = bio_submit_batch(bios, n);
+        if (rc != 0) return rc;
+    }
+    return 0;
+}
+
+int blk_flush(block_device_t* dev) {
+    return blk_nodata_sync(dev, BIO_FLUSH, 0, 0);
+}
+
+int blk_discard(block_device_t* dev, uint64_t lba, size_t count) {
+    return blk_nodata_sync(dev, BIO_DISCARD, lba, count);
+}
+
+int blk_write_zeroes(block_device_t* dev, uint64_t lba, size_t count) {
+    return blk_nodata_sync(dev, BIO_WRITE_ZEROES, lba, count);
+}
+
+int blk_get_queue_stats(block_device_t* dev, blk_queue_stats_t* out) {
+    if (!dev || !out) return -EINVAL;
+    blk_queue_t* q = blk_queue(dev);
+    uint64_t flags = spinlock_acquire_irqsave(&q->lock);
+    *out = q->stats;
+    spinlock_release_irqrestore(&q->lock, flags);
+    return 0;
+}
@@ -1,19 +1,51 @@
 // SPDX-License-Identifier: GPL-3.0-only
 
 #include <core/fs/block.h>
+#include <core/fs/bio.h>
 #include <core/kernel/kstd.h>
+#include <core/kernel/mem.h>
+#include <core/arch/spinlock.h>
+#include <core/arch/pause.h>
+#include <core/arch/tsc.h>
 #include <log.h>
 #include <string.h>
 
+/*
+ * Entries are filled in completely and then published by setting `used`
+ * with release ordering, so lookups scan the array without a lock. Nothing
+ * is ever unregistered, which means there is no old version to reclaim;
+ * `block_devices_lock` only keeps two registrations off the same slot.
+ */
 static block_device_t block_devices[MAX_BLOCK_DEVICES];
+static spinlock_t block_devices_lock;
+
+/*
+ * Buffer cache state, all under `bcache_lock`. A hashed buffer with no
+ * holders is on the LRU list, oldest release first; one with BH_BUSY set
+ * always has a holder, so eviction never meets I/O in flight. Headers that
+ * hold no block are chained through `hash_next` on the free list.
+ */
+static buffer_head_t  bcache[BCACHE_MAX_BUFFERS];
+static uint32_t       bcache_used;
+static buffer_head_t* bcache_free;
+static buffer_head_t* bcache_hash[1u << BCACHE_HASH_BITS];
+static buffer_head_t* lru_head;
+static buffer_head_t* lru_tail;
+static spinlock_t     bcache_lock;
+static bcache_stats_t bcache_stats;
+static uint64_t       bcache_last_writeback;
 
 void block_init(void) {
     memset(block_devices, 0, sizeof(block_devices));
+    spinlock_init_named(&block_devices_lock, "block_devices");
+    spinlock_init_named(&bcache_lock, "bcache");
+    bio_init();
     LOG_INFO("Block device layer initialized.\n");
 }
 
 int register_block_device(const char* name, uint32_t block_size, uint64_t total_blocks, 
                            block_device_ops_t* ops, void* private_data) {
+    spinlock_acquire(&block_devices_lock);
     for (int i = 0; i < MAX_BLOCK_DEVICES; i++) {
         if (!block_devices[i].used) {
             strcpy_safe(block_devices[i].name, name, sizeof(block_devices[i].name));
@@ -21,11 +53,13 @@ int register_block_device(const char* name, uint32_t block_size, uint64_t total_
             block_devices[i].total_blocks = total_blocks;
             block_devices[i].ops = *ops;
             block_devices[i].private_data = private_data;
-            block_devices[i].used = true;
+            __atomic_store_n(&block_devices[i].used, true, __ATOMIC_RELEASE);
+            spinlock_release(&block_devices_lock);
             LOG_INFO("Registered block device '%s'. \n", name);
             return 0;
         }
     }
+    spinlock_release(&block_devices_lock);
 
     LOG_WARN("Could not register block device '%s': registry full.", name);
     return -ENOMEM;
@@ -33,9 +67,9 @@ int register_block_device(const char* name, uint32_t block_size, uint64_t total_
 
 block_device_t* find_block_device(const char* name) {
     for (int i = 0; i < MAX_BLOCK_DEVICES; i++) {
-        if (block_devices[i].used && strcmp(block_devices[i].name, name) == 0) {
+        if (__atomic_load_n(&block_devices[i].used, __ATOMIC_ACQUIRE) &&
+            strcmp(block_devices[i].name, name) == 0)
             return &block_devices[i];
-        }
     }
     return NULL;
 }
@@ -43,3 +77,410 @@ block_device_t* find_block_device(const char* name) {
 block_device_t* get_block_devices(void) {
     return block_devices;
 }
+
+static inline uint32_t bcache_hashfn(block_device_t* dev, uint64_t lba) {
+    uint64_t key = lba ^ ((uint64_t)(dev - block_devices) << 48);
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - BCACHE_HASH_BITS));
+}
+
+static buffer_head_t* bcache_lookup(block_device_t* dev, uint64_t lba) {
+    for (buffer_head_t* bh = bcache_hash[bcache_hashfn(dev, lba)]; bh; bh = bh->hash_next)
+        if (bh->dev == dev && bh->lba == lba) return bh;
+    return NULL;
+}
+
+static void bcache_unhash(buffer_head_t* bh) {
+    buffer_head_t** link = &bcache_hash[bcache_hashfn(bh->dev, bh->lba)];
+    while (*link != bh) link = &(*link)->hash_next;
+    *link = bh->hash_next;
+    bh->hash_next = NULL;
+}
+
+static void lru_remove(buffer_head_t* bh) {
+    if (bh->lru_prev) bh->lru_prev->lru_next = bh->lru_next;
+    else lru_head = bh->lru_next;
+    if (bh->lru_next) bh->lru_next->lru_prev = bh->lru_prev;
+    else lru_tail = bh->lru_prev;
+    bh->lru_prev = bh->lru_next = NULL;
+}
+
+static void lru_append(buffer_head_t* bh) {
+    bh->lru_prev = lru_tail;
+    bh->lru_next = NULL;
+    if (lru_tail) lru_tail->lru_next = bh;
+    else lru_head = bh;
+    lru_tail = bh;
+}
+
+// Unhashed, unreferenced and clean; its data is kept for the next user of the header
+static void bcache_release_header(buffer_head_t* bh) {
+    bcache_unhash(bh);
+    bcache_stats.buffers--;
+    bh->dev = NULL;
+    bh->flags = 0;
+    bh->hash_next = bcache_free;
+    bcache_free = bh;
+}
+
+static inline void bh_get_locked(buffer_head_t* bh) {
+    if (bh->ref++ == 0) lru_remove(bh);
+}
+
+static void bh_put_locked(buffer_head_t* bh) {
+    if (--bh->ref) return;
+    // A failed read leaves nothing worth keeping
+    if (!(bh->flags & BH_UPTODATE)) bcache_release_header(bh);
+    else lru_append(bh);
+}
+
+/*
+ * Called with the lock held on a dirty buffer that is not busy; returns
+ * with it held again. DIRTY is cleared before the write so that a holder
+ * dirtying the buffer meanwhile is not lost.
+ */
+static int bcache_writeout_locked(buffer_head_t* bh) {
+    bh_get_locked(bh);
+    bh->flags = (bh->flags & ~BH_DIRTY) | BH_BUSY;
+    bcache_stats.dirty--;
+    spinlock_release(&bcache_lock);
+
+    int rc = blk_write_blocks(bh->dev, bh->lba, bh->count, bh->data);
+
+    spinlock_acquire(&bcache_lock);
+    if (rc != 0) {
+        bcache_stats.write_errors++;
+        if (!(bh->flags & BH_DIRTY)) bcache_stats.dirty++;
+        bh->flags |= BH_DIRTY;
+        LOG_WARN("bcache: write-back of %s lba %u failed: %d\n", bh->dev->name, (uint32_t)bh->lba, rc);
+    } else {
+        bcache_stats.writebacks++;
+    }
+    bh->flags &= ~BH_BUSY;
+    bh_put_locked(bh);
+    return rc;
+}
+
+// Oldest clean buffer on the LRU list, unhashed and ready to reuse
+static buffer_head_t* bcache_evict_locked(void) {
+    for (buffer_head_t* bh = lru_head; bh; bh = bh->lru_next) {
+        if (bh->flags & BH_DIRTY) continue;
+        lru_remove(bh);
+        bcache_unhash(bh);
+        bcache_stats.buffers--;
+        bcache_stats.evictions++;
+        return bh;
+    }
+    return NULL;
+}
+
+/*
+ * Waits out another holder's I/O or bget() claim, then reads the data in
+ * if nobody has yet. Without `read` the caller takes the claim instead.
+ */
+static buffer_head_t* bcache_fill(buffer_head_t* bh, bool read) {
+    for (;;) {
+        while (bh->flags & (BH_BUSY | BH_NEW)) cpu_relax();
+        if (bh->flags & BH_UPTODATE) return bh;
+
+        spinlock_acquire(&bcache_lock);
+        if (bh->flags & (BH_BUSY | BH_NEW | BH_UPTODATE)) {
+            spinlock_release(&bcache_lock);
+            continue;
+        }
+        if (!read) {
+            bh->flags |= BH_NEW;
+            spinlock_release(&bcache_lock);
+            return bh;
+        }
+        bh->flags |= BH_BUSY;
+        spinlock_release(&bcache_lock);
+
+        int rc = blk_read_blocks(bh->dev, bh->lba, bh->count, bh->data);
+
+        spinlock_acquire(&bcache_lock);
+        bh->flags &= ~BH_BUSY;
+        if (rc == 0) bh->flags |= BH_UPTODATE;
+        spinlock_release(&bcache_lock);
+
+        if (rc == 0) return bh;
+        brelse(bh);
+        return NULL;
+    }
+}
+
+static buffer_head_t* bcache_get(block_device_t* dev, uint64_t lba, uint32_t count, bool read) {
+    if (!dev || count == 0 || lba + count > dev->total_blocks) return NULL;
+    uint32_t size = count * dev->block_size;
+
+    buffer_head_t* bh;
+    spinlock_acquire(&bcache_lock);
+    for (;;) {
+        bh = bcache_lookup(dev, lba);
+        if (bh && bh->count == count) {
+            bh_get_locked(bh);
+            bcache_stats.hits++;
+            spinlock_release(&bcache_lock);
+            return bcache_fill(bh, read);
+        }
+
+        if (bh) {
+            // Same start, different span: retire the old buffer first
+            if (bh->ref) {
+                spinlock_release(&bcache_lock);
+                LOG_WARN("bcache: %s lba %u is held with another size\n", dev->name, (uint32_t)lba);
+                return NULL;
+            }
+            if (bh->flags & BH_DIRTY) {
+                if (bcache_writeout_locked(bh) == 0) continue;
+                spinlock_release(&bcache_lock);
+                return NULL;
+            }
+            lru_remove(bh);
+            bcache_release_header(bh);
+        }
+
+        bh = bcache_free;
+        if (bh) bcache_free = bh->hash_next;
+        else if (bcache_used < BCACHE_MAX_BUFFERS) bh = &bcache[bcache_used++];
+        else bh = bcache_evict_locked();
+
+        if (!bh) {
+            // Everything unreferenced is dirty; clean the oldest and look again
+            if (lru_head && bcache_writeout_locked(lru_head) == 0) continue;
+            spinlock_release(&bcache_lock);
+            if (!lru_head) LOG_WARN("bcache: every buffer is in use\n");
+            return NULL;
+        }
+
+        // Published busy, so anyone else asking for this block waits for the data
+        bh->dev = dev;
+        bh->lba = lba;
+        bh->count = count;
+        bh->flags = BH_BUSY;
+        bh->ref = 1;
+        bh->hash_next = bcache_hash[bcache_hashfn(dev, lba)];
+        bcache_hash[bcache_hashfn(dev, lba)] = bh;
+        bcache_stats.buffers++;
+        bcache_stats.misses++;
+        spinlock_release(&bcache_lock);
+        break;
+    }
+
+    if (bh->size != size) {
+        if (bh->data) {
+            kfree(bh->data);
+            bcache_stats.bytes -= bh->size;
+        }
+        bh->data = kmalloc(size);
+        bh->size = bh->data ? size : 0;
+        if (bh->data) bcache_stats.bytes += size;
+    }
+
+    int rc = bh->data ? 0 : -ENOMEM;
+    if (rc == 0 && read)
+        rc = blk_read_blocks(dev, lba, count, bh->data);
+
+    spinlock_acquire(&bcache_lock);
+    bh->flags &= ~BH_BUSY;
+    if (rc == 0) bh->flags |= read ? BH_UPTODATE : BH_NEW;
+    if (rc != 0) {
+        bh_put_locked(bh);
+        bh = NULL;
+    }
+    spinlock_release(&bcache_lock);
+    return bh;
+}
+
+buffer_head_t* bread(block_device_t* dev, uint64_t lba, uint32_t count) {
+    return bcache_get(dev, lba, count, true);
+}
+
+buffer_head_t* bget(block_device_t* dev, uint64_t lba, uint32_t count) {
+    return bcache_get(dev, lba, count, false);
+}
+
+void bdirty(buffer_head_t* bh) {
+    spinlock_acquire(&bcache_lock);
+    if (!(bh->flags & BH_DIRTY)) {
+        bh->dirty_ms = ktime_get_ms();
+        bcache_stats.dirty++;
+    }
+    bh->flags = (bh->flags & ~BH_NEW) | BH_DIRTY | BH_UPTODATE;
+    spinlock_release(&bcache_lock);
+}
+
+int bwrite(buffer_head_t* bh) {
+    for (;;) {
+        while (bh->flags & BH_BUSY) cpu_relax();
+        spinlock_acquire(&bcache_lock);
+        if (!(bh->flags & BH_BUSY)) break;
+        spinlock_release(&bcache_lock);
+    }
+
+    bh->flags = (bh->flags & ~BH_NEW) | BH_UPTODATE;
+    if (!(bh->flags & BH_DIRTY)) {
+        bh->flags |= BH_DIRTY;
+        bcache_stats.dirty++;
+    }
+    int rc = bcache_writeout_locked(bh);
+    spinlock_release(&bcache_lock);
+    return rc;
+}
+
+void brelse(buffer_head_t* bh) {
+    if (!bh) return;
+    spinlock_acquire(&bcache_lock);
+    // An unfilled bget() buffer is dropped, and a waiting reader reads the device
+    bh->flags &= ~BH_NEW;
+    bh_put_locked(bh);
+    spinlock_release(&bcache_lock);
+}
+
+// Claimed buffers go out as one batch of bios, so the device sees them all at once
+static int bsync_batch(block_device_t* dev, buffer_head_t** claimed, uint32_t n) {
+    bio_t bios[BLK_BATCH_MAX];
+    for (uint32_t i = 0; i < n; i++)
+        bio_setup(&bios[i], dev, BIO_WRITE, claimed[i]->lba, claimed[i]->count,
+                  claimed[i]->data, NULL, NULL);
+    int result = bio_submit_batch(bios, n);
+
+    spinlock_acquire(&bcache_lock);
+    for (uint32_t i = 0; i < n; i++) {
+        buffer_head_t* bh = claimed[i];
+        if (bios[i].status != 0) {
+            bcache_stats.write_errors++;
+            if (!(bh->flags & BH_DIRTY)) bcache_stats.dirty++;
+            bh->flags |= BH_DIRTY;
+        } else {
+            bcache_stats.writebacks++;
+        }
+        bh->flags &= ~BH_BUSY;
+        bh_put_locked(bh);
+    }
+    spinlock_release(&bcache_lock);
+
+    if (result != 0)
+        LOG_WARN("bcache: sync of %s failed: %d\n", dev->name, result);
+    return result;
+}
+
+static int bsync_device(block_device_t* dev) {
+    buffer_head_t* claimed[BLK_BATCH_MAX];
+    uint32_t next = 0;
+
+    for (;;) {
+        uint32_t n = 0;
+        spinlock_acquire(&bcache_lock);
+        for (; next < bcache_used && n < BLK_BATCH_MAX; next++) {
+            buffer_head_t* bh = &bcache[next];
+            if (bh->dev != dev || (bh->flags & (BH_DIRTY | BH_BUSY)) != BH_DIRTY) continue;
+            // Same hand-off as bcache_writeout_locked()
+            bh_get_locked(bh);
+            bh->flags = (bh->flags & ~BH_DIRTY) | BH_BUSY;
+            bcache_stats.dirty--;
+            claimed[n++] = bh;
+        }
+        spinlock_release(&bcache_lock);
+
+        if (n == 0) break;
+        int rc = bsync_batch(dev, claimed, n);
+        if (rc != 0) return rc;
+    }
+
+    return dev->ops.flush ? dev->ops.flush(dev) : 0;
+}
+
+int bsync(block_device_t* dev) {
+    if (dev) return bsync_device(dev);
+
+    int result = 0;
+    for (int i = 0; i < MAX_BLOCK_DEVICES; i++) {
+        if (!__atomic_load_n(&block_devices[i].used, __ATOMIC_ACQUIRE)) continue;
+        int rc = bsync_device(&block_devices[i]);
+        if (rc != 0 && result == 0) result = rc;
+    }
+    return result;
+}
+
+int bzero_blocks(block_device_t* dev, uint64_t lba, uint32_t count) {
+    buffer_head_t* bh = bget(dev, lba, count);
+    if (!bh) return -EIO;
+
+    // Claimed like a write-back, so nobody sees it half-zeroed or writes it meanwhile
+    for (;;) {
+        while (bh->flags & BH_BUSY) cpu_relax();
+        spinlock_acquire(&bcache_lock);
+        if (!(bh->flags & BH_BUSY)) break;
+        spinlock_release(&bcache_lock);
+    }
+    if (bh->flags & BH_DIRTY) bcache_stats.dirty--;
+    bh->flags = (bh->flags & ~BH_DIRTY) | BH_BUSY;
+    spinlock_release(&bcache_lock);
+
+    memset(bh->data, 0, bh->size);
+    int rc = dev->ops.write_zeroes ? dev->ops.write_zeroes(dev, lba, count) : -ENOSYS;
+
+    spinlock_acquire(&bcache_lock);
+    bh->flags = (bh->flags & ~(BH_BUSY | BH_NEW)) | BH_UPTODATE;
+    spinlock_release(&bcache_lock);
+
+    if (rc != 0) bdirty(bh);
+    brelse(bh);
+    return 0;
+}
+
+int bdiscard(block_device_t* dev, uint64_t lba, uint64_t count) {
+    if (!dev || count == 0 || lba + count > dev->total_blocks) return -EINVAL;
+
+    // Unheld copies inside the range are dropped, dirty or not; a held one is its holder's business
+    spinlock_acquire(&bcache_lock);
+    for (uint32_t i = 0; i < bcache_used; i++) {
+        buffer_head_t* bh = &bcache[i];
+        if (bh->dev != dev || bh->ref) continue;
+        if (bh->lba < lba || bh->lba + bh->count > lba + count) continue;
+        if (bh->flags & BH_DIRTY) bcache_stats.dirty--;
+        lru_remove(bh);
+        bcache_release_header(bh);
+    }
+    spinlock_release(&bcache_lock);
+
+    return dev->ops.discard ? dev->ops.discard(dev, lba, count) : 0;
+}
+
+void binvalidate(block_device_t* dev) {
+    spinlock_acquire(&bcache_lock);
+    for (uint32_t i = 0; i < bcache_used; i++) {
+        buffer_head_t* bh = &bcache[i];
+        if (bh->dev != dev || bh->ref || (bh->flags & BH_DIRTY)) continue;
+        lru_remove(bh);
+        bcache_release_header(bh);
+        kfree(bh->data);
+        bcache_stats.bytes -= bh->size;
+        bh->data = NULL;
+        bh->size = 0;
+    }
+    spinlock_release(&bcache_lock);
+}
+
+void bcache_writeback(void) {
+    uint64_t now = ktime_get_ms();
+    if (__atomic_load_n(&bcache_stats.dirty, __ATOMIC_RELAXED) == 0) return;
+    if (now - bcache_last_writeback < 1000) return;
+    bcache_last_writeback = now;
+
+    spinlock_acquire(&bcache_lock);
+    for (uint32_t i = 0; i < bcache_used; i++) {
+        buffer_head_t* bh = &bcache[i];
+        if (!bh->dev || bh->ref || !(bh->flags & BH_DIRTY)) continue;
+        if (now - bh->dirty_ms < BCACHE_WRITEBACK_MS) continue;
+        bcache_writeout_locked(bh);
+    }
+    spinlock_release(&bcache_lock);
+}
+
+void bcache_get_stats(bcache_stats_t* out) {
+    if (!out) return;
+    spinlock_acquire(&bcache_lock);
+    *out = bcache_stats;
+    spinlock_release(&bcache_lock);
+}
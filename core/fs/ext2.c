@@ -5,40 +5,35 @@
 #include <core/fs/block.h>
 #include <core/kernel/kstd.h>
 #include <core/kernel/mem.h>
+#include <core/kernel/mem/slab.h>
 #include <log.h>
 #include <stddef.h>
 #include <stdbool.h>
 
-static int ext2_read_block(ext2_fs_t *fs, uint32_t block, void *buf) {
-    uint64_t lba = (uint64_t)block * fs->sectors_per_block;
-    return fs->block_dev->ops.read_blocks(fs->block_dev, lba,
-                                          fs->sectors_per_block, buf);
+static kmem_cache_t *ext2_handle_cache;
+
+// Metadata and file data are changed in place in the buffer cache, under one bread()/bdirty()/brelse()
+static buffer_head_t *ext2_bread(ext2_fs_t *fs, uint32_t block) {
+    return bread(fs->block_dev, (uint64_t)block * fs->sectors_per_block,
+                 fs->sectors_per_block);
 }
 
-static int ext2_write_block(ext2_fs_t *fs, uint32_t block, const void *buf) {
-    uint64_t lba = (uint64_t)block * fs->sectors_per_block;
-    return fs->block_dev->ops.write_blocks(fs->block_dev, lba,
-                                           fs->sectors_per_block,
-                                           (void *)buf);
+// For a block about to be overwritten whole; nothing is read from the device
+static buffer_head_t *ext2_bget(ext2_fs_t *fs, uint32_t block) {
+    return bget(fs->block_dev, (uint64_t)block * fs->sectors_per_block,
+                fs->sectors_per_block);
 }
 
 static int ext2_write_superblock(ext2_fs_t *fs) {
-
-    uint8_t *blk = kmalloc(fs->block_size);
-    if (!blk) return -ENOMEM;
-
     uint32_t sb_block = (fs->block_size == 1024) ? 1 : 0;
-    if (ext2_read_block(fs, sb_block, blk) != 0) {
-        kfree(blk);
-        return -EIO;
-    }
+    buffer_head_t *bh = ext2_bread(fs, sb_block);
+    if (!bh) return -EIO;
 
     uint32_t sb_offset = (fs->block_size == 1024) ? 0 : 1024;
-    memcpy(blk + sb_offset, &fs->sb, sizeof(ext2_superblock_t));
-
-    int rc = ext2_write_block(fs, sb_block, blk);
-    kfree(blk);
-    return rc;
+    memcpy(bh->data + sb_offset, &fs->sb, sizeof(ext2_superblock_t));
+    bdirty(bh);
+    brelse(bh);
+    return 0;
 }
 
 static int ext2_write_bgdt(ext2_fs_t *fs) {
@@ -48,16 +43,15 @@ static int ext2_write_bgdt(ext2_fs_t *fs) {
     uint32_t bgdt_blocks = (bgdt_size + fs->block_size - 1) / fs->block_size;
 
     for (uint32_t i = 0; i < bgdt_blocks; i++) {
-        uint8_t *blk = kmalloc(fs->block_size);
-        if (!blk) return -ENOMEM;
-        memset(blk, 0, fs->block_size);
+        buffer_head_t *bh = ext2_bget(fs, bgdt_block + i);
+        if (!bh) return -EIO;
         uint32_t offset  = i * fs->block_size;
         uint32_t to_copy = bgdt_size - offset;
         if (to_copy > fs->block_size) to_copy = fs->block_size;
-        memcpy(blk, (uint8_t *)fs->bgdt + offset, to_copy);
-        int rc = ext2_write_block(fs, bgdt_block + i, blk);
-        kfree(blk);
-        if (rc != 0) return rc;
+        memcpy(bh->data, (uint8_t *)fs->bgdt + offset, to_copy);
+        memset(bh->data + to_copy, 0, fs->block_size - to_copy);
+        bdirty(bh);
+        brelse(bh);
     }
     return 0;
 }
@@ -75,15 +69,11 @@ static int ext2_read_inode(ext2_fs_t *fs, uint32_t ino, ext2_inode_t *out) {
     uint32_t block_in_table    = byte_offset / fs->block_size;
     uint32_t offset_in_block   = byte_offset % fs->block_size;
 
-    uint8_t *blk = kmalloc(fs->block_size);
-    if (!blk) return -ENOMEM;
-
-    int rc = ext2_read_block(fs, inode_table_block + block_in_table, blk);
-    if (rc == 0)
-        memcpy(out, blk + offset_in_block, sizeof(ext2_inode_t));
-
-    kfree(blk);
-    return rc;
+    buffer_head_t *bh = ext2_bread(fs, inode_table_block + block_in_table);
+    if (!bh) return -EIO;
+    memcpy(out, bh->data + offset_in_block, sizeof(ext2_inode_t));
+    brelse(bh);
+    return 0;
 }
 
 static int ext2_write_inode(ext2_fs_t *fs, uint32_t ino, const ext2_inode_t *in) {
@@ -99,16 +89,12 @@ static int ext2_write_inode(ext2_fs_t *fs, uint32_t ino, const ext2_inode_t *in)
     uint32_t block_in_table    = byte_offset / fs->block_size;
     uint32_t offset_in_block   = byte_offset % fs->block_size;
 
-    uint8_t *blk = kmalloc(fs->block_size);
-    if (!blk) return -ENOMEM;
-
-    int rc = ext2_read_block(fs, inode_table_block + block_in_table, blk);
-    if (rc == 0) {
-        memcpy(blk + offset_in_block, in, sizeof(ext2_inode_t));
-        rc = ext2_write_block(fs, inode_table_block + block_in_table, blk);
-    }
-    kfree(blk);
-    return rc;
+    buffer_head_t *bh = ext2_bread(fs, inode_table_block + block_in_table);
+    if (!bh) return -EIO;
+    memcpy(bh->data + offset_in_block, in, sizeof(ext2_inode_t));
+    bdirty(bh);
+    brelse(bh);
+    return 0;
 }
 
 #define PTRS_PER_BLOCK(fs) ((fs)->block_size / sizeof(uint32_t))
@@ -116,14 +102,10 @@ static int ext2_write_inode(ext2_fs_t *fs, uint32_t ino, const ext2_inode_t *in)
 static uint32_t ext2_read_indirect(ext2_fs_t *fs, uint32_t ind_block,
                                    uint32_t index) {
     if (ind_block == 0) return 0;
-    uint32_t *table = kmalloc(fs->block_size);
-    if (!table) return 0;
-    if (ext2_read_block(fs, ind_block, table) != 0) {
-        kfree(table);
-        return 0;
-    }
-    uint32_t phys = table[index];
-    kfree(table);
+    buffer_head_t *bh = ext2_bread(fs, ind_block);
+    if (!bh) return 0;
+    uint32_t phys = ((uint32_t *)bh->data)[index];
+    brelse(bh);
     return phys;
 }
 
@@ -156,13 +138,9 @@ static uint32_t ext2_bmap(ext2_fs_t *fs, ext2_inode_t *inode, uint32_t lbn) {
 static uint32_t ext2_alloc_block_in_group(ext2_fs_t *fs, uint32_t group) {
     if (fs->bgdt[group].bg_free_blocks_count == 0) return 0;
 
-    uint8_t *bitmap = kmalloc(fs->block_size);
-    if (!bitmap) return 0;
-
-    if (ext2_read_block(fs, fs->bgdt[group].bg_block_bitmap, bitmap) != 0) {
-        kfree(bitmap);
-        return 0;
-    }
+    buffer_head_t *bh = ext2_bread(fs, fs->bgdt[group].bg_block_bitmap);
+    if (!bh) return 0;
+    uint8_t *bitmap = bh->data;
 
     uint32_t blocks_in_group = fs->blocks_per_group;
     for (uint32_t i = 0; i < blocks_in_group; i++) {
@@ -170,8 +148,8 @@ static uint32_t ext2_alloc_block_in_group(ext2_fs_t *fs, uint32_t group) {
         uint32_t bit  = i % 8;
         if (!(bitmap[byte] & (1u << bit))) {
             bitmap[byte] |= (1u << bit);
-            ext2_write_block(fs, fs->bgdt[group].bg_block_bitmap, bitmap);
-            kfree(bitmap);
+            bdirty(bh);
+            brelse(bh);
             uint32_t block = fs->sb.s_first_data_block
                              + group * fs->blocks_per_group + i;
             fs->bgdt[group].bg_free_blocks_count--;
@@ -179,7 +157,7 @@ static uint32_t ext2_alloc_block_in_group(ext2_fs_t *fs, uint32_t group) {
             return block;
         }
     }
-    kfree(bitmap);
+    brelse(bh);
     return 0;
 }
 
@@ -198,48 +176,62 @@ static void ext2_free_block(ext2_fs_t *fs, uint32_t block) {
     uint32_t index = rel % fs->blocks_per_group;
     if (group >= fs->num_groups) return;
 
-    uint8_t *bitmap = kmalloc(fs->block_size);
-    if (!bitmap) return;
-    if (ext2_read_block(fs, fs->bgdt[group].bg_block_bitmap, bitmap) != 0) {
-        kfree(bitmap);
-        return;
-    }
-    bitmap[index / 8] &= ~(1u << (index % 8));
-    ext2_write_block(fs, fs->bgdt[group].bg_block_bitmap, bitmap);
-    kfree(bitmap);
+    buffer_head_t *bh = ext2_bread(fs, fs->bgdt[group].bg_block_bitmap);
+    if (!bh) return;
+    bh->data[index / 8] &= ~(1u << (index % 8));
+    bdirty(bh);
+    brelse(bh);
     fs->bgdt[group].bg_free_blocks_count++;
     fs->sb.s_free_blocks_count++;
 }
 
+// Freed blocks are passed on to the device in physically contiguous runs
+static void ext2_discard_blocks(ext2_fs_t *fs, uint32_t start, uint32_t count) {
+    if (count == 0) return;
+    bdiscard(fs->block_dev, (uint64_t)start * fs->sectors_per_block,
+             (uint64_t)count * fs->sectors_per_block);
+}
+
+/*
+ * Allocates a block and returns it zeroed and already dirty, so the
+ * caller can fill it in and release it like any other cached block.
+ */
+static int ext2_alloc_zeroed(ext2_fs_t *fs, uint32_t *block_out,
+                             buffer_head_t **bh_out) {
+    uint32_t block = ext2_alloc_block(fs);
+    if (block == 0) return -ENOSPC;
+    buffer_head_t *bh = ext2_bget(fs, block);
+    if (!bh) {
+        ext2_free_block(fs, block);
+        return -EIO;
+    }
+    memset(bh->data, 0, fs->block_size);
+    bdirty(bh);
+    *block_out = block;
+    *bh_out = bh;
+    return 0;
+}
+
+// The index block `*block` points at, allocated and linked there first if it is 0
+static int ext2_index_block(ext2_fs_t *fs, uint32_t *block,
+                            buffer_head_t **bh_out) {
+    if (*block == 0) return ext2_alloc_zeroed(fs, block, bh_out);
+    *bh_out = ext2_bread(fs, *block);
+    return *bh_out ? 0 : -EIO;
+}
+
 static int ext2_set_indirect(ext2_fs_t *fs, uint32_t *ind_block_ptr,
                               uint32_t index, uint32_t phys_block) {
-    uint32_t *table = kmalloc(fs->block_size);
-    if (!table) return -ENOMEM;
-
-    uint32_t ind_block = *ind_block_ptr;
-    
-    if (ind_block == 0) {
-        ind_block = ext2_alloc_block(fs);
-        if (ind_block == 0) { kfree(table); return -ENOSPC; }
-        memset(table, 0, fs->block_size);
-    } else {
-        if (ext2_read_block(fs, ind_block, table) != 0) {
-            kfree(table);
-            return -EIO;
-        }
-    }
-    
-    table[index] = phys_block;
-    int rc = ext2_write_block(fs, ind_block, table);
-    
-    if (rc == 0) {
-        *ind_block_ptr = ind_block; 
-    }
-    
-    kfree(table);
-    return rc;
+    buffer_head_t *bh;
+    int rc = ext2_index_block(fs, ind_block_ptr, &bh);
+    if (rc != 0) return rc;
+    ((uint32_t *)bh->data)[index] = phys_block;
+    bdirty(bh);
+    brelse(bh);
+    return 0;
 }
 
+// Index blocks are updated in place, each held from its read to its release
 static int ext2_bmap_set(ext2_fs_t *fs, ext2_inode_t *inode,
                           uint32_t lbn, uint32_t phys) {
     uint32_t ppb = PTRS_PER_BLOCK(fs);
@@ -250,99 +242,44 @@ static int ext2_bmap_set(ext2_fs_t *fs, ext2_inode_t *inode,
     }
     lbn -= EXT2_NDIR_BLOCKS;
 
+    // The inode is packed, so its block pointers go through a local
     if (lbn < ppb) {
         uint32_t ind_block = inode->i_block[EXT2_IND_BLOCK];
         int rc = ext2_set_indirect(fs, &ind_block, lbn, phys);
-        if (rc == 0 && ind_block != inode->i_block[EXT2_IND_BLOCK]) {
-            inode->i_block[EXT2_IND_BLOCK] = ind_block;
-        }
+        inode->i_block[EXT2_IND_BLOCK] = ind_block;
         return rc;
     }
     lbn -= ppb;
 
+    buffer_head_t *l1;
     if (lbn < ppb * ppb) {
-        uint32_t *l1_table = kmalloc(fs->block_size);
-        if (!l1_table) return -ENOMEM;
-        
         uint32_t dind_block = inode->i_block[EXT2_DIND_BLOCK];
-        uint32_t *dind_ptr = &dind_block; 
-        
-        if (dind_block == 0) {
-            dind_block = ext2_alloc_block(fs);
-            if (dind_block == 0) { kfree(l1_table); return -ENOSPC; }
-            memset(l1_table, 0, fs->block_size);
-        } else {
-            if (ext2_read_block(fs, dind_block, l1_table) != 0) {
-                kfree(l1_table); return -EIO;
-            }
-        }
-        
-        uint32_t l1_idx = lbn / ppb;
-        int rc = ext2_set_indirect(fs, &l1_table[l1_idx], lbn % ppb, phys);
-        
-        if (rc == 0) {
-            rc = ext2_write_block(fs, dind_block, l1_table);
-        }
-        
-        if (rc == 0 && dind_block != inode->i_block[EXT2_DIND_BLOCK]) {
-            inode->i_block[EXT2_DIND_BLOCK] = dind_block;
-        }
-        
-        kfree(l1_table);
+        int rc = ext2_index_block(fs, &dind_block, &l1);
+        inode->i_block[EXT2_DIND_BLOCK] = dind_block;
+        if (rc != 0) return rc;
+        rc = ext2_set_indirect(fs, &((uint32_t *)l1->data)[lbn / ppb],
+                               lbn % ppb, phys);
+        bdirty(l1);
+        brelse(l1);
         return rc;
     }
-
     lbn -= ppb * ppb;
-    uint32_t *l1_table = kmalloc(fs->block_size);
-    if (!l1_table) return -ENOMEM;
-    
+
     uint32_t tind_block = inode->i_block[EXT2_TIND_BLOCK];
-    
-    if (tind_block == 0) {
-        tind_block = ext2_alloc_block(fs);
-        if (tind_block == 0) { kfree(l1_table); return -ENOSPC; }
-        memset(l1_table, 0, fs->block_size);
-    } else {
-        if (ext2_read_block(fs, tind_block, l1_table) != 0) { 
-            kfree(l1_table); return -EIO; 
-        }
-    }
-    
-    uint32_t l1_idx = lbn / (ppb * ppb);
-    uint32_t *l2_table = kmalloc(fs->block_size);
-    if (!l2_table) { kfree(l1_table); return -ENOMEM; }
-    
-    uint32_t l1_entry = l1_table[l1_idx];
-    if (l1_entry == 0) {
-        l1_entry = ext2_alloc_block(fs);
-        if (l1_entry == 0) { 
-            kfree(l1_table); kfree(l2_table); return -ENOSPC; 
-        }
-        memset(l2_table, 0, fs->block_size);
-    } else {
-        if (ext2_read_block(fs, l1_entry, l2_table) != 0) {
-            kfree(l1_table); kfree(l2_table); return -EIO;
-        }
-    }
-    
-    uint32_t l2_idx = (lbn / ppb) % ppb;
-    int rc = ext2_set_indirect(fs, &l2_table[l2_idx], lbn % ppb, phys);
-    
-    if (rc == 0) {
-        rc = ext2_write_block(fs, l1_entry, l2_table);
-    }
-    
+    int rc = ext2_index_block(fs, &tind_block, &l1);
+    inode->i_block[EXT2_TIND_BLOCK] = tind_block;
+    if (rc != 0) return rc;
+
+    buffer_head_t *l2;
+    rc = ext2_index_block(fs, &((uint32_t *)l1->data)[lbn / (ppb * ppb)], &l2);
     if (rc == 0) {
-        l1_table[l1_idx] = l1_entry;
-        rc = ext2_write_block(fs, tind_block, l1_table);
-    }
-    
-    if (rc == 0 && tind_block != inode->i_block[EXT2_TIND_BLOCK]) {
-        inode->i_block[EXT2_TIND_BLOCK] = tind_block;
+        rc = ext2_set_indirect(fs, &((uint32_t *)l2->data)[(lbn / ppb) % ppb],
+                               lbn % ppb, phys);
+        bdirty(l2);
+        brelse(l2);
     }
-    
-    kfree(l1_table);
-    kfree(l2_table);
+    bdirty(l1);
+    brelse(l1);
     return rc;
 }
 
@@ -350,24 +287,21 @@ static uint32_t ext2_alloc_inode(ext2_fs_t *fs) {
     for (uint32_t g = 0; g < fs->num_groups; g++) {
         if (fs->bgdt[g].bg_free_inodes_count == 0) continue;
 
-        uint8_t *bitmap = kmalloc(fs->block_size);
-        if (!bitmap) return 0;
-        if (ext2_read_block(fs, fs->bgdt[g].bg_inode_bitmap, bitmap) != 0) {
-            kfree(bitmap);
-            continue;
-        }
+        buffer_head_t *bh = ext2_bread(fs, fs->bgdt[g].bg_inode_bitmap);
+        if (!bh) continue;
+        uint8_t *bitmap = bh->data;
         for (uint32_t i = 0; i < fs->inodes_per_group; i++) {
             if (!(bitmap[i / 8] & (1u << (i % 8)))) {
                 bitmap[i / 8] |= (1u << (i % 8));
-                ext2_write_block(fs, fs->bgdt[g].bg_inode_bitmap, bitmap);
-                kfree(bitmap);
+                bdirty(bh);
+                brelse(bh);
                 uint32_t ino = g * fs->inodes_per_group + i + 1;
                 fs->bgdt[g].bg_free_inodes_count--;
                 fs->sb.s_free_inodes_count--;
                 return ino;
             }
         }
-        kfree(bitmap);
+        brelse(bh);
     }
     return 0;
 }
@@ -378,15 +312,11 @@ static void ext2_free_inode(ext2_fs_t *fs, uint32_t ino) {
     uint32_t index = (ino - 1) % fs->inodes_per_group;
     if (group >= fs->num_groups) return;
 
-    uint8_t *bitmap = kmalloc(fs->block_size);
-    if (!bitmap) return;
-    if (ext2_read_block(fs, fs->bgdt[group].bg_inode_bitmap, bitmap) != 0) {
-        kfree(bitmap);
-        return;
-    }
-    bitmap[index / 8] &= ~(1u << (index % 8));
-    ext2_write_block(fs, fs->bgdt[group].bg_inode_bitmap, bitmap);
-    kfree(bitmap);
+    buffer_head_t *bh = ext2_bread(fs, fs->bgdt[group].bg_inode_bitmap);
+    if (!bh) return;
+    bh->data[index / 8] &= ~(1u << (index % 8));
+    bdirty(bh);
+    brelse(bh);
     fs->bgdt[group].bg_free_inodes_count++;
     fs->sb.s_free_inodes_count++;
 }
@@ -401,33 +331,32 @@ static uint32_t ext2_dir_lookup(ext2_fs_t *fs, uint32_t dir_ino,
     uint32_t lbn      = 0;
     uint32_t consumed = 0;
     size_t   namelen  = strlen(name);
-    uint8_t *blk      = kmalloc(fs->block_size);
-    if (!blk) return 0;
 
     while (consumed < size) {
         uint32_t phys = ext2_bmap(fs, &inode, lbn);
         if (phys == 0) { consumed += fs->block_size; lbn++; continue; }
-        if (ext2_read_block(fs, phys, blk) != 0) break;
+        buffer_head_t *bh = ext2_bread(fs, phys);
+        if (!bh) break;
 
         uint32_t off = 0;
         uint32_t chunk = fs->block_size;
         if (consumed + chunk > size) chunk = size - consumed;
 
         while (off < chunk) {
-            ext2_dirent_t *de = (ext2_dirent_t *)(blk + off);
+            ext2_dirent_t *de = (ext2_dirent_t *)(bh->data + off);
             if (de->rec_len == 0) break;
             if (de->inode != 0 && de->name_len == (uint8_t)namelen &&
                 strncmp(de->name, name, namelen) == 0) {
                 uint32_t found = de->inode;
-                kfree(blk);
+                brelse(bh);
                 return found;
             }
             off += de->rec_len;
         }
+        brelse(bh);
         consumed += fs->block_size;
         lbn++;
     }
-    kfree(blk);
     return 0;
 }
 
@@ -489,29 +418,25 @@ static int ext2_dir_add_entry(ext2_fs_t *fs, uint32_t dir_ino,
     uint16_t needed   = (uint16_t)((8 + namelen + 3) & ~3u);
     uint32_t size     = dir_inode.i_size;
     uint32_t lbn      = 0;
-    uint8_t *blk      = kmalloc(fs->block_size);
-    if (!blk) return -ENOMEM;
 
     uint32_t consumed = 0;
     while (consumed < size) {
         uint32_t phys = ext2_bmap(fs, &dir_inode, lbn);
         bool new_block = (phys == 0);
+        buffer_head_t *bh;
         if (new_block) {
-            phys = ext2_alloc_block(fs);
-            if (phys == 0) { kfree(blk); return -ENOSPC; }
-            memset(blk, 0, fs->block_size);
-            ext2_dirent_t *span = (ext2_dirent_t *)blk;
-            span->inode    = 0;
+            int rc = ext2_alloc_zeroed(fs, &phys, &bh);
+            if (rc != 0) return rc;
+            ext2_dirent_t *span = (ext2_dirent_t *)bh->data;
             span->rec_len  = (uint16_t)fs->block_size;
-            span->name_len = 0;
-            span->file_type = 0;
         } else {
-            if (ext2_read_block(fs, phys, blk) != 0) { kfree(blk); return -EIO; }
+            bh = ext2_bread(fs, phys);
+            if (!bh) return -EIO;
         }
 
         uint32_t off = 0;
         while (off < fs->block_size) {
-            ext2_dirent_t *de = (ext2_dirent_t *)(blk + off);
+            ext2_dirent_t *de = (ext2_dirent_t *)(bh->data + off);
             if (de->rec_len == 0) break;
 
             uint16_t real_len = (de->inode == 0) ? 0
@@ -525,45 +450,47 @@ static int ext2_dir_add_entry(ext2_fs_t *fs, uint32_t dir_ino,
                     uint16_t old_rec = de->rec_len;
                     de->rec_len = real_len;
                     off += real_len;
-                    de = (ext2_dirent_t *)(blk + off);
+                    de = (ext2_dirent_t *)(bh->data + off);
                     de->rec_len = old_rec - real_len;
                 }
                 de->inode     = ino;
                 de->name_len  = (uint8_t)namelen;
                 de->file_type = file_type;
                 memcpy(de->name, name, namelen);
+                bdirty(bh);
+                brelse(bh);
 
                 if (new_block) {
                     ext2_bmap_set(fs, &dir_inode, lbn, phys);
                     dir_inode.i_size += fs->block_size;
                     dir_inode.i_blocks += fs->sectors_per_block;
                 }
-                ext2_write_block(fs, phys, blk);
                 ext2_write_inode(fs, dir_ino, &dir_inode);
-                kfree(blk);
                 return 0;
             }
             off += de->rec_len;
         }
+        brelse(bh);
         consumed += fs->block_size;
         lbn++;
     }
 
-    uint32_t phys = ext2_alloc_block(fs);
-    if (phys == 0) { kfree(blk); return -ENOSPC; }
-    memset(blk, 0, fs->block_size);
-    ext2_dirent_t *de = (ext2_dirent_t *)blk;
+    uint32_t phys;
+    buffer_head_t *bh;
+    int rc = ext2_alloc_zeroed(fs, &phys, &bh);
+    if (rc != 0) return rc;
+    ext2_dirent_t *de = (ext2_dirent_t *)bh->data;
     de->inode     = ino;
     de->rec_len   = (uint16_t)fs->block_size;
     de->name_len  = (uint8_t)namelen;
     de->file_type = file_type;
     memcpy(de->name, name, namelen);
+    bdirty(bh);
+    brelse(bh);
     ext2_bmap_set(fs, &dir_inode, lbn, phys);
     dir_inode.i_size  += fs->block_size;
     dir_inode.i_blocks += fs->sectors_per_block;
-    ext2_write_block(fs, phys, blk);
     ext2_write_inode(fs, dir_ino, &dir_inode);
-    kfree(blk);
     return 0;
 }
 
@@ -576,18 +503,17 @@ static int ext2_dir_remove_entry(ext2_fs_t *fs, uint32_t dir_ino,
     uint32_t size     = dir_inode.i_size;
     uint32_t lbn      = 0;
     uint32_t consumed = 0;
-    uint8_t *blk      = kmalloc(fs->block_size);
-    if (!blk) return -ENOMEM;
 
     while (consumed < size) {
         uint32_t phys = ext2_bmap(fs, &dir_inode, lbn);
         if (phys == 0) { consumed += fs->block_size; lbn++; continue; }
-        if (ext2_read_block(fs, phys, blk) != 0) { lbn++; consumed += fs->block_size; continue; }
+        buffer_head_t *bh = ext2_bread(fs, phys);
+        if (!bh) { lbn++; consumed += fs->block_size; continue; }
 
         uint32_t off = 0;
         ext2_dirent_t *prev = NULL;
         while (off < fs->block_size) {
-            ext2_dirent_t *de = (ext2_dirent_t *)(blk + off);
+            ext2_dirent_t *de = (ext2_dirent_t *)(bh->data + off);
             if (de->rec_len == 0) break;
             if (de->inode != 0 && de->name_len == (uint8_t)namelen &&
                 strncmp(de->name, name, namelen) == 0) {
@@ -596,17 +522,17 @@ static int ext2_dir_remove_entry(ext2_fs_t *fs, uint32_t dir_ino,
                 } else {
                     de->inode = 0;
                 }
-                ext2_write_block(fs, phys, blk);
-                kfree(blk);
+                bdirty(bh);
+                brelse(bh);
                 return 0;
             }
             prev = de;
             off += de->rec_len;
         }
+        brelse(bh);
         consumed += fs->block_size;
         lbn++;
     }
-    kfree(blk);
     return -ENOENT;
 }
 
@@ -655,17 +581,19 @@ int ext2_mount(vfs_mount_t *mnt, const char *device, void *data) {
 
     uint32_t bgdt_block = (fs->block_size == 1024) ? 2 : 1;
     uint32_t bgdt_blks  = (bgdt_bytes + fs->block_size - 1) / fs->block_size;
-    uint8_t *bgdt_buf   = kmalloc(bgdt_blks * fs->block_size);
-    if (!bgdt_buf) { kfree(fs->bgdt); kfree(fs); return -ENOMEM; }
 
     for (uint32_t i = 0; i < bgdt_blks; i++) {
-        if (ext2_read_block(fs, bgdt_block + i, bgdt_buf + i * fs->block_size) != 0) {
-            kfree(bgdt_buf); kfree(fs->bgdt); kfree(fs);
+        buffer_head_t *bh = ext2_bread(fs, bgdt_block + i);
+        if (!bh) {
+            kfree(fs->bgdt); kfree(fs);
             return -EIO;
         }
+        uint32_t offset  = i * fs->block_size;
+        uint32_t to_copy = bgdt_bytes - offset;
+        if (to_copy > fs->block_size) to_copy = fs->block_size;
+        memcpy((uint8_t *)fs->bgdt + offset, bh->data, to_copy);
+        brelse(bh);
     }
-    memcpy(fs->bgdt, bgdt_buf, bgdt_bytes);
-    kfree(bgdt_buf);
 
     mnt->fs_private = fs;
     LOG_INFO("ext2: mounted '%s' at '%s' (block_size=%u, groups=%u)\n",
@@ -679,13 +607,23 @@ int ext2_unmount(vfs_mount_t *mnt) {
     if (!fs->read_only) {
         ext2_write_superblock(fs);
         ext2_write_bgdt(fs);
+        bsync(fs->block_dev);
     }
+    binvalidate(fs->block_dev);
     kfree(fs->bgdt);
     kfree(fs);
     mnt->fs_private = NULL;
     return 0;
 }
 
+int ext2_vfs_sync(vfs_mount_t *mnt) {
+    ext2_fs_t *fs = (ext2_fs_t *)mnt->fs_private;
+    if (!fs || fs->read_only) return 0;
+    ext2_write_superblock(fs);
+    ext2_write_bgdt(fs);
+    return bsync(fs->block_dev);
+}
+
 int ext2_vfs_open(vfs_mount_t *mnt, const char *path, int flags,
                   vfs_file_handle_t *h) {
     ext2_fs_t *fs = (ext2_fs_t *)mnt->fs_private;
@@ -725,17 +663,27 @@ int ext2_vfs_open(vfs_mount_t *mnt, const char *path, int flags,
 
     if ((flags & VFS_TRUNC) && !fs->read_only) {
         uint32_t total_lblocks = (inode.i_size + fs->block_size - 1) / fs->block_size;
+        uint32_t run_start = 0, run_len = 0;
         for (uint32_t lb = 0; lb < total_lblocks; lb++) {
             uint32_t phys = ext2_bmap(fs, &inode, lb);
-            if (phys) ext2_free_block(fs, phys);
+            if (!phys) continue;
+            ext2_free_block(fs, phys);
+            if (run_len && phys == run_start + run_len) {
+                run_len++;
+            } else {
+                ext2_discard_blocks(fs, run_start, run_len);
+                run_start = phys;
+                run_len = 1;
+            }
         }
+        ext2_discard_blocks(fs, run_start, run_len);
         memset(inode.i_block, 0, sizeof(inode.i_block));
         inode.i_size   = 0;
         inode.i_blocks = 0;
         ext2_write_inode(fs, ino, &inode);
     }
 
-    ext2_file_handle_t *fh = kmalloc(sizeof(ext2_file_handle_t));
+    ext2_file_handle_t *fh = kmem_cache_alloc(ext2_handle_cache);
     if (!fh) return -ENOMEM;
     fh->ino       = ino;
     fh->file_size = inode.i_size;
@@ -749,7 +697,7 @@ int ext2_vfs_open(vfs_mount_t *mnt, const char *path, int flags,
 int ext2_vfs_close(vfs_mount_t *mnt, vfs_file_handle_t *h) {
     (void)mnt;
     if (h->private_data) {
-        kfree(h->private_data);
+        kmem_cache_free(ext2_handle_cache, h->private_data);
         h->private_data = NULL;
     }
     return 0;
@@ -768,9 +716,6 @@ vfs_ssize_t ext2_vfs_read(vfs_mount_t *mnt, vfs_file_handle_t *h,
         count = file_size - (uint32_t)h->position;
     if (count == 0) return 0;
 
-    uint8_t *blk = kmalloc(fs->block_size);
-    if (!blk) return -ENOMEM;
-
     size_t   remaining = count;
     uint8_t *dst       = (uint8_t *)buf;
     uint32_t pos       = (uint32_t)h->position;
@@ -785,17 +730,15 @@ vfs_ssize_t ext2_vfs_read(vfs_mount_t *mnt, vfs_file_handle_t *h,
         if (phys == 0) {
             memset(dst, 0, can_read);
         } else {
-            if (ext2_read_block(fs, phys, blk) != 0) {
-                kfree(blk);
-                return -EIO;
-            }
-            memcpy(dst, blk + boff, can_read);
+            buffer_head_t *bh = ext2_bread(fs, phys);
+            if (!bh) return -EIO;
+            memcpy(dst, bh->data + boff, can_read);
+            brelse(bh);
         }
         dst       += can_read;
         pos       += can_read;
         remaining -= can_read;
     }
-    kfree(blk);
     h->position = pos;
     return (vfs_ssize_t)count;
 }
@@ -808,9 +751,6 @@ vfs_ssize_t ext2_vfs_write(vfs_mount_t *mnt, vfs_file_handle_t *h,
     if (fs->read_only) return -EROFS;
     if (count == 0) return 0;
 
-    uint8_t       *blk       = kmalloc(fs->block_size);
-    if (!blk) return -ENOMEM;
-
     size_t         remaining = count;
     const uint8_t *src       = (const uint8_t *)buf;
     uint32_t       pos       = (uint32_t)h->position;
@@ -822,33 +762,30 @@ vfs_ssize_t ext2_vfs_write(vfs_mount_t *mnt, vfs_file_handle_t *h,
         if (can_write > remaining) can_write = (uint32_t)remaining;
 
         uint32_t phys = ext2_bmap(fs, &fh->inode, lbn);
+        buffer_head_t *bh;
         if (phys == 0) {
-            phys = ext2_alloc_block(fs);
-            if (phys == 0) { kfree(blk); return -ENOSPC; }
-            memset(blk, 0, fs->block_size);
-            int rc = ext2_bmap_set(fs, &fh->inode, lbn, phys);
-            if (rc != 0) { kfree(blk); return rc; }
-        } else {
-            if (boff != 0 || can_write != fs->block_size) {
-                if (ext2_read_block(fs, phys, blk) != 0) {
-                    kfree(blk);
-                    return -EIO;
-                }
+            int rc = ext2_alloc_zeroed(fs, &phys, &bh);
+            if (rc != 0) return rc;
+            rc = ext2_bmap_set(fs, &fh->inode, lbn, phys);
+            if (rc != 0) {
+                brelse(bh);
+                ext2_free_block(fs, phys);
+                return rc;
             }
-        }
-        memcpy(blk + boff, src, can_write);
-        bool is_new_block = (ext2_bmap(fs, &fh->inode, lbn) != 0 && phys != 0);
-        if (ext2_write_block(fs, phys, blk) != 0) {
-            kfree(blk); return -EIO;
-        }
-        if (is_new_block) {
             fh->inode.i_blocks += fs->sectors_per_block;
+        } else if (boff == 0 && can_write == fs->block_size) {
+            bh = ext2_bget(fs, phys);
+        } else {
+            bh = ext2_bread(fs, phys);
         }
+        if (!bh) return -EIO;
+        memcpy(bh->data + boff, src, can_write);
+        bdirty(bh);
+        brelse(bh);
         src       += can_write;
         pos       += can_write;
         remaining -= can_write;
     }
-    kfree(blk);
 
     if (pos > fh->inode.i_size) {
         fh->inode.i_size = pos;
@@ -895,20 +832,19 @@ int ext2_vfs_readdir(vfs_mount_t *mnt, const char *path,
     uint32_t lbn      = 0;
     uint32_t consumed = 0;
     size_t   count    = 0;
-    uint8_t *blk      = kmalloc(fs->block_size);
-    if (!blk) return -ENOMEM;
 
     while (consumed < size && count < max_entries) {
         uint32_t phys = ext2_bmap(fs, &inode, lbn);
         if (phys == 0) { consumed += fs->block_size; lbn++; continue; }
-        if (ext2_read_block(fs, phys, blk) != 0) break;
+        buffer_head_t *bh = ext2_bread(fs, phys);
+        if (!bh) break;
 
         uint32_t off = 0;
         uint32_t chunk = fs->block_size;
         if (consumed + chunk > size) chunk = size - consumed;
 
         while (off < chunk && count < max_entries) {
-            ext2_dirent_t *de = (ext2_dirent_t *)(blk + off);
+            ext2_dirent_t *de = (ext2_dirent_t *)(bh->data + off);
             if (de->rec_len == 0) break;
             if (de->rec_len < 8 || (de->rec_len & 3) != 0) break;
             if (de->inode != 0 && de->name_len > 0) {
@@ -922,10 +858,10 @@ int ext2_vfs_readdir(vfs_mount_t *mnt, const char *path,
             }
             off += de->rec_len;
         }
+        brelse(bh);
         consumed += fs->block_size;
         lbn++;
     }
-    kfree(blk);
     return (int)count;
 }
 
@@ -959,10 +895,17 @@ static const vfs_fs_ops_t ext2_ops = {
     .stat    = ext2_vfs_stat,
     .unlink  = NULL,
     .ioctl   = NULL,
-    .sync    = NULL,
+    .sync    = ext2_vfs_sync,
 };
 
 void ext2_init(void) {
+    ext2_handle_cache = kmem_cache_create("ext2_file_handle",
+                                          sizeof(ext2_file_handle_t), 0, NULL);
+    if (!ext2_handle_cache) {
+        LOG_ERROR("ext2: failed to create file handle cache\n");
+        return;
+    }
+
     int rc = vfs_register_filesystem("ext2", &ext2_ops, 0);
     if (rc == 0)
         LOG_INFO("ext2: driver registered\n");
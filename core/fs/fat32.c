@@ -6,12 +6,20 @@
 #include <core/kernel/kstd.h>
 #include <log.h>
 #include <core/kernel/mem.h>
+#include <core/kernel/mem/slab.h>
 #include <errno.h>
 #include <string.h>
 
 static const vfs_fs_ops_t fat32_ops;
+static kmem_cache_t* fat32_handle_cache;
 
 void fat32_init(void) {
+    fat32_handle_cache = kmem_cache_create("fat32_file_handle",
+                                           sizeof(fat32_file_handle_t), 0, NULL);
+    if (!fat32_handle_cache) {
+        LOG_ERROR("Failed to create FAT32 file handle cache\n");
+        return;
+    }
     vfs_register_filesystem("fat32", &fat32_ops, 0);
     LOG_INFO("FAT32 filesystem driver registered\n");
 }
@@ -100,6 +108,8 @@ int fat32_unmount(vfs_mount_t* mnt) {
     }
 
     fat32_fs_t* fs_data = (fat32_fs_t*)mnt->fs_private;
+    bsync(fs_data->block_dev);
+    binvalidate(fs_data->block_dev);
     kfree(fs_data);
     mnt->fs_private = NULL;
 
@@ -119,20 +129,16 @@ int fat32_read_fat_entry(fat32_fs_t* fs, uint32_t cluster, uint32_t* out_entry)
     uint32_t fat_sector = fs->reserved_sectors + (fat_offset / fs->bytes_per_sector);
     uint32_t offset_in_sector = fat_offset % fs->bytes_per_sector;
 
-    uint8_t* sector_buf = kmalloc(fs->bytes_per_sector);
-    if (!sector_buf) return -ENOMEM;
-
-    int rc = fs->block_dev->ops.read_blocks(fs->block_dev, fat_sector, 1, sector_buf);
-    if (rc != 0) {
-        LOG_ERROR("fat32_read_fat_entry: read failed at sector %u: %d\n", fat_sector, rc);
-        kfree(sector_buf);
-        return rc;
+    buffer_head_t* bh = bread(fs->block_dev, fat_sector, 1);
+    if (!bh) {
+        LOG_ERROR("fat32_read_fat_entry: read failed at sector %u\n", fat_sector);
+        return -EIO;
     }
 
-    uint32_t raw = le32_to_cpu(*(uint32_t*)(sector_buf + offset_in_sector));
+    uint32_t raw = le32_to_cpu(*(uint32_t*)(bh->data + offset_in_sector));
     *out_entry = raw & FAT32_MASK;
 
-    kfree(sector_buf);
+    brelse(bh);
     return 0;
 }
 
@@ -147,34 +153,26 @@ int fat32_write_fat_entry(fat32_fs_t* fs, uint32_t cluster, uint32_t value) {
     uint32_t sector_offset_in_fat = fat_offset / fs->bytes_per_sector;
     uint32_t offset_in_sector = fat_offset % fs->bytes_per_sector;
 
-    uint8_t* sector_buf = kmalloc(fs->bytes_per_sector);
-    if (!sector_buf) return -ENOMEM;
-
+    // Every FAT copy is updated in the buffer cache and written back with the rest
     for (uint32_t i = 0; i < fs->num_fats; i++) {
         uint32_t fat_sector = fs->reserved_sectors +
                               (i * fs->fat_size) + sector_offset_in_fat;
 
-        int rc = fs->block_dev->ops.read_blocks(fs->block_dev, fat_sector, 1, sector_buf);
-        if (rc != 0) {
-            LOG_ERROR("fat32_write_fat_entry: read failed at sector %u: %d\n", fat_sector, rc);
-            kfree(sector_buf);
-            return rc;
+        buffer_head_t* bh = bread(fs->block_dev, fat_sector, 1);
+        if (!bh) {
+            LOG_ERROR("fat32_write_fat_entry: read failed at sector %u\n", fat_sector);
+            return -EIO;
         }
 
-        uint32_t* entry_ptr = (uint32_t*)(sector_buf + offset_in_sector);
+        uint32_t* entry_ptr = (uint32_t*)(bh->data + offset_in_sector);
         uint32_t old_raw = le32_to_cpu(*entry_ptr);
         uint32_t new_raw = (old_raw & ~FAT32_MASK) | (value & FAT32_MASK);
         *entry_ptr = cpu_to_le32(new_raw);
 
-        rc = fs->block_dev->ops.write_blocks(fs->block_dev, fat_sector, 1, sector_buf);
-        if (rc != 0) {
-            LOG_ERROR("fat32_write_fat_entry: write failed at sector %u: %d\n", fat_sector, rc);
-            kfree(sector_buf);
-            return rc;
-        }
+        bdirty(bh);
+        brelse(bh);
     }
 
-    kfree(sector_buf);
     return 0;
 }
 
@@ -241,10 +239,18 @@ int fat32_extend_chain(fat32_fs_t* fs, uint32_t last_cluster, uint32_t* out_new)
     return 0;
 }
 
+// Freed clusters are passed on to the device in contiguous runs
+static void fat32_discard_clusters(fat32_fs_t* fs, uint32_t first, uint32_t count) {
+    if (count == 0) return;
+    bdiscard(fs->block_dev, fat32_cluster_to_sector(fs, first),
+             (uint64_t)count * fs->sectors_per_cluster);
+}
+
 int fat32_free_chain(fat32_fs_t* fs, uint32_t start_cluster) {
     if (!fs) return -EINVAL;
 
     uint32_t cluster = start_cluster;
+    uint32_t run_start = 0, run_len = 0;
 
     while (cluster >= 2 && !fat32_is_free(cluster) && !fat32_is_bad(cluster)) {
         uint32_t next;
@@ -256,11 +262,20 @@ int fat32_free_chain(fat32_fs_t* fs, uint32_t start_cluster) {
 
         LOG_TRACE("fat32_free_chain: freed cluster %u\n", cluster);
 
+        if (run_len && cluster == run_start + run_len) {
+            run_len++;
+        } else {
+            fat32_discard_clusters(fs, run_start, run_len);
+            run_start = cluster;
+            run_len = 1;
+        }
+
         if (fat32_is_eoc(next))
             break;
 
         cluster = next;
     }
+    fat32_discard_clusters(fs, run_start, run_len);
 
     return 0;
 }
@@ -278,8 +293,11 @@ int fat32_read_cluster(fat32_fs_t* fs, uint32_t cluster, void* buffer) {
     }
 
     uint32_t sector = fat32_cluster_to_sector(fs, cluster);
-    return fs->block_dev->ops.read_blocks(fs->block_dev, sector,
-                                          fs->sectors_per_cluster, buffer);
+    buffer_head_t* bh = bread(fs->block_dev, sector, fs->sectors_per_cluster);
+    if (!bh) return -EIO;
+    memcpy(buffer, bh->data, fs->bytes_per_cluster);
+    brelse(bh);
+    return 0;
 }
 
 int fat32_write_cluster(fat32_fs_t* fs, uint32_t cluster, const void* buffer) {
@@ -291,8 +309,24 @@ int fat32_write_cluster(fat32_fs_t* fs, uint32_t cluster, const void* buffer) {
     }
 
     uint32_t sector = fat32_cluster_to_sector(fs, cluster);
-    return fs->block_dev->ops.write_blocks(fs->block_dev, sector,
-                                           fs->sectors_per_cluster, buffer);
+    buffer_head_t* bh = bget(fs->block_dev, sector, fs->sectors_per_cluster);
+    if (!bh) return -EIO;
+    memcpy(bh->data, buffer, fs->bytes_per_cluster);
+    bdirty(bh);
+    brelse(bh);
+    return 0;
+}
+
+int fat32_zero_cluster(fat32_fs_t* fs, uint32_t cluster) {
+    if (!fs) return -EINVAL;
+    if (cluster < 2 || cluster >= fs->total_clusters + 2) {
+        LOG_ERROR("fat32_zero_cluster: invalid cluster %u (valid range: 2..%u)\n",
+                  cluster, fs->total_clusters + 1);
+        return -EINVAL;
+    }
+
+    return bzero_blocks(fs->block_dev, fat32_cluster_to_sector(fs, cluster),
+                        fs->sectors_per_cluster);
 }
 
 
@@ -1034,7 +1068,7 @@ int fat32_vfs_open(vfs_mount_t* mnt, const char* path, int flags,
                                      &entry_cluster, &entry_index);
         if (rc != 0) return rc;
 
-        fat32_file_handle_t* fh = kmalloc(sizeof(fat32_file_handle_t));
+        fat32_file_handle_t* fh = kmem_cache_alloc(fat32_handle_cache);
         if (!fh) return -ENOMEM;
 
         fh->first_cluster     = 0;
@@ -1052,7 +1086,7 @@ int fat32_vfs_open(vfs_mount_t* mnt, const char* path, int flags,
     if (rc != 0) return rc;
     if (entry.is_dir) return -EINVAL;
 
-    fat32_file_handle_t* fh = kmalloc(sizeof(fat32_file_handle_t));
+    fat32_file_handle_t* fh = kmem_cache_alloc(fat32_handle_cache);
     if (!fh) return -ENOMEM;
 
     fh->first_cluster = entry.first_cluster;
@@ -1063,7 +1097,7 @@ int fat32_vfs_open(vfs_mount_t* mnt, const char* path, int flags,
                                      &fh->dir_entry_cluster,
                                      &fh->dir_entry_index);
     if (rc != 0) {
-        kfree(fh);
+        kmem_cache_free(fat32_handle_cache, fh);
         return rc;
     }
 
@@ -1073,7 +1107,7 @@ int fat32_vfs_open(vfs_mount_t* mnt, const char* path, int flags,
     if (flags & VFS_TRUNC) {
         rc = fat32_trunc_file(fs, fh);
         if (rc != 0) {
-            kfree(fh);
+            kmem_cache_free(fat32_handle_cache, fh);
             h->private_data = NULL;
             return rc;
         }
@@ -1089,7 +1123,7 @@ int fat32_vfs_close(vfs_mount_t* mnt, vfs_file_handle_t* h) {
     if (!h) return -EINVAL;
 
     if (h->private_data) {
-        kfree(h->private_data);
+        kmem_cache_free(fat32_handle_cache, h->private_data);
         h->private_data = NULL;
     }
     return 0;
@@ -1178,12 +1212,17 @@ vfs_ssize_t fat32_vfs_write(vfs_mount_t* mnt, vfs_file_handle_t* h,
     uint32_t cluster = fh->first_cluster;
 
     if (cluster == 0) {
-        // Empty file: allocate and zero the very first cluster.
+        // Empty file: allocate and zero the very first cluster. Clusters the
+        // write skips over are zeroed on the device rather than written.
         int rc = fat32_alloc_cluster(fs, &cluster);
         if (rc != 0) { kfree(cluster_buf); return rc; }
 
-        memset(cluster_buf, 0, fs->bytes_per_cluster);
-        rc = fat32_write_cluster(fs, cluster, cluster_buf);
+        if (cluster_idx > 0) {
+            rc = fat32_zero_cluster(fs, cluster);
+        } else {
+            memset(cluster_buf, 0, fs->bytes_per_cluster);
+            rc = fat32_write_cluster(fs, cluster, cluster_buf);
+        }
         if (rc != 0) {
             fat32_write_fat_entry(fs, cluster, FAT32_FREE);
             kfree(cluster_buf);
@@ -1211,8 +1250,7 @@ vfs_ssize_t fat32_vfs_write(vfs_mount_t* mnt, vfs_file_handle_t* h,
             uint32_t new_cluster;
             int nav_rc = fat32_extend_chain(fs, cluster, &new_cluster);
             if (nav_rc != 0) { kfree(cluster_buf); return nav_rc; }
-            memset(cluster_buf, 0, fs->bytes_per_cluster);
-            nav_rc = fat32_write_cluster(fs, new_cluster, cluster_buf);
+            nav_rc = fat32_zero_cluster(fs, new_cluster);
             if (nav_rc != 0) { kfree(cluster_buf); return nav_rc; }
             cluster = new_cluster;
         }
@@ -1230,8 +1268,7 @@ vfs_ssize_t fat32_vfs_write(vfs_mount_t* mnt, vfs_file_handle_t* h,
                 rc = fat32_extend_chain(fs, cluster, &new_cluster);
                 if (rc != 0) { kfree(cluster_buf); return rc; }
 
-                memset(cluster_buf, 0, fs->bytes_per_cluster);
-                rc = fat32_write_cluster(fs, new_cluster, cluster_buf);
+                rc = fat32_zero_cluster(fs, new_cluster);
                 if (rc != 0) { kfree(cluster_buf); return rc; }
                 cluster = new_cluster;
             } else if (fat32_is_bad(next)) {
@@ -1376,6 +1413,11 @@ int fat32_vfs_readdir(vfs_mount_t* mnt, const char* path,
     return (int)filled;
 }
 
+int fat32_vfs_sync(vfs_mount_t* mnt) {
+    if (!mnt || !mnt->fs_private) return -EINVAL;
+    return bsync(((fat32_fs_t*)mnt->fs_private)->block_dev);
+}
+
 int fat32_vfs_stat(vfs_mount_t* mnt, const char* path, vfs_stat_t* stat) {
     if (!mnt || !mnt->fs_private || !path || !stat) return -EINVAL;
 
@@ -1712,5 +1754,5 @@ static const vfs_fs_ops_t fat32_ops = {
     .stat    = fat32_vfs_stat,
     .unlink  = fat32_vfs_unlink,
     .ioctl   = NULL,
-    .sync    = NULL,
+    .sync    = fat32_vfs_sync,
 };
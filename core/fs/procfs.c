@@ -2,10 +2,25 @@
 
 #include <core/fs/procfs.h>
 #include <core/fs/vfs.h>
+#include <core/fs/block.h>
+#include <core/fs/bio.h>
 #include <core/kernel/vge/fb_render.h>
 #include <core/arch/cpuid.h>
 #include <core/kernel/kstd.h>
 #include <core/kernel/mem.h>
+#include <core/kernel/mem/buddy.h>
+#include <core/kernel/mem/slab.h>
+#include <core/kernel/mem/vmm.h>
+#include <core/kernel/mem/alloc_trace.h>
+#include <core/arch/delay.h>
+#include <core/arch/spinlock.h>
+#include <core/arch/smp.h>
+#include <core/arch/work_queue.h>
+#include <core/arch/softirq.h>
+#include <core/drivers/pci.h>
+#include <core/kernel/boottime.h>
+#include <core/arch/apic.h>
+#include <core/arch/tsc.h>
 #include <core/kernel/nvm/nvm.h>
 #include <core/drivers/timer.h>
 #include <stdint.h>
@@ -716,24 +731,92 @@ vfs_ssize_t procfs_cpuinfo(vfs_file_t* file, void* buf, size_t count, vfs_off_t*
     return to_copy;
 }
 
+#define PROCFS_STATS_BUF_SIZE 8192
+
+// Append `value` right-aligned in a field of `width` characters
+static void procfs_append_num(char* dst, size_t size, uint64_t value, int width) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0 && n < (int)sizeof(digits));
+
+    char field[32];
+    int pos = 0;
+    for (int i = n; i < width && pos < (int)sizeof(field) - 1; i++)
+        field[pos++] = ' ';
+    while (n > 0 && pos < (int)sizeof(field) - 1)
+        field[pos++] = digits[--n];
+    field[pos] = '\0';
+    strcat_safe(dst, field, size);
+}
+
+// Append `value` as 0x followed by 16 hex digits
+static void procfs_append_hex(char* dst, size_t size, uint64_t value) {
+    static const char hex[] = "0123456789abcdef";
+    char field[19];
+    field[0] = '0';
+    field[1] = 'x';
+    for (int i = 0; i < 16; i++)
+        field[2 + i] = hex[(value >> (60 - 4 * i)) & 0xF];
+    field[18] = '\0';
+    strcat_safe(dst, field, size);
+}
+
+// Append `str` left-aligned in a field of `width` characters
+static void procfs_append_str(char* dst, size_t size, const char* str, int width) {
+    strcat_safe(dst, str, size);
+    for (int i = (int)strlen(str); i < width; i++)
+        strcat_safe(dst, " ", size);
+}
+
+static vfs_ssize_t procfs_copy_out(const char* text, void* buf, size_t count, vfs_off_t* pos) {
+    size_t len = strlen(text);
+    if (*pos >= len) {
+        return 0;
+    }
+
+    size_t remaining = len - *pos;
+    size_t to_copy = (remaining < count) ? remaining : count;
+
+    memcpy(buf, text + *pos, to_copy);
+    *pos += to_copy;
+
+    return to_copy;
+}
+
 vfs_ssize_t procfs_meminfo(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
     (void)file;
-    char meminfo_buf[512];
+    char meminfo_buf[1024];
+
+    mem_stats_t stats;
+    memory_get_stats(&stats);
 
     size_t memTotal = get_memory_total();
     size_t buddyFree = get_memory_free();
-    size_t allocated = get_memory_used();
-    size_t memUsed = allocated;
-    size_t memFree = memTotal - allocated;
-
-    size_t overhead = 0;
+    size_t memUsed = stats.allocated;
+    size_t memFree = memTotal - stats.allocated;
+
+    size_t slab_bytes = 0;
+    for (uint32_t i = 0; i < kmem_cache_count(); i++) {
+        kmem_cache_stats_t cs;
+        kmem_cache_get_stats(kmem_cache_get(i), &cs);
+        slab_bytes += cs.slab_count * cs.slab_size;
+    }
 
-    char total_str[32], used_str[32], free_str[32], ovh_str[32], buddy_free_str[32];
+    char total_str[32], used_str[32], free_str[32], buddy_free_str[32];
+    char slab_str[32], pages_str[32], vm_used_str[32], vm_huge_str[32];
+    vmm_stats_t vm;
+    vmm_get_stats(&vm);
+    format_memory_size(vm.used, vm_used_str);
+    format_memory_size(vm.huge, vm_huge_str);
     format_memory_size(memTotal, total_str);
     format_memory_size(memUsed, used_str);
     format_memory_size(memFree, free_str);
-    format_memory_size(overhead, ovh_str);
     format_memory_size(buddyFree, buddy_free_str);
+    format_memory_size(slab_bytes, slab_str);
+    format_memory_size(stats.page_bytes, pages_str);
 
     strcpy_safe(meminfo_buf, "MemTotal       : ", sizeof(meminfo_buf));
     strcat_safe(meminfo_buf, total_str, sizeof(meminfo_buf));
@@ -741,25 +824,513 @@ vfs_ssize_t procfs_meminfo(vfs_file_t* file, void* buf, size_t count, vfs_off_t*
     strcat_safe(meminfo_buf, used_str, sizeof(meminfo_buf));
     strcat_safe(meminfo_buf, "\nMemFree        : ", sizeof(meminfo_buf));
     strcat_safe(meminfo_buf, free_str, sizeof(meminfo_buf));
+    strcat_safe(meminfo_buf, "\nBuddyFree      : ", sizeof(meminfo_buf));
+    strcat_safe(meminfo_buf, buddy_free_str, sizeof(meminfo_buf));
+    strcat_safe(meminfo_buf, "\nSlab           : ", sizeof(meminfo_buf));
+    strcat_safe(meminfo_buf, slab_str, sizeof(meminfo_buf));
+    strcat_safe(meminfo_buf, "\nPageAllocs     : ", sizeof(meminfo_buf));
+    strcat_safe(meminfo_buf, pages_str, sizeof(meminfo_buf));
+    strcat_safe(meminfo_buf, "\nAllocations    : ", sizeof(meminfo_buf));
+    procfs_append_num(meminfo_buf, sizeof(meminfo_buf), stats.alloc_count, 0);
+    strcat_safe(meminfo_buf, "\nFrees          : ", sizeof(meminfo_buf));
+    procfs_append_num(meminfo_buf, sizeof(meminfo_buf), stats.free_count, 0);
+    strcat_safe(meminfo_buf, "\nPageAllocCount : ", sizeof(meminfo_buf));
+    procfs_append_num(meminfo_buf, sizeof(meminfo_buf), stats.page_allocs, 0);
+    strcat_safe(meminfo_buf, "\nPageFreeCount  : ", sizeof(meminfo_buf));
+    procfs_append_num(meminfo_buf, sizeof(meminfo_buf), stats.page_frees, 0);
+    strcat_safe(meminfo_buf, "\nVmallocUsed    : ", sizeof(meminfo_buf));
+    strcat_safe(meminfo_buf, vm_used_str, sizeof(meminfo_buf));
+    strcat_safe(meminfo_buf, "\nVmallocHuge    : ", sizeof(meminfo_buf));
+    strcat_safe(meminfo_buf, vm_huge_str, sizeof(meminfo_buf));
+    strcat_safe(meminfo_buf, "\nVmallocAreas   : ", sizeof(meminfo_buf));
+    procfs_append_num(meminfo_buf, sizeof(meminfo_buf), vm.area_count, 0);
     strcat_safe(meminfo_buf, "\n", sizeof(meminfo_buf));
 
-    size_t len = strlen(meminfo_buf);
-    if (*pos >= len) {
-        return 0;
+    return procfs_copy_out(meminfo_buf, buf, count, pos);
+}
+
+vfs_ssize_t procfs_slabinfo(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
+    (void)file;
+    char* text = kmalloc(PROCFS_STATS_BUF_SIZE);
+    if (!text) return -ENOMEM;
+    const size_t size = PROCFS_STATS_BUF_SIZE;
+
+    strcpy_safe(text, "name                  active    total  objsize  per-slab  pages  slabs  depot\n", size);
+    for (uint32_t i = 0; i < kmem_cache_count(); i++) {
+        kmem_cache_stats_t cs;
+        kmem_cache_get_stats(kmem_cache_get(i), &cs);
+
+        size_t active = cs.alloc_count > cs.free_count ? cs.alloc_count - cs.free_count : 0;
+        procfs_append_str(text, size, cs.name, 20);
+        procfs_append_num(text, size, active, 8);
+        procfs_append_num(text, size, cs.slab_count * cs.objs_per_slab, 9);
+        procfs_append_num(text, size, cs.stride, 9);
+        procfs_append_num(text, size, cs.objs_per_slab, 10);
+        procfs_append_num(text, size, cs.slab_size / SLAB_PAGE_SIZE, 7);
+        procfs_append_num(text, size, cs.slab_count, 7);
+        procfs_append_num(text, size, cs.depot_full, 4);
+        strcat_safe(text, "/", size);
+        procfs_append_num(text, size, cs.depot_empty, 0);
+        strcat_safe(text, "\n", size);
     }
 
-    size_t remaining = len - *pos;
-    size_t to_copy = (remaining < count) ? remaining : count;
+    // Magazine fill as loaded+previous rounds out of 2 * SLAB_MAG_ROUNDS
+    strcat_safe(text, "\nmagazines (loaded+previous per CPU)\n", size);
+    for (uint32_t i = 0; i < kmem_cache_count(); i++) {
+        kmem_cache_t* cache = kmem_cache_get(i);
+        kmem_cache_stats_t cs;
+        kmem_cache_get_stats(cache, &cs);
+        if (cs.alloc_count == 0) continue;
+
+        procfs_append_str(text, size, cs.name, 20);
+        for (uint32_t cpu = 0; cpu < smp_cpu_count() && cpu < SLAB_MAX_CPUS; cpu++) {
+            kmem_cache_cpu_stats_t ccs;
+            if (kmem_cache_get_cpu_stats(cache, cpu, &ccs) < 0) continue;
+            strcat_safe(text, " cpu", size);
+            procfs_append_num(text, size, cpu, 0);
+            strcat_safe(text, "=", size);
+            procfs_append_num(text, size, ccs.loaded_rounds, 0);
+            strcat_safe(text, "+", size);
+            procfs_append_num(text, size, ccs.previous_rounds, 0);
+        }
+        strcat_safe(text, "\n", size);
+    }
 
-    memcpy(buf, meminfo_buf + *pos, to_copy);
-    *pos += to_copy;
+    vfs_ssize_t ret = procfs_copy_out(text, buf, count, pos);
+    kfree(text);
+    return ret;
+}
 
-    return to_copy;
+vfs_ssize_t procfs_buddyinfo(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
+    (void)file;
+    char* text = kmalloc(PROCFS_STATS_BUF_SIZE);
+    if (!text) return -ENOMEM;
+    const size_t size = PROCFS_STATS_BUF_SIZE;
+
+    // One column per order, counted in pages (order 0 = 4 KiB)
+    strcpy_safe(text, "zone  size     ", size);
+    for (uint32_t order = BUDDY_MIN_ORDER; order <= BUDDY_MAX_ORDER; order++)
+        procfs_append_num(text, size, order - BUDDY_MIN_ORDER, 7);
+    strcat_safe(text, "\n", size);
+
+    buddy_allocator_t* buddy = slab_get_buddy();
+    for (uint32_t z = 0; z < buddy_zone_count(buddy); z++) {
+        buddy_zone_t* zone = buddy_get_zone(buddy, z);
+        size_t counts[BUDDY_MAX_ORDER + 1];
+        buddy_zone_free_areas(zone, counts);
+        char size_str[32];
+        format_memory_size(zone->pool_size, size_str);
+
+        procfs_append_num(text, size, z, 4);
+        strcat_safe(text, "  ", size);
+        procfs_append_str(text, size, size_str, 9);
+        for (uint32_t order = BUDDY_MIN_ORDER; order <= BUDDY_MAX_ORDER; order++)
+            procfs_append_num(text, size, counts[order], 7);
+        strcat_safe(text, "\n", size);
+    }
+
+    vfs_ssize_t ret = procfs_copy_out(text, buf, count, pos);
+    kfree(text);
+    return ret;
+}
+
+vfs_ssize_t procfs_lockstat(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
+    (void)file;
+    char* text = kmalloc(PROCFS_STATS_BUF_SIZE);
+    if (!text) return -ENOMEM;
+    const size_t size = PROCFS_STATS_BUF_SIZE;
+
+    // max-hold is in TSC cycles; readers of an rwlock do not contribute to it
+    strcpy_safe(text, "name                    acquired   contended         spins      max-hold\n", size);
+    for (uint32_t i = 0; i < lock_stats_count(); i++) {
+        lock_stats_t* ls = lock_stats_get(i);
+        procfs_append_str(text, size, ls->name, 20);
+        procfs_append_num(text, size, __atomic_load_n(&ls->acquisitions, __ATOMIC_RELAXED), 12);
+        procfs_append_num(text, size, __atomic_load_n(&ls->contended, __ATOMIC_RELAXED), 12);
+        procfs_append_num(text, size, __atomic_load_n(&ls->spins, __ATOMIC_RELAXED), 14);
+        procfs_append_num(text, size, ls->max_hold, 14);
+        strcat_safe(text, "\n", size);
+    }
+
+    vfs_ssize_t ret = procfs_copy_out(text, buf, count, pos);
+    kfree(text);
+    return ret;
+}
+
+vfs_ssize_t procfs_workqueue(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
+    (void)file;
+    char* text = kmalloc(PROCFS_STATS_BUF_SIZE);
+    if (!text) return -ENOMEM;
+    const size_t size = PROCFS_STATS_BUF_SIZE;
+
+    strcpy_safe(text, "cpu      executed      stolen  queued  state\n", size);
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        wq_cpu_stats_t st;
+        if (wq_get_stats(i, &st) != 0) continue;
+        procfs_append_num(text, size, i, 3);
+        procfs_append_num(text, size, st.executed, 14);
+        procfs_append_num(text, size, st.stolen, 12);
+        procfs_append_num(text, size, st.queued, 8);
+        strcat_safe(text, st.idle ? "  idle\n" : "  running\n", size);
+    }
+
+    vfs_ssize_t ret = procfs_copy_out(text, buf, count, pos);
+    kfree(text);
+    return ret;
+}
+
+vfs_ssize_t procfs_bcache(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
+    (void)file;
+    char text[512];
+    const size_t size = sizeof(text);
+
+    bcache_stats_t st;
+    bcache_get_stats(&st);
+
+    strcpy_safe(text, "Buffers:         ", size);
+    procfs_append_num(text, size, st.buffers, 0);
+    strcat_safe(text, " / ", size);
+    procfs_append_num(text, size, BCACHE_MAX_BUFFERS, 0);
+    strcat_safe(text, "\nDirty:           ", size);
+    procfs_append_num(text, size, st.dirty, 0);
+    strcat_safe(text, "\nMemoryKb:        ", size);
+    procfs_append_num(text, size, st.bytes / 1024, 0);
+    strcat_safe(text, "\nHits:            ", size);
+    procfs_append_num(text, size, st.hits, 0);
+    strcat_safe(text, "\nMisses:          ", size);
+    procfs_append_num(text, size, st.misses, 0);
+    strcat_safe(text, "\nEvictions:       ", size);
+    procfs_append_num(text, size, st.evictions, 0);
+    strcat_safe(text, "\nWritebacks:      ", size);
+    procfs_append_num(text, size, st.writebacks, 0);
+    strcat_safe(text, "\nWriteErrors:     ", size);
+    procfs_append_num(text, size, st.write_errors, 0);
+    strcat_safe(text, "\n", size);
+
+    return procfs_copy_out(text, buf, count, pos);
+}
+
+vfs_ssize_t procfs_blkqueue(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
+    (void)file;
+    char* text = kmalloc(PROCFS_STATS_BUF_SIZE);
+    if (!text) return -ENOMEM;
+    const size_t size = PROCFS_STATS_BUF_SIZE;
+
+    strcpy_safe(text, "device          bios    merged  requests      busy      irqs  queued  inflight  max\n", size);
+    block_device_t* devices = get_block_devices();
+    for (int i = 0; i < MAX_BLOCK_DEVICES; i++) {
+        blk_queue_stats_t st;
+        if (!devices[i].used || blk_get_queue_stats(&devices[i], &st) != 0) continue;
+        strcat_safe(text, devices[i].name, size);
+        for (size_t pad = strlen(devices[i].name); pad < 6; pad++)
+            strcat_safe(text, " ", size);
+        procfs_append_num(text, size, st.bios, 10);
+        procfs_append_num(text, size, st.merged, 10);
+        procfs_append_num(text, size, st.requests, 10);
+        procfs_append_num(text, size, st.busy, 10);
+        procfs_append_num(text, size, st.irqs, 10);
+        procfs_append_num(text, size, st.queued, 8);
+        procfs_append_num(text, size, st.in_flight, 10);
+        procfs_append_num(text, size, st.max_in_flight, 5);
+        strcat_safe(text, "\n", size);
+    }
+
+    vfs_ssize_t ret = procfs_copy_out(text, buf, count, pos);
+    kfree(text);
+    return ret;
+}
+
+vfs_ssize_t procfs_softirqs(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
+    (void)file;
+    char* text = kmalloc(PROCFS_STATS_BUF_SIZE);
+    if (!text) return -ENOMEM;
+    const size_t size = PROCFS_STATS_BUF_SIZE;
+
+    strcpy_safe(text, "cpu", size);
+    for (uint32_t nr = 0; nr < SOFTIRQ_COUNT; nr++) {
+        char col[16];
+        strcpy_safe(col, "", sizeof(col));
+        for (size_t pad = strlen(softirq_names[nr]); pad < 12; pad++)
+            strcat_safe(col, " ", sizeof(col));
+        strcat_safe(text, col, size);
+        strcat_safe(text, softirq_names[nr], size);
+    }
+    strcat_safe(text, "    deferred\n", size);
+
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        softirq_stats_t st;
+        if (softirq_get_stats(i, &st) != 0) continue;
+        procfs_append_num(text, size, i, 3);
+        for (uint32_t nr = 0; nr < SOFTIRQ_COUNT; nr++)
+            procfs_append_num(text, size, st.runs[nr], 12);
+        procfs_append_num(text, size, st.deferred, 12);
+        strcat_safe(text, "\n", size);
+    }
+
+    vfs_ssize_t ret = procfs_copy_out(text, buf, count, pos);
+    kfree(text);
+    return ret;
+}
+
+#define PROCFS_TRACE_BUF_SIZE 32768
+#define PROCFS_TRACE_TOP      16    // Rows in each top-sites table
+#define PROCFS_TRACE_RECENT   8     // Recent events shown per CPU
+
+static const char* const alloc_event_names[] = {
+    [ALLOC_EV_KMALLOC]    = "kmalloc",
+    [ALLOC_EV_KFREE]      = "kfree",
+    [ALLOC_EV_PAGES]      = "pages",
+    [ALLOC_EV_PAGES_FREE] = "pages_free",
+};
+
+// Index of the largest entry not yet taken, ranked by bytes or by count
+static int procfs_trace_pick(const alloc_site_stats_t* sites, uint32_t n, const bool* taken, bool by_bytes) {
+    int best = -1;
+    for (uint32_t i = 0; i < n; i++) {
+        if (taken[i]) continue;
+        uint64_t key = by_bytes ? sites[i].alloc_bytes : sites[i].alloc_count;
+        uint64_t best_key = best < 0 ? 0 : (by_bytes ? sites[best].alloc_bytes : sites[best].alloc_count);
+        if (best < 0 || key > best_key) best = (int)i;
+    }
+    return best;
+}
+
+static void procfs_trace_top(char* text, size_t size, const alloc_site_stats_t* sites, uint32_t n,
+                             bool* taken, bool by_bytes) {
+    strcat_safe(text, by_bytes ? "\ntop sites by bytes\n" : "\ntop sites by count\n", size);
+    strcat_safe(text, "site                    allocs         bytes     frees\n", size);
+
+    memset(taken, 0, n * sizeof(bool));
+    for (uint32_t row = 0; row < PROCFS_TRACE_TOP; row++) {
+        int i = procfs_trace_pick(sites, n, taken, by_bytes);
+        if (i < 0) break;
+        taken[i] = true;
+
+        procfs_append_hex(text, size, sites[i].site);
+        procfs_append_num(text, size, sites[i].alloc_count, 10);
+        procfs_append_num(text, size, sites[i].alloc_bytes, 14);
+        procfs_append_num(text, size, sites[i].free_count, 10);
+        strcat_safe(text, "\n", size);
+    }
+}
+
+vfs_ssize_t procfs_alloctrace(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
+    (void)file;
+    char* text = kmalloc(PROCFS_TRACE_BUF_SIZE);
+    if (!text) return -ENOMEM;
+    const size_t size = PROCFS_TRACE_BUF_SIZE;
+
+    alloc_trace_status_t st;
+    alloc_trace_get_status(&st);
+
+    strcpy_safe(text, "State          : ", size);
+    strcat_safe(text, st.enabled ? "on" : "off", size);
+    strcat_safe(text, "\nEvents         : ", size);
+    procfs_append_num(text, size, st.events, 0);
+    strcat_safe(text, "\nSites          : ", size);
+    procfs_append_num(text, size, st.sites, 0);
+    strcat_safe(text, "\nLive           : ", size);
+    procfs_append_num(text, size, st.live, 0);
+    strcat_safe(text, "\nSiteDrops      : ", size);
+    procfs_append_num(text, size, st.site_drops, 0);
+    strcat_safe(text, "\nLiveDrops      : ", size);
+    procfs_append_num(text, size, st.live_drops, 0);
+    strcat_safe(text, "\nUntrackedFrees : ", size);
+    procfs_append_num(text, size, st.untracked, 0);
+    strcat_safe(text, "\n", size);
+
+    alloc_site_stats_t* sites = kmalloc(ALLOC_TRACE_MAX_SITES * sizeof(alloc_site_stats_t));
+    bool* taken = kmalloc(ALLOC_TRACE_MAX_SITES * sizeof(bool));
+    if (sites && taken) {
+        uint32_t n = alloc_trace_get_sites(sites, ALLOC_TRACE_MAX_SITES);
+        procfs_trace_top(text, size, sites, n, taken, true);
+        procfs_trace_top(text, size, sites, n, taken, false);
+    }
+    if (sites) kfree(sites);
+    if (taken) kfree(taken);
+
+    // Newest first; tsc is the raw counter, so events compare across CPUs
+    strcat_safe(text, "\nrecent events\n", size);
+    strcat_safe(text, "cpu  type          size  ptr                 site                tsc\n", size);
+    for (uint32_t cpu = 0; cpu < smp_cpu_count() && cpu < ALLOC_TRACE_MAX_CPUS; cpu++) {
+        alloc_event_t ev[PROCFS_TRACE_RECENT];
+        uint32_t n = alloc_trace_get_recent(cpu, ev, PROCFS_TRACE_RECENT);
+        for (uint32_t i = 0; i < n; i++) {
+            procfs_append_num(text, size, cpu, 3);
+            strcat_safe(text, "  ", size);
+            procfs_append_str(text, size, ev[i].type <= ALLOC_EV_PAGES_FREE ? alloc_event_names[ev[i].type] : "?", 10);
+            procfs_append_num(text, size, ev[i].size, 8);
+            strcat_safe(text, "  ", size);
+            procfs_append_hex(text, size, ev[i].ptr);
+            strcat_safe(text, "  ", size);
+            procfs_append_hex(text, size, ev[i].site);
+            strcat_safe(text, "  ", size);
+            procfs_append_num(text, size, ev[i].tsc, 0);
+            strcat_safe(text, "\n", size);
+        }
+    }
+
+    vfs_ssize_t ret = procfs_copy_out(text, buf, count, pos);
+    kfree(text);
+    return ret;
+}
+
+vfs_ssize_t procfs_allocleaks(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
+    (void)file;
+    char* text = kmalloc(PROCFS_TRACE_BUF_SIZE);
+    alloc_live_site_t* live = kmalloc((ALLOC_TRACE_MAX_SITES + 1) * sizeof(alloc_live_site_t));
+    if (!text || !live) {
+        if (text) kfree(text);
+        if (live) kfree(live);
+        return -ENOMEM;
+    }
+    const size_t size = PROCFS_TRACE_BUF_SIZE;
+
+    uint32_t n = alloc_trace_get_live(live, ALLOC_TRACE_MAX_SITES + 1);
+    uint64_t now = rdtsc();
+
+    // Largest outstanding byte counts first; site 0 collects blocks from untracked sites
+    strcpy_safe(text, "site                     count         bytes  oldest(Mcycles)\n", size);
+    for (uint32_t row = 0; row < n; row++) {
+        uint32_t best = row;
+        for (uint32_t i = row + 1; i < n; i++)
+            if (live[i].bytes > live[best].bytes) best = i;
+        alloc_live_site_t tmp = live[row];
+        live[row] = live[best];
+        live[best] = tmp;
+
+        procfs_append_hex(text, size, live[row].site);
+        procfs_append_num(text, size, live[row].count, 11);
+        procfs_append_num(text, size, live[row].bytes, 14);
+        procfs_append_num(text, size, (now - live[row].oldest_tsc) / 1000000, 17);
+        strcat_safe(text, "\n", size);
+    }
+
+    kfree(live);
+    vfs_ssize_t ret = procfs_copy_out(text, buf, count, pos);
+    kfree(text);
+    return ret;
+}
+
+// Append the low `digits` hex digits of `value`, zero-padded
+static void procfs_append_hex_digits(char* dst, size_t size, uint32_t value, int digits) {
+    static const char hex[] = "0123456789abcdef";
+    char field[9];
+    for (int i = 0; i < digits; i++)
+        field[i] = hex[(value >> (4 * (digits - 1 - i))) & 0xF];
+    field[digits] = '\0';
+    strcat_safe(dst, field, size);
 }
 
 vfs_ssize_t procfs_pci(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
-    (void)file; (void)buf; (void)count; (void)pos;
-    return 0;
+    (void)file;
+    char* text = kmalloc(PROCFS_STATS_BUF_SIZE);
+    if (!text) return -ENOMEM;
+    const size_t size = PROCFS_STATS_BUF_SIZE;
+
+    // bus:slot.func vendor:device class.subclass.prog-if
+    text[0] = '\0';
+    for (uint32_t i = 0; i < pci_device_count(); i++) {
+        const pci_device_t* dev = pci_get_device(i);
+        procfs_append_hex_digits(text, size, dev->bus, 2);
+        strcat_safe(text, ":", size);
+        procfs_append_hex_digits(text, size, dev->slot, 2);
+        strcat_safe(text, ".", size);
+        procfs_append_hex_digits(text, size, dev->func, 1);
+        strcat_safe(text, " ", size);
+        procfs_append_hex_digits(text, size, dev->vendor_id, 4);
+        strcat_safe(text, ":", size);
+        procfs_append_hex_digits(text, size, dev->device_id, 4);
+        strcat_safe(text, " ", size);
+        procfs_append_hex_digits(text, size, dev->class_code, 2);
+        strcat_safe(text, ".", size);
+        procfs_append_hex_digits(text, size, dev->subclass, 2);
+        strcat_safe(text, ".", size);
+        procfs_append_hex_digits(text, size, dev->prog_if, 2);
+        strcat_safe(text, "\n", size);
+    }
+
+    vfs_ssize_t ret = procfs_copy_out(text, buf, count, pos);
+    kfree(text);
+    return ret;
+}
+
+vfs_ssize_t procfs_timer(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
+    (void)file;
+    static const char* const mode_names[] = {
+        [APIC_TIMER_MODE_PERIODIC] = "periodic",
+        [APIC_TIMER_MODE_ONESHOT]  = "oneshot",
+        [APIC_TIMER_MODE_DEADLINE] = "tsc-deadline",
+    };
+    char text[512];
+    const size_t size = sizeof(text);
+
+    apic_timer_stats_t st;
+    apic_timer_get_stats(&st);
+
+    strcpy_safe(text, "Clocksource:     ", size);
+    strcat_safe(text, tsc_available() ? "tsc\n" : "apic-tick\n", size);
+    strcat_safe(text, "TscHz:           ", size);
+    procfs_append_num(text, size, tsc_get_hz(), 0);
+    strcat_safe(text, "\nTimerMode:       ", size);
+    strcat_safe(text, apic_available() ? mode_names[apic_timer_mode()] : "none", size);
+    strcat_safe(text, "\nInterrupts:      ", size);
+    procfs_append_num(text, size, st.interrupts, 0);
+    strcat_safe(text, "\nTicks:           ", size);
+    procfs_append_num(text, size, st.ticks, 0);
+    strcat_safe(text, "\nIdleEntries:     ", size);
+    procfs_append_num(text, size, st.idle_entries, 0);
+    strcat_safe(text, "\nIdleMs:          ", size);
+    procfs_append_num(text, size, st.idle_ns / NSEC_PER_MSEC, 0);
+    strcat_safe(text, "\nUptimeMs:        ", size);
+    procfs_append_num(text, size, ktime_get_ms(), 0);
+    strcat_safe(text, "\n", size);
+
+    return procfs_copy_out(text, buf, count, pos);
+}
+
+#define PROCFS_BOOTTIME_BUF_SIZE 16384
+
+vfs_ssize_t procfs_boottime(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
+    (void)file;
+    char* text = kmalloc(PROCFS_BOOTTIME_BUF_SIZE);
+    if (!text) return -ENOMEM;
+    const size_t size = PROCFS_BOOTTIME_BUF_SIZE;
+
+    // Times are relative to boottime_init(); without a TSC rate only cycles are shown
+    uint64_t hz = boottime_tsc_hz();
+    uint64_t base = boottime_base_tsc();
+    strcpy_safe(text, "TscHz: ", size);
+    procfs_append_num(text, size, hz, 0);
+    strcat_safe(text, "\nstage                        cpu    start_us     time_us          cycles\n", size);
+
+    for (uint32_t i = 0; i < boottime_count(); i++) {
+        const boottime_event_t* ev = boottime_get(i);
+        int depth = 0;
+        for (int32_t at = ev->parent; at != BOOTTIME_NONE && depth < 8; at = boottime_get(at)->parent)
+            depth++;
+
+        char name[48];
+        name[0] = '\0';
+        for (int d = 0; d < depth; d++) strcat_safe(name, "  ", sizeof(name));
+        strcat_safe(name, ev->name, sizeof(name));
+        procfs_append_str(text, size, name, 28);
+
+        uint64_t cycles = ev->end_tsc > ev->start_tsc ? ev->end_tsc - ev->start_tsc : 0;
+        procfs_append_num(text, size, ev->cpu, 4);
+        procfs_append_num(text, size, boottime_cycles_to_us(ev->start_tsc - base), 12);
+        if (ev->end_tsc) {
+            procfs_append_num(text, size, boottime_cycles_to_us(cycles), 12);
+            procfs_append_num(text, size, cycles, 16);
+        } else {
+            strcat_safe(text, "        open", size);
+        }
+        strcat_safe(text, "\n", size);
+    }
+
+    vfs_ssize_t ret = procfs_copy_out(text, buf, count, pos);
+    kfree(text);
+    return ret;
 }
 
 vfs_ssize_t procfs_uptime(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos) {
@@ -1015,7 +1586,18 @@ void procfs_init(void) {
 
     procfs_add_entry("cpuinfo", procfs_cpuinfo, NULL, false);
     procfs_add_entry("meminfo", procfs_meminfo, NULL, false);
+    procfs_add_entry("slabinfo", procfs_slabinfo, NULL, false);
+    procfs_add_entry("buddyinfo", procfs_buddyinfo, NULL, false);
+    procfs_add_entry("alloctrace", procfs_alloctrace, NULL, false);
+    procfs_add_entry("allocleaks", procfs_allocleaks, NULL, false);
+    procfs_add_entry("lockstat", procfs_lockstat, NULL, false);
+    procfs_add_entry("workqueue", procfs_workqueue, NULL, false);
+    procfs_add_entry("softirqs", procfs_softirqs, NULL, false);
+    procfs_add_entry("bcache", procfs_bcache, NULL, false);
+    procfs_add_entry("blkqueue", procfs_blkqueue, NULL, false);
     procfs_add_entry("pci", procfs_pci, NULL, false);
+    procfs_add_entry("boottime", procfs_boottime, NULL, false);
+    procfs_add_entry("timer", procfs_timer, NULL, false);
     procfs_add_entry("uptime", procfs_uptime, NULL, false);
     procfs_add_entry("version", procfs_version, NULL, false);
     procfs_add_entry("self", procfs_self, NULL, false);
@@ -6,6 +6,8 @@
 #include <core/kernel/kstd.h>
 #include <log.h>
 #include <core/kernel/mem.h>
+#include <core/arch/epoch.h>
+#include <core/kernel/sync/mutex.h>
 #include <stddef.h>
 #include <string.h>
 
@@ -23,6 +25,21 @@ static int next_fd = 3;
 
 static vfs_filesystem_t registered_fs[MAX_REGISTERED_FS];
 static vfs_mount_t mounts[MAX_MOUNTS];
+
+/*
+ * Every path lookup scans the mount table, so readers take no lock: they
+ * walk the published snapshot inside an epoch read section. Mount and
+ * umount, serialized by `mounts_mutex`, publish a new snapshot and free the
+ * old one after a grace period. A slot in `mounts` is owned while its `fs`
+ * is set and is only reused once no snapshot can still point at it.
+ */
+typedef struct mount_table {
+    uint32_t     count;
+    vfs_mount_t* entries[MAX_MOUNTS];
+} mount_table_t;
+
+static mount_table_t* mount_table;
+static mutex_t mounts_mutex;
 static vfs_file_handle_t file_handles[MAX_HANDLES];
 
 static vfs_handle_t* get_handle(int fd) {
@@ -195,6 +212,9 @@ void vfs_init(void) {
         registered_fs[i].name[0] = '\0';
     }
 
+    mutex_init(&mounts_mutex);
+    mount_table = kmalloc(sizeof(mount_table_t));
+    if (mount_table) mount_table->count = 0;
     for (int i = 0; i < MAX_MOUNTS; i++) {
         mounts[i].mounted = false;
         mounts[i].fs = NULL;
@@ -314,6 +334,8 @@ int vfs_pseudo_register(const char* filename,
     return -3;
 }
 
+static int vfs_open_mounted(vfs_mount_t* mnt, const char* rel_path, int flags);
+
 const char* vfs_read(const char* filename, size_t* size) {
     static char buffer[MAX_FILE_SIZE];
 
@@ -371,8 +393,16 @@ int vfs_open(const char* filename, int flags) {
     
     // 3. Ищем в смонтированных ФС
     const char* rel_path;
-    vfs_mount_t* mnt = vfs_find_mount(filename, &rel_path);
-    if (!mnt || !mnt->fs || !mnt->fs->ops) {
+    vfs_mount_t* mnt = vfs_get_mount(filename, &rel_path);
+    if (!mnt) return -ENOENT;
+    int fd = vfs_open_mounted(mnt, rel_path, flags);
+    if (fd < 0) vfs_put_mount(mnt);
+    return fd;
+}
+
+// `mnt` is pinned by the caller; on success the open handle keeps that pin until close
+static int vfs_open_mounted(vfs_mount_t* mnt, const char* rel_path, int flags) {
+    if (!mnt->fs || !mnt->fs->ops) {
         return -ENOENT;
     }
     
@@ -545,6 +575,8 @@ int vfs_close(int fd) {
                     fh->used = false;
                 }
             }
+            if (handles[i].mount)
+                vfs_put_mount(handles[i].mount);
             
             handles[i].used = false;
             handles[i].fd = -1;
@@ -594,9 +626,12 @@ vfs_off_t vfs_seek(int fd, vfs_off_t offset, int whence) {
 
 int vfs_delete(const char* filename) {
     const char* rel_path;
-    vfs_mount_t* mnt = vfs_find_mount(filename, &rel_path);
-    if (mnt && mnt->fs && mnt->fs->ops && mnt->fs->ops->unlink) {
-        return mnt->fs->ops->unlink(mnt, rel_path);
+    vfs_mount_t* mnt = vfs_get_mount(filename, &rel_path);
+    if (mnt) {
+        bool handled = mnt->fs && mnt->fs->ops && mnt->fs->ops->unlink;
+        int ret = handled ? mnt->fs->ops->unlink(mnt, rel_path) : 0;
+        vfs_put_mount(mnt);
+        if (handled) return ret;
     }
 
     for (int i = 0; i < MAX_FILES; i++) {
@@ -742,15 +777,15 @@ bool vfs_exists(const char* filename) {
         }
         
         const char* rel_path;
-        vfs_mount_t* mnt = vfs_find_mount(filename, &rel_path);
+        bool found = false;
+        vfs_mount_t* mnt = vfs_get_mount(filename, &rel_path);
         if (mnt && mnt->fs && mnt->fs->ops && mnt->fs->ops->stat) {
             vfs_stat_t stat;
-            if (mnt->fs->ops->stat(mnt, rel_path, &stat) == 0) {
-                return true;
-            }
+            found = mnt->fs->ops->stat(mnt, rel_path, &stat) == 0;
         }
+        if (mnt) vfs_put_mount(mnt);
         
-        return false;
+        return found;
 }
 
 bool vfs_is_dir(const char* path) {
@@ -869,11 +904,14 @@ int vfs_unregister_filesystem(const char* name) {
 
     for (int i = 0; i < MAX_REGISTERED_FS; i++) {
         if (registered_fs[i].registered && strcmp(registered_fs[i].name, name) == 0) {
+            mutex_lock(&mounts_mutex);
             for (int j = 0; j < MAX_MOUNTS; j++) {
-                if (mounts[j].mounted && mounts[j].fs == &registered_fs[i]) {
+                if (mounts[j].fs == &registered_fs[i]) {
+                    mutex_unlock(&mounts_mutex);
                     return -EBUSY;
                 }
             }
+            mutex_unlock(&mounts_mutex);
             registered_fs[i].registered = false;
             registered_fs[i].ops = NULL;
             return 0;
@@ -895,6 +933,30 @@ vfs_filesystem_t* vfs_find_filesystem(const char* name) {
     return NULL;
 }
 
+/*
+ * Publishes a copy of the mount table with `add` appended and `drop` left
+ * out, then frees the old copy once no reader can still be walking it.
+ * Called with mounts_mutex held.
+ */
+static int mount_table_replace(vfs_mount_t* add, vfs_mount_t* drop) {
+    mount_table_t* old = mount_table;
+    mount_table_t* next = kmalloc(sizeof(mount_table_t));
+    if (!next) return -ENOMEM;
+
+    next->count = 0;
+    for (uint32_t i = 0; old && i < old->count; i++) {
+        if (old->entries[i] != drop)
+            next->entries[next->count++] = old->entries[i];
+    }
+    if (add && next->count < MAX_MOUNTS)
+        next->entries[next->count++] = add;
+
+    epoch_publish(mount_table, next);
+    epoch_synchronize();
+    kfree(old);
+    return 0;
+}
+
 int vfs_mount_fs(const char* fs_name, const char* mount_point,
                  const char* device, uint32_t flags, void* data) {
     if (!fs_name || !mount_point) return -EINVAL;
@@ -908,21 +970,23 @@ int vfs_mount_fs(const char* fs_name, const char* mount_point,
     vfs_filesystem_t* fs = vfs_find_filesystem(fs_name);
     if (!fs) return -ENODEV;
 
+    // The driver's mount callback runs before the mount is published, so it may do I/O or resolve paths
+    mutex_lock(&mounts_mutex);
+    vfs_mount_t* mnt = NULL;
     for (int i = 0; i < MAX_MOUNTS; i++) {
-        if (mounts[i].mounted && strcmp(mounts[i].mount_point, mount_point) == 0) {
+        if (mounts[i].fs && strcmp(mounts[i].mount_point, mount_point) == 0) {
+            mutex_unlock(&mounts_mutex);
             return -EBUSY;
         }
-    }
-
-    vfs_mount_t* mnt = NULL;
-    for (int i = 0; i < MAX_MOUNTS; i++) {
-        if (!mounts[i].mounted) {
+        if (!mnt && !mounts[i].fs) {
             mnt = &mounts[i];
-            break;
         }
     }
 
-    if (!mnt) return -ENOMEM;
+    if (!mnt) {
+        mutex_unlock(&mounts_mutex);
+        return -ENOMEM;
+    }
 
     strcpy(mnt->mount_point, mount_point);
     if (device) {
@@ -934,45 +998,83 @@ int vfs_mount_fs(const char* fs_name, const char* mount_point,
     mnt->flags = flags;
     mnt->ref_count = 0;
     mnt->fs_private = NULL;
+    mnt->mounted = false;
 
     if (fs->ops && fs->ops->mount) {
         int result = fs->ops->mount(mnt, device, data);
         if (result < 0) {
-            mnt->mounted = false;
+            mnt->fs = NULL;
+            mutex_unlock(&mounts_mutex);
             return result;
         }
     }
 
     mnt->mounted = true;
-    return 0;
+    int result = mount_table_replace(mnt, NULL);
+    if (result < 0) {
+        if (fs->ops && fs->ops->unmount) fs->ops->unmount(mnt);
+        mnt->mounted = false;
+        mnt->fs = NULL;
+    }
+    mutex_unlock(&mounts_mutex);
+    return result;
 }
 
 int vfs_umount(const char* mount_point) {
     if (!mount_point) return -EINVAL;
 
+    mutex_lock(&mounts_mutex);
+    vfs_mount_t* mnt = NULL;
     for (int i = 0; i < MAX_MOUNTS; i++) {
         if (mounts[i].mounted && strcmp(mounts[i].mount_point, mount_point) == 0) {
-            vfs_mount_t* mnt = &mounts[i];
+            mnt = &mounts[i];
+            break;
+        }
+    }
+    if (!mnt) {
+        mutex_unlock(&mounts_mutex);
+        return -ENOENT;
+    }
 
-            if (mnt->ref_count > 0) {
-                return -EBUSY;
-            }
+    if (__atomic_load_n(&mnt->ref_count, __ATOMIC_ACQUIRE) > 0) {
+        mutex_unlock(&mounts_mutex);
+        return -EBUSY;
+    }
 
-            if (mnt->fs && mnt->fs->ops && mnt->fs->ops->unmount) {
-                int result = mnt->fs->ops->unmount(mnt);
-                if (result < 0) {
-                    return result;
-                }
-            }
+    // Once the grace period is over no lookup can reach the mount, but one may have opened a file first
+    mnt->mounted = false;
+    int result = mount_table_replace(NULL, mnt);
+    if (result == 0 && __atomic_load_n(&mnt->ref_count, __ATOMIC_ACQUIRE) > 0)
+        result = -EBUSY;
 
-            mnt->mounted = false;
-            mnt->fs = NULL;
-            mnt->fs_private = NULL;
-            return 0;
-        }
+    if (result == 0 && mnt->fs && mnt->fs->ops && mnt->fs->ops->unmount)
+        result = mnt->fs->ops->unmount(mnt);
+
+    if (result < 0) {
+        mnt->mounted = true;
+        if (mount_table_replace(mnt, NULL) < 0)
+            LOG_ERROR("vfs: lost mount %s while backing out of umount\n", mnt->mount_point);
+        mutex_unlock(&mounts_mutex);
+        return result;
     }
 
-    return -ENOENT;
+    mnt->fs = NULL;
+    mnt->fs_private = NULL;
+    mutex_unlock(&mounts_mutex);
+    return 0;
+}
+
+int vfs_sync(void) {
+    int result = 0;
+    mutex_lock(&mounts_mutex);
+    for (int i = 0; i < MAX_MOUNTS; i++) {
+        vfs_mount_t* mnt = &mounts[i];
+        if (!mnt->mounted || !mnt->fs || !mnt->fs->ops || !mnt->fs->ops->sync) continue;
+        int rc = mnt->fs->ops->sync(mnt);
+        if (rc < 0 && result == 0) result = rc;
+    }
+    mutex_unlock(&mounts_mutex);
+    return result;
 }
 
 vfs_mount_t* vfs_find_mount(const char* path, const char** relative_path) {
@@ -981,16 +1083,16 @@ vfs_mount_t* vfs_find_mount(const char* path, const char** relative_path) {
     vfs_mount_t* best_match = NULL;
     size_t best_len = 0;
 
-    for (int i = 0; i < MAX_MOUNTS; i++) {
-        if (!mounts[i].mounted) continue;
-
-        size_t mount_len = strlen(mounts[i].mount_point);
+    mount_table_t* table = epoch_deref(mount_table);
+    for (uint32_t i = 0; table && i < table->count; i++) {
+        vfs_mount_t* mnt = table->entries[i];
+        size_t mount_len = strlen(mnt->mount_point);
 
-        if (strncmp(path, mounts[i].mount_point, mount_len) == 0) {
+        if (strncmp(path, mnt->mount_point, mount_len) == 0) {
             if (path[mount_len] == '/' || path[mount_len] == '\0' ||
-                (mount_len == 1 && mounts[i].mount_point[0] == '/')) {
+                (mount_len == 1 && mnt->mount_point[0] == '/')) {
                 if (mount_len > best_len) {
-                    best_match = &mounts[i];
+                    best_match = mnt;
                     best_len = mount_len;
                 }
             }
@@ -1006,14 +1108,29 @@ vfs_mount_t* vfs_find_mount(const char* path, const char** relative_path) {
     return best_match;
 }
 
+vfs_mount_t* vfs_get_mount(const char* path, const char** relative_path) {
+    epoch_read_lock();
+    vfs_mount_t* mnt = vfs_find_mount(path, relative_path);
+    // Taken inside the section, so an umount past its grace period sees it and backs out
+    if (mnt) __atomic_fetch_add(&mnt->ref_count, 1, __ATOMIC_ACQ_REL);
+    epoch_read_unlock();
+    return mnt;
+}
+
+void vfs_put_mount(vfs_mount_t* mnt) {
+    __atomic_fetch_sub(&mnt->ref_count, 1, __ATOMIC_ACQ_REL);
+}
+
 int vfs_stat(const char* path, vfs_stat_t* stat) {
     if (!path || !stat) return -EINVAL;
 
     const char* rel_path;
-    vfs_mount_t* mnt = vfs_find_mount(path, &rel_path);
-
-    if (mnt && mnt->fs && mnt->fs->ops && mnt->fs->ops->stat) {
-        return mnt->fs->ops->stat(mnt, rel_path, stat);
+    vfs_mount_t* mnt = vfs_get_mount(path, &rel_path);
+    if (mnt) {
+        bool handled = mnt->fs && mnt->fs->ops && mnt->fs->ops->stat;
+        int ret = handled ? mnt->fs->ops->stat(mnt, rel_path, stat) : 0;
+        vfs_put_mount(mnt);
+        if (handled) return ret;
     }
 
     for (int i = 0; i < MAX_FILES; i++) {
@@ -1040,7 +1157,7 @@ int vfs_readdir(const char* path, vfs_dirent_t* entries, size_t max_entries) {
     if (!path || !entries || max_entries == 0) return -EINVAL;
 
     const char* rel_path;
-    vfs_mount_t* mnt = vfs_find_mount(path, &rel_path);
+    vfs_mount_t* mnt = vfs_get_mount(path, &rel_path);
     int count = 0;
 
     if (mnt && mnt->fs && mnt->fs->ops && mnt->fs->ops->readdir) {
@@ -1101,13 +1218,16 @@ int vfs_readdir(const char* path, vfs_dirent_t* entries, size_t max_entries) {
         }
     }
 
+    if (mnt) vfs_put_mount(mnt);
+
+    // Mount points under `path` show up as directories; only this walk needs the section
     if (count < (int)max_entries) {
         size_t path_len = strlen(path);
 
-        for (int i = 0; i < MAX_MOUNTS; i++) {
-            if (!mounts[i].mounted) continue;
-            
-            const char* mount_point = mounts[i].mount_point;
+        epoch_read_lock();
+        mount_table_t* table = epoch_deref(mount_table);
+        for (uint32_t i = 0; table && i < table->count; i++) {
+            const char* mount_point = table->entries[i]->mount_point;
             size_t mount_len = strlen(mount_point);
             
             bool is_child = false;
@@ -1170,6 +1290,7 @@ int vfs_readdir(const char* path, vfs_dirent_t* entries, size_t max_entries) {
                 }
             }
         }
+        epoch_read_unlock();
     }
 
     return count;
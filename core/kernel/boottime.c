@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/kernel/boottime.h>
+#include <core/kernel/kstd.h>
+#include <core/drivers/serial.h>
+#include <core/arch/percpu.h>
+#include <core/arch/smp.h>
+#include <core/arch/apic.h>
+#include <core/arch/delay.h>
+#include <core/arch/tsc.h>
+#include <log.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define BOOTTIME_MAX_DEPTH  16
+
+static boottime_event_t  events[BOOTTIME_MAX_EVENTS];
+static int32_t           events_prev[BOOTTIME_MAX_EVENTS];  // Open event on that CPU before this one began
+static volatile uint32_t events_used;
+static uint64_t          base_tsc;
+
+// Innermost open event per CPU, or BOOTTIME_NONE
+static int32_t open_event[MAX_CPUS];
+
+// TSC and APIC uptime taken together at the first event after the tick started
+static uint64_t ref_tsc;
+static uint64_t ref_ms;
+
+static void clock_reference(uint64_t tsc) {
+    if (ref_ms) return;
+    uint64_t ms = apic_get_uptime_ms();
+    if (ms == 0) return;
+    ref_tsc = tsc;
+    ref_ms = ms;
+}
+
+void boottime_init(void) {
+    for (uint32_t i = 0; i < MAX_CPUS; i++) open_event[i] = BOOTTIME_NONE;
+    events_used = 0;
+    ref_tsc = ref_ms = 0;
+    base_tsc = rdtsc();
+}
+
+static int event_alloc(const char* name, int parent, uint32_t cpu, uint64_t start_tsc) {
+    uint32_t id = __atomic_fetch_add(&events_used, 1, __ATOMIC_RELAXED);
+    if (id >= BOOTTIME_MAX_EVENTS) {
+        __atomic_fetch_sub(&events_used, 1, __ATOMIC_RELAXED);
+        return BOOTTIME_NONE;
+    }
+
+    boottime_event_t* ev = &events[id];
+    size_t i = 0;
+    for (; name[i] && i < BOOTTIME_NAME_LEN - 1; i++) ev->name[i] = name[i];
+    ev->name[i]   = '\0';
+    ev->parent    = parent;
+    ev->cpu       = cpu;
+    ev->end_tsc   = 0;
+    ev->start_tsc = start_tsc;
+    return (int)id;
+}
+
+int boottime_begin_under(const char* name, int parent) {
+    if (!base_tsc) return BOOTTIME_NONE;
+
+    uint32_t cpu = this_cpu_id();
+    int id = event_alloc(name, parent, cpu, rdtsc());
+    if (id == BOOTTIME_NONE) return id;
+
+    events_prev[id] = open_event[cpu];
+    open_event[cpu] = id;
+    return id;
+}
+
+int boottime_begin(const char* name) {
+    if (!base_tsc) return BOOTTIME_NONE;
+    return boottime_begin_under(name, open_event[this_cpu_id()]);
+}
+
+void boottime_end(int id) {
+    if (id < 0 || (uint32_t)id >= BOOTTIME_MAX_EVENTS) return;
+
+    uint64_t now = rdtsc();
+    events[id].end_tsc = now;
+    clock_reference(now);
+
+    uint32_t cpu = this_cpu_id();
+    if (open_event[cpu] == id) open_event[cpu] = events_prev[id];
+}
+
+int boottime_current(void) {
+    if (!base_tsc) return BOOTTIME_NONE;
+    return open_event[this_cpu_id()];
+}
+
+void boottime_record(const char* name, int parent, uint32_t cpu, uint64_t start_tsc, uint64_t end_tsc) {
+    if (!base_tsc) return;
+
+    int id = event_alloc(name, parent, cpu, start_tsc);
+    if (id == BOOTTIME_NONE) return;
+    events_prev[id] = BOOTTIME_NONE;
+    events[id].end_tsc = end_tsc;
+}
+
+uint32_t boottime_count(void) {
+    uint32_t n = __atomic_load_n(&events_used, __ATOMIC_ACQUIRE);
+    return n < BOOTTIME_MAX_EVENTS ? n : BOOTTIME_MAX_EVENTS;
+}
+
+const boottime_event_t* boottime_get(uint32_t index) {
+    return index < boottime_count() ? &events[index] : NULL;
+}
+
+uint64_t boottime_base_tsc(void) {
+    return base_tsc;
+}
+
+// The clocksource's rate when it was calibrated; otherwise measured once, from the reference
+// taken during boot if it spans long enough or else over a 50ms window
+uint64_t boottime_tsc_hz(void) {
+    static uint64_t tsc_hz;
+    if (tsc_hz) return tsc_hz;
+    if (tsc_available()) return tsc_get_hz();
+
+    uint64_t ms = apic_get_uptime_ms();
+    if (ref_ms && ms >= ref_ms + 100) {
+        tsc_hz = (rdtsc() - ref_tsc) * 1000 / (ms - ref_ms);
+        return tsc_hz;
+    }
+
+    // A stopped tick must not hang the caller
+    uint64_t limit = rdtsc() + 4000000000ULL;
+    while (apic_get_uptime_ms() == ms)
+        if (rdtsc() > limit) return 0;
+
+    uint64_t t0 = rdtsc();
+    ms = apic_get_uptime_ms();
+    while (apic_get_uptime_ms() < ms + 50)
+        if (rdtsc() > limit) return 0;
+    tsc_hz = (rdtsc() - t0) * 1000 / 50;
+    return tsc_hz;
+}
+
+uint64_t boottime_cycles_to_us(uint64_t cycles) {
+    uint64_t hz = boottime_tsc_hz();
+    return hz ? cycles * 1000000 / hz : 0;
+}
+
+static uint64_t event_cycles(const boottime_event_t* ev) {
+    return ev->end_tsc > ev->start_tsc ? ev->end_tsc - ev->start_tsc : 0;
+}
+
+static size_t append_str(char* buf, size_t pos, size_t cap, const char* s) {
+    while (*s && pos + 1 < cap) buf[pos++] = *s++;
+    buf[pos] = '\0';
+    return pos;
+}
+
+static size_t append_u64(char* buf, size_t pos, size_t cap, uint64_t v) {
+    char tmp[21];
+    int n = 0;
+    do { tmp[n++] = '0' + v % 10; v /= 10; } while (v);
+    while (n > 0 && pos + 1 < cap) buf[pos++] = tmp[--n];
+    buf[pos] = '\0';
+    return pos;
+}
+
+void boottime_dump_folded(void) {
+    uint32_t count = boottime_count();
+    bool in_us = boottime_tsc_hz() != 0;
+
+    uint64_t flags = log_lock_acquire();
+    serial_print(in_us ? "# boottime folded stacks, self time in us\n"
+                       : "# boottime folded stacks, self time in cycles\n");
+
+    for (uint32_t i = 0; i < count; i++) {
+        const boottime_event_t* ev = &events[i];
+        if (!ev->end_tsc) continue;
+
+        // Children on other CPUs overlap the parent rather than being part of it
+        uint64_t self = event_cycles(ev);
+        for (uint32_t j = 0; j < count; j++) {
+            const boottime_event_t* child = &events[j];
+            if (child->parent != (int32_t)i || child->cpu != ev->cpu || !child->end_tsc) continue;
+            uint64_t c = event_cycles(child);
+            self = self > c ? self - c : 0;
+        }
+
+        int32_t chain[BOOTTIME_MAX_DEPTH];
+        int depth = 0;
+        for (int32_t at = (int32_t)i; at != BOOTTIME_NONE && depth < BOOTTIME_MAX_DEPTH; at = events[at].parent)
+            chain[depth++] = at;
+
+        char line[BOOTTIME_MAX_DEPTH * BOOTTIME_NAME_LEN + 32];
+        size_t pos = 0;
+        line[0] = '\0';
+        while (depth-- > 0) {
+            pos = append_str(line, pos, sizeof(line), events[chain[depth]].name);
+            if (depth) pos = append_str(line, pos, sizeof(line), ";");
+        }
+        pos = append_str(line, pos, sizeof(line), " ");
+        pos = append_u64(line, pos, sizeof(line), in_us ? boottime_cycles_to_us(self) : self);
+        append_str(line, pos, sizeof(line), "\n");
+        serial_print(line);
+    }
+
+    log_lock_release(flags);
+}
@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/kernel/hrtimer.h>
+#include <core/arch/spinlock.h>
+#include <core/arch/apic.h>
+#include <core/arch/softirq.h>
+#include <stddef.h>
+
+// Binary min-heap on `expires`; each timer remembers its slot so cancel is O(log n)
+static hrtimer_t*  heap[HRTIMER_MAX];
+static uint32_t    heap_count;
+static spinlock_t  hrtimer_lock;
+
+static inline void heap_set(uint32_t i, hrtimer_t* t) {
+    heap[i] = t;
+    t->slot = (int32_t)i;
+}
+
+static void heap_sift_up(uint32_t i) {
+    hrtimer_t* t = heap[i];
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (heap[parent]->expires <= t->expires) break;
+        heap_set(i, heap[parent]);
+        i = parent;
+    }
+    heap_set(i, t);
+}
+
+static void heap_sift_down(uint32_t i) {
+    hrtimer_t* t = heap[i];
+    for (;;) {
+        uint32_t child = 2 * i + 1;
+        if (child >= heap_count) break;
+        if (child + 1 < heap_count && heap[child + 1]->expires < heap[child]->expires)
+            child++;
+        if (t->expires <= heap[child]->expires) break;
+        heap_set(i, heap[child]);
+        i = child;
+    }
+    heap_set(i, t);
+}
+
+static void heap_remove(hrtimer_t* t) {
+    uint32_t i = (uint32_t)t->slot;
+    t->slot = -1;
+    if (--heap_count == i) return;
+
+    heap_set(i, heap[heap_count]);
+    if (i > 0 && heap[(i - 1) / 2]->expires > heap[i]->expires)
+        heap_sift_up(i);
+    else
+        heap_sift_down(i);
+}
+
+// Raised by the timer interrupt once the earliest timer is due
+static void hrtimer_softirq(void) {
+    hrtimer_run_expired(ktime_get());
+    apic_timer_reprogram();
+}
+
+void hrtimers_init(void) {
+    spinlock_init_named(&hrtimer_lock, "hrtimer");
+    heap_count = 0;
+    softirq_register(SOFTIRQ_HRTIMER, hrtimer_softirq);
+}
+
+void hrtimer_init(hrtimer_t* timer, hrtimer_fn_t fn, void* data) {
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->data = data;
+    timer->slot = -1;
+}
+
+int hrtimer_start(hrtimer_t* timer, ktime_t expires) {
+    uint64_t flags = spinlock_acquire_irqsave(&hrtimer_lock);
+
+    if (timer->slot >= 0) heap_remove(timer);
+    if (heap_count == HRTIMER_MAX) {
+        spinlock_release_irqrestore(&hrtimer_lock, flags);
+        return -1;
+    }
+
+    timer->expires = expires;
+    heap[heap_count] = timer;
+    heap_sift_up(heap_count++);
+    bool first = heap[0] == timer;
+
+    spinlock_release_irqrestore(&hrtimer_lock, flags);
+
+    if (first)
+        apic_timer_reprogram();
+    return 0;
+}
+
+bool hrtimer_cancel(hrtimer_t* timer) {
+    uint64_t flags = spinlock_acquire_irqsave(&hrtimer_lock);
+    bool queued = timer->slot >= 0;
+    if (queued) heap_remove(timer);
+    spinlock_release_irqrestore(&hrtimer_lock, flags);
+    return queued;
+}
+
+bool hrtimer_pending(const hrtimer_t* timer) {
+    return __atomic_load_n(&timer->slot, __ATOMIC_RELAXED) >= 0;
+}
+
+ktime_t hrtimer_next_expiry(void) {
+    uint64_t flags = spinlock_acquire_irqsave(&hrtimer_lock);
+    ktime_t next = heap_count ? heap[0]->expires : KTIME_MAX;
+    spinlock_release_irqrestore(&hrtimer_lock, flags);
+    return next;
+}
+
+void hrtimer_run_expired(ktime_t now) {
+    for (;;) {
+        uint64_t flags = spinlock_acquire_irqsave(&hrtimer_lock);
+        if (heap_count == 0 || heap[0]->expires > now) {
+            spinlock_release_irqrestore(&hrtimer_lock, flags);
+            return;
+        }
+        hrtimer_t* t = heap[0];
+        heap_remove(t);
+        spinlock_release_irqrestore(&hrtimer_lock, flags);
+
+        // Unlocked, so the callback may re-arm its own timer
+        t->fn(t);
+    }
+}
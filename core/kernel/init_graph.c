@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/kernel/init_graph.h>
+#include <core/kernel/kstd.h>
+#include <core/kernel/boottime.h>
+#include <core/arch/work_queue.h>
+#include <core/arch/percpu.h>
+#include <core/arch/pause.h>
+#include <log.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// One graph runs at a time: boot is the only user
+static init_stage_t*     graph_stages;
+static uint32_t          graph_count;
+static volatile uint32_t graph_remaining;
+static int               graph_boottime;   // Event the stages are timed under, whichever CPU runs them
+
+static void stage_submit(init_stage_t* stage);
+
+static void stage_run(void* arg) {
+    init_stage_t* stage = arg;
+    stage->cpu = this_cpu_id();
+    int ev = boottime_begin_under(stage->name, graph_boottime);
+    stage->fn();
+    boottime_end(ev);
+    if (stage->message) kprint(stage->message, 7);
+
+    uint32_t bit = INIT_DEP((uint32_t)(stage - graph_stages));
+    for (uint32_t i = 0; i < graph_count; i++) {
+        init_stage_t* next = &graph_stages[i];
+        if ((next->deps & bit) && __atomic_sub_fetch(&next->waiting, 1, __ATOMIC_ACQ_REL) == 0)
+            stage_submit(next);
+    }
+
+    __atomic_sub_fetch(&graph_remaining, 1, __ATOMIC_RELEASE);
+}
+
+static void stage_submit(init_stage_t* stage) {
+    // Without memory for a work item the stage still has to run, so run it here
+    if (wq_submit_any(stage_run, stage) != 0)
+        stage_run(stage);
+}
+
+// Kahn's algorithm on a copy of the counts; every stage must become ready eventually
+static int graph_check(init_stage_t* stages, uint32_t count) {
+    uint32_t done = 0;
+    for (uint32_t round = 0; round < count; round++) {
+        bool progress = false;
+        for (uint32_t i = 0; i < count; i++) {
+            if (done & INIT_DEP(i)) continue;
+            if ((stages[i].deps & ~done) == 0) {
+                done |= INIT_DEP(i);
+                progress = true;
+            }
+        }
+        if (!progress) break;
+    }
+    return done == (count == INIT_GRAPH_MAX ? UINT32_MAX : INIT_DEP(count) - 1) ? 0 : -1;
+}
+
+int init_graph_run(init_stage_t* stages, uint32_t count) {
+    if (!stages || count == 0) return 0;
+    if (count > INIT_GRAPH_MAX || graph_check(stages, count) != 0) {
+        LOG_ERROR("init: stage graph is too large or has a cycle\n");
+        return -1;
+    }
+
+    graph_stages = stages;
+    graph_count = count;
+    graph_remaining = count;
+    graph_boottime = boottime_current();
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t deps = stages[i].deps, n = 0;
+        for (; deps; deps &= deps - 1) n++;
+        stages[i].waiting = n;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (stages[i].waiting == 0)
+            stage_submit(&stages[i]);
+    }
+
+    while (__atomic_load_n(&graph_remaining, __ATOMIC_ACQUIRE) > 0) {
+        if (wq_run(this_cpu_id()) == 0)
+            cpu_relax();
+    }
+
+    graph_stages = NULL;
+    graph_count = 0;
+    return 0;
+}
@@ -14,7 +14,10 @@
 #include <core/drivers/ide.h>
 #include <core/drivers/nvme.h>
 #include <core/drivers/ahci.h>
+#include <core/drivers/pci.h>
 #include <core/kernel/shell.h>
+#include <core/kernel/init_graph.h>
+#include <core/kernel/boottime.h>
 #include <log.h>
 #include <core/fs/iso9660.h>
 #include <core/fs/vfs.h>
@@ -28,10 +31,14 @@
 #include <core/kernel/elf.h>
 #include <core/arch/idt.h>
 #include <core/arch/apic.h>
+#include <core/arch/tsc.h>
+#include <core/kernel/hrtimer.h>
 #include <core/arch/smp.h>
+#include <core/arch/percpu.h>
 #include <core/arch/work_queue.h>
 #include <core/kernel/mem/slab.h>
 #include <core/kernel/mem/cpu_pool.h>
+#include <core/kernel/mem/scratch.h>
 #include <core/arch/panic.h>
 #include <core/arch/idt.h>
 #include <core/arch/rtc.h>
@@ -109,6 +116,16 @@ static void init_interrupts(void) {
     kprint(":: Interrupt descriptor table initialized\n", 7);
 }
 
+static void init_clocksource(void) {
+    tsc_init();
+    hrtimers_init();
+    if (tsc_available()) {
+        kprint(":: TSC clocksource calibrated\n", 7);
+    } else {
+        kprint(":: TSC calibration failed, using the APIC tick\n", 7);
+    }
+}
+
 static void init_apic(void) {
     if (apic_init()) {
         kprint(":: APIC initialized\n", 7);
@@ -133,20 +150,47 @@ static void init_nvm(void) {
 }
 
 static void init_multiprocessing(void) {
-    smp_init(smp_request.response);
-    kprint(":: SMP initialized\n", 7);
-    
+    // APs go straight into the work queue loop, so it must exist first
     wq_init();
     kprint(":: Work queue initialized\n", 7);
+
+    smp_init(smp_request.response);
+    kprint(":: SMP initialized\n", 7);
     
     slab_cpu_init(0);
     kprint(":: Slab allocator initialized\n", 7);
     
     cpu_pool_init(0);
     kprint(":: CPU pool initialized\n", 7);
+
+    scratch_cpu_init(0);
 }
 
 
+enum {
+    STAGE_PCI,
+    STAGE_IDE,
+    STAGE_NVME,
+    STAGE_AHCI,
+    STAGE_FAT32,
+    STAGE_EXT2,
+    STAGE_COUNT
+};
+
+/*
+ * Controller probing is mostly spent polling hardware, so independent
+ * probes overlap on the APs. Both filesystem drivers fill the unlocked
+ * registered_fs table, hence the edge between them.
+ */
+static init_stage_t storage_stages[STAGE_COUNT] = {
+    [STAGE_PCI]   = { "pci",   pci_init,   ":: PCI bus enumerated\n",          0 },
+    [STAGE_IDE]   = { "ide",   ide_init,   ":: IDE controller initialized\n",  0 },
+    [STAGE_NVME]  = { "nvme",  nvme_init,  ":: NVMe controller initialized\n", INIT_DEP(STAGE_PCI) },
+    [STAGE_AHCI]  = { "ahci",  ahci_init,  ":: AHCI controller initialized\n", INIT_DEP(STAGE_PCI) },
+    [STAGE_FAT32] = { "fat32", fat32_init, ":: FAT32 filesystem initialized\n", 0 },
+    [STAGE_EXT2]  = { "ext2",  ext2_init,  ":: Ext2 filesystem initialized\n",  INIT_DEP(STAGE_FAT32) },
+};
+
 static void init_filesystems(void) {
     vfs_init();
     kprint(":: Virtual filesystem initialized\n", 7);
@@ -154,20 +198,7 @@ static void init_filesystems(void) {
     block_init();
     kprint(":: Block subsystem initialized\n", 7);
     
-    ide_init();
-    kprint(":: IDE controller initialized\n", 7);
-    
-    nvme_init();
-    kprint(":: NVMe controller initialized\n", 7);
-    
-    ahci_init();
-    kprint(":: AHCI controller initialized\n", 7);
-    
-    fat32_init();
-    kprint(":: FAT32 filesystem initialized\n", 7);
-    
-    ext2_init();
-    kprint(":: Ext2 filesystem initialized\n", 7);
+    init_graph_run(storage_stages, STAGE_COUNT);
     
     block_dev_vfs_init();
     kprint(":: Block device VFS layer initialized\n", 7);
@@ -254,9 +285,11 @@ static void load_kernel_modules(void) {
                 while (*n) *p++ = *n++;
                 *p = '\0';
 
+                int ev = boottime_begin(name);
                 if (kmodule_load(path) == 0) {
                     loaded++;
                 }
+                boottime_end(ev);
             }
         }
     } else {
@@ -273,33 +306,47 @@ void limine_smp_entry(struct limine_mp_info *info) {
 }
 
 
+// Runs one boot step as a named interval on the /proc/boottime timeline
+static void boot_step(const char* name, void (*fn)(void)) {
+    int ev = boottime_begin(name);
+    fn();
+    boottime_end(ev);
+}
+
 void kmain() {
+    // Per-CPU area first: allocator fast paths read the CPU id through GS
+    percpu_init(0, 0, NULL);
+    boottime_init();
+    int boot_ev = boottime_begin("boot");
+
     // Early initialization
-    init_serial_port();
-    init_video();
+    boot_step("serial", init_serial_port);
+    boot_step("video", init_video);
     
     // Core system initialization
-    init_memory();
-    init_interrupts();
-    init_apic();
-    init_syslog();
-    init_keyboard();
-    init_nvm();
-    init_multiprocessing();
-    init_timer_subsystem();
+    boot_step("memory", init_memory);
+    boot_step("interrupts", init_interrupts);
+    boot_step("clocksource", init_clocksource);
+    boot_step("apic", init_apic);
+    boot_step("syslog", init_syslog);
+    boot_step("keyboard", init_keyboard);
+    boot_step("nvm", init_nvm);
+    boot_step("smp", init_multiprocessing);
+    boot_step("timer", init_timer_subsystem);
     
     // Filesystem initialization
-    init_filesystems();
+    boot_step("filesystems", init_filesystems);
     
     // Boot modules and root filesystem
-    init_boot_modules();
+    boot_step("boot_modules", init_boot_modules);
 
     // Display banner
     show_banner();
 
-    load_kernel_modules();
+    boot_step("kernel_modules", load_kernel_modules);
 
     shell_init();
+    boottime_end(boot_ev);
     shell_run();
     
     // Work loop
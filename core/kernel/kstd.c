@@ -2,6 +2,8 @@
 
 #include <core/kernel/kstd.h>
 #include <core/kernel/tty.h>
+#include <core/arch/spinlock.h>
+#include <core/arch/softirq.h>
 #include <stdint.h>
 
 void reverse(char* str, int length) {
@@ -224,6 +226,25 @@ int memcmp(const void* s1, const void* s2, size_t n) {
     return 0;
 }
 
+// Boot stages and APs print concurrently; these keep messages and the log file whole
+static spinlock_t kprint_lock;
+static spinlock_t log_lock;
+
+uint64_t log_lock_acquire(void) {
+    return spinlock_acquire_irqsave(&log_lock);
+}
+
+void log_lock_release(uint64_t flags) {
+    spinlock_release_irqrestore(&log_lock, flags);
+}
+
+// The log file is written with interrupts on and outside softirq context; ISRs and handlers only print
+bool log_may_publish(void) {
+    uint64_t rflags;
+    __asm__ volatile("pushfq; popq %0" : "=r"(rflags));
+    return (rflags & (1ULL << 9)) && !in_softirq();
+}
+
 void kprint(const char *str, int color) {
     char esc_buf[16];
     
@@ -256,9 +277,11 @@ void kprint(const char *str, int color) {
     *ptr++ = 'm';
     *ptr = '\0';
     
+    uint64_t flags = spinlock_acquire_irqsave(&kprint_lock);
     tty_puts(esc_buf);
 
     tty_puts(str);
     
     tty_puts("\033[0m");
+    spinlock_release_irqrestore(&kprint_lock, flags);
 }
\ No newline at end of file
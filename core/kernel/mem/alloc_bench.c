@@ -0,0 +1,515 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/kernel/mem/alloc_bench.h>
+#include <core/kernel/mem/allocator.h>
+#include <core/kernel/mem/buddy.h>
+#include <core/kernel/mem/vmm.h>
+#include <core/kernel/kstd.h>
+#include <core/arch/work_queue.h>
+#include <core/arch/smp.h>
+#include <core/arch/apic.h>
+#include <core/arch/delay.h>
+#include <core/arch/tsc.h>
+#include <log.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+enum {
+    BENCH_CHURN,        // kmalloc/kfree of one size in a tight loop
+    BENCH_MIXED,        // Random replacement over a working set of mixed sizes
+    BENCH_XCPU,         // One CPU allocates, its partner frees
+    BENCH_LARGE,        // Multi-page blocks of random order with holes punched in
+    BENCH_WORKLOADS
+};
+
+static const char* const bench_names[BENCH_WORKLOADS] = {
+    "churn-64", "mixed", "cross-cpu", "large-order",
+};
+
+// Single producer, single consumer; indices only ever grow
+typedef struct {
+    void*             slots[BENCH_RING_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t done;
+} bench_ring_t;
+
+typedef struct bench_worker {
+    struct bench_run* run;
+    uint32_t      index;
+    uint32_t      rng;
+    uint64_t      ops;
+    uint64_t      failures;
+    uint64_t      start_tsc;
+    uint64_t      end_tsc;
+    uint32_t*     samples;
+    uint32_t      sample_count;
+    void**        slots;
+    bench_ring_t* ring;
+} __attribute__((aligned(64))) bench_worker_t;
+
+typedef struct bench_run {
+    int               workload;
+    uint32_t          workers;
+    volatile uint32_t ready;
+    volatile uint32_t go;
+    volatile uint32_t finished;
+    volatile uint32_t stop;     // Set when a partner never started; producers give up
+    bench_worker_t    w[BENCH_MAX_WORKERS];
+} bench_run_t;
+
+static bench_run_t bench;
+static uint32_t    bench_cpus[BENCH_MAX_WORKERS];
+static uint64_t    tsc_hz;
+static volatile uint32_t bench_busy;
+
+static inline uint32_t bench_rand(bench_worker_t* w) {
+    uint32_t x = w->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    w->rng = x;
+    return x;
+}
+
+static inline void bench_sample(bench_worker_t* w, uint64_t op, uint64_t cycles) {
+    uint64_t stride = BENCH_ITERATIONS / BENCH_SAMPLES;
+    if (stride == 0) stride = 1;
+    if (op % stride == 0 && w->sample_count < BENCH_SAMPLES)
+        w->samples[w->sample_count++] = cycles > UINT32_MAX ? UINT32_MAX : (uint32_t)cycles;
+}
+
+// 70% slab sizes, 20% the larger slab classes, 10% page-class blocks
+static size_t bench_mixed_size(bench_worker_t* w) {
+    uint32_t r = bench_rand(w);
+    uint32_t pick = r % 10;
+    if (pick < 7) return 8 + (r >> 8) % 249;
+    if (pick < 9) return 257 + (r >> 8) % 768;
+    return 1025 + (r >> 8) % (16 * 1024 - 1025);
+}
+
+static void bench_churn(bench_worker_t* w) {
+    for (uint64_t i = 0; i < BENCH_ITERATIONS; i++) {
+        uint64_t t0 = rdtsc();
+        uint8_t* p = kmalloc(64);
+        if (!p) { w->failures++; continue; }
+        p[0] = (uint8_t)i;
+        kfree(p);
+        bench_sample(w, i, rdtsc() - t0);
+        w->ops += 2;
+    }
+}
+
+static void bench_mixed(bench_worker_t* w) {
+    for (uint32_t i = 0; i < BENCH_MIXED_SLOTS; i++)
+        w->slots[i] = NULL;
+
+    for (uint64_t i = 0; i < BENCH_ITERATIONS; i++) {
+        uint32_t slot = bench_rand(w) % BENCH_MIXED_SLOTS;
+        size_t size = bench_mixed_size(w);
+
+        uint64_t t0 = rdtsc();
+        if (w->slots[slot]) {
+            kfree(w->slots[slot]);
+            w->ops++;
+        }
+        uint8_t* p = kmalloc(size);
+        uint64_t t1 = rdtsc();
+
+        w->slots[slot] = p;
+        if (!p) { w->failures++; continue; }
+        p[0] = p[size - 1] = (uint8_t)i;
+        bench_sample(w, i, t1 - t0);
+        w->ops++;
+    }
+
+    for (uint32_t i = 0; i < BENCH_MIXED_SLOTS; i++) {
+        if (w->slots[i]) {
+            kfree(w->slots[i]);
+            w->slots[i] = NULL;
+            w->ops++;
+        }
+    }
+}
+
+static void bench_produce(bench_worker_t* w) {
+    static const size_t sizes[4] = {32, 128, 512, 2048};
+    bench_ring_t* ring = w->ring;
+
+    for (uint64_t i = 0; i < BENCH_ITERATIONS; i++) {
+        uint64_t t0 = rdtsc();
+        uint8_t* p = kmalloc(sizes[i & 3]);
+        bench_sample(w, i, rdtsc() - t0);
+        if (!p) { w->failures++; continue; }
+        p[0] = (uint8_t)i;
+
+        uint32_t tail = ring->tail;
+        while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= BENCH_RING_SIZE) {
+            if (__atomic_load_n(&w->run->stop, __ATOMIC_ACQUIRE)) {
+                kfree(p);
+                goto done;
+            }
+            cpu_relax();
+        }
+        ring->slots[tail % BENCH_RING_SIZE] = p;
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        w->ops++;
+    }
+done:
+    __atomic_store_n(&ring->done, 1, __ATOMIC_RELEASE);
+}
+
+static void bench_consume(bench_worker_t* w) {
+    bench_ring_t* ring = w->ring;
+    uint64_t n = 0;
+
+    while (1) {
+        uint32_t head = ring->head;
+        if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+            if (__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) &&
+                head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+                break;
+            cpu_relax();
+            continue;
+        }
+        void* p = ring->slots[head % BENCH_RING_SIZE];
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+        uint64_t t0 = rdtsc();
+        kfree(p);
+        bench_sample(w, n++, rdtsc() - t0);
+        w->ops++;
+    }
+}
+
+/*
+ * Fill with blocks of order 0..5, free every other one, then try to allocate
+ * order 6..9 blocks out of what is left. Failures there are the interesting
+ * number, not an error.
+ */
+static void bench_large(bench_worker_t* w) {
+    uint32_t rounds = BENCH_ITERATIONS / (BENCH_LARGE_BLOCKS * 2);
+    if (rounds == 0) rounds = 1;
+
+    for (uint32_t r = 0; r < rounds; r++) {
+        uint32_t count = 0;
+        for (; count < BENCH_LARGE_BLOCKS; count++) {
+            uint32_t order = bench_rand(w) % 6;
+            uint64_t t0 = rdtsc();
+            void* p = kalloc_pages(order, 0, NULL);
+            bench_sample(w, w->ops, rdtsc() - t0);
+            if (!p) { w->failures++; break; }
+            w->slots[count] = p;
+            w->ops++;
+        }
+
+        for (uint32_t i = 0; i < count; i += 2) {
+            kfree_pages(w->slots[i]);
+            w->slots[i] = NULL;
+            w->ops++;
+        }
+
+        for (uint32_t i = 0; i < count; i += 2) {
+            uint32_t order = 6 + bench_rand(w) % (BENCH_FRAG_ORDER - 5);
+            uint64_t t0 = rdtsc();
+            w->slots[i] = kalloc_pages(order, 0, NULL);
+            bench_sample(w, w->ops, rdtsc() - t0);
+            if (!w->slots[i]) w->failures++;
+            else w->ops++;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            if (w->slots[i]) {
+                kfree_pages(w->slots[i]);
+                w->slots[i] = NULL;
+                w->ops++;
+            }
+        }
+    }
+}
+
+static void bench_worker_fn(void* arg) {
+    bench_worker_t* w = (bench_worker_t*)arg;
+    bench_run_t* run = w->run;
+
+    __atomic_fetch_add(&run->ready, 1, __ATOMIC_ACQ_REL);
+    while (!__atomic_load_n(&run->go, __ATOMIC_ACQUIRE))
+        cpu_relax();
+
+    w->start_tsc = rdtsc();
+    switch (run->workload) {
+        case BENCH_CHURN: bench_churn(w); break;
+        case BENCH_MIXED: bench_mixed(w); break;
+        case BENCH_XCPU:
+            if (w->index & 1) bench_consume(w);
+            else              bench_produce(w);
+            break;
+        case BENCH_LARGE: bench_large(w); break;
+    }
+    w->end_tsc = rdtsc();
+
+    __atomic_fetch_add(&run->finished, 1, __ATOMIC_ACQ_REL);
+}
+
+// Heapsort: no recursion and no extra memory for up to 128K samples
+static void bench_sort(uint32_t* a, uint32_t n) {
+    for (uint32_t start = n / 2; start-- > 0; ) {
+        uint32_t root = start;
+        while (2 * root + 1 < n) {
+            uint32_t child = 2 * root + 1;
+            if (child + 1 < n && a[child] < a[child + 1]) child++;
+            if (a[root] >= a[child]) break;
+            uint32_t t = a[root]; a[root] = a[child]; a[child] = t;
+            root = child;
+        }
+    }
+    for (uint32_t end = n; end-- > 1; ) {
+        uint32_t t = a[0]; a[0] = a[end]; a[end] = t;
+        uint32_t root = 0;
+        while (2 * root + 1 < end) {
+            uint32_t child = 2 * root + 1;
+            if (child + 1 < end && a[child] < a[child + 1]) child++;
+            if (a[root] >= a[child]) break;
+            t = a[root]; a[root] = a[child]; a[child] = t;
+            root = child;
+        }
+    }
+}
+
+static void bench_print_u64(uint64_t value, int width) {
+    char digits[24];
+    int len = 0;
+    do {
+        digits[len++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    char out[32];
+    int pos = 0;
+    for (int pad = width - len; pad > 0 && pos < 16; pad--)
+        out[pos++] = ' ';
+    while (len > 0)
+        out[pos++] = digits[--len];
+    out[pos] = '\0';
+    kprint(out, 7);
+}
+
+static uint64_t bench_cycles_to_ns(uint64_t cycles) {
+    return tsc_hz ? cycles * 1000000000ULL / tsc_hz : cycles;
+}
+
+// TSC rate from the LAPIC millisecond tick; 0 if the tick is not running
+static uint64_t bench_calibrate_tsc(void) {
+    uint64_t limit = rdtsc() + 4000000000ULL;
+    uint64_t ms = apic_get_uptime_ms();
+    while (apic_get_uptime_ms() == ms)
+        if (rdtsc() > limit) return 0;
+
+    uint64_t t0 = rdtsc();
+    ms = apic_get_uptime_ms();
+    while (apic_get_uptime_ms() < ms + 50)
+        if (rdtsc() > limit) return 0;
+    return (rdtsc() - t0) * 1000 / 50;
+}
+
+uint32_t alloc_bench_fragmentation(void) {
+    buddy_allocator_t* buddy = slab_get_buddy();
+    uint64_t free_bytes = 0, usable = 0;
+    uint32_t min_order = BUDDY_MIN_ORDER + BENCH_FRAG_ORDER;
+
+    for (uint32_t z = 0; z < buddy_zone_count(buddy); z++) {
+        size_t counts[BUDDY_MAX_ORDER + 1];
+        buddy_zone_free_areas(buddy_get_zone(buddy, z), counts);
+        for (uint32_t order = BUDDY_MIN_ORDER; order <= BUDDY_MAX_ORDER; order++) {
+            uint64_t bytes = (uint64_t)counts[order] * BUDDY_BLOCK_SIZE(order);
+            free_bytes += bytes;
+            if (order >= min_order) usable += bytes;
+        }
+    }
+    if (free_bytes == 0) return 100;
+    return (uint32_t)(100 - usable * 100 / free_bytes);
+}
+
+static bool bench_dispatch(uint32_t workers) {
+    bench.ready = 0;
+    bench.go = 0;
+    bench.finished = 0;
+    bench.stop = 0;
+    bench.workers = workers;
+
+    // Without APs the BSP runs the single worker itself
+    if (bench_cpus[0] == 0) {
+        bench.go = 1;
+        bench_worker_fn(&bench.w[0]);
+        return true;
+    }
+
+    for (uint32_t i = 0; i < workers; i++) {
+        if (wq_submit(bench_cpus[i], bench_worker_fn, &bench.w[i]) != 0) {
+            LOG_WARN("membench: could not queue work on cpu%u\n", bench_cpus[i]);
+            // Release whatever was queued; a producer left without its consumer stops early
+            __atomic_store_n(&bench.stop, 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&bench.go, 1, __ATOMIC_RELEASE);
+            while (__atomic_load_n(&bench.finished, __ATOMIC_ACQUIRE) < i)
+                cpu_relax();
+            if (bench.workload == BENCH_XCPU && (i & 1)) {
+                bench_ring_t* ring = bench.w[i - 1].ring;
+                for (uint32_t head = ring->head; head != ring->tail; head++)
+                    kfree(ring->slots[head % BENCH_RING_SIZE]);
+            }
+            return false;
+        }
+    }
+
+    while (__atomic_load_n(&bench.ready, __ATOMIC_ACQUIRE) < workers)
+        cpu_relax();
+    __atomic_store_n(&bench.go, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&bench.finished, __ATOMIC_ACQUIRE) < workers)
+        cpu_relax();
+    return true;
+}
+
+static void bench_report(uint32_t workers, uint32_t* merged) {
+    uint64_t ops = 0, failures = 0, first = UINT64_MAX, last = 0;
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < workers; i++) {
+        bench_worker_t* w = &bench.w[i];
+        ops += w->ops;
+        failures += w->failures;
+        if (w->start_tsc < first) first = w->start_tsc;
+        if (w->end_tsc > last) last = w->end_tsc;
+        memcpy(merged + count, w->samples, w->sample_count * sizeof(uint32_t));
+        count += w->sample_count;
+    }
+
+    uint64_t cycles = last > first ? last - first : 1;
+    uint64_t rate = tsc_hz ? ops * tsc_hz / cycles : ops * 1000000ULL / cycles;
+
+    bench_print_u64(workers, 6);
+    bench_print_u64(rate, 13);
+    if (count > 0) {
+        bench_sort(merged, count);
+        bench_print_u64(bench_cycles_to_ns(merged[count / 2]), 9);
+        bench_print_u64(bench_cycles_to_ns(merged[(uint64_t)count * 90 / 100]), 9);
+        bench_print_u64(bench_cycles_to_ns(merged[(uint64_t)count * 99 / 100]), 9);
+        bench_print_u64(bench_cycles_to_ns(merged[count - 1]), 10);
+    } else {
+        kprint("        -        -        -         -", 7);
+    }
+    bench_print_u64(failures, 7);
+    kprint("\n", 7);
+}
+
+static void bench_print_frag(const char* label) {
+    kprint(label, 7);
+    bench_print_u64(alloc_bench_fragmentation(), 0);
+    kprint("% of free memory unusable for 2 MiB blocks\n", 7);
+}
+
+void alloc_bench_run(void) {
+    if (__atomic_exchange_n(&bench_busy, 1, __ATOMIC_ACQ_REL)) {
+        kprint("membench: already running\n", 4);
+        return;
+    }
+
+    // Workers run on APs only, so the BSP stays free to coordinate
+    uint32_t ap_count = 0;
+    for (uint32_t i = 1; i < cpu_count && ap_count < BENCH_MAX_WORKERS; i++)
+        if (cpus[i].state == CPU_STATE_ONLINE)
+            bench_cpus[ap_count++] = i;
+    uint32_t max_workers = ap_count ? ap_count : 1;
+    if (!ap_count) bench_cpus[0] = 0;
+
+    size_t merged_size = (size_t)max_workers * BENCH_SAMPLES * sizeof(uint32_t);
+    uint32_t* merged = vmalloc(merged_size);
+    if (!merged) merged = kmalloc(merged_size);
+    bench_ring_t* rings = kmalloc(sizeof(bench_ring_t) * ((max_workers + 1) / 2));
+    bool ok = merged && rings;
+    for (uint32_t i = 0; i < max_workers && ok; i++) {
+        bench.w[i].samples = kalloc_pages(1, 0, NULL);   // BENCH_SAMPLES * 4 bytes
+        bench.w[i].slots   = kalloc_pages(0, 0, NULL);   // 512 pointers
+        ok = bench.w[i].samples && bench.w[i].slots;
+    }
+    if (!ok) {
+        kprint("membench: out of memory for result buffers\n", 4);
+        goto out;
+    }
+
+    tsc_hz = tsc_available() ? tsc_get_hz() : bench_calibrate_tsc();
+
+    kprint("\n=== Allocator benchmark ===\n", 11);
+    kprint("workers: ", 7);
+    bench_print_u64(max_workers, 0);
+    kprint(ap_count ? " AP(s)" : " (BSP only)", 7);
+    kprint(", TSC ", 7);
+    if (tsc_hz) {
+        bench_print_u64(tsc_hz / 1000000, 0);
+        kprint(" MHz\n", 7);
+    } else {
+        kprint("uncalibrated: rates are ops/Mcycle, latencies in cycles\n", 6);
+    }
+    bench_print_frag("fragmentation before: ");
+
+    for (int wl = 0; wl < BENCH_WORKLOADS; wl++) {
+        kprint("\n[", 7);
+        kprint(bench_names[wl], 11);
+        kprint("]\n  cpus        ops/s   p50 ns   p90 ns   p99 ns    max ns   fail\n", 7);
+
+        // 1, 2, 4, ... and finally every worker; cross-cpu needs whole pairs
+        uint32_t last = 0;
+        for (uint32_t n = 1; ; n = (n * 2 < max_workers) ? n * 2 : max_workers) {
+            uint32_t workers = (wl == BENCH_XCPU) ? (n & ~1u) : n;
+            if (workers == 0 || workers == last) {
+                if (n == max_workers) break;
+                continue;
+            }
+            last = workers;
+
+            bench.workload = wl;
+            for (uint32_t i = 0; i < workers; i++) {
+                bench_worker_t* w = &bench.w[i];
+                w->run = &bench;
+                w->index = i;
+                w->rng = 0x9E3779B9u * (i + 1) + (uint32_t)rdtsc();
+                if (!w->rng) w->rng = 1;
+                w->ops = 0;
+                w->failures = 0;
+                w->sample_count = 0;
+                w->ring = &rings[i / 2];
+            }
+            for (uint32_t i = 0; i < workers / 2; i++) {
+                rings[i].head = 0;
+                rings[i].tail = 0;
+                rings[i].done = 0;
+            }
+
+            if (!bench_dispatch(workers)) {
+                kprint("membench: run aborted\n", 4);
+                goto out;
+            }
+            bench_report(workers, merged);
+            if (n == max_workers) break;
+        }
+        if (wl == BENCH_XCPU && max_workers < 2)
+            kprint("  needs at least 2 APs\n", 6);
+        if (wl == BENCH_LARGE)
+            bench_print_frag("  fragmentation after: ");
+    }
+
+    kprint("\n", 7);
+    bench_print_frag("fragmentation score: ");
+
+out:
+    for (uint32_t i = 0; i < max_workers; i++) {
+        if (bench.w[i].samples) kfree_pages(bench.w[i].samples);
+        if (bench.w[i].slots) kfree_pages(bench.w[i].slots);
+        bench.w[i].samples = NULL;
+        bench.w[i].slots = NULL;
+    }
+    if (rings) kfree(rings);
+    if (merged && is_vmalloc_addr(merged)) vfree(merged);
+    else if (merged) kfree(merged);
+    __atomic_store_n(&bench_busy, 0, __ATOMIC_RELEASE);
+}
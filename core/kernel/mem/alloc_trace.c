@@ -0,0 +1,319 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/kernel/mem/alloc_trace.h>
+#include <core/kernel/mem/vmm.h>
+#include <core/kernel/kstd.h>
+#include <core/arch/percpu.h>
+#include <core/arch/smp.h>
+#include <core/arch/spinlock.h>
+#include <core/arch/delay.h>
+#include <log.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SITE_MASK       (ALLOC_TRACE_MAX_SITES - 1)
+#define LIVE_MASK       (ALLOC_TRACE_MAX_LIVE - 1)
+#define LIVE_LIMIT      (ALLOC_TRACE_MAX_LIVE / 4 * 3)  // Keeps probe chains short
+#define SITE_NONE       0xFFFFFFFFu
+
+typedef struct {
+    uint64_t head;          // Events this CPU has written; only the owner writes
+} __attribute__((aligned(64))) trace_cpu_t;
+
+typedef struct {
+    uintptr_t ptr;          // 0 marks an empty slot
+    uintptr_t site;
+    uint64_t  tsc;
+    uint64_t  size;
+} trace_live_t;
+
+volatile bool alloc_trace_enabled = false;
+
+static trace_cpu_t trace_cpus[ALLOC_TRACE_MAX_CPUS];
+static alloc_event_t* trace_rings;          // ring_cpus rings of ALLOC_TRACE_RING_SIZE
+static uint32_t trace_ring_cpus;
+static alloc_site_stats_t* trace_sites;     // Open addressing, claimed with a CAS on `site`
+static trace_live_t* trace_live;            // Linear probing under trace_live_lock
+static uint32_t trace_live_used;
+static spinlock_t trace_live_lock;
+
+static uint64_t site_drops;
+static uint64_t live_drops;
+static uint64_t untracked_frees;
+
+static inline uint32_t site_hash(uintptr_t site) {
+    return (uint32_t)(((uint64_t)site * 0x9E3779B97F4A7C15ULL) >> 32) & SITE_MASK;
+}
+
+static inline uint32_t live_hash(uintptr_t ptr) {
+    return (uint32_t)(((uint64_t)(ptr >> 4) * 0x9E3779B97F4A7C15ULL) >> 32) & LIVE_MASK;
+}
+
+// Returns the site's slot, claiming an empty one if `insert` is set
+static uint32_t site_slot(uintptr_t site, bool insert) {
+    uint32_t i = site_hash(site);
+    for (uint32_t probe = 0; probe < ALLOC_TRACE_MAX_SITES; probe++, i = (i + 1) & SITE_MASK) {
+        uintptr_t cur = __atomic_load_n(&trace_sites[i].site, __ATOMIC_ACQUIRE);
+        if (cur == site) return i;
+        if (cur != 0) continue;
+        if (!insert) return SITE_NONE;
+
+        uintptr_t expected = 0;
+        if (__atomic_compare_exchange_n(&trace_sites[i].site, &expected, site, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return i;
+        if (expected == site) return i;
+    }
+    return SITE_NONE;
+}
+
+static void trace_record(alloc_event_type_t type, void* ptr, size_t size, uintptr_t site, uint64_t tsc) {
+    uint32_t cpu = this_cpu_id();
+    if (cpu >= trace_ring_cpus) return;
+
+    trace_cpu_t* tc = &trace_cpus[cpu];
+    alloc_event_t* ev = &trace_rings[cpu * ALLOC_TRACE_RING_SIZE + (tc->head & (ALLOC_TRACE_RING_SIZE - 1))];
+    ev->tsc  = tsc;
+    ev->ptr  = (uintptr_t)ptr;
+    ev->site = site;
+    ev->size = (uint32_t)size;
+    ev->type = (uint8_t)type;
+    ev->cpu  = (uint8_t)cpu;
+    __atomic_store_n(&tc->head, tc->head + 1, __ATOMIC_RELEASE);
+}
+
+static void live_insert(uintptr_t ptr, uintptr_t site, size_t size, uint64_t tsc) {
+    spinlock_acquire(&trace_live_lock);
+
+    uint32_t i = live_hash(ptr);
+    while (trace_live[i].ptr && trace_live[i].ptr != ptr)
+        i = (i + 1) & LIVE_MASK;
+
+    if (!trace_live[i].ptr) {
+        if (trace_live_used >= LIVE_LIMIT) {
+            spinlock_release(&trace_live_lock);
+            __atomic_fetch_add(&live_drops, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        trace_live_used++;
+    }
+
+    trace_live[i].ptr  = ptr;
+    trace_live[i].site = site;
+    trace_live[i].tsc  = tsc;
+    trace_live[i].size = size;
+    spinlock_release(&trace_live_lock);
+}
+
+// Removes `ptr` and returns the site that allocated it, or 0 if it was never recorded
+static uintptr_t live_remove(uintptr_t ptr) {
+    spinlock_acquire(&trace_live_lock);
+
+    uint32_t i = live_hash(ptr);
+    while (trace_live[i].ptr && trace_live[i].ptr != ptr)
+        i = (i + 1) & LIVE_MASK;
+
+    if (!trace_live[i].ptr) {
+        spinlock_release(&trace_live_lock);
+        return 0;
+    }
+
+    uintptr_t site = trace_live[i].site;
+
+    // Backward-shift deletion: pull later entries of the chain into the hole
+    uint32_t hole = i;
+    for (uint32_t j = (i + 1) & LIVE_MASK; trace_live[j].ptr; j = (j + 1) & LIVE_MASK) {
+        uint32_t home = live_hash(trace_live[j].ptr);
+        if (((j - home) & LIVE_MASK) >= ((j - hole) & LIVE_MASK)) {
+            trace_live[hole] = trace_live[j];
+            hole = j;
+        }
+    }
+    trace_live[hole].ptr = 0;
+    trace_live_used--;
+
+    spinlock_release(&trace_live_lock);
+    return site;
+}
+
+void alloc_trace_alloc(alloc_event_type_t type, void* ptr, size_t size, uintptr_t site) {
+    if (!ptr || !trace_live) return;
+
+    uint64_t tsc = rdtsc();
+    trace_record(type, ptr, size, site, tsc);
+
+    uint32_t slot = site_slot(site, true);
+    if (slot == SITE_NONE) {
+        __atomic_fetch_add(&site_drops, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&trace_sites[slot].alloc_count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&trace_sites[slot].alloc_bytes, size, __ATOMIC_RELAXED);
+    }
+
+    live_insert((uintptr_t)ptr, site, size, tsc);
+}
+
+void alloc_trace_free(alloc_event_type_t type, void* ptr, uintptr_t site) {
+    if (!ptr || !trace_live) return;
+
+    trace_record(type, ptr, 0, site, rdtsc());
+
+    uintptr_t owner = live_remove((uintptr_t)ptr);
+    if (!owner) {
+        __atomic_fetch_add(&untracked_frees, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint32_t slot = site_slot(owner, false);
+    if (slot != SITE_NONE)
+        __atomic_fetch_add(&trace_sites[slot].free_count, 1, __ATOMIC_RELAXED);
+}
+
+int alloc_trace_start(void) {
+    if (alloc_trace_active()) return 0;
+
+    if (!trace_live) {
+        uint32_t cpus = smp_cpu_count();
+        if (cpus == 0) cpus = 1;
+        if (cpus > ALLOC_TRACE_MAX_CPUS) cpus = ALLOC_TRACE_MAX_CPUS;
+
+        // Allocated before tracing is on, so these never show up in the trace
+        alloc_event_t* rings = vmalloc((size_t)cpus * ALLOC_TRACE_RING_SIZE * sizeof(alloc_event_t));
+        alloc_site_stats_t* sites = vmalloc(ALLOC_TRACE_MAX_SITES * sizeof(alloc_site_stats_t));
+        trace_live_t* live = vmalloc(ALLOC_TRACE_MAX_LIVE * sizeof(trace_live_t));
+        if (!rings || !sites || !live) {
+            if (rings) vfree(rings);
+            if (sites) vfree(sites);
+            if (live) vfree(live);
+            LOG_WARN("alloc_trace: cannot allocate trace buffers\n");
+            return -1;
+        }
+
+        spinlock_init_named(&trace_live_lock, "alloc_trace");
+        trace_rings = rings;
+        trace_ring_cpus = cpus;
+        trace_sites = sites;
+        trace_live = live;
+    }
+
+    alloc_trace_clear();
+    __atomic_store_n(&alloc_trace_enabled, true, __ATOMIC_RELEASE);
+    LOG_INFO("alloc_trace: started (%u CPUs, %u live slots)\n", trace_ring_cpus, ALLOC_TRACE_MAX_LIVE);
+    return 0;
+}
+
+void alloc_trace_stop(void) {
+    __atomic_store_n(&alloc_trace_enabled, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * Counters bumped by a hook already in flight on another CPU may survive the
+ * reset; that only skews the next report by an event or two.
+ */
+void alloc_trace_clear(void) {
+    if (!trace_live) return;
+
+    spinlock_acquire(&trace_live_lock);
+    memset(trace_live, 0, ALLOC_TRACE_MAX_LIVE * sizeof(trace_live_t));
+    trace_live_used = 0;
+    spinlock_release(&trace_live_lock);
+
+    memset(trace_sites, 0, ALLOC_TRACE_MAX_SITES * sizeof(alloc_site_stats_t));
+    for (uint32_t cpu = 0; cpu < trace_ring_cpus; cpu++)
+        __atomic_store_n(&trace_cpus[cpu].head, 0, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&site_drops, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&live_drops, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&untracked_frees, 0, __ATOMIC_RELAXED);
+}
+
+void alloc_trace_get_status(alloc_trace_status_t* out) {
+    memset(out, 0, sizeof(*out));
+    out->enabled = alloc_trace_active();
+    if (!trace_live) return;
+
+    for (uint32_t cpu = 0; cpu < trace_ring_cpus; cpu++)
+        out->events += __atomic_load_n(&trace_cpus[cpu].head, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < ALLOC_TRACE_MAX_SITES; i++)
+        if (__atomic_load_n(&trace_sites[i].site, __ATOMIC_ACQUIRE)) out->sites++;
+
+    out->live       = __atomic_load_n(&trace_live_used, __ATOMIC_RELAXED);
+    out->site_drops = __atomic_load_n(&site_drops, __ATOMIC_RELAXED);
+    out->live_drops = __atomic_load_n(&live_drops, __ATOMIC_RELAXED);
+    out->untracked  = __atomic_load_n(&untracked_frees, __ATOMIC_RELAXED);
+}
+
+uint32_t alloc_trace_get_sites(alloc_site_stats_t* out, uint32_t max) {
+    if (!trace_live) return 0;
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < ALLOC_TRACE_MAX_SITES && n < max; i++) {
+        uintptr_t site = __atomic_load_n(&trace_sites[i].site, __ATOMIC_ACQUIRE);
+        if (!site) continue;
+        out[n].site        = site;
+        out[n].alloc_count = __atomic_load_n(&trace_sites[i].alloc_count, __ATOMIC_RELAXED);
+        out[n].alloc_bytes = __atomic_load_n(&trace_sites[i].alloc_bytes, __ATOMIC_RELAXED);
+        out[n].free_count  = __atomic_load_n(&trace_sites[i].free_count, __ATOMIC_RELAXED);
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Groups are found through the site table's slot numbers, so the scan stays
+ * linear in the live table. Blocks whose site never made it into the site
+ * table are pooled under site 0.
+ */
+uint32_t alloc_trace_get_live(alloc_live_site_t* out, uint32_t max) {
+    if (!trace_live || max == 0) return 0;
+    if (max > ALLOC_TRACE_MAX_SITES + 1) max = ALLOC_TRACE_MAX_SITES + 1;
+
+    uint16_t group_of[ALLOC_TRACE_MAX_SITES];
+    memset(group_of, 0xFF, sizeof(group_of));
+    uint32_t unknown = SITE_NONE;
+    uint32_t n = 0;
+
+    spinlock_acquire(&trace_live_lock);
+    for (uint32_t i = 0; i < ALLOC_TRACE_MAX_LIVE; i++) {
+        trace_live_t* e = &trace_live[i];
+        if (!e->ptr) continue;
+
+        uint32_t slot = site_slot(e->site, false);
+        uint32_t g = unknown;
+        if (slot != SITE_NONE)
+            g = (group_of[slot] == 0xFFFF) ? SITE_NONE : group_of[slot];
+
+        if (g == SITE_NONE) {
+            if (n >= max) continue;
+            g = n++;
+            out[g].site = (slot == SITE_NONE) ? 0 : e->site;
+            out[g].count = 0;
+            out[g].bytes = 0;
+            out[g].oldest_tsc = e->tsc;
+            if (slot == SITE_NONE) unknown = g;
+            else group_of[slot] = (uint16_t)g;
+        }
+
+        out[g].count++;
+        out[g].bytes += e->size;
+        if (e->tsc < out[g].oldest_tsc) out[g].oldest_tsc = e->tsc;
+    }
+    spinlock_release(&trace_live_lock);
+
+    return n;
+}
+
+uint32_t alloc_trace_get_recent(uint32_t cpu, alloc_event_t* out, uint32_t max) {
+    if (!trace_live || cpu >= trace_ring_cpus) return 0;
+
+    uint64_t head = __atomic_load_n(&trace_cpus[cpu].head, __ATOMIC_ACQUIRE);
+    uint64_t avail = head < ALLOC_TRACE_RING_SIZE ? head : ALLOC_TRACE_RING_SIZE;
+    uint32_t n = 0;
+
+    for (; n < max && n < avail; n++) {
+        uint64_t idx = (head - 1 - n) & (ALLOC_TRACE_RING_SIZE - 1);
+        out[n] = trace_rings[cpu * ALLOC_TRACE_RING_SIZE + idx];
+    }
+    return n;
+}
@@ -4,11 +4,13 @@
 #include <core/kernel/mem/buddy.h>
 #include <core/kernel/mem/slab.h>
 #include <core/kernel/mem/cpu_pool.h>
+#include <core/kernel/mem/vmm.h>
+#include <core/kernel/mem/alloc_trace.h>
 #include <core/kernel/kstd.h>
 #include <log.h>
 #include <limine.h>
 #include <core/arch/panic.h>
-#include <core/arch/smp.h>
+#include <core/arch/percpu.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -24,24 +26,53 @@ static volatile struct limine_hhdm_request hhdm_request = {
 
 static buddy_allocator_t buddy_allocator;
 static uint64_t hhdm_offset;
-static size_t allocated_memory = 0;
-static size_t alloc_count = 0;
-static size_t free_count = 0;
 
-static size_t alloc_total = 0;
-static size_t free_total = 0;
-static uintptr_t last_alloc_ptr = 0;
-static size_t last_alloc_size = 0;
-static uintptr_t last_free_ptr = 0;
-static size_t last_free_size = 0;
+/*
+ * Each CPU only updates its own cache line; readers sum every slot. Byte
+ * counts are signed because a block may be freed on a different CPU than
+ * the one that allocated it.
+ */
+typedef struct {
+    int64_t  allocated;
+    uint64_t alloc_count;
+    uint64_t free_count;
+    int64_t  page_bytes;
+    uint64_t page_allocs;
+    uint64_t page_frees;
+} __attribute__((aligned(64))) mem_cpu_stats_t;
+
+static mem_cpu_stats_t mem_cpu_stats[MEM_STATS_MAX_CPUS];
+
+#define MEM_STAT_ADD(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+
+static inline mem_cpu_stats_t* cpu_stats(uint32_t cpu_id) {
+    return &mem_cpu_stats[cpu_id < MEM_STATS_MAX_CPUS ? cpu_id : 0];
+}
 
-typedef struct alloc_info {
-    uint32_t order;
-    uint32_t magic;
-    size_t user_size;
-} alloc_info_t;
+// Only meaningful in the public entry points: the site is whoever called them
+#define TRACE_CALLER() ((uintptr_t)__builtin_return_address(0))
+
+void memory_get_stats(mem_stats_t* out) {
+    int64_t allocated = 0, page_bytes = 0;
+    uint64_t allocs = 0, frees = 0, page_allocs = 0, page_frees = 0;
+
+    for (uint32_t i = 0; i < MEM_STATS_MAX_CPUS; i++) {
+        mem_cpu_stats_t* st = &mem_cpu_stats[i];
+        allocated   += __atomic_load_n(&st->allocated, __ATOMIC_RELAXED);
+        allocs      += __atomic_load_n(&st->alloc_count, __ATOMIC_RELAXED);
+        frees       += __atomic_load_n(&st->free_count, __ATOMIC_RELAXED);
+        page_bytes  += __atomic_load_n(&st->page_bytes, __ATOMIC_RELAXED);
+        page_allocs += __atomic_load_n(&st->page_allocs, __ATOMIC_RELAXED);
+        page_frees  += __atomic_load_n(&st->page_frees, __ATOMIC_RELAXED);
+    }
 
-#define ALLOC_MAGIC 0xA110C123
+    out->allocated   = allocated > 0 ? (size_t)allocated : 0;
+    out->alloc_count = allocs;
+    out->free_count  = frees;
+    out->page_bytes  = page_bytes > 0 ? (size_t)page_bytes : 0;
+    out->page_allocs = page_allocs;
+    out->page_frees  = page_frees;
+}
 
 void format_memory_size(size_t size, char* buffer) {
     const char* units[] = {"B", "KB", "MB", "GB"};
@@ -109,147 +140,164 @@ void memory_manager_init(void) {
     struct limine_memmap_response* memmap = memmap_request.response;
     LOG_TRACE("memory_manager_init: found %zu memory map entries\n", memmap->entry_count);
 
-    size_t max_usable_size = 0;
-    struct limine_memmap_entry* best_entry = NULL;
+    buddy_init(&buddy_allocator, hhdm_offset);
 
     for (size_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry* entry = memmap->entries[i];
-        LOG_TRACE("memory_manager_init: entry %zu: base=%llx, length=%llx, type=%u\n",
-                 i, entry->base, entry->length, entry->type);
-
-        if (entry->type == LIMINE_MEMMAP_USABLE) {
-            if (entry->length > max_usable_size) {
-                max_usable_size = entry->length;
-                best_entry = entry;
-            }
+        LOG_TRACE("memory_manager_init: entry %zu: base=%p, length=%zu, type=%u\n",
+                 i, (void*)entry->base, (size_t)entry->length, entry->type);
+
+        if (entry->type != LIMINE_MEMMAP_USABLE) continue;
+
+        void* pool_start = (void*)(entry->base + hhdm_offset);
+        if (buddy_add_zone(&buddy_allocator, pool_start, entry->length) < 0) {
+            LOG_TRACE("memory_manager_init: region %p not usable as a zone\n", pool_start);
         }
     }
 
-    if (best_entry == NULL) {
+    if (buddy_zone_count(&buddy_allocator) == 0) {
         LOG_ERROR("memory_manager_init: No suitable memory region found\n");
         panic("No suitable memory region found");
         return;
     }
 
-    LOG_TRACE("memory_manager_init: selected memory region: base=%llx, length=%llx\n",
-             best_entry->base, best_entry->length);
-
-    void* pool_start = (void*)(best_entry->base + hhdm_offset);
-    size_t pool_size = best_entry->length;
-
-    LOG_TRACE("memory_manager_init: pool_start=%p, pool_size=%zu\n", pool_start, pool_size);
-
-    buddy_init(&buddy_allocator, pool_start, pool_size, hhdm_offset);
-
     char buffer[64];
+    for (uint32_t i = 0; i < buddy_zone_count(&buddy_allocator); i++) {
+        buddy_zone_t* zone = buddy_get_zone(&buddy_allocator, i);
+        format_memory_size(zone->pool_size, buffer);
+        LOG_DEBUG("Buddy zone %u: %p (%s)\n", i, zone->pool_start, buffer);
+    }
+
     format_memory_size(buddy_get_total_memory(&buddy_allocator), buffer);
-    LOG_INFO("Buddy allocator initialized (%s)\n", buffer);
+    LOG_INFO("Buddy allocator initialized (%s in %u zones)\n", buffer, buddy_zone_count(&buddy_allocator));
     slab_init();
+    vmm_init();
     LOG_TRACE("memory_manager_init: completed\n");
 }
 
+static uint32_t block_order_for(size_t size) {
+    uint32_t order = BUDDY_MIN_ORDER;
+    while (BUDDY_BLOCK_SIZE(order) < size && order < BUDDY_MAX_ORDER)
+        order++;
+    return order;
+}
+
+// Page-class blocks carry no header: order and request size live in the page descriptor
 void* kmalloc(size_t size) {
     if (size == 0) return NULL;
 
+    mem_cpu_stats_t* st = cpu_stats(this_cpu_id());
+
     if (size <= 1024) {
         void* ptr = slab_alloc(size);
         if (ptr) {
-            allocated_memory += size;
-            alloc_count++;
+            MEM_STAT_ADD(st->allocated, (int64_t)size);
+            MEM_STAT_ADD(st->alloc_count, 1);
+            if (alloc_trace_active())
+                alloc_trace_alloc(ALLOC_EV_KMALLOC, ptr, size, TRACE_CALLER());
             return ptr;
         }
     }
 
-    if (size <= 4096) {
-        uint32_t cpu_id = smp_current_cpu_id();
-        void* block = cpu_pool_alloc(cpu_id, 12);
-        if (block) {
-            alloc_info_t* info = (alloc_info_t*)block;
-            info->order     = 12;
-            info->magic     = ALLOC_MAGIC;
-            info->user_size = size;
+    if (size > BUDDY_BLOCK_SIZE(BUDDY_MAX_ORDER)) return NULL;
 
-            allocated_memory += size;
-            alloc_count++;
+    uint32_t order = block_order_for(size);
+    void* block = cpu_pool_alloc(order);
+    if (!block) return NULL;
 
-            return (void*)((uintptr_t)block + sizeof(alloc_info_t));
-        }
-    }
+    page_desc_t* desc = buddy_page_desc(&buddy_allocator, block);
+    desc->type    = PAGE_TYPE_KMALLOC;
+    desc->order   = (uint8_t)order;
+    desc->private = (uint32_t)size;
 
-    if (size <= 8192) {
-        uint32_t cpu_id = smp_current_cpu_id();
-        void* block = cpu_pool_alloc(cpu_id, 13);
-        if (block) {
-            alloc_info_t* info = (alloc_info_t*)block;
-            info->order     = 13;
-            info->magic     = ALLOC_MAGIC;
-            info->user_size = size;
+    MEM_STAT_ADD(st->allocated, (int64_t)size);
+    MEM_STAT_ADD(st->alloc_count, 1);
+    if (alloc_trace_active())
+        alloc_trace_alloc(ALLOC_EV_KMALLOC, block, size, TRACE_CALLER());
 
-            allocated_memory += size;
-            alloc_count++;
+    return block;
+}
 
-            return (void*)((uintptr_t)block + sizeof(alloc_info_t));
-        }
-    }
+void kfree(void* ptr) {
+    if (!ptr) return;
 
-    size_t total_size = size + sizeof(alloc_info_t);
-    uint32_t order = BUDDY_MIN_ORDER;
-    size_t block_size = BUDDY_BLOCK_SIZE(order);
+    if (alloc_trace_active())
+        alloc_trace_free(ALLOC_EV_KFREE, ptr, TRACE_CALLER());
 
-    while (block_size < total_size && order < BUDDY_MAX_ORDER) {
-        order++;
-        block_size <<= 1;
+    mem_cpu_stats_t* st = cpu_stats(this_cpu_id());
+    page_desc_t* desc = buddy_page_desc(&buddy_allocator, ptr);
+
+    if (desc && desc->type == PAGE_TYPE_SLAB) {
+        slab_free(ptr);
+        MEM_STAT_ADD(st->free_count, 1);
+        return;
     }
 
-    void* block = buddy_alloc(&buddy_allocator, block_size);
+    if (!desc || desc->type != PAGE_TYPE_KMALLOC ||
+        ((uintptr_t)ptr & (BUDDY_BLOCK_SIZE(desc->order) - 1)) != 0) {
+        LOG_ERROR("kfree: invalid pointer %p (type=%u)\n", ptr, desc ? desc->type : 0);
+        panic("Invalid free: not a kmalloc allocation");
+    }
+
+    MEM_STAT_ADD(st->allocated, -(int64_t)desc->private);
+    MEM_STAT_ADD(st->free_count, 1);
+
+    uint32_t order = desc->order;
+    desc->type = PAGE_TYPE_BUDDY;
+    cpu_pool_free(ptr, order);
+}
+
+void* kalloc_pages(uint32_t order, uint32_t flags, uint64_t* phys) {
+    if (order > BUDDY_MAX_ORDER - BUDDY_MIN_ORDER) return NULL;
+
+    uint32_t block_order = BUDDY_MIN_ORDER + order;
+    void* block = cpu_pool_alloc(block_order);
     if (!block) return NULL;
 
-    alloc_info_t* info = (alloc_info_t*)block;
-    info->order     = order;
-    info->magic     = ALLOC_MAGIC;
-    info->user_size = size;
+    page_desc_t* desc = buddy_page_desc(&buddy_allocator, block);
+    desc->type    = PAGE_TYPE_PAGES;
+    desc->order   = (uint8_t)block_order;
+    desc->flags   = (uint16_t)flags;
+    desc->private = 0;
+
+    if (flags & KALLOC_ZERO)
+        memset(block, 0, BUDDY_BLOCK_SIZE(block_order));
 
-    allocated_memory += size;
-    alloc_count++;
+    mem_cpu_stats_t* st = cpu_stats(this_cpu_id());
+    MEM_STAT_ADD(st->page_bytes, (int64_t)BUDDY_BLOCK_SIZE(block_order));
+    MEM_STAT_ADD(st->page_allocs, 1);
+    if (alloc_trace_active())
+        alloc_trace_alloc(ALLOC_EV_PAGES, block, BUDDY_BLOCK_SIZE(block_order), TRACE_CALLER());
 
-    return (void*)((uintptr_t)block + sizeof(alloc_info_t));
+    if (phys)
+        *phys = (uint64_t)(uintptr_t)block - hhdm_offset;
+    return block;
 }
 
-void kfree(void* ptr) {
+void kfree_pages(void* ptr) {
     if (!ptr) return;
 
-    if (slab_owns(ptr)) {
-        slab_free(ptr);
-        free_count++;
-        return;
+    page_desc_t* desc = buddy_page_desc(&buddy_allocator, ptr);
+    if (!desc || desc->type != PAGE_TYPE_PAGES) {
+        LOG_ERROR("kfree_pages: %p was not allocated by kalloc_pages\n", ptr);
+        panic("Invalid free: not a page allocation");
     }
 
-    alloc_info_t* info = (alloc_info_t*)((uintptr_t)ptr - sizeof(alloc_info_t));
+    if (alloc_trace_active())
+        alloc_trace_free(ALLOC_EV_PAGES_FREE, ptr, TRACE_CALLER());
 
-    if (info->magic != ALLOC_MAGIC) {
-        LOG_ERROR("kfree: corruption at %p (magic=0x%08x)\n", ptr, info->magic);
-        panic("Invalid free: corrupted allocation info");
-    }
+    uint32_t order = desc->order;
+    desc->type = PAGE_TYPE_BUDDY;
 
-    if (info->order == 12 || info->order == 13) {
-        if (allocated_memory >= info->user_size)
-            allocated_memory -= info->user_size;
-        free_count++;
-        uint32_t cpu_id = smp_current_cpu_id();
-        cpu_pool_free(cpu_id, (void*)info, info->order);
-        return;
-    }
+    mem_cpu_stats_t* st = cpu_stats(this_cpu_id());
+    MEM_STAT_ADD(st->page_bytes, -(int64_t)BUDDY_BLOCK_SIZE(order));
+    MEM_STAT_ADD(st->page_frees, 1);
 
-    if (info->order < BUDDY_MIN_ORDER || info->order > BUDDY_MAX_ORDER) {
-        LOG_ERROR("kfree: invalid order %u at %p\n", info->order, ptr);
-        panic("Invalid free: invalid order");
-    }
-
-    if (allocated_memory >= info->user_size)
-        allocated_memory -= info->user_size;
+    cpu_pool_free(ptr, order);
+}
 
-    free_count++;
-    buddy_free(&buddy_allocator, (void*)info, info->order);
+uint64_t kvirt_to_phys(const void* ptr) {
+    return (uint64_t)(uintptr_t)ptr - hhdm_offset;
 }
 
 size_t get_memory_total(void) {
@@ -261,7 +309,9 @@ size_t get_memory_free(void) {
 }
 
 size_t get_memory_used(void) {
-    return allocated_memory;
+    mem_stats_t stats;
+    memory_get_stats(&stats);
+    return stats.allocated;
 }
 
 size_t get_memory_available(void) {
@@ -361,6 +411,11 @@ void memory_test(void) {
 void check_memory_leaks(void) {
     char buffer[128];
     char num_buf[32];
+    mem_stats_t stats;
+    memory_get_stats(&stats);
+    size_t allocated_memory = stats.allocated;
+    size_t alloc_count = stats.alloc_count;
+    size_t free_count = stats.free_count;
     size_t leaked = alloc_count - free_count;
     int i, len;
 
@@ -19,35 +19,30 @@ static inline uint32_t get_minimum_order(size_t size) {
     return order;
 }
 
-static inline void* get_buddy_address(void* block, uint32_t order, void* pool_start) {
-    uintptr_t block_addr = (uintptr_t)block;
-    uintptr_t pool_addr = (uintptr_t)pool_start;
-    uintptr_t offset = block_addr - pool_addr;
-    uintptr_t buddy_offset = offset ^ BUDDY_BLOCK_SIZE(order);
+static inline uintptr_t zone_end(buddy_zone_t* zone) {
+    return (uintptr_t)zone->pool_start + zone->pool_size;
+}
 
-    return (void*)(pool_addr + buddy_offset);
+static inline void* get_buddy_address(buddy_zone_t* zone, void* block, uint32_t order) {
+    uintptr_t offset = (uintptr_t)block - zone->base;
+    return (void*)(zone->base + (offset ^ BUDDY_BLOCK_SIZE(order)));
 }
 
-static inline bool is_valid_block(buddy_allocator_t* allocator, void* ptr, uint32_t order) {
+static inline bool is_valid_block(buddy_zone_t* zone, void* ptr, uint32_t order) {
     if (!ptr) return false;
 
     uintptr_t addr = (uintptr_t)ptr;
-    uintptr_t pool_start = (uintptr_t)allocator->pool_start;
-    uintptr_t pool_end = pool_start + allocator->pool_size;
 
-    if (addr < pool_start || addr >= pool_end) return false;
+    if (addr < (uintptr_t)zone->pool_start) return false;
+    if (addr + BUDDY_BLOCK_SIZE(order) > zone_end(zone)) return false;
 
-    size_t offset = addr - pool_start;
-    if (offset % BUDDY_BLOCK_SIZE(order) != 0) return false;
+    if ((addr - zone->base) % BUDDY_BLOCK_SIZE(order) != 0) return false;
 
     return true;
 }
 
-static inline size_t get_block_index(void* ptr, void* pool_start, uint32_t order) {
-    uintptr_t addr = (uintptr_t)ptr;
-    uintptr_t pool_addr = (uintptr_t)pool_start;
-    size_t offset = addr - pool_addr;
-    return offset / BUDDY_BLOCK_SIZE(order);
+static inline size_t get_block_index(buddy_zone_t* zone, void* ptr, uint32_t order) {
+    return ((uintptr_t)ptr - zone->base) / BUDDY_BLOCK_SIZE(order);
 }
 
 static inline bool is_valid_bitmap_index(uint32_t* bitmap, size_t max_blocks, size_t index) {
@@ -76,156 +71,111 @@ static inline void clear_bit(uint32_t* bitmap, size_t index, size_t max_blocks)
 static inline bool test_bit(uint32_t* bitmap, size_t index, size_t max_blocks) {
     if (!is_valid_bitmap_index(bitmap, max_blocks, index)) {
         LOG_ERROR("test_bit: invalid index %zu (max_blocks=%zu)\n", index, max_blocks);
-        return false;
+        return true;
     }
     return (bitmap[index / 32] & (1U << (index % 32))) != 0;
 }
 
 static inline size_t find_first_free_bit(uint32_t* bitmap, size_t max_blocks) {
-    for (size_t i = 0; i < max_blocks; i++) {
-        if (!test_bit(bitmap, i, max_blocks)) {
-            return i;
-        }
+    size_t words = (max_blocks + 31) / 32;
+
+    for (size_t w = 0; w < words; w++) {
+        if (bitmap[w] == 0xFFFFFFFF) continue;
+
+        size_t index = w * 32 + (size_t)__builtin_ctz(~bitmap[w]);
+        if (index < max_blocks) return index;
     }
     return (size_t)-1;
 }
 
-static void* get_block_address(buddy_allocator_t* allocator, uint32_t order, size_t index) {
-    return (void*)((uintptr_t)allocator->pool_start + index * BUDDY_BLOCK_SIZE(order));
+static void* get_block_address(buddy_zone_t* zone, uint32_t order, size_t index) {
+    return (void*)(zone->base + index * BUDDY_BLOCK_SIZE(order));
 }
 
-static void split_block(buddy_allocator_t* allocator, uint32_t order, size_t index) {
-    uint32_t new_order = order - 1;
-
-    size_t left_index = index * 2;
-    size_t right_index = index * 2 + 1;
-
-    if (left_index >= allocator->max_blocks[new_order] ||
-        right_index >= allocator->max_blocks[new_order]) {
-        LOG_ERROR("split_block: invalid indices for new order %u: left=%zu, right=%zu, max=%zu\n",
-                 new_order, left_index, right_index, allocator->max_blocks[new_order]);
-        return;
-    }
-
-    clear_bit(allocator->free_area_bitmap[new_order], left_index, allocator->max_blocks[new_order]);
-    clear_bit(allocator->free_area_bitmap[new_order], right_index, allocator->max_blocks[new_order]);
-    allocator->free_area_size[new_order] += 2;
-
-    LOG_TRACE("split_block: split order %u block %zu into order %u blocks %zu and %zu\n",
-             order, index, new_order, left_index, right_index);
+static void mark_block_free(buddy_zone_t* zone, void* block, uint32_t order) {
+    size_t index = get_block_index(zone, block, order);
+    clear_bit(zone->free_area_bitmap[order], index, zone->max_blocks[order]);
+    zone->free_area_size[order]++;
+    zone->free_bytes += BUDDY_BLOCK_SIZE(order);
 }
 
-static void* alloc_block(buddy_allocator_t* allocator, uint32_t order) {
-    LOG_TRACE("alloc_block: attempting to allocate order=%u\n", order);
+static void* alloc_block(buddy_zone_t* zone, uint32_t order) {
+    LOG_TRACE("alloc_block: zone %u attempting to allocate order=%u\n", zone->id, order);
 
     if (order > BUDDY_MAX_ORDER) {
         LOG_TRACE("alloc_block: order %u > max_order %u, returning NULL\n", order, BUDDY_MAX_ORDER);
         return NULL;
     }
 
-    if (allocator->free_area_size[order] == 0) {
-        LOG_TRACE("alloc_block: no free blocks of order %u, trying larger order %u\n", order, order + 1);
-        void* larger_block = alloc_block(allocator, order + 1);
+    if (zone->free_area_size[order] == 0) {
+        void* larger_block = alloc_block(zone, order + 1);
         if (!larger_block) {
-            LOG_TRACE("alloc_block: failed to allocate larger block\n");
             return NULL;
         }
 
-        size_t larger_index = get_block_index(larger_block, allocator->pool_start, order + 1);
-        LOG_TRACE("alloc_block: splitting block at index %zu (order %u) into order %u\n", larger_index, order + 1, order);
-        split_block(allocator, order + 1, larger_index);
-
-        size_t left_index = larger_index * 2;
-
-        if (left_index >= allocator->max_blocks[order]) {
-            LOG_ERROR("alloc_block: invalid left_index %zu for order %u (max_blocks=%zu)\n",
-                     left_index, order, allocator->max_blocks[order]);
-            size_t right_index = larger_index * 2 + 1;
-            if (right_index >= allocator->max_blocks[order]) {
-                LOG_ERROR("alloc_block: both split indices invalid, returning larger block\n");
-                return larger_block;
-            }
-            left_index = right_index;
-        }
+        // Keep the lower half, release the upper half at this order
+        mark_block_free(zone, (void*)((uintptr_t)larger_block + BUDDY_BLOCK_SIZE(order)), order);
 
-        set_bit(allocator->free_area_bitmap[order], left_index, allocator->max_blocks[order]);
-        allocator->free_area_size[order]--;
-
-        void* result = get_block_address(allocator, order, left_index);
-        LOG_TRACE("alloc_block: allocated split block at %p (index %zu)\n", result, left_index);
-        return result;
+        LOG_TRACE("alloc_block: split order %u block at %p\n", order + 1, larger_block);
+        return larger_block;
     }
 
-    size_t free_index = find_first_free_bit(allocator->free_area_bitmap[order],
-                                           allocator->max_blocks[order]);
+    size_t free_index = find_first_free_bit(zone->free_area_bitmap[order], zone->max_blocks[order]);
     if (free_index == (size_t)-1) {
-        LOG_TRACE("alloc_block: no free blocks found in bitmap for order %u\n", order);
+        LOG_ERROR("alloc_block: zone %u order %u count=%zu but bitmap is full\n",
+                 zone->id, order, zone->free_area_size[order]);
+        zone->free_area_size[order] = 0;
         return NULL;
     }
 
-    set_bit(allocator->free_area_bitmap[order], free_index, allocator->max_blocks[order]);
-    allocator->free_area_size[order]--;
+    set_bit(zone->free_area_bitmap[order], free_index, zone->max_blocks[order]);
+    zone->free_area_size[order]--;
+    zone->free_bytes -= BUDDY_BLOCK_SIZE(order);
 
-    void* result = get_block_address(allocator, order, free_index);
+    void* result = get_block_address(zone, order, free_index);
     LOG_TRACE("alloc_block: allocated existing block at %p (index %zu)\n", result, free_index);
     return result;
 }
 
-static void free_block(buddy_allocator_t* allocator, void* ptr, uint32_t order) {
+static void free_block(buddy_zone_t* zone, void* ptr, uint32_t order) {
     LOG_TRACE("free_block: freeing block at %p (order %u)\n", ptr, order);
 
-    if (!is_valid_block(allocator, ptr, order)) {
-        LOG_ERROR("free_block: invalid block %p (order %u)\n", ptr, order);
+    size_t index = get_block_index(zone, ptr, order);
+
+    if (!test_bit(zone->free_area_bitmap[order], index, zone->max_blocks[order])) {
+        LOG_ERROR("free_block: double free of %p (order %u)\n", ptr, order);
         return;
     }
 
-    size_t index = get_block_index(ptr, allocator->pool_start, order);
-
-    clear_bit(allocator->free_area_bitmap[order], index, allocator->max_blocks[order]);
-    allocator->free_area_size[order]++;
-    LOG_TRACE("free_block: marked block free at index %zu (order %u)\n", index, order);
+    mark_block_free(zone, ptr, order);
 
     void* current_block = ptr;
     uint32_t current_order = order;
 
     while (current_order < BUDDY_MAX_ORDER) {
-        void* buddy = get_buddy_address(current_block, current_order, allocator->pool_start);
-        LOG_TRACE("free_block: checking buddy at %p (order %u)\n", buddy, current_order);
+        void* buddy = get_buddy_address(zone, current_block, current_order);
 
-        if (!is_valid_block(allocator, buddy, current_order)) {
-            LOG_TRACE("free_block: buddy not valid, stopping merge\n");
+        if (!is_valid_block(zone, buddy, current_order)) {
             break;
         }
 
-        size_t buddy_index = get_block_index(buddy, allocator->pool_start, current_order);
-        if (test_bit(allocator->free_area_bitmap[current_order], buddy_index, allocator->max_blocks[current_order])) {
-            LOG_TRACE("free_block: buddy at index %zu is allocated, stopping merge\n", buddy_index);
-            break;
-        }
-
-        LOG_TRACE("free_block: merging blocks into order %u\n", current_order + 1);
-
-        if (test_bit(allocator->free_area_bitmap[current_order], index, allocator->max_blocks[current_order]) ||
-            test_bit(allocator->free_area_bitmap[current_order], buddy_index, allocator->max_blocks[current_order])) {
-            LOG_ERROR("free_block: one or both blocks not free during merge (index=%zu, buddy_index=%zu)\n",
-                     index, buddy_index);
+        size_t buddy_index = get_block_index(zone, buddy, current_order);
+        if (test_bit(zone->free_area_bitmap[current_order], buddy_index, zone->max_blocks[current_order])) {
             break;
         }
 
-        set_bit(allocator->free_area_bitmap[current_order], index, allocator->max_blocks[current_order]);
-        set_bit(allocator->free_area_bitmap[current_order], buddy_index, allocator->max_blocks[current_order]);
-        allocator->free_area_size[current_order] -= 2;
-
         void* merged_block = (uintptr_t)current_block < (uintptr_t)buddy ? current_block : buddy;
-        size_t merged_index = get_block_index(merged_block, allocator->pool_start, current_order + 1);
-
-        if (merged_index >= allocator->max_blocks[current_order + 1]) {
-            LOG_ERROR("free_block: invalid merged_index %zu for order %u\n", merged_index, current_order + 1);
+        if (!is_valid_block(zone, merged_block, current_order + 1)) {
             break;
         }
 
-        clear_bit(allocator->free_area_bitmap[current_order + 1], merged_index, allocator->max_blocks[current_order + 1]);
-        allocator->free_area_size[current_order + 1]++;
+        set_bit(zone->free_area_bitmap[current_order], index, zone->max_blocks[current_order]);
+        set_bit(zone->free_area_bitmap[current_order], buddy_index, zone->max_blocks[current_order]);
+        zone->free_area_size[current_order] -= 2;
+
+        size_t merged_index = get_block_index(zone, merged_block, current_order + 1);
+        clear_bit(zone->free_area_bitmap[current_order + 1], merged_index, zone->max_blocks[current_order + 1]);
+        zone->free_area_size[current_order + 1]++;
 
         LOG_TRACE("free_block: merged into block at index %zu (order %u)\n", merged_index, current_order + 1);
 
@@ -233,111 +183,142 @@ static void free_block(buddy_allocator_t* allocator, void* ptr, uint32_t order)
         current_order++;
         index = merged_index;
     }
+}
+
+static void rebuild_fallback(buddy_allocator_t* allocator) {
+    for (uint32_t i = 0; i < allocator->zone_count; i++) {
+        allocator->zones[i].id = i;
+        allocator->fallback[i] = i;
+    }
 
-    LOG_TRACE("free_block: completed freeing block\n");
+    // Largest zones first: they are least likely to fragment and have the deepest orders
+    for (uint32_t i = 1; i < allocator->zone_count; i++) {
+        uint32_t key = allocator->fallback[i];
+        int32_t j = (int32_t)i - 1;
+        while (j >= 0 && allocator->zones[allocator->fallback[j]].pool_size <
+                         allocator->zones[key].pool_size) {
+            allocator->fallback[j + 1] = allocator->fallback[j];
+            j--;
+        }
+        allocator->fallback[j + 1] = key;
+    }
 }
 
-void buddy_init(buddy_allocator_t* allocator, void* pool_start, size_t pool_size, uint64_t hhdm_offset) {
-    LOG_TRACE("buddy_init: pool_start=%p, pool_size=%zu, hhdm_offset=%llu\n", pool_start, pool_size, hhdm_offset);
+void buddy_init(buddy_allocator_t* allocator, uint64_t hhdm_offset) {
+    LOG_TRACE("buddy_init: hhdm_offset=%p\n", (void*)hhdm_offset);
 
     if (!allocator) {
         LOG_ERROR("buddy_init: allocator pointer is NULL\n");
         panic("Buddy allocator initialization failed: NULL allocator");
     }
 
-    if (!pool_start) {
-        LOG_ERROR("buddy_init: pool_start is NULL\n");
-        panic("Buddy allocator initialization failed: NULL pool_start");
-    }
+    allocator->zone_count = 0;
+    allocator->hhdm_offset = hhdm_offset;
+}
 
-    if (pool_size == 0) {
-        LOG_ERROR("buddy_init: pool_size is zero\n");
-        panic("Buddy allocator initialization failed: zero pool_size");
-    }
+int buddy_add_zone(buddy_allocator_t* allocator, void* pool_start, size_t pool_size) {
+    LOG_TRACE("buddy_add_zone: pool_start=%p, pool_size=%zu\n", pool_start, pool_size);
 
-    if (pool_size < BUDDY_BLOCK_SIZE(BUDDY_MIN_ORDER)) {
-        LOG_ERROR("buddy_init: pool_size %zu too small (minimum %zu)\n",
-                 pool_size, BUDDY_BLOCK_SIZE(BUDDY_MIN_ORDER));
-        panic("Buddy allocator initialization failed: pool too small");
+    if (!allocator || !pool_start) {
+        LOG_ERROR("buddy_add_zone: invalid arguments\n");
+        return -1;
     }
 
-    spinlock_init(&allocator->lock);
-    spinlock_acquire(&allocator->lock);
-
-    allocator->pool_start = pool_start;
-    allocator->pool_size = pool_size;
-    allocator->hhdm_offset = hhdm_offset;
-
-    if (allocator->pool_size % BUDDY_BLOCK_SIZE(BUDDY_MIN_ORDER) != 0) {
-        allocator->pool_size -= allocator->pool_size % BUDDY_BLOCK_SIZE(BUDDY_MIN_ORDER);
+    if (allocator->zone_count >= BUDDY_MAX_ZONES) {
+        LOG_WARN("buddy_add_zone: zone table full, ignoring region at %p\n", pool_start);
+        return -1;
     }
 
-    size_t preliminary_max_blocks[BUDDY_MAX_ORDER + 1];
-    for (uint32_t order = BUDDY_MIN_ORDER; order <= BUDDY_MAX_ORDER; order++) {
-        preliminary_max_blocks[order] = allocator->pool_size / BUDDY_BLOCK_SIZE(order);
+    uintptr_t start = ((uintptr_t)pool_start + BUDDY_PAGE_SIZE - 1) & ~(uintptr_t)(BUDDY_PAGE_SIZE - 1);
+    uintptr_t region_end = ((uintptr_t)pool_start + pool_size) & ~(uintptr_t)(BUDDY_PAGE_SIZE - 1);
+    if (region_end <= start) {
+        return -1;
     }
 
+    uintptr_t base = start & ~(uintptr_t)(BUDDY_BLOCK_SIZE(BUDDY_MAX_ORDER) - 1);
+
     size_t total_bitmap_size = 0;
     for (uint32_t order = BUDDY_MIN_ORDER; order <= BUDDY_MAX_ORDER; order++) {
-        size_t bitmap_words = (preliminary_max_blocks[order] + 31) / 32;
-        total_bitmap_size += bitmap_words * sizeof(uint32_t);
-    }
-
-    if (allocator->pool_size > total_bitmap_size) {
-        allocator->pool_size -= total_bitmap_size;
-    } else {
-        LOG_ERROR("buddy_init: pool too small for bitmaps (pool_size=%zu, bitmap_size=%zu)\n",
-                 allocator->pool_size, total_bitmap_size);
-        panic("Pool too small for buddy allocator bitmaps");
-    }
-
+        size_t blocks = (region_end - base) / BUDDY_BLOCK_SIZE(order);
+        total_bitmap_size += ((blocks + 31) / 32) * sizeof(uint32_t);
+    }
+
+    // Descriptors cover the whole region; the tail used by metadata is simply never handed out
+    size_t page_count = (region_end - start) / BUDDY_PAGE_SIZE;
+    size_t desc_size = (page_count * sizeof(page_desc_t) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    size_t meta_size = desc_size + total_bitmap_size;
+
+    uintptr_t end = (region_end - meta_size) & ~(uintptr_t)(BUDDY_PAGE_SIZE - 1);
+    if (region_end < meta_size || end <= start) {
+        LOG_WARN("buddy_add_zone: region at %p too small for metadata, skipping\n", pool_start);
+        return -1;
+    }
+
+    // Keep zones sorted by address so frees can binary search
+    uint32_t slot = allocator->zone_count;
+    while (slot > 0 && (uintptr_t)allocator->zones[slot - 1].pool_start > start) {
+        allocator->zones[slot] = allocator->zones[slot - 1];
+        slot--;
+    }
+
+    buddy_zone_t* zone = &allocator->zones[slot];
+    // Unnamed: up to BUDDY_MAX_ZONES of them would crowd everything else out of /proc/lockstat
+    spinlock_init(&zone->lock);
+    zone->base = base;
+    zone->pool_start = (void*)start;
+    zone->pool_size = end - start;
+    zone->free_bytes = 0;
+    zone->stats.alloc_count = 0;
+    zone->stats.free_count = 0;
+    zone->stats.fail_count = 0;
+    zone->stats.fallback_count = 0;
+
+    zone->pages = (page_desc_t*)end;
+    zone->page_count = page_count;
+    for (size_t i = 0; i < page_count; i++) {
+        zone->pages[i].type = PAGE_TYPE_FREE;
+        zone->pages[i].order = 0;
+        zone->pages[i].flags = 0;
+        zone->pages[i].private = 0;
+    }
+
+    uintptr_t bitmap_start = end + desc_size;
     for (uint32_t order = BUDDY_MIN_ORDER; order <= BUDDY_MAX_ORDER; order++) {
-        allocator->max_blocks[order] = allocator->pool_size / BUDDY_BLOCK_SIZE(order);
-    }
+        zone->max_blocks[order] = (end - base) / BUDDY_BLOCK_SIZE(order);
+        size_t bitmap_words = (zone->max_blocks[order] + 31) / 32;
 
-    uintptr_t bitmap_start = (uintptr_t)allocator->pool_start + allocator->pool_size;
-    for (int32_t order = BUDDY_MAX_ORDER; order >= BUDDY_MIN_ORDER; order--) {
-        size_t bitmap_words = (allocator->max_blocks[order] + 31) / 32;
-        bitmap_start -= bitmap_words * sizeof(uint32_t);
-        allocator->free_area_bitmap[order] = (uint32_t*)bitmap_start;
-        allocator->free_area_size[order] = 0;
+        zone->free_area_bitmap[order] = (uint32_t*)bitmap_start;
+        zone->free_area_size[order] = 0;
+        bitmap_start += bitmap_words * sizeof(uint32_t);
 
         for (size_t i = 0; i < bitmap_words; i++) {
-            allocator->free_area_bitmap[order][i] = 0xFFFFFFFF;
+            zone->free_area_bitmap[order][i] = 0xFFFFFFFF;
         }
     }
 
-    if (bitmap_start < (uintptr_t)allocator->pool_start) {
-        LOG_ERROR("buddy_init: bitmap placement error\n");
+    if (bitmap_start > region_end) {
+        LOG_ERROR("buddy_add_zone: bitmap placement error\n");
         panic("Bitmap placement error in buddy allocator");
     }
 
-    uint32_t max_order = BUDDY_MAX_ORDER;
-    while (max_order > BUDDY_MIN_ORDER && allocator->max_blocks[max_order] == 0) {
-        max_order--;
-    }
-
-    if (max_order < BUDDY_MIN_ORDER || allocator->max_blocks[max_order] == 0) {
-        LOG_ERROR("buddy_init: no suitable order found for pool_size=%zu\n", allocator->pool_size);
-        panic("No suitable order found for buddy allocator");
+    // Carve [start, end) into the largest naturally aligned blocks that fit
+    uintptr_t addr = start;
+    while (addr < end) {
+        uint32_t order = BUDDY_MAX_ORDER;
+        while (order > BUDDY_MIN_ORDER &&
+               (((addr - base) & (BUDDY_BLOCK_SIZE(order) - 1)) != 0 ||
+                addr + BUDDY_BLOCK_SIZE(order) > end)) {
+            order--;
+        }
+        mark_block_free(zone, (void*)addr, order);
+        addr += BUDDY_BLOCK_SIZE(order);
     }
 
-    size_t block_size = BUDDY_BLOCK_SIZE(max_order);
-    if (allocator->pool_size % block_size != 0) {
-        LOG_WARN("buddy_init: pool_size %zu not divisible by block_size %zu, adjusting\n",
-                allocator->pool_size, block_size);
-        allocator->pool_size = (allocator->pool_size / block_size) * block_size;
-        allocator->max_blocks[max_order] = allocator->pool_size / block_size;
-    }
+    allocator->zone_count++;
+    rebuild_fallback(allocator);
 
-    if (allocator->max_blocks[max_order] > 0) {
-        clear_bit(allocator->free_area_bitmap[max_order], 0, allocator->max_blocks[max_order]);
-        allocator->free_area_size[max_order] = 1;
-        LOG_TRACE("buddy_init: marked block 0 in order max_order %u as free\n", max_order);
-    }
-
-    spinlock_release(&allocator->lock);
-    LOG_TRACE("buddy_init: completed, final pool_size=%zu\n", allocator->pool_size);
+    LOG_TRACE("buddy_add_zone: zone %u ready, usable=%zu\n", slot, zone->pool_size);
+    return (int)slot;
 }
 
 void* buddy_alloc(buddy_allocator_t* allocator, size_t size) {
@@ -353,18 +334,78 @@ void* buddy_alloc(buddy_allocator_t* allocator, size_t size) {
         return NULL;
     }
 
-    if (size > allocator->pool_size) {
-        LOG_TRACE("buddy_alloc: size %zu > pool_size %zu\n", size, allocator->pool_size);
+    if (size > BUDDY_BLOCK_SIZE(BUDDY_MAX_ORDER)) {
+        LOG_TRACE("buddy_alloc: size %zu exceeds max block\n", size);
         return NULL;
     }
 
-    spinlock_acquire(&allocator->lock);
     uint32_t target_order = get_minimum_order(size);
-    void* result = alloc_block(allocator, target_order);
-    spinlock_release(&allocator->lock);
 
-    LOG_TRACE("buddy_alloc: allocated at %p (order=%u)\n", result, target_order);
-    return result;
+    for (uint32_t i = 0; i < allocator->zone_count; i++) {
+        buddy_zone_t* zone = &allocator->zones[allocator->fallback[i]];
+
+        spinlock_acquire(&zone->lock);
+        void* result = NULL;
+        if (zone->free_bytes >= BUDDY_BLOCK_SIZE(target_order))
+            result = alloc_block(zone, target_order);
+        if (result) {
+            page_desc_t* desc = &zone->pages[((uintptr_t)result - (uintptr_t)zone->pool_start) / BUDDY_PAGE_SIZE];
+            desc->type = PAGE_TYPE_BUDDY;
+            desc->order = (uint8_t)target_order;
+            desc->flags = 0;
+            desc->private = 0;
+            zone->stats.alloc_count++;
+            if (i > 0) zone->stats.fallback_count++;
+        }
+        spinlock_release(&zone->lock);
+
+        if (result) {
+            LOG_TRACE("buddy_alloc: allocated at %p (order=%u, zone=%u)\n", result, target_order, zone->id);
+            return result;
+        }
+    }
+
+    // Only a request no zone could satisfy is a failure; it is charged to the preferred zone
+    if (allocator->zone_count > 0) {
+        buddy_zone_t* zone = &allocator->zones[allocator->fallback[0]];
+        spinlock_acquire(&zone->lock);
+        zone->stats.fail_count++;
+        spinlock_release(&zone->lock);
+    }
+
+    LOG_TRACE("buddy_alloc: no zone can satisfy order %u\n", target_order);
+    return NULL;
+}
+
+buddy_zone_t* buddy_find_zone(buddy_allocator_t* allocator, void* ptr) {
+    uintptr_t addr = (uintptr_t)ptr;
+    uint32_t lo = 0;
+    uint32_t hi = allocator->zone_count;
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        buddy_zone_t* zone = &allocator->zones[mid];
+
+        if (addr < (uintptr_t)zone->pool_start) {
+            hi = mid;
+        } else if (addr >= zone_end(zone)) {
+            lo = mid + 1;
+        } else {
+            return zone;
+        }
+    }
+    return NULL;
+}
+
+page_desc_t* buddy_page_desc(buddy_allocator_t* allocator, void* ptr) {
+    if (!allocator || !ptr) return NULL;
+
+    buddy_zone_t* zone = buddy_find_zone(allocator, ptr);
+    if (!zone) return NULL;
+
+    size_t index = ((uintptr_t)ptr - (uintptr_t)zone->pool_start) / BUDDY_PAGE_SIZE;
+    if (index >= zone->page_count) return NULL;
+    return &zone->pages[index];
 }
 
 void buddy_free(buddy_allocator_t* allocator, void* ptr, uint32_t order) {
@@ -385,33 +426,61 @@ void buddy_free(buddy_allocator_t* allocator, void* ptr, uint32_t order) {
         return;
     }
 
-    if (!is_valid_block(allocator, ptr, order)) {
+    buddy_zone_t* zone = buddy_find_zone(allocator, ptr);
+    if (!zone || !is_valid_block(zone, ptr, order)) {
         LOG_ERROR("buddy_free: invalid block ptr=%p order=%u\n", ptr, order);
         return;
     }
 
-    spinlock_acquire(&allocator->lock);
-    free_block(allocator, ptr, order);
-    spinlock_release(&allocator->lock);
+    spinlock_acquire(&zone->lock);
+    free_block(zone, ptr, order);
+    zone->pages[((uintptr_t)ptr - (uintptr_t)zone->pool_start) / BUDDY_PAGE_SIZE].type = PAGE_TYPE_FREE;
+    zone->stats.free_count++;
+    spinlock_release(&zone->lock);
 
     LOG_TRACE("buddy_free: freed block at %p\n", ptr);
 }
 
+size_t buddy_zone_free_memory(buddy_zone_t* zone) {
+    uint64_t flags = spinlock_acquire_irqsave(&zone->lock);
+    size_t free_memory = zone->free_bytes;
+    spinlock_release_irqrestore(&zone->lock, flags);
+    return free_memory;
+}
+
+void buddy_zone_free_areas(buddy_zone_t* zone, size_t counts[BUDDY_MAX_ORDER + 1]) {
+    uint64_t flags = spinlock_acquire_irqsave(&zone->lock);
+    memcpy(counts, zone->free_area_size, sizeof(zone->free_area_size));
+    spinlock_release_irqrestore(&zone->lock, flags);
+}
+
 size_t buddy_get_free_memory(buddy_allocator_t* allocator) {
-    spinlock_acquire(&allocator->lock);
     size_t free_memory = 0;
 
-    for (uint32_t order = BUDDY_MIN_ORDER; order <= BUDDY_MAX_ORDER; order++) {
-        free_memory += allocator->free_area_size[order] * BUDDY_BLOCK_SIZE(order);
+    for (uint32_t i = 0; i < allocator->zone_count; i++) {
+        free_memory += buddy_zone_free_memory(&allocator->zones[i]);
     }
 
-    spinlock_release(&allocator->lock);
     LOG_TRACE("buddy_get_free_memory: %zu bytes free\n", free_memory);
     return free_memory;
 }
 
 size_t buddy_get_total_memory(buddy_allocator_t* allocator) {
-    size_t total = allocator->pool_size;
+    size_t total = 0;
+
+    for (uint32_t i = 0; i < allocator->zone_count; i++) {
+        total += allocator->zones[i].pool_size;
+    }
+
     LOG_TRACE("buddy_get_total_memory: %zu bytes total\n", total);
     return total;
 }
+
+uint32_t buddy_zone_count(buddy_allocator_t* allocator) {
+    return allocator->zone_count;
+}
+
+buddy_zone_t* buddy_get_zone(buddy_allocator_t* allocator, uint32_t index) {
+    if (index >= allocator->zone_count) return NULL;
+    return &allocator->zones[index];
+}
@@ -3,6 +3,7 @@
 #include <core/kernel/mem/cpu_pool.h>
 #include <core/kernel/mem/buddy.h>
 #include <core/kernel/kstd.h>
+#include <core/arch/percpu.h>
 #include <log.h>
 
 extern buddy_allocator_t* slab_get_buddy(void);
@@ -35,8 +36,10 @@ void cpu_pool_init(uint32_t cpu_id) {
     p->initialized = 1;
 }
 
-void* cpu_pool_alloc(uint32_t cpu_id, uint32_t order) {
+// Pools are only ever touched by their own CPU
+void* cpu_pool_alloc(uint32_t order) {
     buddy_allocator_t* buddy = slab_get_buddy();
+    uint32_t cpu_id = this_cpu_id();
     size_t bsize = (size_t)1 << order;
 
     if (cpu_id >= CPU_POOL_MAX_CPUS) return buddy_alloc(buddy, bsize);
@@ -62,9 +65,10 @@ void* cpu_pool_alloc(uint32_t cpu_id, uint32_t order) {
     return buddy_alloc(buddy, bsize);
 }
 
-void cpu_pool_free(uint32_t cpu_id, void* ptr, uint32_t order) {
+void cpu_pool_free(void* ptr, uint32_t order) {
     if (!ptr) return;
     buddy_allocator_t* buddy = slab_get_buddy();
+    uint32_t cpu_id = this_cpu_id();
 
     if (cpu_id >= CPU_POOL_MAX_CPUS) { buddy_free(buddy, ptr, order); return; }
     cpu_pool_t* p = &cpu_pools[cpu_id];
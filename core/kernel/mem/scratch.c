@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/kernel/mem/scratch.h>
+#include <core/kernel/mem/allocator.h>
+#include <core/arch/percpu.h>
+#include <log.h>
+
+typedef struct {
+    uint8_t* base;
+    uint32_t top;
+    uint32_t size;
+    uint32_t overflows;
+} __attribute__((aligned(64))) scratch_arena_t;
+
+static scratch_arena_t arenas[SCRATCH_MAX_CPUS];
+
+static inline scratch_arena_t* this_arena(void) {
+    uint32_t cpu_id = this_cpu_id();
+    return cpu_id < SCRATCH_MAX_CPUS ? &arenas[cpu_id] : NULL;
+}
+
+void scratch_cpu_init(uint32_t cpu_id) {
+    if (cpu_id >= SCRATCH_MAX_CPUS) return;
+    scratch_arena_t* a = &arenas[cpu_id];
+    if (a->base) return;
+
+    a->base = kalloc_pages(SCRATCH_ARENA_ORDER, 0, NULL);
+    if (!a->base) {
+        LOG_WARN("scratch: no arena for cpu%u\n", cpu_id);
+        return;
+    }
+    a->top  = 0;
+    a->size = 4096u << SCRATCH_ARENA_ORDER;
+}
+
+scratch_mark_t scratch_mark(void) {
+    scratch_arena_t* a = this_arena();
+    return a ? a->top : 0;
+}
+
+// An interrupt that uses the arena resets it before returning, so `top` is stable here
+void* scratch_alloc_aligned(size_t size, size_t align) {
+    scratch_arena_t* a = this_arena();
+    if (!a || !a->base) return NULL;
+
+    if (align < SCRATCH_ALIGN) align = SCRATCH_ALIGN;
+    size_t start = ((size_t)a->top + align - 1) & ~(align - 1);
+    size = (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    if (start > a->size || size > a->size - start) {
+        if (a->overflows++ == 0)
+            LOG_WARN("scratch: cpu%u arena exhausted (%zu bytes requested, %u in use)\n",
+                     this_cpu_id(), size, a->top);
+        return NULL;
+    }
+
+    a->top = (uint32_t)(start + size);
+    return a->base + start;
+}
+
+void* scratch_alloc(size_t size) {
+    return scratch_alloc_aligned(size, SCRATCH_ALIGN);
+}
+
+void scratch_reset(scratch_mark_t mark) {
+    scratch_arena_t* a = this_arena();
+    if (a && mark <= a->top) a->top = mark;
+}
@@ -4,7 +4,7 @@
 #include <core/kernel/mem/buddy.h>
 #include <core/kernel/kstd.h>
 #include <core/arch/spinlock.h>
-#include <core/arch/smp.h>
+#include <core/arch/percpu.h>
 #include <log.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -12,45 +12,97 @@
 
 extern buddy_allocator_t* slab_get_buddy(void);
 
-typedef struct slab_obj {
-    struct slab_obj* next;
-} slab_obj_t;
-
+/*
+ * Pages owned by a CPU are only touched by that CPU, except for
+ * `remote_free`: other CPUs push objects there without a lock, and the
+ * first push onto an empty list also queues the page on the owner's
+ * `remote_pages` stack so the owner can reclaim the whole batch later.
+ *
+ * A slab spans 2^order pages and is naturally aligned to its own size, so
+ * the header of any object's slab is found by masking the object address.
+ * Free objects are linked through a pointer stored `free_offset` bytes in.
+ */
 typedef struct slab_page {
     struct slab_page* next;
     struct slab_page* prev;
     uint32_t          magic;
-    uint16_t          obj_size;
     uint16_t          total_count;
     uint16_t          free_count;
     uint16_t          owner_cpu;
-    slab_obj_t*       freelist;
+    kmem_cache_t*     cache;
+    void*             freelist;
+    void*             remote_free;
+    struct slab_page* remote_next;
 } slab_page_t;
 
 #define SLAB_CPU_NONE 0xFFFF
 
-typedef struct {
-    uint16_t     obj_size;
-    slab_page_t* partial;
-    slab_page_t* full;
-    spinlock_t   lock;
-} slab_cache_t;
+typedef struct slab_magazine {
+    struct slab_magazine* next;
+    uint32_t              rounds;
+    void*                 objs[SLAB_MAG_ROUNDS];
+} slab_magazine_t;
 
 typedef struct {
-    slab_page_t* partial;
-    slab_page_t* full;
-    uint16_t     obj_size;
+    slab_magazine_t* loaded;
+    slab_magazine_t* previous;
+    slab_page_t*     partial;
+    slab_page_t*     full;
+    slab_page_t*     remote_pages;
+    size_t           alloc_count;
+    size_t           free_count;
 } cpu_cache_t;
 
-typedef struct {
-    cpu_cache_t caches[SLAB_SIZES_COUNT];
-    uint8_t     initialized;
-} cpu_slab_t;
-
-static slab_cache_t caches[SLAB_SIZES_COUNT];
-static cpu_slab_t   cpu_slabs[SLAB_MAX_CPUS];
+struct kmem_cache {
+    char             name[KMEM_NAME_LEN];
+    size_t           obj_size;
+    size_t           stride;
+    size_t           align;
+    size_t           free_offset;
+    size_t           first_offset;
+    size_t           slab_size;
+    uint32_t         order;
+    uint16_t         objs_per_slab;
+    void           (*ctor)(void*);
+
+    // Pages used before the current CPU has called slab_cpu_init
+    slab_page_t*     partial;
+    slab_page_t*     full;
+    spinlock_t       lock;
+
+    // Depot of magazines shared by all CPUs
+    slab_magazine_t* depot_full;
+    slab_magazine_t* depot_empty;
+    uint32_t         depot_full_count;
+    uint32_t         depot_empty_count;
+    spinlock_t       depot_lock;
+
+    size_t           slab_count;
+    size_t           alloc_count;
+    size_t           free_count;
+
+    cpu_cache_t      cpu[SLAB_MAX_CPUS];
+};
+
+static kmem_cache_t kmem_caches[KMEM_MAX_CACHES];
+static uint32_t     kmem_cache_used = 0;
+static spinlock_t   kmem_cache_lock;
+static uint8_t      cpu_online[SLAB_MAX_CPUS];
 static const size_t obj_sizes[SLAB_SIZES_COUNT] = SLAB_OBJ_SIZES;
 
+static slab_magazine_t* free_magazines = NULL;
+static spinlock_t       magazine_lock;
+
+#define SLAB_ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+static inline void* obj_next(kmem_cache_t* cache, void* obj) {
+    return *(void**)((uint8_t*)obj + cache->free_offset);
+}
+
+static inline void obj_set_next(kmem_cache_t* cache, void* obj, void* next) {
+    *(void**)((uint8_t*)obj + cache->free_offset) = next;
+}
+
 static void list_remove(slab_page_t** head, slab_page_t* page) {
     if (page->prev)
         page->prev->next = page->next;
@@ -70,90 +122,232 @@ static void list_push(slab_page_t** head, slab_page_t* page) {
     *head = page;
 }
 
-static void slab_page_init(slab_page_t* page, size_t obj_size, uint16_t owner) {
+static void slab_page_init(kmem_cache_t* cache, slab_page_t* page, uint16_t owner) {
     page->magic       = SLAB_MAGIC;
-    page->obj_size    = (uint16_t)obj_size;
+    page->cache       = cache;
     page->next        = NULL;
     page->prev        = NULL;
     page->freelist    = NULL;
+    page->remote_free = NULL;
+    page->remote_next = NULL;
     page->owner_cpu   = owner;
 
-    uintptr_t start = (uintptr_t)page + sizeof(slab_page_t);
-    uintptr_t end   = (uintptr_t)page + SLAB_PAGE_SIZE;
-    uint16_t  count = 0;
-
-    for (uintptr_t p = start; p + obj_size <= end; p += obj_size) {
-        slab_obj_t* obj = (slab_obj_t*)p;
-        obj->next       = page->freelist;
-        page->freelist  = obj;
-        count++;
+    // Link in reverse so the first allocation returns the lowest address
+    uint8_t* base = (uint8_t*)page + cache->first_offset;
+    for (int i = (int)cache->objs_per_slab - 1; i >= 0; i--) {
+        void* obj = base + (size_t)i * cache->stride;
+        if (cache->ctor)
+            cache->ctor(obj);
+        obj_set_next(cache, obj, page->freelist);
+        page->freelist = obj;
     }
-    page->total_count = count;
-    page->free_count  = count;
+    page->total_count = cache->objs_per_slab;
+    page->free_count  = cache->objs_per_slab;
 }
 
-static slab_page_t* alloc_raw_page(size_t obj_size, uint16_t owner) {
+static slab_page_t* alloc_raw_page(kmem_cache_t* cache, uint16_t owner) {
     buddy_allocator_t* buddy = slab_get_buddy();
-    void* raw = buddy_alloc(buddy, SLAB_PAGE_SIZE);
+    void* raw = buddy_alloc(buddy, cache->slab_size);
     if (!raw) return NULL;
+    for (size_t off = 0; off < cache->slab_size; off += SLAB_PAGE_SIZE) {
+        page_desc_t* desc = buddy_page_desc(buddy, (uint8_t*)raw + off);
+        if (!desc) continue;
+        desc->type  = PAGE_TYPE_SLAB;
+        desc->order = (uint8_t)(BUDDY_MIN_ORDER + cache->order);
+    }
+
     slab_page_t* page = (slab_page_t*)raw;
-    slab_page_init(page, obj_size, owner);
+    slab_page_init(cache, page, owner);
+    __atomic_fetch_add(&cache->slab_count, 1, __ATOMIC_RELAXED);
     return page;
 }
 
-static int cache_index_for_size(uint16_t obj_size) {
-    for (int i = 0; i < SLAB_SIZES_COUNT; i++) {
-        if ((uint16_t)obj_sizes[i] == obj_size)
-            return i;
+static inline slab_page_t* slab_of(kmem_cache_t* cache, void* ptr) {
+    return (slab_page_t*)((uintptr_t)ptr & ~(uintptr_t)(cache->slab_size - 1));
+}
+
+static inline cpu_cache_t* current_cpu_cache(kmem_cache_t* cache, uint32_t* cpu_out) {
+    uint32_t cpu_id = this_cpu_id();
+    *cpu_out = cpu_id;
+    if (cpu_id < SLAB_MAX_CPUS && cpu_online[cpu_id])
+        return &cache->cpu[cpu_id];
+    return NULL;
+}
+
+// Smallest slab holding KMEM_MIN_OBJS with at most 1/8 waste, else the least wasteful
+static int pick_slab_order(size_t first_offset, size_t stride) {
+    int best = -1;
+    size_t best_waste = 0;
+
+    for (int order = 0; order <= KMEM_MAX_SLAB_ORDER; order++) {
+        size_t bytes = (size_t)SLAB_PAGE_SIZE << order;
+        if (first_offset + stride > bytes) continue;
+
+        size_t count = (bytes - first_offset) / stride;
+        size_t waste = bytes - first_offset - count * stride;
+        if (count >= KMEM_MIN_OBJS && waste * 8 <= bytes)
+            return order;
+
+        if (best < 0 || waste * ((size_t)SLAB_PAGE_SIZE << best) < best_waste * bytes) {
+            best       = order;
+            best_waste = waste;
+        }
     }
-    return -1;
+    return best;
+}
+
+static int cache_setup(kmem_cache_t* cache, const char* name, size_t size, size_t align,
+                       void (*ctor)(void*)) {
+    if (size == 0) return -1;
+    if (align == 0) align = 8;
+    if ((align & (align - 1)) != 0 || align > SLAB_PAGE_SIZE) return -1;
+    if (align < 8) align = 8;
+
+    // A constructed object must survive on the freelist, so keep the link past it
+    size_t free_offset = 0;
+    size_t stride;
+    if (ctor) {
+        free_offset = SLAB_ALIGN_UP(size, sizeof(void*));
+        stride      = SLAB_ALIGN_UP(free_offset + sizeof(void*), align);
+    } else {
+        stride = SLAB_ALIGN_UP(size < sizeof(void*) ? sizeof(void*) : size, align);
+    }
+
+    size_t first_offset = SLAB_ALIGN_UP(sizeof(slab_page_t), align);
+    int order = pick_slab_order(first_offset, stride);
+    if (order < 0) return -1;
+
+    memset(cache, 0, sizeof(*cache));
+    strcpy_safe(cache->name, name ? name : "unnamed", KMEM_NAME_LEN);
+    cache->obj_size      = size;
+    cache->stride        = stride;
+    cache->align         = align;
+    cache->free_offset   = free_offset;
+    cache->first_offset  = first_offset;
+    cache->order         = (uint32_t)order;
+    cache->slab_size     = (size_t)SLAB_PAGE_SIZE << order;
+    cache->objs_per_slab = (uint16_t)((cache->slab_size - first_offset) / stride);
+    cache->ctor          = ctor;
+    spinlock_init(&cache->lock);
+    spinlock_init(&cache->depot_lock);
+    return 0;
 }
 
 void slab_init(void) {
+    spinlock_init(&kmem_cache_lock);
+    spinlock_init(&magazine_lock);
+    for (int c = 0; c < SLAB_MAX_CPUS; c++)
+        cpu_online[c] = 0;
+
     for (int i = 0; i < SLAB_SIZES_COUNT; i++) {
-        caches[i].obj_size = (uint16_t)obj_sizes[i];
-        caches[i].partial  = NULL;
-        caches[i].full     = NULL;
-        spinlock_init(&caches[i].lock);
+        char name[KMEM_NAME_LEN];
+        char num[12];
+        strcpy_safe(name, "kmalloc-", sizeof(name));
+        itoa((int)obj_sizes[i], num, 10);
+        strcat_safe(name, num, sizeof(name));
+        cache_setup(&kmem_caches[i], name, obj_sizes[i], 8, NULL);
     }
-    for (int c = 0; c < SLAB_MAX_CPUS; c++)
-        cpu_slabs[c].initialized = 0;
+    kmem_cache_used = SLAB_SIZES_COUNT;
     LOG_INFO("slab: initialized %d caches\n", SLAB_SIZES_COUNT);
 }
 
 void slab_cpu_init(uint32_t cpu_id) {
     if (cpu_id >= SLAB_MAX_CPUS) return;
-    cpu_slab_t* cs = &cpu_slabs[cpu_id];
-    for (int i = 0; i < SLAB_SIZES_COUNT; i++) {
-        cs->caches[i].obj_size = (uint16_t)obj_sizes[i];
-        cs->caches[i].partial  = NULL;
-        cs->caches[i].full     = NULL;
+    cpu_online[cpu_id] = 1;
+}
+
+// Magazine structures are carved out of whole buddy pages and never returned
+static slab_magazine_t* magazine_alloc(void) {
+    spinlock_acquire(&magazine_lock);
+    if (!free_magazines) {
+        void* raw = buddy_alloc(slab_get_buddy(), SLAB_PAGE_SIZE);
+        if (!raw) {
+            spinlock_release(&magazine_lock);
+            return NULL;
+        }
+        size_t per_page = SLAB_PAGE_SIZE / sizeof(slab_magazine_t);
+        for (size_t i = 0; i < per_page; i++) {
+            slab_magazine_t* m = (slab_magazine_t*)raw + i;
+            m->next = free_magazines;
+            free_magazines = m;
+        }
     }
-    cs->initialized = 1;
+    slab_magazine_t* mag = free_magazines;
+    free_magazines = mag->next;
+    spinlock_release(&magazine_lock);
+
+    mag->next   = NULL;
+    mag->rounds = 0;
+    return mag;
 }
 
-static void* cpu_cache_alloc(cpu_cache_t* cc, uint32_t cpu_id, int idx) {
-    slab_page_t* page = cc->partial;
+static void magazine_release(slab_magazine_t* mag) {
+    spinlock_acquire(&magazine_lock);
+    mag->next = free_magazines;
+    free_magazines = mag;
+    spinlock_release(&magazine_lock);
+}
 
-    if (!page) {
-        slab_cache_t* gc = &caches[idx];
-        spinlock_acquire(&gc->lock);
-        page = gc->partial;
-        if (page) {
-            list_remove(&gc->partial, page);
-            spinlock_release(&gc->lock);
-            page->owner_cpu = (uint16_t)cpu_id;
-            list_push(&cc->partial, page);
-        } else {
-            spinlock_release(&gc->lock);
-            page = alloc_raw_page(cc->obj_size, (uint16_t)cpu_id);
-            if (!page) return NULL;
+/* ---- Page layer ---- */
+
+static void remote_page_free(kmem_cache_t* cache, slab_page_t* page, void* ptr) {
+    void* head = __atomic_load_n(&page->remote_free, __ATOMIC_RELAXED);
+    do {
+        obj_set_next(cache, ptr, head);
+    } while (!__atomic_compare_exchange_n(&page->remote_free, &head, ptr, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (head != NULL) return;
+
+    // First remote free since the owner last drained this page: tell the owner
+    cpu_cache_t* owner = &cache->cpu[page->owner_cpu];
+    slab_page_t* pending = __atomic_load_n(&owner->remote_pages, __ATOMIC_RELAXED);
+    do {
+        page->remote_next = pending;
+    } while (!__atomic_compare_exchange_n(&owner->remote_pages, &pending, page, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void cpu_cache_reclaim_remote(kmem_cache_t* cache, cpu_cache_t* cc) {
+    slab_page_t* page = __atomic_exchange_n(&cc->remote_pages, NULL, __ATOMIC_ACQUIRE);
+
+    while (page) {
+        slab_page_t* next = page->remote_next;
+        void* obj = __atomic_exchange_n(&page->remote_free, NULL, __ATOMIC_ACQ_REL);
+        bool was_full = (page->free_count == 0);
+
+        while (obj) {
+            void* obj_after = obj_next(cache, obj);
+            obj_set_next(cache, obj, page->freelist);
+            page->freelist = obj;
+            page->free_count++;
+            obj = obj_after;
+        }
+
+        if (was_full && page->free_count > 0) {
+            list_remove(&cc->full, page);
             list_push(&cc->partial, page);
         }
+        page = next;
+    }
+}
+
+static void* cpu_cache_alloc(kmem_cache_t* cache, cpu_cache_t* cc, uint32_t cpu_id) {
+    slab_page_t* page = cc->partial;
+
+    if (!page) {
+        cpu_cache_reclaim_remote(cache, cc);
+        page = cc->partial;
     }
 
-    slab_obj_t* obj = page->freelist;
-    page->freelist  = obj->next;
+    if (!page) {
+        page = alloc_raw_page(cache, (uint16_t)cpu_id);
+        if (!page) return NULL;
+        list_push(&cc->partial, page);
+    }
+
+    void* obj      = page->freelist;
+    page->freelist = obj_next(cache, obj);
     page->free_count--;
 
     if (page->free_count == 0) {
@@ -161,15 +355,14 @@ static void* cpu_cache_alloc(cpu_cache_t* cc, uint32_t cpu_id, int idx) {
         list_push(&cc->full, page);
     }
 
-    return (void*)obj;
+    return obj;
 }
 
-static void cpu_cache_free(cpu_cache_t* cc, slab_page_t* page, void* ptr) {
+static void cpu_cache_free(kmem_cache_t* cache, cpu_cache_t* cc, slab_page_t* page, void* ptr) {
     bool was_full = (page->free_count == 0);
 
-    slab_obj_t* obj = (slab_obj_t*)ptr;
-    obj->next       = page->freelist;
-    page->freelist  = obj;
+    obj_set_next(cache, ptr, page->freelist);
+    page->freelist = ptr;
     page->free_count++;
 
     if (was_full) {
@@ -178,110 +371,309 @@ static void cpu_cache_free(cpu_cache_t* cc, slab_page_t* page, void* ptr) {
     }
 }
 
-static void global_cache_free(slab_cache_t* gc, slab_page_t* page, void* ptr) {
-    spinlock_acquire(&gc->lock);
+static void global_cache_free(kmem_cache_t* cache, slab_page_t* page, void* ptr) {
+    spinlock_acquire(&cache->lock);
 
     bool was_full = (page->free_count == 0);
 
-    slab_obj_t* obj = (slab_obj_t*)ptr;
-    obj->next       = page->freelist;
-    page->freelist  = obj;
+    obj_set_next(cache, ptr, page->freelist);
+    page->freelist = ptr;
     page->free_count++;
 
     if (was_full) {
-        list_remove(&gc->full, page);
-        list_push(&gc->partial, page);
+        list_remove(&cache->full, page);
+        list_push(&cache->partial, page);
     }
 
-    spinlock_release(&gc->lock);
+    spinlock_release(&cache->lock);
 }
 
-void* slab_alloc(size_t size) {
-    for (int i = 0; i < SLAB_SIZES_COUNT; i++) {
-        if (size > caches[i].obj_size) continue;
-
-        uint32_t cpu_id = smp_current_cpu_id();
-        if (cpu_id < SLAB_MAX_CPUS && cpu_slabs[cpu_id].initialized)
-            return cpu_cache_alloc(&cpu_slabs[cpu_id].caches[i], cpu_id, i);
+static void* global_cache_alloc(kmem_cache_t* cache) {
+    spinlock_acquire(&cache->lock);
 
-        slab_cache_t* gc = &caches[i];
-        spinlock_acquire(&gc->lock);
-
-        slab_page_t* page = gc->partial;
+    slab_page_t* page = cache->partial;
+    if (!page) {
+        page = alloc_raw_page(cache, SLAB_CPU_NONE);
         if (!page) {
-            page = alloc_raw_page(gc->obj_size, SLAB_CPU_NONE);
-            if (!page) {
-                spinlock_release(&gc->lock);
-                return NULL;
-            }
-            list_push(&gc->partial, page);
+            spinlock_release(&cache->lock);
+            return NULL;
         }
+        list_push(&cache->partial, page);
+    }
+
+    void* obj      = page->freelist;
+    page->freelist = obj_next(cache, obj);
+    page->free_count--;
+
+    if (page->free_count == 0) {
+        list_remove(&cache->partial, page);
+        list_push(&cache->full, page);
+    }
+
+    spinlock_release(&cache->lock);
+    return obj;
+}
+
+// Return an object to the slab it was carved from, wherever that slab lives
+static void page_layer_free(kmem_cache_t* cache, uint32_t cpu_id, void* ptr) {
+    slab_page_t* page = slab_of(cache, ptr);
+    uint16_t owner = page->owner_cpu;
+
+    if (owner == SLAB_CPU_NONE || owner >= SLAB_MAX_CPUS || !cpu_online[owner]) {
+        global_cache_free(cache, page, ptr);
+    } else if (owner == (uint16_t)cpu_id) {
+        cpu_cache_free(cache, &cache->cpu[cpu_id], page, ptr);
+    } else {
+        remote_page_free(cache, page, ptr);
+    }
+}
+
+/* ---- Magazine layer ---- */
 
-        slab_obj_t* obj = page->freelist;
-        page->freelist  = obj->next;
-        page->free_count--;
+static void* magazine_alloc_obj(kmem_cache_t* cache, cpu_cache_t* cc, uint32_t cpu_id) {
+    slab_magazine_t* loaded = cc->loaded;
+    if (loaded && loaded->rounds > 0)
+        return loaded->objs[--loaded->rounds];
 
-        if (page->free_count == 0) {
-            list_remove(&gc->partial, page);
-            list_push(&gc->full, page);
+    if (cc->previous && cc->previous->rounds > 0) {
+        cc->loaded   = cc->previous;
+        cc->previous = loaded;
+        return cc->loaded->objs[--cc->loaded->rounds];
+    }
+
+    spinlock_acquire(&cache->depot_lock);
+    slab_magazine_t* full = cache->depot_full;
+    if (full) {
+        cache->depot_full = full->next;
+        cache->depot_full_count--;
+        if (cc->previous) {
+            cc->previous->next = cache->depot_empty;
+            cache->depot_empty = cc->previous;
+            cache->depot_empty_count++;
         }
+    }
+    spinlock_release(&cache->depot_lock);
 
-        spinlock_release(&gc->lock);
-        return (void*)obj;
+    if (full) {
+        cc->previous = cc->loaded;
+        cc->loaded   = full;
+        return full->objs[--full->rounds];
     }
-    return NULL;
+
+    return cpu_cache_alloc(cache, cc, cpu_id);
 }
 
-void slab_free(void* ptr) {
-    if (!ptr) return;
+static void magazine_free_obj(kmem_cache_t* cache, cpu_cache_t* cc, uint32_t cpu_id, void* ptr) {
+    slab_magazine_t* loaded = cc->loaded;
+    if (loaded && loaded->rounds < SLAB_MAG_ROUNDS) {
+        loaded->objs[loaded->rounds++] = ptr;
+        return;
+    }
 
-    uintptr_t page_addr = (uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1);
-    slab_page_t* page   = (slab_page_t*)page_addr;
+    if (cc->previous && cc->previous->rounds == 0) {
+        cc->loaded   = cc->previous;
+        cc->previous = loaded;
+        cc->loaded->objs[cc->loaded->rounds++] = ptr;
+        return;
+    }
 
-    if (page->magic != SLAB_MAGIC) {
-        LOG_WARN("slab_free: bad magic at %p\n", page);
+    slab_magazine_t* overflow = NULL;
+
+    spinlock_acquire(&cache->depot_lock);
+    slab_magazine_t* empty = cache->depot_empty;
+    if (empty) {
+        cache->depot_empty = empty->next;
+        cache->depot_empty_count--;
+    }
+    if (cc->previous) {
+        cc->previous->next = cache->depot_full;
+        cache->depot_full  = cc->previous;
+        cache->depot_full_count++;
+        cc->previous = NULL;
+    }
+    if (cache->depot_full_count > SLAB_DEPOT_MAX_FULL) {
+        overflow = cache->depot_full;
+        cache->depot_full = overflow->next;
+        cache->depot_full_count--;
+    }
+    spinlock_release(&cache->depot_lock);
+
+    // Depot is over its limit: hand one magazine's worth back to the slabs
+    if (overflow) {
+        for (uint32_t i = 0; i < overflow->rounds; i++)
+            page_layer_free(cache, cpu_id, overflow->objs[i]);
+        overflow->rounds = 0;
+        if (empty)
+            magazine_release(overflow);
+        else
+            empty = overflow;
+    }
+
+    if (!empty)
+        empty = magazine_alloc();
+
+    if (!empty) {
+        page_layer_free(cache, cpu_id, ptr);
         return;
     }
 
-    int idx = cache_index_for_size(page->obj_size);
-    if (idx < 0) return;
+    cc->previous = loaded;
+    cc->loaded   = empty;
+    empty->objs[empty->rounds++] = ptr;
+}
+
+/* ---- Cache interface ---- */
 
-    uint16_t owner = page->owner_cpu;
-    uint32_t cpu_id = smp_current_cpu_id();
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*)) {
+    spinlock_acquire(&kmem_cache_lock);
+    if (kmem_cache_used >= KMEM_MAX_CACHES) {
+        spinlock_release(&kmem_cache_lock);
+        LOG_ERROR("slab: no free cache slot for %s\n", name ? name : "unnamed");
+        return NULL;
+    }
+
+    kmem_cache_t* cache = &kmem_caches[kmem_cache_used];
+    if (cache_setup(cache, name, size, align, ctor) != 0) {
+        spinlock_release(&kmem_cache_lock);
+        LOG_ERROR("slab: cannot create cache %s (size %zu, align %zu)\n",
+                  name ? name : "unnamed", size, align);
+        return NULL;
+    }
+    kmem_cache_used++;
+    spinlock_release(&kmem_cache_lock);
+
+    LOG_DEBUG("slab: cache %s: %zu byte objects, %u per %zu byte slab\n",
+              cache->name, cache->stride, (uint32_t)cache->objs_per_slab, cache->slab_size);
+    return cache;
+}
 
-    if (owner != SLAB_CPU_NONE && owner == (uint16_t)cpu_id
-        && cpu_id < SLAB_MAX_CPUS && cpu_slabs[cpu_id].initialized) {
-        cpu_cache_free(&cpu_slabs[cpu_id].caches[idx], page, ptr);
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    if (!cache) return NULL;
+
+    uint32_t cpu_id;
+    cpu_cache_t* cc = current_cpu_cache(cache, &cpu_id);
+    if (cc) {
+        void* obj = magazine_alloc_obj(cache, cc, cpu_id);
+        if (obj) cc->alloc_count++;
+        return obj;
+    }
+
+    void* obj = global_cache_alloc(cache);
+    if (obj) __atomic_fetch_add(&cache->alloc_count, 1, __ATOMIC_RELAXED);
+    return obj;
+}
+
+static void cache_free_obj(kmem_cache_t* cache, void* ptr) {
+    uint32_t cpu_id;
+    cpu_cache_t* cc = current_cpu_cache(cache, &cpu_id);
+    if (cc) {
+        cc->free_count++;
+        magazine_free_obj(cache, cc, cpu_id, ptr);
         return;
     }
 
-    if (owner != SLAB_CPU_NONE && owner < SLAB_MAX_CPUS && cpu_slabs[owner].initialized) {
-        global_cache_free(&caches[idx], page, ptr);
-        page->owner_cpu = SLAB_CPU_NONE;
+    __atomic_fetch_add(&cache->free_count, 1, __ATOMIC_RELAXED);
+    page_layer_free(cache, cpu_id, ptr);
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!cache || !obj) return;
+
+    slab_page_t* page = slab_of(cache, obj);
+    if (page->magic != SLAB_MAGIC || page->cache != cache) {
+        LOG_WARN("kmem_cache_free: %p does not belong to %s\n", obj, cache->name);
         return;
     }
+    cache_free_obj(cache, obj);
+}
 
-    global_cache_free(&caches[idx], page, ptr);
+uint32_t kmem_cache_count(void) {
+    return __atomic_load_n(&kmem_cache_used, __ATOMIC_ACQUIRE);
 }
 
-int slab_owns(void* ptr) {
-    if (!ptr) return 0;
-    uintptr_t page_addr = (uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1);
-    slab_page_t* page   = (slab_page_t*)page_addr;
-    return (page->magic == SLAB_MAGIC);
+kmem_cache_t* kmem_cache_get(uint32_t index) {
+    if (index >= kmem_cache_count()) return NULL;
+    return &kmem_caches[index];
 }
 
-void* slab_alloc_cpu(uint32_t cpu_id, size_t size) {
-    if (cpu_id >= SLAB_MAX_CPUS || !cpu_slabs[cpu_id].initialized)
-        return slab_alloc(size);
+// Per-CPU counters are read without their owners' cooperation, so totals are approximate
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* out) {
+    if (!cache || !out) return;
+
+    out->name          = cache->name;
+    out->obj_size      = cache->obj_size;
+    out->stride        = cache->stride;
+    out->align         = cache->align;
+    out->slab_size     = cache->slab_size;
+    out->objs_per_slab = cache->objs_per_slab;
+    out->slab_count    = __atomic_load_n(&cache->slab_count, __ATOMIC_RELAXED);
+    out->alloc_count   = __atomic_load_n(&cache->alloc_count, __ATOMIC_RELAXED);
+    out->free_count    = __atomic_load_n(&cache->free_count, __ATOMIC_RELAXED);
+    out->depot_full    = __atomic_load_n(&cache->depot_full_count, __ATOMIC_RELAXED);
+    out->depot_empty   = __atomic_load_n(&cache->depot_empty_count, __ATOMIC_RELAXED);
+
+    for (int c = 0; c < SLAB_MAX_CPUS; c++) {
+        out->alloc_count += __atomic_load_n(&cache->cpu[c].alloc_count, __ATOMIC_RELAXED);
+        out->free_count  += __atomic_load_n(&cache->cpu[c].free_count, __ATOMIC_RELAXED);
+    }
+}
+
+// Magazines are never returned to the page allocator, so a stale pointer is still readable
+int kmem_cache_get_cpu_stats(kmem_cache_t* cache, uint32_t cpu_id, kmem_cache_cpu_stats_t* out) {
+    if (!cache || !out || cpu_id >= SLAB_MAX_CPUS || !cpu_online[cpu_id]) return -1;
+
+    cpu_cache_t* cc = &cache->cpu[cpu_id];
+    slab_magazine_t* loaded   = __atomic_load_n(&cc->loaded, __ATOMIC_RELAXED);
+    slab_magazine_t* previous = __atomic_load_n(&cc->previous, __ATOMIC_RELAXED);
+
+    out->loaded_rounds   = loaded ? __atomic_load_n(&loaded->rounds, __ATOMIC_RELAXED) : 0;
+    out->previous_rounds = previous ? __atomic_load_n(&previous->rounds, __ATOMIC_RELAXED) : 0;
+    out->alloc_count     = __atomic_load_n(&cc->alloc_count, __ATOMIC_RELAXED);
+    out->free_count      = __atomic_load_n(&cc->free_count, __ATOMIC_RELAXED);
+    return 0;
+}
 
+/* ---- kmalloc size classes ---- */
+
+void* slab_alloc(size_t size) {
     for (int i = 0; i < SLAB_SIZES_COUNT; i++) {
-        if (size > (size_t)cpu_slabs[cpu_id].caches[i].obj_size) continue;
-        return cpu_cache_alloc(&cpu_slabs[cpu_id].caches[i], cpu_id, i);
+        if (size <= kmem_caches[i].obj_size)
+            return kmem_cache_alloc(&kmem_caches[i]);
     }
     return NULL;
 }
 
+// Any cache's object may come through here; the page descriptor gives the slab size
+void slab_free(void* ptr) {
+    if (!ptr) return;
+
+    page_desc_t* desc = buddy_page_desc(slab_get_buddy(), ptr);
+    if (!desc || desc->type != PAGE_TYPE_SLAB) {
+        LOG_WARN("slab_free: %p is not a slab object\n", ptr);
+        return;
+    }
+
+    slab_page_t* page = (slab_page_t*)((uintptr_t)ptr & ~(uintptr_t)(BUDDY_BLOCK_SIZE(desc->order) - 1));
+    if (page->magic != SLAB_MAGIC) {
+        LOG_WARN("slab_free: bad magic at %p\n", page);
+        return;
+    }
+
+    cache_free_obj(page->cache, ptr);
+}
+
+int slab_owns(void* ptr) {
+    if (!ptr) return 0;
+    page_desc_t* desc = buddy_page_desc(slab_get_buddy(), ptr);
+    return desc && desc->type == PAGE_TYPE_SLAB;
+}
+
+// Per-CPU state is only safe to touch from its own CPU; other ids use the caller's
+void* slab_alloc_cpu(uint32_t cpu_id, size_t size) {
+    (void)cpu_id;
+    return slab_alloc(size);
+}
+
 void slab_free_cpu(void* ptr) {
     slab_free(ptr);
 }
@@ -0,0 +1,525 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/kernel/mem/vmm.h>
+#include <core/kernel/mem/allocator.h>
+#include <core/kernel/mem/slab.h>
+#include <core/kernel/kstd.h>
+#include <core/arch/spinlock.h>
+#include <core/arch/percpu.h>
+#include <core/arch/panic.h>
+#include <core/arch/smp.h>
+#include <core/arch/msr.h>
+#include <log.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Every CPU runs on the PML4 Limine built for the BSP, so upper-level tables
+ * created here are visible everywhere at once. Unmapping is the hard part:
+ * instead of shooting down other CPUs' TLBs, a freed area is parked on the
+ * area list as a purge entry stamped with a new generation, and each CPU
+ * reloads CR3 from vmm_sync_tlb() once it sees the generation move. The
+ * virtual range is only handed out again after every online CPU has caught
+ * up, so a stale translation can never alias a new mapping. The pages and
+ * page tables it used wait the same way before going back to the buddy
+ * allocator, so a stale translation cannot reach someone else's memory
+ * either. CPUs halted in the work queue loop are not waited for: they sync
+ * before running anything.
+ */
+
+#define VM_AREA_PAGES   (1u << 0)   /**< Owns the pages it maps */
+#define VM_AREA_HUGE    (1u << 1)   /**< May contain 2 MiB mappings */
+#define VM_AREA_MAP     (1u << 2)   /**< Maps memory it does not own */
+#define VM_AREA_PURGE   (1u << 3)   /**< Freed, waiting for TLB flushes */
+
+#define VMM_GUARD_SIZE  VMM_PAGE_SIZE
+#define LARGE_ORDER     9           /**< kalloc_pages order of a 2 MiB block */
+
+typedef struct vm_area {
+    uintptr_t       start;
+    size_t          size;           /**< Mapped bytes */
+    size_t          span;           /**< Reserved bytes, guard included */
+    uint32_t        flags;
+    uint64_t        free_gen;       /**< Generation stamped by vfree */
+    struct vm_area* next;
+} vm_area_t;
+
+// A freed page waiting for every CPU to flush past `gen`; lives in the page itself
+typedef struct deferred_page {
+    struct deferred_page* next;
+    uint64_t              gen;
+} deferred_page_t;
+
+static uint64_t*     kernel_pml4;
+static uint64_t      hhdm;
+static uint64_t      nx_mask;
+static bool          vmm_enabled;
+static spinlock_t    vmm_lock;
+static kmem_cache_t* area_cache;
+static vm_area_t*    areas;         // Sorted by start, live and purge entries alike
+static uint64_t      tlb_gen;
+static size_t        used_bytes;
+static size_t        huge_bytes;
+static size_t        live_areas;
+static size_t        purge_areas;
+static deferred_page_t* deferred_head;  // Oldest generation first
+static deferred_page_t* deferred_tail;
+
+static inline void invlpg(uintptr_t virt) {
+    __asm__ volatile("invlpg (%0)" :: "r"(virt) : "memory");
+}
+
+static inline uint64_t read_cr3(void) {
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+static inline void write_cr3(uint64_t cr3) {
+    __asm__ volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+}
+
+static inline uint64_t* table_of(uint64_t entry) {
+    return (uint64_t*)((entry & PTE_ADDR_MASK) + hhdm);
+}
+
+static inline size_t index_at(uintptr_t virt, int level) {
+    return (virt >> (12 + 9 * (level - 1))) & 511;
+}
+
+static inline uint64_t leaf_flags(uint64_t flags) {
+    return flags & ~PTE_ADDR_MASK & ~(PTE_NX & ~nx_mask);
+}
+
+static inline uintptr_t align_up(uintptr_t value, uintptr_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+/*
+ * Returns the entry for `virt` at `depth` (1 = PTE, 2 = PDE), allocating
+ * intermediate tables when `create` is set. NULL if the path is missing or
+ * passes through a large page.
+ */
+static uint64_t* walk(uintptr_t virt, int depth, bool create) {
+    uint64_t* table = kernel_pml4;
+    for (int level = 4; level > depth; level--) {
+        uint64_t* entry = &table[index_at(virt, level)];
+        if (!(*entry & PTE_PRESENT)) {
+            if (!create) return NULL;
+            uint64_t phys;
+            if (!kalloc_pages(0, KALLOC_ZERO, &phys)) return NULL;
+            *entry = phys | PTE_PRESENT | PTE_WRITE;
+        } else if (*entry & PTE_LARGE) {
+            return NULL;
+        }
+        table = table_of(*entry);
+    }
+    return &table[index_at(virt, depth)];
+}
+
+static void defer_free_locked(void* page, uint64_t gen) {
+    deferred_page_t* d = (deferred_page_t*)page;
+    d->next = NULL;
+    d->gen  = gen;
+    if (deferred_tail) deferred_tail->next = d;
+    else               deferred_head = d;
+    deferred_tail = d;
+}
+
+static int map_page_locked(uintptr_t virt, uint64_t phys, uint64_t flags) {
+    uint64_t* pte = walk(virt, 1, true);
+    if (!pte || (*pte & PTE_PRESENT)) return -1;
+    *pte = (phys & PTE_ADDR_MASK) | leaf_flags(flags);
+    return 0;
+}
+
+static int map_large_locked(uintptr_t virt, uint64_t phys, uint64_t flags) {
+    uint64_t* pde = walk(virt, 2, true);
+    if (!pde) return -1;
+
+    if (*pde & PTE_PRESENT) {
+        if (*pde & PTE_LARGE) return -1;
+        // An empty page table left behind by earlier 4 KiB areas can go
+        uint64_t* pt = table_of(*pde);
+        for (size_t i = 0; i < 512; i++)
+            if (pt[i] & PTE_PRESENT) return -1;
+        *pde = 0;
+        invlpg(virt);
+        // Other CPUs may still have the old PDE cached and walk through it
+        defer_free_locked(pt, __atomic_add_fetch(&tlb_gen, 1, __ATOMIC_ACQ_REL));
+    }
+
+    *pde = (phys & PTE_ADDR_MASK) | leaf_flags(flags) | PTE_LARGE;
+    return 0;
+}
+
+// Clears the mapping at `virt`; `large` reports whether it was a 2 MiB page
+static uint64_t unmap_locked(uintptr_t virt, bool* large) {
+    *large = false;
+    uint64_t* pde = walk(virt, 2, false);
+    if (!pde || !(*pde & PTE_PRESENT)) return 0;
+
+    uint64_t phys;
+    if (*pde & PTE_LARGE) {
+        phys = *pde & PTE_ADDR_MASK;
+        *pde = 0;
+        *large = true;
+    } else {
+        uint64_t* pte = &table_of(*pde)[index_at(virt, 1)];
+        if (!(*pte & PTE_PRESENT)) return 0;
+        phys = *pte & PTE_ADDR_MASK;
+        *pte = 0;
+    }
+    invlpg(virt);
+    return phys;
+}
+
+// Oldest generation every online, non-idle CPU has flushed
+static uint64_t flushed_gen(void) {
+    uint64_t min = __atomic_load_n(&tlb_gen, __ATOMIC_ACQUIRE);
+    // Pairs with the idle flag update in wq_worker_loop() and apic_idle(): a CPU we skip sees this generation on waking
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        if (cpus[i].state != CPU_STATE_ONLINE) continue;
+        if (__atomic_load_n(&percpu_get(i)->idle, __ATOMIC_SEQ_CST)) continue;
+        uint64_t gen = __atomic_load_n(&percpu_get(i)->tlb_gen, __ATOMIC_ACQUIRE);
+        if (gen < min) min = gen;
+    }
+    return min;
+}
+
+static void reap_purged(void) {
+    if (purge_areas == 0 && !deferred_head) return;
+
+    uint64_t safe = flushed_gen();
+    while (deferred_head && deferred_head->gen <= safe) {
+        deferred_page_t* d = deferred_head;
+        deferred_head = d->next;
+        if (!deferred_head) deferred_tail = NULL;
+        kfree_pages(d);
+    }
+
+    vm_area_t** link = &areas;
+    while (*link) {
+        vm_area_t* area = *link;
+        if ((area->flags & VM_AREA_PURGE) && area->free_gen <= safe) {
+            *link = area->next;
+            kmem_cache_free(area_cache, area);
+            purge_areas--;
+            continue;
+        }
+        link = &area->next;
+    }
+}
+
+// First fit over the sorted list; the guard page is part of the reservation
+static vm_area_t* reserve_area(size_t size, uintptr_t align) {
+    reap_purged();
+
+    vm_area_t* area = kmem_cache_alloc(area_cache);
+    if (!area) return NULL;
+
+    size_t span = size + VMM_GUARD_SIZE;
+    uintptr_t cursor = VMALLOC_START;
+    vm_area_t** link = &areas;
+    while (*link) {
+        uintptr_t start = align_up(cursor, align);
+        if (start + span <= (*link)->start) break;
+        cursor = (*link)->start + (*link)->span;
+        link = &(*link)->next;
+    }
+
+    uintptr_t start = align_up(cursor, align);
+    if (start + span > VMALLOC_END || start < cursor) {
+        kmem_cache_free(area_cache, area);
+        return NULL;
+    }
+
+    area->start    = start;
+    area->size     = size;
+    area->span     = span;
+    area->flags    = 0;
+    area->free_gen = 0;
+    area->next     = *link;
+    *link = area;
+    live_areas++;
+    return area;
+}
+
+// Unmaps the whole area and queues the range and the pages it owned for purging
+static void release_area(vm_area_t* area) {
+    // vmm_lock serializes generation bumps, so this is the one taken below
+    uint64_t gen = __atomic_load_n(&tlb_gen, __ATOMIC_ACQUIRE) + 1;
+    uintptr_t virt = area->start;
+    uintptr_t end = area->start + area->size;
+    while (virt < end) {
+        bool large;
+        uint64_t phys = unmap_locked(virt, &large);
+        size_t step = large ? VMM_LARGE_PAGE : VMM_PAGE_SIZE;
+
+        if (phys && (area->flags & VM_AREA_PAGES))
+            defer_free_locked((void*)(uintptr_t)(phys + hhdm), gen);
+        if (phys) {
+            used_bytes -= step;
+            if (large) huge_bytes -= step;
+        }
+        virt += step;
+    }
+
+    area->flags |= VM_AREA_PURGE;
+    area->free_gen = __atomic_add_fetch(&tlb_gen, 1, __ATOMIC_ACQ_REL);
+    live_areas--;
+    purge_areas++;
+}
+
+static vm_area_t* find_area(uintptr_t addr) {
+    for (vm_area_t* area = areas; area && area->start <= addr; area = area->next) {
+        if (area->flags & VM_AREA_PURGE) continue;
+        if (addr < area->start + area->size) return area;
+    }
+    return NULL;
+}
+
+void vmm_init(void) {
+    spinlock_init_named(&vmm_lock, "vmm");
+    hhdm = get_hhdm_offset();
+    kernel_pml4 = (uint64_t*)((read_cr3() & PTE_ADDR_MASK) + hhdm);
+    nx_mask = (rdmsr(MSR_EFER) & EFER_NXE) ? PTE_NX : 0;
+
+    // The window must not overlap anything the bootloader mapped
+    for (uintptr_t virt = VMALLOC_START; virt < VMALLOC_END; virt += 1ULL << 39) {
+        if (kernel_pml4[index_at(virt, 4)] & PTE_PRESENT) {
+            LOG_ERROR("vmm: vmalloc window %p already mapped, vmalloc disabled\n", (void*)virt);
+            return;
+        }
+    }
+
+    area_cache = kmem_cache_create("vm_area", sizeof(vm_area_t), 0, NULL);
+    if (!area_cache) {
+        LOG_ERROR("vmm: failed to create area cache, vmalloc disabled\n");
+        return;
+    }
+
+    vmm_enabled = true;
+    LOG_INFO("vmm: vmalloc window %p-%p (nx %s)\n",
+             (void*)VMALLOC_START, (void*)VMALLOC_END, nx_mask ? "on" : "off");
+}
+
+bool vmm_ready(void) {
+    return vmm_enabled;
+}
+
+int vmm_map_page(uintptr_t virt, uint64_t phys, uint64_t flags) {
+    if (!kernel_pml4 || (virt | phys) & (VMM_PAGE_SIZE - 1)) return -1;
+    spinlock_acquire(&vmm_lock);
+    int ret = map_page_locked(virt, phys, flags);
+    spinlock_release(&vmm_lock);
+    return ret;
+}
+
+int vmm_map_large(uintptr_t virt, uint64_t phys, uint64_t flags) {
+    if (!kernel_pml4 || (virt | phys) & (VMM_LARGE_PAGE - 1)) return -1;
+    spinlock_acquire(&vmm_lock);
+    int ret = map_large_locked(virt, phys, flags);
+    spinlock_release(&vmm_lock);
+    return ret;
+}
+
+uint64_t vmm_unmap_page(uintptr_t virt) {
+    if (!kernel_pml4) return 0;
+    bool large;
+    spinlock_acquire(&vmm_lock);
+    uint64_t phys = unmap_locked(virt, &large);
+    if (phys) __atomic_add_fetch(&tlb_gen, 1, __ATOMIC_ACQ_REL);
+    spinlock_release(&vmm_lock);
+    return phys;
+}
+
+uint64_t vmm_virt_to_phys(uintptr_t virt) {
+    if (!kernel_pml4) return 0;
+    uint64_t* table = kernel_pml4;
+    for (int level = 4; level >= 1; level--) {
+        uint64_t entry = table[index_at(virt, level)];
+        if (!(entry & PTE_PRESENT)) return 0;
+        if (level == 1 || (level <= 3 && (entry & PTE_LARGE))) {
+            uint64_t page_mask = (1ULL << (12 + 9 * (level - 1))) - 1;
+            return (entry & PTE_ADDR_MASK & ~page_mask) | (virt & page_mask);
+        }
+        table = table_of(entry);
+    }
+    return 0;
+}
+
+void* vmalloc(size_t size) {
+    if (!vmm_enabled || size == 0) return NULL;
+    size = align_up(size, VMM_PAGE_SIZE);
+
+    spinlock_acquire(&vmm_lock);
+    vm_area_t* area = reserve_area(size, VMM_PAGE_SIZE);
+    if (!area) {
+        spinlock_release(&vmm_lock);
+        LOG_WARN("vmalloc: no virtual space for %zu bytes\n", size);
+        return NULL;
+    }
+    area->flags = VM_AREA_PAGES;
+
+    for (size_t off = 0; off < size; off += VMM_PAGE_SIZE) {
+        uint64_t phys;
+        void* page = kalloc_pages(0, 0, &phys);
+        if (!page || map_page_locked(area->start + off, phys, VMM_KERNEL_RW) < 0) {
+            if (page) kfree_pages(page);
+            area->size = off;
+            release_area(area);
+            spinlock_release(&vmm_lock);
+            return NULL;
+        }
+        used_bytes += VMM_PAGE_SIZE;
+    }
+
+    spinlock_release(&vmm_lock);
+    return (void*)area->start;
+}
+
+void* vmalloc_huge(size_t size) {
+    if (size < VMM_LARGE_PAGE) return vmalloc(size);
+    if (!vmm_enabled) return NULL;
+    size = align_up(size, VMM_LARGE_PAGE);
+
+    spinlock_acquire(&vmm_lock);
+    vm_area_t* area = reserve_area(size, VMM_LARGE_PAGE);
+    if (!area) {
+        spinlock_release(&vmm_lock);
+        LOG_WARN("vmalloc_huge: no virtual space for %zu bytes\n", size);
+        return NULL;
+    }
+    area->flags = VM_AREA_PAGES | VM_AREA_HUGE;
+
+    for (size_t off = 0; off < size; off += VMM_LARGE_PAGE) {
+        uintptr_t virt = area->start + off;
+        uint64_t phys;
+        if (kalloc_pages(LARGE_ORDER, 0, &phys)) {
+            if (map_large_locked(virt, phys, VMM_KERNEL_RW) == 0) {
+                used_bytes += VMM_LARGE_PAGE;
+                huge_bytes += VMM_LARGE_PAGE;
+                continue;
+            }
+            kfree_pages((void*)(uintptr_t)(phys + hhdm));
+        }
+
+        // No contiguous 2 MiB block left: fill this slot with single pages
+        for (size_t sub = 0; sub < VMM_LARGE_PAGE; sub += VMM_PAGE_SIZE) {
+            void* page = kalloc_pages(0, 0, &phys);
+            if (!page || map_page_locked(virt + sub, phys, VMM_KERNEL_RW) < 0) {
+                if (page) kfree_pages(page);
+                area->size = off + sub;
+                release_area(area);
+                spinlock_release(&vmm_lock);
+                return NULL;
+            }
+            used_bytes += VMM_PAGE_SIZE;
+        }
+    }
+
+    spinlock_release(&vmm_lock);
+    return (void*)area->start;
+}
+
+void* vmap(uint64_t phys, size_t size, uint64_t flags) {
+    if (!vmm_enabled || size == 0) return NULL;
+
+    uint64_t page_off = phys & (VMM_PAGE_SIZE - 1);
+    uint64_t base = phys - page_off;
+    size = align_up(size + page_off, VMM_PAGE_SIZE);
+
+    // Give the virtual address the same offset within 2 MiB as `base` so large pages line up
+    uint64_t large_off = base & (VMM_LARGE_PAGE - 1);
+    bool try_large = size >= VMM_LARGE_PAGE;
+
+    spinlock_acquire(&vmm_lock);
+    vm_area_t* area = try_large ? reserve_area(size + large_off, VMM_LARGE_PAGE)
+                                : reserve_area(size, VMM_PAGE_SIZE);
+    if (!area) {
+        spinlock_release(&vmm_lock);
+        LOG_WARN("vmap: no virtual space for %zu bytes\n", size);
+        return NULL;
+    }
+    if (try_large) {
+        area->start += large_off;
+        area->span  -= large_off;
+        area->size   = size;
+    }
+    area->flags = VM_AREA_MAP;
+
+    for (size_t off = 0; off < size; ) {
+        uintptr_t virt = area->start + off;
+        uint64_t pa = base + off;
+        if (((virt | pa) & (VMM_LARGE_PAGE - 1)) == 0 && size - off >= VMM_LARGE_PAGE &&
+            map_large_locked(virt, pa, flags) == 0) {
+            area->flags |= VM_AREA_HUGE;
+            used_bytes += VMM_LARGE_PAGE;
+            huge_bytes += VMM_LARGE_PAGE;
+            off += VMM_LARGE_PAGE;
+            continue;
+        }
+        if (map_page_locked(virt, pa, flags) < 0) {
+            area->size = off;
+            release_area(area);
+            spinlock_release(&vmm_lock);
+            return NULL;
+        }
+        used_bytes += VMM_PAGE_SIZE;
+        off += VMM_PAGE_SIZE;
+    }
+
+    spinlock_release(&vmm_lock);
+    return (void*)(area->start + page_off);
+}
+
+void vfree(void* ptr) {
+    if (!ptr) return;
+
+    spinlock_acquire(&vmm_lock);
+    vm_area_t* area = find_area((uintptr_t)ptr);
+    if (!area || (uintptr_t)ptr - area->start >= VMM_PAGE_SIZE) {
+        spinlock_release(&vmm_lock);
+        LOG_ERROR("vfree: %p is not the start of a vmalloc area\n", ptr);
+        panic("Invalid free: not a vmalloc area");
+    }
+    release_area(area);
+    reap_purged();
+    spinlock_release(&vmm_lock);
+}
+
+bool is_vmalloc_addr(const void* ptr) {
+    uintptr_t addr = (uintptr_t)ptr;
+    return addr >= VMALLOC_START && addr < VMALLOC_END;
+}
+
+// Cheap enough for the timer tick and idle loops: one compare when nothing changed
+void vmm_sync_tlb(void) {
+    percpu_t* cpu = this_cpu();
+    uint64_t gen = __atomic_load_n(&tlb_gen, __ATOMIC_ACQUIRE);
+    if (cpu->tlb_gen == gen) return;
+    write_cr3(read_cr3());
+    __atomic_store_n(&cpu->tlb_gen, gen, __ATOMIC_RELEASE);
+}
+
+void vmm_get_stats(vmm_stats_t* out) {
+    spinlock_acquire(&vmm_lock);
+    out->total       = VMALLOC_END - VMALLOC_START;
+    out->used        = used_bytes;
+    out->huge        = huge_bytes;
+    out->area_count  = live_areas;
+    out->purge_count = purge_areas;
+
+    size_t largest = 0;
+    uintptr_t cursor = VMALLOC_START;
+    for (vm_area_t* area = areas; area; area = area->next) {
+        if (area->start - cursor > largest) largest = area->start - cursor;
+        cursor = area->start + area->span;
+    }
+    if (VMALLOC_END - cursor > largest) largest = VMALLOC_END - cursor;
+    out->largest_free = largest;
+    spinlock_release(&vmm_lock);
+}
@@ -5,20 +5,64 @@
 #include <core/kernel/nvm/nvm.h>
 #include <core/kernel/nvm/caps.h>
 #include <core/kernel/mem/allocator.h>
+#include <core/kernel/mem/slab.h>
+#include <core/kernel/mem/vmm.h>
 #include <core/kernel/nvm/instructions.h>
 #include <core/kernel/kstd.h>
+#include <core/kernel/sync/waitqueue.h>
 #include <log.h>
 #include <core/fs/procfs.h>
 #include <stdint.h>
 
 #define HEAP_SIZE (128 * 1024)  // 128 KiB
 
-nvm_process_t processes[MAX_PROCESSES];
+nvm_process_t* processes[MAX_PROCESSES];
 uint8_t current_process = 0;
 uint32_t timer_ticks = 0;
 
+static kmem_cache_t* process_cache = NULL;
+
 static instruction_handler_t instruction_table[256] = {NULL};
 
+// Runs from the SOFTIRQ_HRTIMER softirq, interrupts on; a process woken some other way meanwhile is left alone
+static void nvm_timeout_fire(hrtimer_t* timer) {
+    nvm_process_t* proc = timer->data;
+    if (!proc->active || !proc->blocked) return;
+    proc->wakeup_reason = WAKE_REASON_TIMEOUT;
+    proc->blocked = false;
+}
+
+// PCBs come from the process cache on first use of a slot and stay there so
+// exit codes remain readable after the process ends
+static nvm_process_t* nvm_slot_acquire(int slot) {
+    if (!processes[slot]) {
+        processes[slot] = kmem_cache_alloc(process_cache);
+        if (processes[slot])
+            hrtimer_init(&processes[slot]->timeout, nvm_timeout_fire, processes[slot]);
+    } else {
+        // A timeout left over from the previous owner must not wake the new one
+        hrtimer_cancel(&processes[slot]->timeout);
+    }
+    return processes[slot];
+}
+
+// Heaps are virtually contiguous so they never need a high-order physical block
+static uint8_t* nvm_heap_alloc(void) {
+    uint8_t* heap = vmalloc(HEAP_SIZE);
+    return heap ? heap : (uint8_t*)kmalloc(HEAP_SIZE);
+}
+
+void nvm_heap_free(uint8_t* heap) {
+    if (is_vmalloc_addr(heap))
+        vfree(heap);
+    else
+        kfree(heap);
+}
+
+static inline bool nvm_slot_runnable(int slot) {
+    return processes[slot] && processes[slot]->active && !processes[slot]->blocked;
+}
+
 // Signature checking and process creation
 int nvm_create_process(uint8_t* bytecode, uint32_t size, uint16_t initial_caps[], uint8_t caps_count) {
     if(bytecode[0] != 0x4E || bytecode[1] != 0x56 ||
@@ -28,42 +72,48 @@ int nvm_create_process(uint8_t* bytecode, uint32_t size, uint16_t initial_caps[]
     }
 
     for(int i = 0; i < MAX_PROCESSES; i++) {
-        if(!processes[i].active) {
-            processes[i].bytecode = bytecode;
-            processes[i].ip = 4;
-            processes[i].size = size;
-            processes[i].sp = 0;
-            processes[i].active = true;
-            processes[i].exit_code = 0;
-            processes[i].pid = i;
-            processes[i].caps_count = 0;
-            processes[i].fp = -1;
-            processes[i].blocked = false;
-            processes[i].wakeup_reason = 0;
+        if(!processes[i] || !processes[i]->active) {
+            nvm_process_t* proc = nvm_slot_acquire(i);
+            if (!proc) {
+                LOG_WARN("Failed to allocate PCB for process %d\n", i);
+                return -1;
+            }
+
+            proc->bytecode = bytecode;
+            proc->ip = 4;
+            proc->size = size;
+            proc->sp = 0;
+            proc->active = true;
+            proc->exit_code = 0;
+            proc->pid = i;
+            proc->caps_count = 0;
+            proc->fp = -1;
+            proc->blocked = false;
+            proc->wakeup_reason = 0;
 
             // Allocate heap
-            processes[i].heap = (uint8_t*)kmalloc(HEAP_SIZE);
-            if (!processes[i].heap) {
+            proc->heap = nvm_heap_alloc();
+            if (!proc->heap) {
                 LOG_WARN("Failed to allocate heap for process %d\n", i);
                 return -1;
             }
-            processes[i].heap_size = HEAP_SIZE;
+            proc->heap_size = HEAP_SIZE;
             // Zero out the heap
             for (uint32_t j = 0; j < HEAP_SIZE; j++) {
-                processes[i].heap[j] = 0;
+                proc->heap[j] = 0;
             }
 
             // Initializing capabilities
             for(int j = 0; j < caps_count && j < MAX_CAPS; j++) {
-                processes[i].capabilities[j] = initial_caps[j];
+                proc->capabilities[j] = initial_caps[j];
             }
-            processes[i].caps_count = caps_count;
+            proc->caps_count = caps_count;
 
             for(int j = 0; j < MAX_LOCALS; j++) {
-                processes[i].locals[j] = 0;
+                proc->locals[j] = 0;
             }
 
-            procfs_register(i, &processes[i]);
+            procfs_register(i, proc);
             return i;
         }
     }
@@ -88,33 +138,39 @@ int nvm_create_process_with_stack(uint8_t* bytecode, uint32_t size,
     }
 
     for(int i = 0; i < MAX_PROCESSES; i++) {
-        if(!processes[i].active) {
-            processes[i].bytecode = bytecode;
-            processes[i].ip = 4;
-            processes[i].size = size;
-            processes[i].active = true;
-            processes[i].exit_code = 0;
-            processes[i].pid = i;
-            processes[i].caps_count = 0;
-            processes[i].blocked = false;
-            processes[i].wakeup_reason = 0;
-            processes[i].fp = -1;
+        if(!processes[i] || !processes[i]->active) {
+            nvm_process_t* proc = nvm_slot_acquire(i);
+            if (!proc) {
+                LOG_WARN("Failed to allocate PCB for process %d\n", i);
+                return -1;
+            }
+
+            proc->bytecode = bytecode;
+            proc->ip = 4;
+            proc->size = size;
+            proc->active = true;
+            proc->exit_code = 0;
+            proc->pid = i;
+            proc->caps_count = 0;
+            proc->blocked = false;
+            proc->wakeup_reason = 0;
+            proc->fp = -1;
 
             // Allocate heap
-            processes[i].heap = (uint8_t*)kmalloc(HEAP_SIZE);
-            if (!processes[i].heap) {
+            proc->heap = nvm_heap_alloc();
+            if (!proc->heap) {
                 LOG_WARN("Failed to allocate heap for process %d\n", i);
                 return -1;
             }
-            processes[i].heap_size = HEAP_SIZE;
+            proc->heap_size = HEAP_SIZE;
 
             // Zero out the heap
             for (uint32_t j = 0; j < HEAP_SIZE; j++) {
-                processes[i].heap[j] = 0;
+                proc->heap[j] = 0;
             }
 
             for(int j = 0; j < stack_count; j++) {
-                processes[i].stack[j] = initial_stack_values[j];
+                proc->stack[j] = initial_stack_values[j];
             }
 
             if(stack_count > 0) {
@@ -136,29 +192,29 @@ int nvm_create_process_with_stack(uint8_t* bytecode, uint32_t size,
 
                             int len = str_end - str_start;
                             for(int k = 0; k < len / 2; k++) {
-                                int32_t temp = processes[i].stack[str_start + k];
-                                processes[i].stack[str_start + k] = processes[i].stack[str_end - 1 - k];
-                                processes[i].stack[str_end - 1 - k] = temp;
+                                int32_t temp = proc->stack[str_start + k];
+                                proc->stack[str_start + k] = proc->stack[str_end - 1 - k];
+                                proc->stack[str_end - 1 - k] = temp;
                             }
                         }
                     }
                 }
             }
 
-            processes[i].sp = stack_count;
+            proc->sp = stack_count;
 
             // Initializing capabilities
             for(int j = 0; j < caps_count && j < MAX_CAPS; j++) {
-                processes[i].capabilities[j] = initial_caps[j];
+                proc->capabilities[j] = initial_caps[j];
             }
-            processes[i].caps_count = caps_count;
+            proc->caps_count = caps_count;
 
             // Initialize locals
             for(int j = 0; j < MAX_LOCALS; j++) {
-                processes[i].locals[j] = 0;
+                proc->locals[j] = 0;
             }
 
-            procfs_register(i, &processes[i]);
+            procfs_register(i, proc);
             return i;
         }
     }
@@ -197,24 +253,25 @@ void nvm_scheduler_tick() {
 
     do {
         current_process = (current_process + 1) % MAX_PROCESSES;
-        if(processes[current_process].active && !processes[current_process].blocked) {
+        if(nvm_slot_runnable(current_process)) {
             break;
         }
     } while(current_process != start);
 
-    if(processes[current_process].active && !processes[current_process].blocked) {
+    if(nvm_slot_runnable(current_process)) {
+        nvm_process_t* proc = processes[current_process];
         for(int i = 0; i < 5000; i++) {
-            if (processes[current_process].ip < processes[current_process].size &&
-                processes[current_process].active &&
-                !processes[current_process].blocked) {
-                if(!nvm_execute_instruction(&processes[current_process])) {
+            if (proc->ip < proc->size &&
+                proc->active &&
+                !proc->blocked) {
+                if(!nvm_execute_instruction(proc)) {
                     break; // Stop if instruction returns false (halt, error, etc)
                 }
             } else {
-                if(processes[current_process].ip >= processes[current_process].size &&
-                   processes[current_process].active) {
-                    processes[current_process].active = false;
-                    processes[current_process].exit_code = 0;
+                if(proc->ip >= proc->size &&
+                   proc->active) {
+                    proc->active = false;
+                    proc->exit_code = 0;
                 }
                 break;
             }
@@ -224,8 +281,19 @@ void nvm_scheduler_tick() {
     }
 }
 
+// False when every process is blocked or gone, i.e. the scheduler has nothing to do until a wake-up
+bool nvm_has_runnable(void) {
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        if (nvm_slot_runnable(i)) return true;
+    }
+    return false;
+}
+
 nvm_process_t* nvm_get_process(uint8_t pid) {
-    return &processes[pid];
+    if(pid >= MAX_PROCESSES) {
+        return NULL;
+    }
+    return processes[pid];
 }
 
 void nvm_execute(uint8_t* bytecode, uint32_t size, uint16_t* capabilities, uint8_t caps_count) {
@@ -239,16 +307,16 @@ void nvm_execute(uint8_t* bytecode, uint32_t size, uint16_t* capabilities, uint8
 
 // Function for get exit code
 int32_t nvm_get_exit_code(uint8_t pid) {
-    if(pid < MAX_PROCESSES && !processes[pid].active) {
-        return processes[pid].exit_code;
+    if(pid < MAX_PROCESSES && processes[pid] && !processes[pid]->active) {
+        return processes[pid]->exit_code;
     }
     return -1;
 }
 
 // Function for check process activity
 bool nvm_is_process_active(uint8_t pid) {
-    if(pid < MAX_PROCESSES) {
-        return processes[pid].active;
+    if(pid < MAX_PROCESSES && processes[pid]) {
+        return processes[pid]->active;
     }
     return false;
 }
@@ -312,15 +380,13 @@ void nvm_init_instruction_table(void) {
 
 
 void nvm_init() {
+    process_cache = kmem_cache_create("nvm_process", sizeof(nvm_process_t), 0, NULL);
+    if (!process_cache) {
+        LOG_ERROR("Failed to create NVM process cache\n");
+    }
+
     for(int i = 0; i < MAX_PROCESSES; i++) {
-        processes[i].active = false;
-        processes[i].sp = 0;
-        processes[i].ip = 0;
-        processes[i].exit_code = 0;
-        processes[i].caps_count = 0;
-        processes[i].fp = -1;
-        processes[i].heap = NULL;
-        processes[i].heap_size = 0;
+        processes[i] = NULL;
     }
 
     nvm_init_instruction_table();
@@ -10,6 +10,7 @@
 #include <core/kernel/kstd.h>
 #include <core/fs/procfs.h>
 #include <core/kernel/tty.h>
+#include <core/kernel/sync/waitqueue.h>
 #include <log.h>
 
 typedef struct {
@@ -21,6 +22,46 @@ typedef struct {
 #define MAX_MESSAGES 32
 static message_t message_queue[MAX_MESSAGES];
 static int message_count = 0;
+// Receivers park here until a message for them arrives; zeroed queues are ready to use
+static waitqueue_t message_waiters[MAX_PROCESSES];
+
+// Width of the SYSCALL instruction: rewinding by this much re-runs the syscall once woken
+#define SYSCALL_INSN_LEN 2
+
+/*
+ * Blocks `proc` until its timeout fires. The timer is armed only on the
+ * first pass, so a process that re-runs its syscall after some other
+ * wake-up keeps its original deadline. Returns false if no timer was free.
+ */
+static bool nvm_block_timeout(nvm_process_t* proc, uint32_t ms) {
+    // Blocked before the timer exists: a callback that found it runnable would do nothing
+    proc->blocked = true;
+    if (hrtimer_pending(&proc->timeout))
+        return true;
+    proc->wakeup_reason = 0;
+    if (hrtimer_start_ns(&proc->timeout, (uint64_t)ms * NSEC_PER_MSEC) != 0) {
+        proc->blocked = false;
+        return false;
+    }
+    return true;
+}
+
+static int nvm_find_message(uint8_t pid) {
+    for (int i = 0; i < message_count; i++) {
+        if (message_queue[i].recipient == pid)
+            return i;
+    }
+    return -1;
+}
+
+static message_t nvm_take_message(int index) {
+    message_t msg = message_queue[index];
+    for (int i = index; i < message_count - 1; i++) {
+        message_queue[i] = message_queue[i + 1];
+    }
+    message_count--;
+    return msg;
+}
 
 int32_t syscall_handler(uint8_t syscall_id, nvm_process_t* proc) {
     int32_t result = 0;
@@ -33,12 +74,13 @@ int32_t syscall_handler(uint8_t syscall_id, nvm_process_t* proc) {
                 proc->exit_code = 0;
             }
             proc->active = false;
+            hrtimer_cancel(&proc->timeout);
             procfs_unregister(proc->pid);
             if (proc->bytecode) {
                 proc->bytecode = NULL;
             }
             if (proc->heap) {
-                kfree(proc->heap);
+                nvm_heap_free(proc->heap);
                 proc->heap = NULL;
             }
             if(proc->sp > 0) proc->sp--;
@@ -426,12 +468,8 @@ int32_t syscall_handler(uint8_t syscall_id, nvm_process_t* proc) {
             message_queue[message_count] = msg;
             message_count++;
 
-            for (int i = 0; i < MAX_PROCESSES; i++) {
-                if (processes[i].active && processes[i].pid == recipient && processes[i].blocked) {
-                    processes[i].blocked = false; 
-                    processes[i].wakeup_reason = 1;
-                    break;
-                }
+            if (recipient < MAX_PROCESSES) {
+                wake_up(&message_waiters[recipient]);
             }
 
             proc->sp -= 2;
@@ -439,16 +477,10 @@ int32_t syscall_handler(uint8_t syscall_id, nvm_process_t* proc) {
         }
 
         case SYS_MSG_RECEIVE: {
-            int found_index = -1;
-            for (int i = 0; i < message_count; i++) {
-                if (message_queue[i].recipient == proc->pid) {
-                    found_index = i;
-                    break;
-                }
-            }
+            int found_index = nvm_find_message(proc->pid);
             
             if (found_index == -1) {
-                proc->blocked = true;
+                waitqueue_park(&message_waiters[proc->pid], proc);
                 result = -1;
                 break;
             }
@@ -458,12 +490,7 @@ int32_t syscall_handler(uint8_t syscall_id, nvm_process_t* proc) {
                 break;
             }
             
-            message_t received_msg = message_queue[found_index];
-            
-            for (int i = found_index; i < message_count - 1; i++) {
-                message_queue[i] = message_queue[i + 1];
-            }
-            message_count--;
+            message_t received_msg = nvm_take_message(found_index);
 
             proc->stack[proc->sp] = received_msg.sender;
             proc->stack[proc->sp + 1] = received_msg.content;
@@ -471,6 +498,60 @@ int32_t syscall_handler(uint8_t syscall_id, nvm_process_t* proc) {
             break;
         }
 
+        case SYS_MSG_RECV_TIMEOUT: {
+            if (proc->sp < 1 || proc->sp + 1 >= STACK_SIZE) {
+                result = -1;
+                break;
+            }
+
+            int32_t timeout_ms = proc->stack[proc->sp - 1];
+            int found_index = nvm_find_message(proc->pid);
+            bool timed_out = proc->wakeup_reason == WAKE_REASON_TIMEOUT || timeout_ms <= 0;
+
+            if (found_index == -1 && !timed_out) {
+                waitqueue_park(&message_waiters[proc->pid], proc);
+                if (nvm_block_timeout(proc, (uint32_t)timeout_ms)) {
+                    proc->ip -= SYSCALL_INSN_LEN;
+                    break;
+                }
+                timed_out = true;
+            }
+
+            hrtimer_cancel(&proc->timeout);
+            proc->wakeup_reason = 0;
+            if (found_index >= 0) {
+                message_t received_msg = nvm_take_message(found_index);
+                proc->stack[proc->sp - 1] = received_msg.sender;
+                proc->stack[proc->sp] = received_msg.content;
+            } else {
+                proc->stack[proc->sp - 1] = -1;
+                proc->stack[proc->sp] = 0;
+                result = -1;
+            }
+            proc->sp += 1;
+            break;
+        }
+
+        case SYS_SLEEP: {
+            if (proc->sp < 1) {
+                result = -1;
+                break;
+            }
+
+            int32_t ms = proc->stack[proc->sp - 1];
+            if (ms > 0 && proc->wakeup_reason != WAKE_REASON_TIMEOUT) {
+                if (nvm_block_timeout(proc, (uint32_t)ms)) {
+                    proc->ip -= SYSCALL_INSN_LEN;
+                    break;
+                }
+                result = -1;
+            }
+
+            proc->wakeup_reason = 0;
+            proc->sp -= 1;
+            break;
+        }
+
         case SYS_PORT_IN_BYTE: {
             if (!caps_has_capability(proc, CAP_DRV_ACCESS)) {
                 result = -1;
@@ -525,7 +606,7 @@ int32_t syscall_handler(uint8_t syscall_id, nvm_process_t* proc) {
             }
             
             if (proc->heap) {
-                kfree(proc->heap);
+                nvm_heap_free(proc->heap);
                 proc->heap = NULL;
             }
             
@@ -13,6 +13,9 @@
 #include <core/arch/work_queue.h>
 #include <core/arch/smp.h>
 #include <core/kernel/mem/slab.h>
+#include <core/kernel/mem/alloc_bench.h>
+#include <core/kernel/mem/alloc_trace.h>
+#include <core/kernel/boottime.h>
 #include <core/kernel/tty.h>
 #include <core/fs/procfs.h>
 
@@ -31,6 +34,7 @@ static void cmd_help(void) {
     kprint("  echo [text] [> file] - Print text or write to file\n", 7);
     kprint("  mount <fs> <dev> <mntpoint> - Mount filesystem\n", 7);
     kprint("  umount <mntpoint>  - Unmount filesystem\n", 7);
+    kprint("  sync               - Write cached filesystem changes to disk\n", 7);
     kprint("\n", 7);
 }
 
@@ -119,7 +123,7 @@ static void cmd_cat(const char* args) {
     }
 
     const char* rel = NULL;
-    vfs_mount_t* mnt = vfs_find_mount(full_path, &rel);
+    vfs_mount_t* mnt = vfs_get_mount(full_path, &rel);
     if (mnt && mnt->fs && mnt->fs->ops) {
         const vfs_fs_ops_t* ops = mnt->fs->ops;
         
@@ -141,11 +145,13 @@ static void cmd_cat(const char* args) {
                     }
                 }
                 if (ops->close) ops->close(mnt, &h);
+                vfs_put_mount(mnt);
                 kprint("\n", 7);
                 return;
             }
         }
     }
+    if (mnt) vfs_put_mount(mnt);
 
     size_t size;
     const char* data = vfs_read(full_path, &size);
@@ -301,7 +307,7 @@ static void cmd_echo(int argc, char* argv[]) {
     }
 
     const char* rel = NULL;
-    vfs_mount_t* mnt = vfs_find_mount(full_path, &rel);
+    vfs_mount_t* mnt = vfs_get_mount(full_path, &rel);
     if (mnt && mnt->fs && mnt->fs->ops && mnt->fs->ops->open &&
         mnt->fs->ops->write && mnt->fs->ops->close) {
         const vfs_fs_ops_t* ops = mnt->fs->ops;
@@ -321,6 +327,7 @@ static void cmd_echo(int argc, char* argv[]) {
             kprint(" path=", 7);
             kprint(rel, 15);
             kprint("\n", 7);
+            vfs_put_mount(mnt);
             return;
         }
         ops->write(mnt, &h, text, tlen);
@@ -333,6 +340,7 @@ static void cmd_echo(int argc, char* argv[]) {
         else
             kprint("echo: no writable filesystem at path\n", 7);
     }
+    if (mnt) vfs_put_mount(mnt);
 }
 
 static int parse_command(const char* command, char* argv[], int max_args) {
@@ -387,6 +395,28 @@ static void execute_command(const char* command) {
         check_memory_leaks();
     } else if (strcmp(argv[0], "memtest") == 0) {
         memory_test();
+    } else if (strcmp(argv[0], "membench") == 0) {
+        alloc_bench_run();
+    } else if (strcmp(argv[0], "alloctrace") == 0) {
+        if (argc > 1 && strcmp(argv[1], "on") == 0) {
+            if (alloc_trace_start() < 0)
+                kprint("alloctrace: cannot allocate trace buffers\n", 4);
+        } else if (argc > 1 && strcmp(argv[1], "off") == 0) {
+            alloc_trace_stop();
+        } else if (argc > 1 && strcmp(argv[1], "clear") == 0) {
+            alloc_trace_clear();
+        } else {
+            kprint("Usage: alloctrace on|off|clear\n", 7);
+            kprint("  reports: /proc/alloctrace, /proc/allocleaks\n", 7);
+        }
+    } else if (strcmp(argv[0], "boottime") == 0) {
+        if (argc > 1 && strcmp(argv[1], "trace") == 0) {
+            boottime_dump_folded();
+            kprint("boottime: folded stacks written to serial\n", 7);
+        } else {
+            kprint("Usage: boottime trace\n", 7);
+            kprint("  report: /proc/boottime\n", 7);
+        }
     } else if (strcmp(argv[0], "clear") == 0) {
         tty_clear();
     } else if (strcmp(argv[0], "pwd") == 0) {
@@ -412,6 +442,9 @@ static void execute_command(const char* command) {
         cmd_mount(argc, argv);
     } else if (strcmp(argv[0], "umount") == 0) {
         cmd_umount(argc, argv);
+    } else if (strcmp(argv[0], "sync") == 0) {
+        if (vfs_sync() < 0)
+            kprint("sync: some buffers could not be written\n", 4);
     } else {
         char bin_path[64];
         int len = strlen(argv[0]);
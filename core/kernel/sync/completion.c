@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/kernel/sync/completion.h>
+#include <stddef.h>
+
+void init_completion(completion_t* c) {
+    c->done = 0;
+    waitqueue_init(&c->wait);
+}
+
+void reinit_completion(completion_t* c) {
+    __atomic_store_n(&c->done, 0, __ATOMIC_RELEASE);
+}
+
+void complete(completion_t* c) {
+    uint32_t done = __atomic_load_n(&c->done, __ATOMIC_RELAXED);
+    while (done != COMPLETION_ALL &&
+           !__atomic_compare_exchange_n(&c->done, &done, done + 1, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    wake_up(&c->wait);
+}
+
+void complete_all(completion_t* c) {
+    __atomic_store_n(&c->done, COMPLETION_ALL, __ATOMIC_RELEASE);
+    wake_up_all(&c->wait);
+}
+
+bool try_wait_for_completion(completion_t* c) {
+    uint32_t done = __atomic_load_n(&c->done, __ATOMIC_ACQUIRE);
+    while (done != 0) {
+        if (done == COMPLETION_ALL)
+            return true;
+        if (__atomic_compare_exchange_n(&c->done, &done, done - 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            return true;
+    }
+    return false;
+}
+
+void wait_for_completion(completion_t* c) {
+    wait_event(&c->wait, try_wait_for_completion(c));
+}
+
+bool wait_for_completion_timeout(completion_t* c, uint32_t timeout_ms) {
+    return wait_event_timeout(&c->wait, try_wait_for_completion(c), timeout_ms);
+}
+
+bool wait_for_completion_polled(completion_t* c, completion_poll_t poll, void* arg, uint32_t timeout_ms) {
+    if (!poll)
+        return wait_for_completion_timeout(c, timeout_ms);
+
+    uint64_t deadline = wait_deadline(timeout_ms);
+    for (;;) {
+        poll(arg);
+        if (try_wait_for_completion(c))
+            return true;
+        if (wait_expired(deadline))
+            return false;
+        wait_yield();
+    }
+}
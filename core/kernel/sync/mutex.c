@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/kernel/sync/mutex.h>
+#include <core/arch/percpu.h>
+
+void mutex_init(mutex_t* m) {
+    m->locked = 0;
+    m->owner = 0;
+    waitqueue_init(&m->waiters);
+}
+
+bool mutex_trylock(mutex_t* m) {
+    uint32_t expected = 0;
+    if (!__atomic_compare_exchange_n(&m->locked, &expected, 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return false;
+    m->owner = this_cpu_id();
+    return true;
+}
+
+void mutex_lock(mutex_t* m) {
+    if (mutex_trylock(m))
+        return;
+    wait_event(&m->waiters, mutex_trylock(m));
+}
+
+void mutex_unlock(mutex_t* m) {
+    __atomic_store_n(&m->locked, 0, __ATOMIC_RELEASE);
+    wake_up(&m->waiters);
+}
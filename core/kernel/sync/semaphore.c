@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/kernel/sync/semaphore.h>
+
+void sem_init(semaphore_t* sem, int32_t count) {
+    sem->count = count;
+    waitqueue_init(&sem->waiters);
+}
+
+bool sem_try_down(semaphore_t* sem) {
+    int32_t count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+    while (count > 0) {
+        if (__atomic_compare_exchange_n(&sem->count, &count, count - 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return true;
+    }
+    return false;
+}
+
+void sem_down(semaphore_t* sem) {
+    wait_event(&sem->waiters, sem_try_down(sem));
+}
+
+bool sem_down_timeout(semaphore_t* sem, uint32_t timeout_ms) {
+    return wait_event_timeout(&sem->waiters, sem_try_down(sem), timeout_ms);
+}
+
+bool sem_down_or_park(semaphore_t* sem, nvm_process_t* proc) {
+    if (sem_try_down(sem))
+        return true;
+
+    waitqueue_park(&sem->waiters, proc);
+
+    /*
+     * An up() between the failed try and the park would otherwise be missed.
+     * Waking everyone also unparks `proc`; the others just retry.
+     */
+    if (sem_try_down(sem)) {
+        wake_up_all(&sem->waiters);
+        return true;
+    }
+    return false;
+}
+
+void sem_up(semaphore_t* sem) {
+    __atomic_fetch_add(&sem->count, 1, __ATOMIC_RELEASE);
+    wake_up(&sem->waiters);
+}
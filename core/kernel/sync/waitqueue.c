@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <core/kernel/sync/waitqueue.h>
+#include <core/arch/smp.h>
+#include <core/arch/percpu.h>
+#include <core/arch/apic.h>
+#include <core/arch/pause.h>
+#include <core/arch/epoch.h>
+#include <core/arch/softirq.h>
+#include <core/arch/tsc.h>
+#include <core/arch/work_queue.h>
+#include <stddef.h>
+
+// Per-CPU yield count; a waiting CPU only ever touches its own slot
+typedef struct {
+    uint64_t yields;
+} __attribute__((aligned(64))) wait_cpu_t;
+
+static wait_cpu_t wait_cpus[MAX_CPUS];
+
+static inline wait_cpu_t* wait_cpu(void) {
+    uint32_t id = this_cpu_id();
+    return &wait_cpus[id < MAX_CPUS ? id : 0];
+}
+
+void waitqueue_init(waitqueue_t* wq) {
+    spinlock_init(&wq->lock);
+    wq->seq = 0;
+    wq->idle_cpus = 0;
+    wq->head = 0;
+    wq->count = 0;
+}
+
+void waitqueue_park(waitqueue_t* wq, nvm_process_t* proc) {
+    uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+
+    // A pid is queued at most once; re-parking after a spurious resume keeps its place
+    bool queued = false;
+    for (uint8_t i = 0; i < wq->count; i++) {
+        if (wq->procs[(wq->head + i) % MAX_PROCESSES] == proc->pid) {
+            queued = true;
+            break;
+        }
+    }
+    if (!queued && wq->count < MAX_PROCESSES) {
+        wq->procs[(wq->head + wq->count) % MAX_PROCESSES] = proc->pid;
+        wq->count++;
+    }
+    proc->blocked = true;
+
+    spinlock_release_irqrestore(&wq->lock, flags);
+}
+
+static void wake_procs(waitqueue_t* wq, bool all) {
+    uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+
+    while (wq->count > 0) {
+        uint8_t pid = wq->procs[wq->head];
+        wq->head = (wq->head + 1) % MAX_PROCESSES;
+        wq->count--;
+
+        // Entries of processes that exited while parked are dropped
+        nvm_process_t* proc = nvm_get_process(pid);
+        if (!proc || !proc->active || !proc->blocked) continue;
+
+        proc->wakeup_reason = WAKE_REASON_EVENT;
+        proc->blocked = false;
+        if (!all) break;
+    }
+
+    __atomic_fetch_add(&wq->seq, 1, __ATOMIC_SEQ_CST);
+    spinlock_release_irqrestore(&wq->lock, flags);
+
+    // Pairs with waitqueue_idle(): either the waiter sees the new seq or we see it halted
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t idle = __atomic_load_n(&wq->idle_cpus, __ATOMIC_SEQ_CST) & ~(1ULL << this_cpu_id());
+    while (idle) {
+        uint32_t cpu = (uint32_t)__builtin_ctzll(idle);
+        idle &= idle - 1;
+        // The work queue wake-up vector does nothing but end the hlt
+        smp_send_ipi(cpus[cpu].lapic_id, WQ_IPI_VECTOR);
+    }
+}
+
+void wake_up(waitqueue_t* wq) {
+    wake_procs(wq, false);
+}
+
+void wake_up_all(waitqueue_t* wq) {
+    wake_procs(wq, true);
+}
+
+/*
+ * Queued work is deliberately not run from here: a work item started inside
+ * a wait could block on a mutex held by the very wait it interrupted, further
+ * down the same stack. Interrupts are still taken while a CPU waits.
+ */
+void wait_yield(void) {
+    wait_cpu()->yields++;
+    epoch_quiescent();
+    cpu_relax();
+}
+
+void waitqueue_idle(waitqueue_t* wq, uint32_t seq, uint64_t max_ns) {
+    softirq_run();
+
+    uint64_t flags;
+    __asm__ volatile ("pushfq; popq %0" : "=r"(flags));
+    if (!(flags & (1ULL << 9)) || this_cpu()->epoch_nest || !apic_available()) {
+        wait_yield();
+        return;
+    }
+
+    wait_cpu()->yields++;
+    epoch_quiescent();
+    uint64_t self = 1ULL << this_cpu_id();
+    __atomic_fetch_or(&wq->idle_cpus, self, __ATOMIC_SEQ_CST);
+    apic_idle_while(ktime_get() + max_ns, &wq->seq, seq);
+    __atomic_fetch_and(&wq->idle_cpus, ~self, __ATOMIC_RELEASE);
+}
+
+static uint64_t wait_clock(void) {
+    if (apic_available())
+        return apic_get_uptime_ms();
+    return wait_cpu()->yields / WAIT_YIELDS_PER_MS;
+}
+
+uint64_t wait_deadline(uint32_t timeout_ms) {
+    return wait_clock() + timeout_ms;
+}
+
+bool wait_expired(uint64_t deadline) {
+    return deadline != WAIT_FOREVER && wait_clock() >= deadline;
+}
+
+bool waitqueue_wait(waitqueue_t* wq, uint32_t seq, uint64_t deadline) {
+    while (waitqueue_seq(wq) == seq) {
+        if (wait_expired(deadline))
+            return false;
+        wait_yield();
+    }
+    return true;
+}
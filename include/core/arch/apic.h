@@ -3,6 +3,7 @@
 #ifndef ARCH_APIC_H
 #define ARCH_APIC_H
 
+#include <core/arch/tsc.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -29,6 +30,7 @@
 // LVT timer modes
 #define LAPIC_TIMER_ONESHOT      (0 << 17)
 #define LAPIC_TIMER_PERIODIC     (1 << 17)
+#define LAPIC_TIMER_TSC_DEADLINE (2 << 17)
 
 // LVT mask bit
 #define LAPIC_LVT_MASKED         (1 << 16)
@@ -40,9 +42,47 @@
 #define APIC_TIMER_VECTOR        0x20
 #define APIC_SPURIOUS_VECTOR     0xFF
 
+typedef enum {
+    APIC_TIMER_MODE_PERIODIC,   // Fixed 1ms tick, no TSC to program against
+    APIC_TIMER_MODE_ONESHOT,    // LAPIC count re-armed for each event
+    APIC_TIMER_MODE_DEADLINE,   // IA32_TSC_DEADLINE re-armed for each event
+} apic_timer_mode_t;
+
+typedef struct apic_timer_stats {
+    uint64_t interrupts;        /**< Timer interrupts taken on the BSP */
+    uint64_t ticks;             /**< Of those, housekeeping ticks */
+    uint64_t idle_entries;
+    uint64_t idle_ns;           /**< Time spent halted in apic_idle() */
+} apic_timer_stats_t;
+
 bool apic_init(void);
+bool apic_ap_init(void);
 bool apic_available(void);
 void apic_eoi(void);
 uint64_t apic_get_uptime_ms(void);
 
+// Re-arms the BSP's timer after the earliest hrtimer changed, waking it if called elsewhere
+void apic_timer_reprogram(void);
+
+/*
+ * Halts until an interrupt arrives. On the BSP the housekeeping tick is
+ * stopped meanwhile, so the timer fires only for the next hrtimer or at
+ * `wake_by` (KTIME_MAX for no limit). An AP arms its own one-shot timer
+ * for `wake_by`; with no limit it needs an IPI to wake.
+ * The CPU counts as idle for TLB shootdowns and grace periods, so never
+ * call this inside an epoch read section.
+ */
+void apic_idle(ktime_t wake_by);
+
+/*
+ * apic_idle() that only halts if `*word` still equals `value` once
+ * interrupts are off. A waiter whose wake-up an ISR delivers passes the
+ * word the ISR changes, so a wake-up just before the hlt is not slept
+ * through.
+ */
+void apic_idle_while(ktime_t wake_by, const volatile uint32_t* word, uint32_t value);
+
+apic_timer_mode_t apic_timer_mode(void);
+void              apic_timer_get_stats(apic_timer_stats_t* out);
+
 #endif // ARCH_APIC_H
@@ -1,7 +1,7 @@
 #ifndef DELAY_H
 #define DELAY_H
 
-#include <arch/pause.h>
+#include <core/arch/pause.h>
 #include <stdint.h>
 
 #define IO_DELAY_PORT   0x80
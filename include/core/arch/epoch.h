@@ -0,0 +1,37 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <core/arch/percpu.h>
+
+/*
+ * Epoch-based reclamation for read-mostly tables. Readers bracket their
+ * traversal with epoch_read_lock()/epoch_read_unlock(), which only touch a
+ * per-CPU nesting count, and load published pointers with epoch_deref().
+ * A writer publishes a new version with epoch_publish(), then calls
+ * epoch_synchronize() before freeing the old one: it returns once every
+ * CPU has been seen outside a read section since the publish.
+ *
+ * A CPU reports that from epoch_quiescent(), which runs on the APIC tick,
+ * in wait_yield() and between work items; CPUs halted in the work queue
+ * loop are not waited for. Read sections must not sleep on something the
+ * writer holds, and a CPU must not synchronize from inside one.
+ */
+
+static inline void epoch_read_lock(void) {
+    __asm__ volatile("incl %%gs:%c0" : : "i"(offsetof(percpu_t, epoch_nest)) : "memory");
+}
+
+static inline void epoch_read_unlock(void) {
+    __asm__ volatile("decl %%gs:%c0" : : "i"(offsetof(percpu_t, epoch_nest)) : "memory");
+}
+
+#define epoch_deref(p)          __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define epoch_publish(p, v)     __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void epoch_quiescent(void);
+void epoch_synchronize(void);
+
+#endif // EPOCH_H
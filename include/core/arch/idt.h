@@ -12,6 +12,10 @@
 #define MAX_TEXT_SIZE     1024
 #define SYSCALL_INTERRUPT 0x80
 
+// Device interrupt vectors are handed out from this range; the fixed ones sit outside it
+#define IDT_DYNAMIC_FIRST 0x30
+#define IDT_DYNAMIC_LAST  0xEF
+
 /* IDT entry (16 bytes) */
 typedef struct __attribute__((packed)) {
     uint16_t offset_0_15;
@@ -41,6 +45,9 @@ typedef struct {
 void idt_init(void);
 void idt_load(void);
 void idt_install_handler(uint8_t vector, void* handler);
+
+// A vector no one else uses, with `handler` installed; 0 once the range is spent
+uint8_t idt_alloc_vector(void* handler);
 void panic_fb_init(uint32_t *addr, uint32_t w, uint32_t h, uint32_t pitch_px);
 
 #endif /* ARCH_IDT_H */
@@ -0,0 +1,23 @@
+#ifndef ARCH_MSR_H
+#define ARCH_MSR_H
+
+#include <stdint.h>
+
+#define MSR_GS_BASE         0xC0000101
+#define MSR_KERNEL_GS_BASE  0xC0000102
+#define MSR_EFER            0xC0000080
+#define MSR_TSC_DEADLINE    0x6E0
+
+#define EFER_NXE            (1ULL << 11)
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+#endif // ARCH_MSR_H
@@ -0,0 +1,41 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct cpu_info;
+
+/*
+ * Per-CPU area, reached through IA32_GS_BASE. `self` must stay the first
+ * field so this_cpu() is a single gs-relative load.
+ */
+typedef struct percpu {
+    struct percpu*   self;
+    uint32_t         cpu_id;
+    uint32_t         lapic_id;
+    struct cpu_info* info;
+    uint64_t         tlb_gen;   /**< Last vmalloc unmap generation flushed */
+    volatile uint32_t idle;     /**< Halted in an idle loop; syncs its TLB before running anything */
+    uint32_t         epoch_nest; /**< Depth of epoch read sections */
+    uint64_t         epoch_qs;  /**< Last epoch seen outside a read section */
+    volatile uint32_t softirq_pending; /**< Raised softirq bits, only touched by this CPU */
+    uint32_t         softirq_disable; /**< Softirqs held off while non-zero; includes running them */
+} percpu_t;
+
+void      percpu_init(uint32_t cpu_id, uint32_t lapic_id, struct cpu_info* info);
+percpu_t* percpu_get(uint32_t cpu_id);
+
+static inline percpu_t* this_cpu(void) {
+    percpu_t* self;
+    __asm__ volatile("movq %%gs:0, %0" : "=r"(self));
+    return self;
+}
+
+static inline uint32_t this_cpu_id(void) {
+    uint32_t id;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(percpu_t, cpu_id)));
+    return id;
+}
+
+#endif // PERCPU_H
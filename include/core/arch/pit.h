@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef ARCH_PIT_H
+#define ARCH_PIT_H
+
+#include <core/arch/io.h>
+#include <stdint.h>
+
+#define PIT_FREQUENCY            1193182
+#define PIT_CMD                  0x43
+#define PIT_CHANNEL0             0x40
+#define PIT_MAX_WINDOW_MS        54     // 16-bit count at PIT_FREQUENCY
+
+/*
+ * Reference window for calibrating other clocks. Channel 0 counts down once
+ * in mode 0; its IRQ is masked by the time anyone calibrates, so only the
+ * count is watched.
+ */
+static inline void pit_oneshot_start(uint32_t ms) {
+    uint16_t ticks = (uint16_t)((uint32_t)PIT_FREQUENCY * ms / 1000);
+    outb(PIT_CMD, 0x30);    // Channel 0, lo/hi byte, mode 0, binary
+    outb(PIT_CHANNEL0, (uint8_t)(ticks & 0xFF));
+    outb(PIT_CHANNEL0, (uint8_t)(ticks >> 8));
+}
+
+// Spins until the count started by pit_oneshot_start() reaches zero
+static inline void pit_oneshot_wait(void) {
+    uint16_t last = 0xFFFF;
+    while (1) {
+        outb(PIT_CMD, 0x00);    // Latch channel 0
+        uint8_t lo = inb(PIT_CHANNEL0);
+        uint8_t hi = inb(PIT_CHANNEL0);
+        uint16_t curr = lo | ((uint16_t)hi << 8);
+        if (curr == 0 || curr > last) break;
+        last = curr;
+    }
+}
+
+#endif // ARCH_PIT_H
@@ -0,0 +1,29 @@
+#ifndef RWLOCK_H
+#define RWLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <core/arch/spinlock.h>
+
+#define RWLOCK_WRITER   (1u << 31)  // Held for writing
+#define RWLOCK_PENDING  (1u << 30)  // A writer is waiting; new readers hold off
+#define RWLOCK_READERS  (RWLOCK_PENDING - 1)
+
+/*
+ * Reader-writer spinlock for read-mostly tables. Readers share the lock;
+ * a waiting writer sets RWLOCK_PENDING so a steady stream of readers cannot
+ * starve it. Neither side may sleep while holding it.
+ */
+typedef struct rwlock {
+    volatile uint32_t state;
+    lock_stats_t* stats;
+} rwlock_t;
+
+void rwlock_init(rwlock_t* lock);
+void rwlock_init_named(rwlock_t* lock, const char* name);
+void read_lock(rwlock_t* lock);
+void read_unlock(rwlock_t* lock);
+void write_lock(rwlock_t* lock);
+void write_unlock(rwlock_t* lock);
+
+#endif // RWLOCK_H
@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <core/arch/percpu.h>
+
+/*
+ * Deferred interrupt work. An ISR acknowledges its device, raises a
+ * softirq on its own CPU and returns through softirq_irq_exit(), which
+ * runs the handlers with interrupts enabled. Whatever is still raised
+ * after SOFTIRQ_MAX_RESTART passes or SOFTIRQ_BUDGET_NS is left for the
+ * next interrupt exit or the CPU's idle loop, so a flood of interrupts
+ * cannot starve the code it interrupted for long.
+ *
+ * Handlers run on the raising CPU and can interrupt any code that has
+ * interrupts enabled. Data they share with process context needs an
+ * irqsave lock, or local_bh_disable() around the process-context side.
+ * They must not wait.
+ */
+
+enum {
+    SOFTIRQ_HRTIMER,    // Expired hrtimer callbacks
+    SOFTIRQ_BLOCK,      // Block request completions
+    SOFTIRQ_COUNT
+};
+
+#define SOFTIRQ_MAX_RESTART     10
+#define SOFTIRQ_BUDGET_NS       (2 * 1000000ULL)
+
+typedef void (*softirq_fn_t)(void);
+
+void softirq_register(uint32_t nr, softirq_fn_t fn);
+
+// Marks `nr` pending on this CPU; safe from any context, interrupts on or off
+static inline void raise_softirq(uint32_t nr) {
+    __asm__ volatile("orl %0, %%gs:%c1" : : "r"(1u << nr), "i"(offsetof(percpu_t, softirq_pending)) : "memory");
+}
+
+static inline bool softirq_pending(void) {
+    uint32_t pending;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(pending) : "i"(offsetof(percpu_t, softirq_pending)));
+    return pending != 0;
+}
+
+// True in a handler and in a local_bh_disable() section, where nothing may wait
+static inline bool in_softirq(void) {
+    uint32_t depth;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(depth) : "i"(offsetof(percpu_t, softirq_disable)));
+    return depth != 0;
+}
+
+static inline void local_bh_disable(void) {
+    __asm__ volatile("incl %%gs:%c0" : : "i"(offsetof(percpu_t, softirq_disable)) : "memory");
+}
+
+// Runs anything raised meanwhile once the outermost section ends
+void local_bh_enable(void);
+
+// Last call in an ISR, after the EOI
+void softirq_irq_exit(void);
+
+// Drains pending softirqs from process context; does nothing with interrupts off
+void softirq_run(void);
+
+typedef struct softirq_stats {
+    uint64_t runs[SOFTIRQ_COUNT];   /**< Handler invocations */
+    uint64_t deferred;              /**< Passes that stopped with work left over */
+} softirq_stats_t;
+
+int softirq_get_stats(uint32_t cpu_id, softirq_stats_t* out);
+
+extern const char* const softirq_names[SOFTIRQ_COUNT];
+
+#endif // SOFTIRQ_H
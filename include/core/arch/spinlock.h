@@ -4,13 +4,54 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#define LOCK_STATS_MAX      64
+#define LOCK_STATS_NAME_LEN 24
+
+/*
+ * Contention counters for one lock, kept in a fixed registry so procfs can
+ * list them. Only locks set up with spinlock_init_named()/rwlock_init_named()
+ * carry stats; everything else skips the bookkeeping.
+ */
+typedef struct lock_stats {
+    char     name[LOCK_STATS_NAME_LEN];
+    uint64_t acquisitions;
+    uint64_t contended;     /**< Acquisitions that had to wait */
+    uint64_t spins;         /**< Pause iterations spent waiting */
+    uint64_t max_hold;      /**< Longest exclusive hold, in TSC cycles */
+    uint64_t hold_start;    /**< Written by the current exclusive holder only */
+} lock_stats_t;
+
+/*
+ * Ticket lock: acquirers take a ticket from `next` and wait until `owner`
+ * reaches it, so the lock is handed out in FIFO order and waiters only read
+ * the shared line while they spin.
+ */
 typedef struct spinlock {
-    volatile uint32_t lock;
+    union {
+        volatile uint32_t word;
+        struct {
+            volatile uint16_t owner;
+            volatile uint16_t next;
+        };
+    };
+    lock_stats_t* stats;
 } spinlock_t;
 
 void spinlock_init(spinlock_t* lock);
+void spinlock_init_named(spinlock_t* lock, const char* name);
 void spinlock_acquire(spinlock_t* lock);
 void spinlock_release(spinlock_t* lock);
 bool spinlock_try_acquire(spinlock_t* lock);
 
+// For locks also taken from interrupt handlers: masks IRQs on this CPU while held
+uint64_t spinlock_acquire_irqsave(spinlock_t* lock);
+void     spinlock_release_irqrestore(spinlock_t* lock, uint64_t flags);
+
+// Returns NULL once the registry is full; the lock then runs without stats
+lock_stats_t* lock_stats_register(const char* name);
+uint32_t      lock_stats_count(void);
+lock_stats_t* lock_stats_get(uint32_t index);
+void          lock_stats_acquired(lock_stats_t* stats, uint64_t spins, bool exclusive);
+void          lock_stats_released(lock_stats_t* stats);
+
 #endif // SPINLOCK_H
@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef ARCH_TSC_H
+#define ARCH_TSC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint64_t ktime_t;   // Nanoseconds on the monotonic clock
+
+#define NSEC_PER_USEC   1000ULL
+#define NSEC_PER_MSEC   1000000ULL
+#define NSEC_PER_SEC    1000000000ULL
+#define KTIME_MAX       UINT64_MAX
+
+/*
+ * Calibrates the TSC as the kernel clocksource: from CPUID leaf 0x15 when
+ * the CPU reports its crystal, otherwise against a PIT window. Must run
+ * before apic_init(), which picks its timer mode from the result.
+ */
+void tsc_init(void);
+
+bool     tsc_available(void);
+bool     tsc_deadline_supported(void);
+uint64_t tsc_get_hz(void);
+
+/*
+ * Monotonic nanoseconds since tsc_init(). Every CPU reads its own TSC,
+ * which firmware starts in step on anything with an invariant TSC. Before
+ * calibration, or if it failed, this falls back to the APIC tick.
+ */
+ktime_t ktime_get(void);
+
+static inline uint64_t ktime_get_ms(void) {
+    return ktime_get() / NSEC_PER_MSEC;
+}
+
+uint64_t tsc_cycles_to_ns(uint64_t cycles);
+uint64_t tsc_from_ktime(ktime_t t);     // TSC value at which the clock reads `t`
+
+// Busy-waits on the TSC; for short hardware settle times, not for sleeping
+void ndelay(uint64_t ns);
+
+#endif // ARCH_TSC_H
@@ -3,32 +3,65 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <core/arch/smp.h>
 #include <core/arch/spinlock.h>
 
-#define WQ_MAX_ITEMS    256
+#define WQ_DEQUE_SIZE   256     // Power of two; a full deque spills into the injection queue
 #define WQ_IPI_VECTOR   0xF0
 
 typedef void (*work_fn_t)(void* arg);
 
-typedef struct {
-    work_fn_t fn;
-    void*     arg;
+typedef struct work_item {
+    work_fn_t         fn;
+    void*             arg;
+    struct work_item* next;
 } work_item_t;
 
+/*
+ * Per-CPU work state. `deque` is a Chase-Lev deque: its owner pushes and
+ * pops at `bottom` without atomics on the fast path, other CPUs steal from
+ * `top` with a CAS. `mailbox` is a lock-free stack for work pinned to this
+ * CPU by wq_submit(); the owner takes it whole and runs it oldest first.
+ */
 typedef struct {
-    work_item_t   items[WQ_MAX_ITEMS];
-    volatile uint32_t head;
-    volatile uint32_t tail;
-    spinlock_t    lock;
-} cpu_work_queue_t;
+    volatile int64_t           top;
+    uint8_t                    pad0[56];
+    volatile int64_t           bottom;
+    work_item_t* volatile      deque[WQ_DEQUE_SIZE];
+    work_item_t* volatile      mailbox;
+    volatile uint32_t          mailbox_count;
+    bool                       worker;      /**< Runs wq_worker_loop() */
+    uint64_t                   executed;
+    uint64_t                   stolen;
+} __attribute__((aligned(64))) cpu_work_queue_t;
 
-extern cpu_work_queue_t cpu_wqs[MAX_CPUS];
+typedef struct {
+    uint64_t executed;   /**< Items run on this CPU */
+    uint64_t stolen;     /**< Of those, taken from another CPU's deque */
+    uint32_t queued;     /**< Pinned plus deque items waiting right now */
+    bool     idle;       /**< Halted waiting for an IPI */
+} wq_cpu_stats_t;
 
 void wq_init(void);
+
+// Runs `fn` on `cpu_id` specifically; never moved by stealing
 int  wq_submit(uint32_t cpu_id, work_fn_t fn, void* arg);
-void wq_run(uint32_t cpu_id);
+
+/*
+ * Runs `fn` on whichever CPU gets to it first. From an AP worker the item
+ * goes on that CPU's own deque, from anywhere else on the injection queue;
+ * either way one idle CPU is woken to go and find it.
+ */
 int  wq_submit_any(work_fn_t fn, void* arg);
+
+// Runs everything this CPU can find, stealing included; returns the number of items run
+uint32_t wq_run(uint32_t cpu_id);
+
+// The AP idle loop: run work, otherwise hlt until a WQ_IPI_VECTOR wake-up
+void wq_worker_loop(void) __attribute__((noreturn));
+
 uint32_t wq_pending(uint32_t cpu_id);
+int      wq_get_stats(uint32_t cpu_id, wq_cpu_stats_t* out);
 
 #endif
@@ -29,14 +29,20 @@
 
 #define HBA_PxIS_TFES         (1 << 30)
 
+#define HBA_CAP_SNCQ          (1U << 30)
+#define HBA_CAP_NCS_SHIFT     8
+
 #define HBA_GHC_AE            (1U << 31)
 #define HBA_GHC_HR            (1 << 0)
 
 #define ATA_CMD_READ_DMA_EX   0x25
 #define ATA_CMD_WRITE_DMA_EX  0x35
+#define ATA_CMD_READ_FPDMA_QUEUED   0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED  0x61
 #define ATA_CMD_IDENTIFY      0xEC
 #define ATA_DEV_BUSY          0x80
 #define ATA_DEV_DRQ           0x08
+#define ATA_SATA_CAP_NCQ      (1 << 8)    // IDENTIFY word 76
 
 #define FIS_TYPE_REG_H2D      0x27
 #define FIS_TYPE_REG_D2H      0x34
@@ -47,8 +53,6 @@
 #define FIS_TYPE_PIO_SETUP    0x5F
 #define FIS_TYPE_DEV_BITS     0xA1
 
-#define PCI_CONFIG_ADDR       0x0CF8
-#define PCI_CONFIG_DATA       0x0CFC
 #define PCI_CLASS_STORAGE     0x01
 #define PCI_SUBCLASS_AHCI     0x06
 
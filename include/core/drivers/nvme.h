@@ -32,14 +32,24 @@
 #define NVME_CAP_DSTRD_SHIFT  32
 #define NVME_CAP_DSTRD_MASK   ((uint64_t)0xF << NVME_CAP_DSTRD_SHIFT)
 #define NVME_CAP_MPSMIN_SHIFT 48
-#define NVME_CAP_MPSMIN_MASK  (0xF << NVME_CAP_MPSMIN_SHIFT)
+#define NVME_CAP_MPSMIN_MASK  ((uint64_t)0xF << NVME_CAP_MPSMIN_SHIFT)
 
 #define NVME_ADMIN_IDENTIFY   0x06
 #define NVME_ADMIN_CREATE_SQ  0x01
 #define NVME_ADMIN_CREATE_CQ  0x05
+#define NVME_ADMIN_SET_FEATURES 0x09
 
-#define NVME_CMD_READ         0x02
+#define NVME_FEAT_NUM_QUEUES  0x07
+
+#define NVME_CMD_FLUSH        0x00
 #define NVME_CMD_WRITE        0x01
+#define NVME_CMD_READ         0x02
+#define NVME_CMD_WRITE_ZEROES 0x08
+#define NVME_CMD_DSM          0x09
+
+#define NVME_DSM_DEALLOCATE   (1 << 2)
+
+#define NVME_CMD_PSDT_SGL     (1 << 14)   // Data pointer is an SGL descriptor, not PRPs
 
 #define NVME_QUEUE_PHYS_CONTIG (1 << 0)
 #define NVME_CQ_IRQ_ENABLED    (1 << 1)
@@ -50,6 +60,16 @@
 
 #define NVME_MAX_NAMESPACES 16
 
+#define NVME_ONCS_DSM            (1 << 2)
+#define NVME_ONCS_WRITE_ZEROES   (1 << 3)
+#define NVME_VWC_PRESENT         (1 << 0)
+
+#define NVME_SGLS_SUPPORT_MASK   0x3
+#define NVME_SGLS_BYTE_ALIGNED   0x1     // SGLs without a data alignment requirement
+
+#define NVME_SGL_DATA_BLOCK      0x00    // Descriptor identifier: type in bits 7:4
+#define NVME_SGL_LAST_SEGMENT    0x30
+
 typedef struct {
     uint64_t cap;
     uint32_t vs;
@@ -92,6 +112,19 @@ typedef struct {
     uint16_t status;
 } __attribute__((packed)) nvme_completion_t;
 
+typedef struct {
+    uint64_t addr;
+    uint32_t length;
+    uint8_t  reserved[3];
+    uint8_t  id;
+} __attribute__((packed)) nvme_sgl_desc_t;
+
+typedef struct {
+    uint32_t cattr;
+    uint32_t nlb;
+    uint64_t slba;
+} __attribute__((packed)) nvme_dsm_range_t;
+
 typedef struct {
     uint64_t lbaf_support;
     uint32_t namespace_size;
@@ -111,7 +144,17 @@ typedef struct {
     char     firmware[8];
     uint8_t  rab;
     uint8_t  ieee[3];
-    uint8_t  reserved[256];
+    uint8_t  cmic;
+    uint8_t  mdts;          // Largest transfer, 2^n units of CAP.MPSMIN; 0 for no limit
+    uint16_t cntlid;
+    uint8_t  reserved[440];
+    uint16_t oncs;          // Optional NVM commands supported
+    uint16_t fuses;
+    uint8_t  fna;
+    uint8_t  vwc;           // Volatile write cache
+    uint8_t  reserved1[10];
+    uint32_t sgls;
+    uint8_t  reserved2[3556];
 } __attribute__((packed)) nvme_identify_controller_t;
 
 void nvme_init(void);
@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PCI_CONFIG_ADDR         0x0CF8
+#define PCI_CONFIG_DATA         0x0CFC
+
+#define PCI_REG_ID              0x00
+#define PCI_REG_COMMAND         0x04
+#define PCI_REG_CLASS           0x08
+#define PCI_REG_HEADER          0x0C
+#define PCI_REG_BAR0            0x10
+#define PCI_REG_BUSES           0x18    // Bridges: primary, secondary, subordinate
+#define PCI_REG_CAP_PTR         0x34
+
+#define PCI_CMD_MEMORY          (1 << 1)
+#define PCI_CMD_BUS_MASTER      (1 << 2)
+#define PCI_CMD_INTX_DISABLE    (1 << 10)
+#define PCI_STATUS_CAP_LIST     (1 << 20)   // In the dword shared with the command register
+
+#define PCI_CAP_ID_MSIX         0x11
+
+#define PCI_MSIX_CTRL_ENABLE    (1 << 15)
+#define PCI_MSIX_CTRL_MASK_ALL  (1 << 14)
+#define PCI_MSIX_ENTRY_SIZE     16
+#define PCI_MSIX_VECTOR_MASKED  (1 << 0)
+
+#define PCI_CLASS_BRIDGE        0x06
+#define PCI_SUBCLASS_PCI_BRIDGE 0x04
+
+#define PCI_MAX_DEVICES         64
+#define PCI_ANY                 0xFF    // Wildcard for pci_find_class()
+
+typedef struct pci_device {
+    uint8_t  bus;
+    uint8_t  slot;
+    uint8_t  func;
+    uint8_t  header_type;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t  class_code;
+    uint8_t  subclass;
+    uint8_t  prog_if;
+    uint8_t  revision;
+    uint32_t bar[6];    /**< Raw BAR registers as found at enumeration */
+} pci_device_t;
+
+/*
+ * Walks config space once, following bridges from bus 0, and keeps the
+ * result. Drivers look devices up here instead of scanning themselves.
+ */
+void pci_init(void);
+
+uint32_t pci_config_read32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+void     pci_config_write32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t val);
+
+uint32_t            pci_device_count(void);
+const pci_device_t* pci_get_device(uint32_t index);
+
+// The `nth` device (from 0) matching the class triple; PCI_ANY matches any subclass or prog_if
+const pci_device_t* pci_find_class(uint8_t class_code, uint8_t subclass, uint8_t prog_if, uint32_t nth);
+
+// Sets the command register bits a DMA-capable MMIO device needs
+void pci_enable_mmio_dma(const pci_device_t* dev);
+
+// Config space offset of the device's first capability with `cap_id`, or 0
+uint8_t pci_find_capability(const pci_device_t* dev, uint8_t cap_id);
+
+typedef struct pci_msix {
+    volatile uint32_t* table;   /**< Vector table, mapped through the HHDM */
+    uint16_t           size;    /**< Entries in the table */
+    uint8_t            cap;     /**< Config space offset of the capability */
+} pci_msix_t;
+
+/*
+ * Switches the device from INTx to MSI-X with every entry masked, so
+ * nothing is delivered until pci_msix_route() unmasks an entry. Returns
+ * -1 if the device has no MSI-X capability.
+ */
+int  pci_msix_enable(const pci_device_t* dev, pci_msix_t* msix);
+
+// Points `entry` at IDT `vector` on the CPU with `lapic_id` (fixed, edge) and unmasks it
+void pci_msix_route(pci_msix_t* msix, uint16_t entry, uint32_t lapic_id, uint8_t vector);
+void pci_msix_mask(pci_msix_t* msix, uint16_t entry, bool masked);
+
+#endif // PCI_H
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef BIO_H
+#define BIO_H
+
+#include <core/fs/block.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Asynchronous block I/O. A bio describes one transfer between a buffer and
+ * a run of device blocks; bio_submit() queues it and returns at once, and
+ * `end_io` runs when it finishes, from whichever context reaps the device's
+ * completions. Callbacks must not wait.
+ *
+ * Each device has a request queue kept sorted by LBA. A bio that continues
+ * a queued request on both the disk and in memory is merged into it, so
+ * the driver sees one transfer. Discards and write-zeroes carry no buffer
+ * and merge on the disk alone; a flush covers writes that have completed
+ * and never merges. Between blk_plug() and blk_unplug() bios
+ * are only queued, which gives merging a chance before anything starts.
+ */
+
+#define BIO_READ            0
+#define BIO_WRITE           1
+#define BIO_FLUSH           2   // `lba` and `count` 0
+#define BIO_DISCARD         3
+#define BIO_WRITE_ZEROES    4
+
+#define BLK_MAX_REQUEST_BYTES   (128 * 1024)    // Largest transfer after merging, unless a device sets less
+#define BLK_MAX_NODATA_BLOCKS   65536           // Largest discard or write-zeroes after merging
+#define BLK_BATCH_MAX           32              // Bios per bio_submit_batch()
+
+typedef struct bio bio_t;
+typedef void (*bio_end_fn_t)(bio_t* bio);
+
+struct bio {
+    block_device_t* dev;
+    uint32_t        op;         /**< BIO_READ, BIO_WRITE, ... */
+    uint32_t        count;      /**< Device blocks */
+    uint64_t        lba;
+    void*           buf;        /**< count * block_size bytes, contiguous; NULL without data */
+    bio_end_fn_t    end_io;
+    void*           private;    /**< Owner's cookie, untouched by the block layer */
+    int             status;     /**< 0 or a negative errno once end_io runs */
+    bio_t*          next;       /**< Next bio of the same request */
+};
+
+/*
+ * One driver transfer, made of one or more merged bios whose buffers are
+ * adjacent in memory. Drivers read the fields and hand it back through
+ * blk_end_request(); `driver_data` is theirs while it is in flight.
+ */
+typedef struct blk_request {
+    block_device_t*     dev;
+    uint32_t            op;
+    uint32_t            count;
+    uint64_t            lba;
+    void*               buf;
+    bio_t*              bio;
+    bio_t*              bio_tail;
+    struct blk_request* next;
+    void*               driver_data;
+} blk_request_t;
+
+typedef struct blk_queue_stats {
+    uint64_t bios;          /**< Bios submitted */
+    uint64_t merged;        /**< Of those, merged into a queued request */
+    uint64_t requests;      /**< Requests handed to the driver */
+    uint64_t busy;          /**< Times the driver's queue was full */
+    uint64_t irqs;          /**< Completion interrupts */
+    uint32_t queued;        /**< Requests waiting now */
+    uint32_t in_flight;     /**< Requests the driver holds now */
+    uint32_t max_in_flight;
+} blk_queue_stats_t;
+
+void bio_init(void);
+
+static inline void bio_setup(bio_t* bio, block_device_t* dev, uint32_t op, uint64_t lba,
+                             uint32_t count, void* buf, bio_end_fn_t end_io, void* private) {
+    bio->dev = dev;
+    bio->op = op;
+    bio->lba = lba;
+    bio->count = count;
+    bio->buf = buf;
+    bio->end_io = end_io;
+    bio->private = private;
+    bio->status = 0;
+    bio->next = NULL;
+}
+
+// Invalid bios complete at once with an error, so end_io always runs exactly once
+void bio_submit(bio_t* bio);
+
+// Holds back dispatch on `dev` until the matching blk_unplug(); nests
+void blk_plug(block_device_t* dev);
+void blk_unplug(block_device_t* dev);
+
+// Reaps `dev`'s finished commands through its driver's poll op
+void blk_poll(block_device_t* dev);
+
+/*
+ * For drivers whose completions raise an interrupt. Waiters on the CPUs in
+ * the `cpus` mask halt until they are woken instead of spinning on
+ * blk_poll(); elsewhere they keep polling. The halt ends on its own
+ * within 10ms to catch timeouts, and is woken earlier by the
+ * completion interrupt or by whichever CPU reaped the request.
+ */
+void blk_set_irq_cpus(block_device_t* dev, uint64_t cpus);
+
+/*
+ * Lowers the largest request `dev` is handed, for hardware that cannot
+ * take BLK_MAX_REQUEST_BYTES in one command. Bios are checked against it,
+ * so it is set at registration, before any are submitted.
+ */
+void blk_set_max_request_bytes(block_device_t* dev, uint32_t bytes);
+uint32_t blk_max_request_bytes(block_device_t* dev);
+
+// Called from the driver's ISR: runs blk_poll(dev) from SOFTIRQ_BLOCK on this CPU
+void blk_complete_irq(block_device_t* dev);
+
+// Called by the driver once per request; finishes every bio in it
+void blk_end_request(blk_request_t* rq, int status);
+
+/*
+ * Reruns `dev`'s queue. blk_end_request() already does this for its own
+ * device; a driver whose devices share hardware slots calls it for one
+ * it refused with -EBUSY once another's completion frees a slot.
+ */
+void blk_kick(block_device_t* dev);
+
+/*
+ * Submits up to BLK_BATCH_MAX bios for one device under a plug and waits
+ * for all of them, polling the device meanwhile. Their `end_io` and
+ * `private` are taken over; each bio's `status` is valid afterwards.
+ * Returns the first error. Bios queued together are not ordered, so they
+ * must not overlap.
+ */
+int bio_submit_batch(bio_t* bios, uint32_t n);
+
+/*
+ * Synchronous transfers on top of bios, split to blk_max_request_bytes() and
+ * all queued before waiting. Their signature matches the driver ops, so a
+ * driver that implements `submit` can use them as its read/write ops.
+ */
+int blk_read_blocks(block_device_t* dev, uint64_t lba, size_t count, void* buf);
+int blk_write_blocks(block_device_t* dev, uint64_t lba, size_t count, const void* buf);
+
+// The same for the data-less ops; discards and zeroing split to BLK_MAX_NODATA_BLOCKS
+int blk_flush(block_device_t* dev);
+int blk_discard(block_device_t* dev, uint64_t lba, size_t count);
+int blk_write_zeroes(block_device_t* dev, uint64_t lba, size_t count);
+
+int blk_get_queue_stats(block_device_t* dev, blk_queue_stats_t* out);
+
+#endif // BIO_H
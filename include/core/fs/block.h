@@ -9,6 +9,7 @@
 
 // Forward declaration
 struct block_device;
+struct blk_request;
 
 // Block device operations
 typedef struct {
@@ -16,6 +17,21 @@ typedef struct {
     int (*read_blocks)(struct block_device* dev, uint64_t lba, size_t count, void* buf);
     // Write `count` blocks starting from `lba` from `buf`.
     int (*write_blocks)(struct block_device* dev, uint64_t lba, size_t count, const void* buf);
+    // Optional. Starts `rq` and returns 0, or -EBUSY while the hardware queue
+    // is full; blk_end_request() is called once it is done. Without it the
+    // request queue calls read_blocks/write_blocks in turn.
+    int (*submit)(struct block_device* dev, struct blk_request* rq);
+    // Optional. Reaps finished commands and fails ones that timed out; the
+    // stand-in for an interrupt while bios are waited for.
+    void (*poll)(struct block_device* dev);
+    // Optional. Makes every completed write durable; absent if the device
+    // has no volatile write cache.
+    int (*flush)(struct block_device* dev);
+    // Optional. Tells the device `count` blocks from `lba` are unused; what
+    // they read back as is up to the device until they are written again.
+    int (*discard)(struct block_device* dev, uint64_t lba, size_t count);
+    // Optional. Sets `count` blocks from `lba` to zero without sending data.
+    int (*write_zeroes)(struct block_device* dev, uint64_t lba, size_t count);
 } block_device_ops_t;
 
 // Represents a registered block device
@@ -41,5 +57,86 @@ block_device_t* find_block_device(const char* name);
 // For devfs to list devices
 block_device_t* get_block_devices(void);
 
+/*
+ * Buffer cache. Each buffer holds `count` device blocks starting at `lba`
+ * and is found again by (device, lba), so a filesystem must always use the
+ * same span for the same start. Writes are write-back: bdirty() only marks
+ * the buffer, and it reaches the device on eviction, bsync(), or from
+ * bcache_writeback() once it has been dirty for BCACHE_WRITEBACK_MS.
+ *
+ * The cache tracks ownership, not contents: two holders of one buffer see
+ * each other's changes as they make them.
+ */
+#define BCACHE_MAX_BUFFERS   256
+#define BCACHE_HASH_BITS     6
+#define BCACHE_WRITEBACK_MS  5000
+
+#define BH_UPTODATE  (1u << 0)      // Data matches the device, or is newer
+#define BH_DIRTY     (1u << 1)      // Data is newer than the device
+#define BH_BUSY      (1u << 2)      // Device I/O in flight; data must not be touched
+#define BH_NEW       (1u << 3)      // Claimed by bget(); others wait for bdirty(), bwrite() or brelse()
+
+typedef struct buffer_head {
+    block_device_t*     dev;
+    uint64_t            lba;
+    uint32_t            count;      /**< Device blocks covered */
+    uint32_t            size;       /**< Bytes in `data` */
+    uint8_t*            data;
+    volatile uint32_t   flags;
+    uint32_t            ref;        /**< Holders; unreferenced buffers sit on the LRU list */
+    uint64_t            dirty_ms;   /**< When it last went from clean to dirty */
+    struct buffer_head* hash_next;
+    struct buffer_head* lru_prev;
+    struct buffer_head* lru_next;
+} buffer_head_t;
+
+typedef struct bcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;            /**< Dirty buffers written to their device */
+    uint64_t write_errors;
+    uint32_t buffers;               /**< Buffers holding a block */
+    uint32_t dirty;
+    uint64_t bytes;                 /**< Memory held for buffer data */
+} bcache_stats_t;
+
+// Returns the buffer with its data read in, or NULL on a bad range, an I/O error or a full cache
+buffer_head_t* bread(block_device_t* dev, uint64_t lba, uint32_t count);
+
+// Same, without reading; for callers about to overwrite the whole buffer.
+// Other users of the block wait until the caller dirties, writes or releases it.
+buffer_head_t* bget(block_device_t* dev, uint64_t lba, uint32_t count);
+
+void bdirty(buffer_head_t* bh);     // Marks the data changed; it is written back later
+int  bwrite(buffer_head_t* bh);     // Writes the data now
+void brelse(buffer_head_t* bh);
+
+// Writes every dirty buffer of `dev`, or of every device if NULL, then flushes the device
+int  bsync(block_device_t* dev);
+
+/*
+ * Zeroes the `count` blocks at `lba`, which must be a span the caller
+ * always uses, and leaves them cached. With a write_zeroes op no data
+ * goes to the device; without one, or if it fails, the zeroes are written
+ * back like any dirty buffer.
+ */
+int  bzero_blocks(block_device_t* dev, uint64_t lba, uint32_t count);
+
+/*
+ * For blocks a filesystem has freed: stops any cached copy being written
+ * back and passes the range to the device's discard op, if it has one.
+ * Waits for the device, so a block can be reused as soon as this returns.
+ */
+int  bdiscard(block_device_t* dev, uint64_t lba, uint64_t count);
+
+// Drops the clean, unreferenced buffers of `dev`; call after bsync() when unmounting
+void binvalidate(block_device_t* dev);
+
+// Writes buffers dirty for longer than BCACHE_WRITEBACK_MS; cheap to call from an idle loop
+void bcache_writeback(void);
+
+void bcache_get_stats(bcache_stats_t* out);
+
 
 #endif // BLOCK_H
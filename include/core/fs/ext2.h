@@ -176,5 +176,6 @@ vfs_ssize_t ext2_vfs_write  (vfs_mount_t* mnt, vfs_file_handle_t* h, const void*
 vfs_off_t   ext2_vfs_seek   (vfs_mount_t* mnt, vfs_file_handle_t* h, vfs_off_t offset, int whence);
 int         ext2_vfs_readdir(vfs_mount_t* mnt, const char* path, vfs_dirent_t* entries, size_t max_entries);
 int         ext2_vfs_stat   (vfs_mount_t* mnt, const char* path, vfs_stat_t* stat);
+int         ext2_vfs_sync   (vfs_mount_t* mnt);
 
 #endif
@@ -162,6 +162,7 @@ vfs_ssize_t fat32_vfs_write(vfs_mount_t* mnt, vfs_file_handle_t* h, const void*
 vfs_off_t fat32_vfs_seek(vfs_mount_t* mnt, vfs_file_handle_t* h, vfs_off_t offset, int whence);
 int fat32_vfs_readdir(vfs_mount_t* mnt, const char* path, vfs_dirent_t* entries, size_t max_entries);
 int fat32_vfs_stat(vfs_mount_t* mnt, const char* path, vfs_stat_t* stat);
+int fat32_vfs_sync(vfs_mount_t* mnt);
 
 // Internal functions (used across the driver)
 int fat32_read_fat_entry(fat32_fs_t* fs, uint32_t cluster, uint32_t* out_entry);
@@ -171,6 +172,7 @@ int fat32_extend_chain(fat32_fs_t* fs, uint32_t last_cluster, uint32_t* out_new)
 int fat32_free_chain(fat32_fs_t* fs, uint32_t start_cluster);
 int fat32_read_cluster(fat32_fs_t* fs, uint32_t cluster, void* buffer);
 int fat32_write_cluster(fat32_fs_t* fs, uint32_t cluster, const void* buffer);
+int fat32_zero_cluster(fat32_fs_t* fs, uint32_t cluster);
 uint32_t fat32_cluster_to_sector(fat32_fs_t* fs, uint32_t cluster);
 
 #endif // CORE_FS_FAT32_H
\ No newline at end of file
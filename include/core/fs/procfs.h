@@ -8,7 +8,18 @@ void procfs_unregister(int pid);
 vfs_ssize_t procfs_cpu(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
 vfs_ssize_t procfs_cpuinfo(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
 vfs_ssize_t procfs_meminfo(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
+vfs_ssize_t procfs_slabinfo(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
+vfs_ssize_t procfs_buddyinfo(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
+vfs_ssize_t procfs_alloctrace(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
+vfs_ssize_t procfs_allocleaks(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
+vfs_ssize_t procfs_lockstat(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
+vfs_ssize_t procfs_workqueue(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
+vfs_ssize_t procfs_softirqs(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
+vfs_ssize_t procfs_bcache(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
+vfs_ssize_t procfs_blkqueue(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
 vfs_ssize_t procfs_pci(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
+vfs_ssize_t procfs_boottime(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
+vfs_ssize_t procfs_timer(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
 vfs_ssize_t procfs_uptime(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
 vfs_ssize_t procfs_version(vfs_file_t* file, void* buf, size_t count, vfs_off_t* pos);
 void procfs_init(void);
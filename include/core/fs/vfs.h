@@ -224,8 +224,21 @@ vfs_filesystem_t* vfs_find_filesystem(const char* name);
 int vfs_mount_fs(const char* fs_name, const char* mount_point,
                  const char* device, uint32_t flags, void* data);
 int vfs_umount(const char* mount_point);
+
+// Runs every mounted filesystem's sync op; returns the first error
+int vfs_sync(void);
+
+// Call inside epoch_read_lock(); the mount may be unmounted once the section ends
 vfs_mount_t* vfs_find_mount(const char* path, const char** relative_path);
 
+/*
+ * vfs_find_mount() with the mount pinned through ref_count, for callers
+ * that go on into the filesystem: umount fails with -EBUSY until
+ * vfs_put_mount(). No read section is held across the filesystem call.
+ */
+vfs_mount_t* vfs_get_mount(const char* path, const char** relative_path);
+void vfs_put_mount(vfs_mount_t* mnt);
+
 int vfs_stat(const char* path, vfs_stat_t* stat);
 int vfs_readdir(const char* path, vfs_dirent_t* entries, size_t max_entries);
 
@@ -0,0 +1,45 @@
+#ifndef BOOTTIME_H
+#define BOOTTIME_H
+
+#include <stdint.h>
+
+#define BOOTTIME_MAX_EVENTS 128
+#define BOOTTIME_NAME_LEN   24
+#define BOOTTIME_NONE       (-1)
+
+/*
+ * Boot-phase timeline. Each event is a named TSC interval on one CPU,
+ * nested under the event that was open on that CPU when it began, or
+ * under an explicit parent when the work was handed to another CPU.
+ */
+typedef struct boottime_event {
+    char     name[BOOTTIME_NAME_LEN];
+    uint64_t start_tsc;
+    uint64_t end_tsc;      /**< 0 while still open */
+    int32_t  parent;       /**< Index of the enclosing event, or BOOTTIME_NONE */
+    uint32_t cpu;
+} boottime_event_t;
+
+// Starts the timeline; everything before this call is not measured
+void boottime_init(void);
+
+int  boottime_begin(const char* name);
+int  boottime_begin_under(const char* name, int parent);
+void boottime_end(int id);
+int  boottime_current(void);
+
+// An interval measured elsewhere, e.g. by a CPU that could not log it itself
+void boottime_record(const char* name, int parent, uint32_t cpu, uint64_t start_tsc, uint64_t end_tsc);
+
+uint32_t                boottime_count(void);
+const boottime_event_t* boottime_get(uint32_t index);
+uint64_t                boottime_base_tsc(void);
+
+// TSC rate measured against the APIC tick; 0 if the tick is not running
+uint64_t boottime_tsc_hz(void);
+uint64_t boottime_cycles_to_us(uint64_t cycles);
+
+// Writes the timeline to serial as folded stacks ("a;b;c <self-us>") for flamegraph.pl
+void boottime_dump_folded(void);
+
+#endif // BOOTTIME_H
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef HRTIMER_H
+#define HRTIMER_H
+
+#include <core/arch/tsc.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HRTIMER_MAX     256     // Timers queued at once
+
+typedef struct hrtimer hrtimer_t;
+typedef void (*hrtimer_fn_t)(hrtimer_t* timer);
+
+/*
+ * One-shot timer on the ktime_get() clock. The caller owns the storage and
+ * it must outlive the timer being queued. Callbacks run in the BSP's
+ * SOFTIRQ_HRTIMER softirq, so they must not wait; waking a process or a
+ * waitqueue is the intended use.
+ */
+struct hrtimer {
+    ktime_t      expires;
+    hrtimer_fn_t fn;
+    void*        data;
+    int32_t      slot;      /**< Heap index while queued, -1 otherwise */
+};
+
+void hrtimers_init(void);
+
+void hrtimer_init(hrtimer_t* timer, hrtimer_fn_t fn, void* data);
+
+/*
+ * Queues `timer` to fire once the clock reaches `expires`, re-queueing it if
+ * it was already pending. Returns -1 if the queue is full.
+ */
+int  hrtimer_start(hrtimer_t* timer, ktime_t expires);
+
+static inline int hrtimer_start_ns(hrtimer_t* timer, uint64_t delta_ns) {
+    return hrtimer_start(timer, ktime_get() + delta_ns);
+}
+
+// Returns true if the timer was dequeued before it fired
+bool hrtimer_cancel(hrtimer_t* timer);
+bool hrtimer_pending(const hrtimer_t* timer);
+
+// Earliest queued expiry, or KTIME_MAX
+ktime_t hrtimer_next_expiry(void);
+
+// Runs every timer due at `now`; called from the hrtimer softirq
+void hrtimer_run_expired(ktime_t now);
+
+#endif // HRTIMER_H
@@ -0,0 +1,30 @@
+#ifndef INIT_GRAPH_H
+#define INIT_GRAPH_H
+
+#include <stdint.h>
+
+#define INIT_GRAPH_MAX      32
+#define INIT_DEP(stage)     (1u << (stage))
+
+/*
+ * One boot step. `deps` is a mask of INIT_DEP() bits naming the stages of
+ * the same graph that must finish first. Stages with nothing in common run
+ * on whichever CPUs the work queue finds idle.
+ */
+typedef struct init_stage {
+    const char*       name;
+    void            (*fn)(void);
+    const char*       message;      /**< Printed with kprint() once the stage is done */
+    uint32_t          deps;
+    volatile uint32_t waiting;      /**< Unfinished dependencies, set up by init_graph_run() */
+    uint32_t          cpu;          /**< CPU the stage ran on */
+} init_stage_t;
+
+/*
+ * Runs every stage and returns once all have finished. The calling CPU
+ * runs queued work while it waits, so the graph completes without APs.
+ * Returns -1 without running anything if the dependencies form a cycle.
+ */
+int init_graph_run(init_stage_t* stages, uint32_t count);
+
+#endif // INIT_GRAPH_H
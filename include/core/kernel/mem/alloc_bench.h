@@ -0,0 +1,25 @@
+#ifndef ALLOC_BENCH_H
+#define ALLOC_BENCH_H
+
+#include <stdint.h>
+
+#define BENCH_MAX_WORKERS   64
+#define BENCH_ITERATIONS    20000   // Operations per worker per run
+#define BENCH_SAMPLES       2048    // Latency samples kept per worker
+#define BENCH_MIXED_SLOTS   256     // Live objects per worker in the mixed workload
+#define BENCH_LARGE_BLOCKS  256     // Blocks per round in the large-order workload
+#define BENCH_RING_SIZE     256     // Producer/consumer hand-off ring entries
+#define BENCH_FRAG_ORDER    9       // Page order the fragmentation score is judged against (2 MiB)
+
+/*
+ * Allocator stress and scalability suite. Each workload runs on 1, 2, 4, ...
+ * APs through the work queues (on the BSP when there are none) and reports
+ * throughput and latency percentiles; the run ends with a fragmentation score.
+ * Results go to the console.
+ */
+void alloc_bench_run(void);
+
+// Percentage of free memory that cannot serve a 2^BENCH_FRAG_ORDER page block
+uint32_t alloc_bench_fragmentation(void);
+
+#endif // ALLOC_BENCH_H
@@ -0,0 +1,85 @@
+#ifndef ALLOC_TRACE_H
+#define ALLOC_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ALLOC_TRACE_MAX_CPUS    64
+#define ALLOC_TRACE_RING_SIZE   4096    // Events kept per CPU (power of two)
+#define ALLOC_TRACE_MAX_SITES   512     // Distinct call sites (power of two)
+#define ALLOC_TRACE_MAX_LIVE    16384   // Outstanding allocations tracked (power of two)
+
+typedef enum {
+    ALLOC_EV_KMALLOC = 0,
+    ALLOC_EV_KFREE,
+    ALLOC_EV_PAGES,
+    ALLOC_EV_PAGES_FREE,
+} alloc_event_type_t;
+
+typedef struct alloc_event {
+    uint64_t  tsc;
+    uintptr_t ptr;
+    uintptr_t site;         /**< Return address of the allocator's caller */
+    uint32_t  size;         /**< Bytes requested; 0 for frees */
+    uint8_t   type;         /**< alloc_event_type_t */
+    uint8_t   cpu;
+    uint16_t  reserved;
+} alloc_event_t;
+
+typedef struct alloc_site_stats {
+    uintptr_t site;
+    uint64_t  alloc_count;
+    uint64_t  alloc_bytes;
+    uint64_t  free_count;   /**< Frees of blocks this site allocated while tracing */
+} alloc_site_stats_t;
+
+// Outstanding allocations of one site, gathered from the live table
+typedef struct alloc_live_site {
+    uintptr_t site;
+    uint64_t  count;
+    uint64_t  bytes;
+    uint64_t  oldest_tsc;
+} alloc_live_site_t;
+
+typedef struct alloc_trace_status {
+    bool     enabled;
+    uint64_t events;        /**< Events recorded since the last clear */
+    uint32_t sites;         /**< Site table entries in use */
+    uint32_t live;          /**< Live table entries in use */
+    uint64_t site_drops;    /**< Allocations whose site did not fit the site table */
+    uint64_t live_drops;    /**< Allocations that did not fit the live table */
+    uint64_t untracked;     /**< Frees of blocks allocated before tracing started */
+} alloc_trace_status_t;
+
+extern volatile bool alloc_trace_enabled;
+
+static inline bool alloc_trace_active(void) {
+    return __atomic_load_n(&alloc_trace_enabled, __ATOMIC_RELAXED);
+}
+
+/*
+ * Opt-in allocation tracing. Once started, kmalloc/kfree and
+ * kalloc_pages/kfree_pages report each call with their caller's return
+ * address; events go to a per-CPU ring, per-site totals to a shared site
+ * table and outstanding blocks to a live table, which is what the leak
+ * report groups by site. The buffers are vmalloc'd on the first start and
+ * kept, so a stopped trace can still be read.
+ */
+int  alloc_trace_start(void);
+void alloc_trace_stop(void);
+void alloc_trace_clear(void);
+
+// Hooks for the allocators; call only when alloc_trace_active()
+void alloc_trace_alloc(alloc_event_type_t type, void* ptr, size_t size, uintptr_t site);
+void alloc_trace_free(alloc_event_type_t type, void* ptr, uintptr_t site);
+
+void     alloc_trace_get_status(alloc_trace_status_t* out);
+// Copies up to `max` used site entries, in table order
+uint32_t alloc_trace_get_sites(alloc_site_stats_t* out, uint32_t max);
+// Groups the live table by site; returns the number of sites written
+uint32_t alloc_trace_get_live(alloc_live_site_t* out, uint32_t max);
+// Copies up to `max` of `cpu`'s most recent events, newest first
+uint32_t alloc_trace_get_recent(uint32_t cpu, alloc_event_t* out, uint32_t max);
+
+#endif // ALLOC_TRACE_H
@@ -4,9 +4,33 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define KALLOC_ZERO  (1u << 0)  // Zero-fill the returned pages
+
+#define MEM_STATS_MAX_CPUS 64
+
+struct buddy_allocator;
+
+// Totals summed over every CPU's counters; approximate while CPUs are allocating
+typedef struct mem_stats {
+    size_t allocated;       /**< Bytes requested through kmalloc and not yet freed */
+    size_t alloc_count;     /**< kmalloc calls */
+    size_t free_count;      /**< kfree calls */
+    size_t page_bytes;      /**< Bytes held by kalloc_pages blocks */
+    size_t page_allocs;
+    size_t page_frees;
+} mem_stats_t;
+
 void memory_manager_init(void);
 void* kmalloc(size_t size);
 void kfree(void* ptr);
+
+/*
+ * Naturally aligned, physically contiguous blocks of 2^order pages with no
+ * in-band header. `phys` (optional) receives the block's physical address.
+ */
+void* kalloc_pages(uint32_t order, uint32_t flags, uint64_t* phys);
+void kfree_pages(void* ptr);
+uint64_t kvirt_to_phys(const void* ptr);
 size_t get_memory_total(void);
 size_t get_memory_free(void);
 size_t get_memory_used(void);
@@ -15,5 +39,7 @@ void format_memory_size(size_t size, char* buffer);
 void memory_test(void);
 void check_memory_leaks(void);
 uint64_t get_hhdm_offset(void);
+void memory_get_stats(mem_stats_t* out);
+struct buddy_allocator* slab_get_buddy(void);
 
 #endif
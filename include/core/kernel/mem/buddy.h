@@ -7,28 +7,81 @@
 #include <core/arch/spinlock.h>
 
 // Configuration constants
-#define BUDDY_MAX_ORDER 20  /**< Maximum allocation order (2^20 = 1MB blocks) */
+#define BUDDY_MAX_ORDER 21  /**< Maximum allocation order (2^21 = 2MB blocks, one large page) */
 #define BUDDY_MIN_ORDER 12  /**< Minimum allocation order (2^12 = 4KB blocks) */
+#define BUDDY_MAX_ZONES 32  /**< Maximum number of usable memory regions tracked */
 
 #define BUDDY_BLOCK_SIZE(order) (1ULL << (order))
 #define BUDDY_TOTAL_BLOCKS_IN_POOL(order, pool_size) (pool_size / BUDDY_BLOCK_SIZE(order))
 #define BUDDY_PAGE_SIZE BUDDY_BLOCK_SIZE(BUDDY_MIN_ORDER)
 #define BUDDY_BITMAP_SIZE(order, pool_size) ((BUDDY_TOTAL_BLOCKS_IN_POOL(order, pool_size) + 31) / 32)
 
-typedef struct buddy_allocator {
-    void* pool_start;                                   /**< Start address of memory pool */
-    size_t pool_size;                                   /**< Total size of memory pool */
-    uint64_t hhdm_offset;                               /**< Higher-half direct mapping offset */
+// Owner of a block, recorded on its first page descriptor
+#define PAGE_TYPE_FREE     0   /**< Free in the buddy allocator */
+#define PAGE_TYPE_BUDDY    1   /**< Raw buddy block (per-CPU pools, slab metadata) */
+#define PAGE_TYPE_SLAB     2   /**< Slab; every page of the slab is tagged */
+#define PAGE_TYPE_KMALLOC  3   /**< Page-class kmalloc block */
+#define PAGE_TYPE_PAGES    4   /**< kalloc_pages block */
+
+/*
+ * Out-of-line metadata for every page of a zone, so blocks handed out by the
+ * page allocator need no in-band header.
+ */
+typedef struct page_desc {
+    uint8_t  type;                                      /**< PAGE_TYPE_* */
+    uint8_t  order;                                     /**< Block order, valid on the first page */
+    uint16_t flags;                                     /**< Owner-defined */
+    uint32_t private;                                   /**< Owner-defined (e.g. kmalloc request size) */
+} page_desc_t;
+
+typedef struct buddy_zone_stats {
+    size_t alloc_count;                                 /**< Successful block allocations */
+    size_t free_count;                                  /**< Blocks returned to the zone */
+    size_t fail_count;                                  /**< Allocations no zone could satisfy, with this one preferred */
+    size_t fallback_count;                              /**< Allocations served after an earlier zone failed */
+} buddy_zone_stats_t;
+
+/*
+ * One zone per usable memory region. Block indices are computed relative to
+ * `base`, which is rounded down to BUDDY_MAX_ORDER alignment, so every block
+ * handed out is naturally aligned to its own size. The range [base, pool_start)
+ * is never marked free and therefore never allocated.
+ */
+typedef struct buddy_zone {
+    uintptr_t base;                                     /**< Max-order aligned origin for block indices */
+    void* pool_start;                                   /**< First usable byte of the zone */
+    size_t pool_size;                                   /**< Usable bytes (bitmaps excluded) */
     uint32_t* free_area_bitmap[BUDDY_MAX_ORDER + 1];    /**< Bitmaps tracking free blocks per order */
     size_t free_area_size[BUDDY_MAX_ORDER + 1];         /**< Number of free blocks per order */
     size_t max_blocks[BUDDY_MAX_ORDER + 1];             /**< Maximum possible blocks per order */
+    size_t free_bytes;                                  /**< Sum of free blocks, kept for fast fallback */
+    page_desc_t* pages;                                 /**< One descriptor per page from pool_start */
+    size_t page_count;                                  /**< Number of entries in `pages` */
+    buddy_zone_stats_t stats;                           /**< Per-zone counters */
+    uint32_t id;                                        /**< Index in address order */
     spinlock_t lock;                                    /**< Thread synchronization lock */
+} buddy_zone_t;
+
+typedef struct buddy_allocator {
+    buddy_zone_t zones[BUDDY_MAX_ZONES];                /**< Zones sorted by address */
+    uint32_t zone_count;                                /**< Number of initialized zones */
+    uint32_t fallback[BUDDY_MAX_ZONES];                 /**< Zone indices in allocation order */
+    uint64_t hhdm_offset;                               /**< Higher-half direct mapping offset */
 } buddy_allocator_t;
 
-void buddy_init(buddy_allocator_t* allocator, void* pool_start, size_t pool_size, uint64_t hhdm_offset);
+void buddy_init(buddy_allocator_t* allocator, uint64_t hhdm_offset);
+int buddy_add_zone(buddy_allocator_t* allocator, void* pool_start, size_t pool_size);
 void* buddy_alloc(buddy_allocator_t* allocator, size_t size);
 void buddy_free(buddy_allocator_t* allocator, void* ptr, uint32_t order);
 size_t buddy_get_free_memory(buddy_allocator_t* allocator);
 size_t buddy_get_total_memory(buddy_allocator_t* allocator);
 
+uint32_t buddy_zone_count(buddy_allocator_t* allocator);
+buddy_zone_t* buddy_get_zone(buddy_allocator_t* allocator, uint32_t index);
+buddy_zone_t* buddy_find_zone(buddy_allocator_t* allocator, void* ptr);
+size_t buddy_zone_free_memory(buddy_zone_t* zone);
+// Free block count per order, copied under the zone lock so splits and merges cannot tear it
+void buddy_zone_free_areas(buddy_zone_t* zone, size_t counts[BUDDY_MAX_ORDER + 1]);
+page_desc_t* buddy_page_desc(buddy_allocator_t* allocator, void* ptr);
+
 #endif
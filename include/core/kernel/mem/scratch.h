@@ -0,0 +1,27 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCRATCH_MAX_CPUS    64
+#define SCRATCH_ARENA_ORDER 4   // 2^4 pages (64 KiB) per CPU
+#define SCRATCH_ALIGN       16
+
+typedef uint32_t scratch_mark_t;
+
+/*
+ * Per-CPU bump arenas for buffers that live only for the duration of a call.
+ * Take a mark, allocate, then reset to the mark on every exit path; nested
+ * users simply stack on top. Memory must not be kept past the reset, handed to
+ * another CPU, or held across anything that could switch away from this CPU.
+ * Allocation returns NULL when the arena is full or not set up yet; `align`
+ * must be a power of two.
+ */
+void           scratch_cpu_init(uint32_t cpu_id);
+scratch_mark_t scratch_mark(void);
+void*          scratch_alloc(size_t size);
+void*          scratch_alloc_aligned(size_t size, size_t align);
+void           scratch_reset(scratch_mark_t mark);
+
+#endif // SCRATCH_H
@@ -9,6 +9,36 @@
 #define SLAB_PAGE_SIZE    4096
 #define SLAB_MAGIC        0x5AB50BEC
 #define SLAB_MAX_CPUS     64
+#define SLAB_MAG_ROUNDS   30   // Objects per magazine (struct fills 256 bytes)
+#define SLAB_DEPOT_MAX_FULL 16 // Full magazines kept per cache before flushing to pages
+
+#define KMEM_MAX_CACHES     32 // Includes the SLAB_SIZES_COUNT kmalloc caches
+#define KMEM_NAME_LEN       24
+#define KMEM_MAX_SLAB_ORDER 3  // Largest slab is 2^3 pages (32 KiB)
+#define KMEM_MIN_OBJS       4  // Objects per slab a cache aims for before accepting waste
+
+typedef struct kmem_cache kmem_cache_t;
+
+typedef struct kmem_cache_stats {
+    const char* name;
+    size_t obj_size;        /**< Requested object size */
+    size_t stride;          /**< Bytes each object occupies in a slab */
+    size_t align;
+    size_t slab_size;       /**< Bytes per slab (one or more pages) */
+    size_t objs_per_slab;
+    size_t slab_count;      /**< Slabs currently backing the cache */
+    size_t alloc_count;     /**< Objects handed out since creation */
+    size_t free_count;      /**< Objects returned since creation */
+    size_t depot_full;      /**< Full magazines parked in the depot */
+    size_t depot_empty;     /**< Empty magazines parked in the depot */
+} kmem_cache_stats_t;
+
+typedef struct kmem_cache_cpu_stats {
+    uint32_t loaded_rounds;     /**< Objects in the CPU's loaded magazine */
+    uint32_t previous_rounds;   /**< Objects in the CPU's previous magazine */
+    size_t alloc_count;
+    size_t free_count;
+} kmem_cache_cpu_stats_t;
 
 void  slab_init(void);
 void* slab_alloc(size_t size);
@@ -19,4 +49,18 @@ void  slab_cpu_init(uint32_t cpu_id);
 void* slab_alloc_cpu(uint32_t cpu_id, size_t size);
 void  slab_free_cpu(void* ptr);
 
+/*
+ * Typed object caches. Objects are `size` bytes aligned to `align` (0 means
+ * 8). When `ctor` is given it runs once per object as slabs are created, and
+ * callers must free objects back in their constructed state.
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*));
+void*         kmem_cache_alloc(kmem_cache_t* cache);
+void          kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+uint32_t      kmem_cache_count(void);
+kmem_cache_t* kmem_cache_get(uint32_t index);
+void          kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* out);
+int           kmem_cache_get_cpu_stats(kmem_cache_t* cache, uint32_t cpu_id, kmem_cache_cpu_stats_t* out);
+
 #endif
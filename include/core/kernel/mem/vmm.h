@@ -0,0 +1,70 @@
+#ifndef VMM_H
+#define VMM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define VMM_PAGE_SIZE      4096ULL
+#define VMM_LARGE_PAGE     (2ULL * 1024 * 1024)
+
+// Page-table entry bits
+#define PTE_PRESENT        (1ULL << 0)
+#define PTE_WRITE          (1ULL << 1)
+#define PTE_USER           (1ULL << 2)
+#define PTE_PWT            (1ULL << 3)
+#define PTE_PCD            (1ULL << 4)
+#define PTE_ACCESSED       (1ULL << 5)
+#define PTE_DIRTY          (1ULL << 6)
+#define PTE_LARGE          (1ULL << 7)   /**< PS bit in a PDE: 2 MiB page */
+#define PTE_GLOBAL         (1ULL << 8)
+#define PTE_NX             (1ULL << 63)  /**< Dropped when EFER.NXE is off */
+#define PTE_ADDR_MASK      0x000FFFFFFFFFF000ULL
+
+#define VMM_KERNEL_RW      (PTE_PRESENT | PTE_WRITE | PTE_NX)
+#define VMM_KERNEL_MMIO    (PTE_PRESENT | PTE_WRITE | PTE_PCD | PTE_NX)
+
+/*
+ * vmalloc space: one 16 TiB window in its own PML4 slots, clear of the HHDM
+ * (0xffff800000000000) and the kernel image (0xffffffff80000000). Every area
+ * is followed by at least one unmapped guard page.
+ */
+#define VMALLOC_START      0xffffc00000000000ULL
+#define VMALLOC_END        0xffffd00000000000ULL
+
+typedef struct vmm_stats {
+    size_t total;           /**< Size of the vmalloc window */
+    size_t used;            /**< Bytes mapped by live areas */
+    size_t huge;            /**< Of `used`, bytes mapped with 2 MiB pages */
+    size_t area_count;      /**< Live areas */
+    size_t purge_count;     /**< Freed areas waiting for every CPU to flush */
+    size_t largest_free;    /**< Largest reusable gap in the window */
+} vmm_stats_t;
+
+void     vmm_init(void);
+bool     vmm_ready(void);
+
+// Single mappings in the kernel page tables; `virt` and `phys` must be aligned
+int      vmm_map_page(uintptr_t virt, uint64_t phys, uint64_t flags);
+int      vmm_map_large(uintptr_t virt, uint64_t phys, uint64_t flags);
+uint64_t vmm_unmap_page(uintptr_t virt);
+uint64_t vmm_virt_to_phys(uintptr_t virt);
+
+/*
+ * Virtually contiguous allocations. vmalloc() builds the area from scattered
+ * order-0 pages; vmalloc_huge() uses 2 MiB pages where the page allocator can
+ * supply them and falls back to 4 KiB pages otherwise. vmap() maps an existing
+ * physical range (device memory, module images) using 2 MiB pages wherever
+ * both addresses allow. All three are released with vfree().
+ */
+void*    vmalloc(size_t size);
+void*    vmalloc_huge(size_t size);
+void*    vmap(uint64_t phys, size_t size, uint64_t flags);
+void     vfree(void* ptr);
+bool     is_vmalloc_addr(const void* ptr);
+
+// Reloads CR3 if another CPU has unmapped vmalloc pages since the last call
+void     vmm_sync_tlb(void);
+void     vmm_get_stats(vmm_stats_t* out);
+
+#endif // VMM_H
@@ -3,6 +3,7 @@
 #ifndef NVM_H
 #define NVM_H
 
+#include <core/kernel/hrtimer.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -25,6 +26,7 @@ typedef struct {
     uint8_t pid;
     int32_t fp;
     uint8_t wakeup_reason;
+    hrtimer_t timeout;          // Armed by SLEEP and MSG_RECV_TIMEOUT
     
     // Capabilities
     uint16_t capabilities[MAX_CAPS];
@@ -35,17 +37,19 @@ typedef struct {
     uint32_t heap_size;
 } nvm_process_t;
 
-extern nvm_process_t processes[MAX_PROCESSES];
+extern nvm_process_t* processes[MAX_PROCESSES];
 extern uint8_t current_process;
 
 int nvm_create_process(uint8_t* bytecode, uint32_t size, uint16_t initial_caps[], uint8_t caps_count);
 int nvm_create_process_with_stack(uint8_t* bytecode, uint32_t size, uint16_t initial_caps[], uint8_t caps_count, int32_t* initial_stack_values, uint16_t stack_count);
 bool nvm_execute_instruction(nvm_process_t* proc);
 void nvm_scheduler_tick();
+bool nvm_has_runnable(void);
 nvm_process_t* nvm_get_process(uint8_t pid);
 void nvm_execute(uint8_t* bytecode, uint32_t size, uint16_t* capabilities, uint8_t caps_count);
 int32_t nvm_get_exit_code(uint8_t pid);
 bool nvm_is_process_active(uint8_t pid);
 void nvm_init(void);
+void nvm_heap_free(uint8_t* heap);
 
 #endif
\ No newline at end of file
@@ -19,6 +19,8 @@
 #define SYS_PORT_IN_BYTE    0x0C
 #define SYS_PORT_OUT_BYTE   0x0D
 #define SYS_PRINT           0x0E
+#define SYS_SLEEP           0x0F
+#define SYS_MSG_RECV_TIMEOUT 0x10
 
 int32_t syscall_handler(uint8_t syscall_id, nvm_process_t* proc);
 
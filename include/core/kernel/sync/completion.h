@@ -0,0 +1,40 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/kernel/sync/waitqueue.h>
+
+#define COMPLETION_ALL  0x7FFFFFFFu   // `done` after complete_all()
+
+/*
+ * One-shot event for I/O: the submitter waits, the side that sees the
+ * request finish calls complete(). Each wait consumes one complete();
+ * after complete_all() every wait succeeds until reinit_completion().
+ */
+typedef struct completion {
+    volatile uint32_t done;
+    waitqueue_t       wait;
+} completion_t;
+
+// Runs between checks of a polled wait; stands in for an interrupt handler
+typedef void (*completion_poll_t)(void* arg);
+
+void init_completion(completion_t* c);
+void reinit_completion(completion_t* c);
+void complete(completion_t* c);
+void complete_all(completion_t* c);
+
+bool try_wait_for_completion(completion_t* c);
+void wait_for_completion(completion_t* c);
+// Returns false if `timeout_ms` passes first
+bool wait_for_completion_timeout(completion_t* c, uint32_t timeout_ms);
+
+/*
+ * For devices driven without interrupts: `poll` is called before every
+ * check and is expected to reap finished requests and complete() them.
+ * Once the device raises interrupts the same waits can drop the hook.
+ */
+bool wait_for_completion_polled(completion_t* c, completion_poll_t poll, void* arg, uint32_t timeout_ms);
+
+#endif // COMPLETION_H
@@ -0,0 +1,28 @@
+#ifndef MUTEX_H
+#define MUTEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/kernel/sync/waitqueue.h>
+
+/*
+ * Sleeping mutex for kernel code that may wait on I/O while holding it.
+ * Contended lockers wait on `waiters` rather than hammering the lock word,
+ * and interrupts stay enabled throughout. Not for interrupt handlers.
+ */
+typedef struct mutex {
+    volatile uint32_t locked;
+    uint32_t          owner;      /**< CPU holding the mutex, for diagnostics */
+    waitqueue_t       waiters;
+} mutex_t;
+
+void mutex_init(mutex_t* m);
+void mutex_lock(mutex_t* m);
+bool mutex_trylock(mutex_t* m);
+void mutex_unlock(mutex_t* m);
+
+static inline bool mutex_is_locked(mutex_t* m) {
+    return __atomic_load_n(&m->locked, __ATOMIC_RELAXED) != 0;
+}
+
+#endif // MUTEX_H
@@ -0,0 +1,26 @@
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/kernel/sync/waitqueue.h>
+
+// Counting semaphore; sem_up() may be called from interrupt handlers
+typedef struct semaphore {
+    volatile int32_t count;
+    waitqueue_t      waiters;
+} semaphore_t;
+
+void sem_init(semaphore_t* sem, int32_t count);
+void sem_down(semaphore_t* sem);
+bool sem_down_timeout(semaphore_t* sem, uint32_t timeout_ms);
+bool sem_try_down(semaphore_t* sem);
+void sem_up(semaphore_t* sem);
+
+/*
+ * For syscalls: takes a unit or parks `proc` and returns false, in which case
+ * the syscall should report "try again" and be retried once the process runs.
+ */
+bool sem_down_or_park(semaphore_t* sem, nvm_process_t* proc);
+
+#endif // SEMAPHORE_H
@@ -0,0 +1,100 @@
+#ifndef WAITQUEUE_H
+#define WAITQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <core/arch/spinlock.h>
+#include <core/kernel/nvm/nvm.h>
+
+#define WAKE_REASON_EVENT   1   // nvm_process_t.wakeup_reason after a wake_up()
+#define WAKE_REASON_TIMEOUT 2   // ... after its timeout hrtimer fired
+
+/*
+ * There are no kernel threads to put to sleep, so waiting takes one of two
+ * forms. An NVM process is parked: it is marked blocked, queued here, and
+ * the scheduler skips it until a wake_up() pops it. Kernel code waits in
+ * place: it re-checks its condition each time `seq` moves, with a deadline
+ * measured in milliseconds rather than loop iterations.
+ */
+typedef struct waitqueue {
+    spinlock_t        lock;
+    volatile uint32_t seq;                  /**< Bumped by every wake-up */
+    volatile uint64_t idle_cpus;            /**< CPUs halted in waitqueue_idle() */
+    uint8_t           procs[MAX_PROCESSES]; /**< FIFO of parked pids */
+    uint8_t           head;
+    uint8_t           count;
+} waitqueue_t;
+
+void     waitqueue_init(waitqueue_t* wq);
+
+// Blocks `proc`; the caller returns to the scheduler and the process resumes once woken
+void     waitqueue_park(waitqueue_t* wq, nvm_process_t* proc);
+
+// wake_up() releases the oldest parked process, wake_up_all() every one; both rouse kernel waiters
+void     wake_up(waitqueue_t* wq);
+void     wake_up_all(waitqueue_t* wq);
+
+static inline uint32_t waitqueue_seq(waitqueue_t* wq) {
+    return __atomic_load_n(&wq->seq, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Waits until a wake-up moves `wq->seq` past `seq` or `deadline` (from
+ * wait_deadline()) passes. Returns false on timeout.
+ */
+bool     waitqueue_wait(waitqueue_t* wq, uint32_t seq, uint64_t deadline);
+
+// One step of a kernel wait; the single place a scheduler would switch away
+void     wait_yield(void);
+
+/*
+ * One step of a wait whose wake-up an interrupt delivers: runs pending
+ * softirqs, then halts until the next interrupt or for `max_ns`, unless
+ * `wq->seq` has already moved past `seq`. A wake-up from another CPU sends
+ * an IPI. Where halting is not safe (interrupts off, inside an epoch read
+ * section, no APIC) this is wait_yield().
+ */
+void     waitqueue_idle(waitqueue_t* wq, uint32_t seq, uint64_t max_ns);
+
+/*
+ * Deadlines come from the APIC millisecond tick. Without an APIC the tick
+ * never advances, so wait_expired() falls back to counting yields at a rough
+ * WAIT_YIELDS_PER_MS per millisecond.
+ */
+#define WAIT_FOREVER        UINT64_MAX
+#define WAIT_YIELDS_PER_MS  2000
+
+uint64_t wait_deadline(uint32_t timeout_ms);
+bool     wait_expired(uint64_t deadline);
+
+/*
+ * Kernel-side condition waits. `cond` is evaluated before every wait and
+ * after every wake-up on `wq`; the waker must change the state behind
+ * `cond` before calling wake_up(). wait_event_timeout() yields true if
+ * `cond` held, false if `ms` milliseconds passed first.
+ */
+#define wait_event(wq, cond)                                        \
+    do {                                                            \
+        for (;;) {                                                  \
+            uint32_t __seq = waitqueue_seq(wq);                     \
+            if (cond) break;                                        \
+            waitqueue_wait((wq), __seq, WAIT_FOREVER);              \
+        }                                                           \
+    } while (0)
+
+#define wait_event_timeout(wq, cond, ms)                            \
+    ({                                                              \
+        uint64_t __deadline = wait_deadline(ms);                    \
+        bool __ok;                                                  \
+        for (;;) {                                                  \
+            uint32_t __seq = waitqueue_seq(wq);                     \
+            if ((__ok = (cond))) break;                             \
+            if (!waitqueue_wait((wq), __seq, __deadline)) {         \
+                __ok = (cond);                                      \
+                break;                                              \
+            }                                                       \
+        }                                                           \
+        __ok;                                                       \
+    })
+
+#endif // WAITQUEUE_H
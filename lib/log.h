@@ -24,16 +24,34 @@
 static char log_buffer[MAX_LOG_SIZE];
 static size_t log_size = 0;
 
-static inline void syslog_print(const char* message) {
-    if (!message) return;
-    
+// Serializes log lines across CPUs; defined next to kprint() in kstd.c
+uint64_t log_lock_acquire(void);
+void     log_lock_release(uint64_t flags);
+bool     log_may_publish(void);
+
+static bool log_publishing = false;
+
+// Called under the log lock; the buffer only grows, so the prefix it returns stays valid
+static inline size_t syslog_append(const char* message) {
     int i = 0;
     while (message[i] != '\0' && log_size < MAX_LOG_SIZE - 1) {
         log_buffer[log_size++] = message[i++];
     }
     log_buffer[log_size] = '\0';
-    
-    vfs_create("/var/log/system.log", log_buffer, log_size);
+    return log_size;
+}
+
+/*
+ * Called without the log lock, since vfs_create() allocates and may log.
+ * A line logged while another publish is running, or from a context that
+ * must not touch the filesystem, is left to the next publish, which covers
+ * the whole buffer anyway.
+ */
+static inline void syslog_publish(size_t size) {
+    if (!log_may_publish()) return;
+    if (__atomic_exchange_n(&log_publishing, true, __ATOMIC_ACQUIRE)) return;
+    vfs_create("/var/log/system.log", log_buffer, size);
+    __atomic_store_n(&log_publishing, false, __ATOMIC_RELEASE);
 }
 
 static inline char* utoa_hex(uintptr_t num, char* str) {
@@ -183,8 +201,11 @@ static inline void log_format_basic(const char* level, const char* format, ...)
     va_end(args);
     
     buffer[buf_pos] = '\0';
+    uint64_t flags = log_lock_acquire();
     serial_print(buffer);
-    syslog_print(buffer);
+    size_t size = syslog_append(buffer);
+    log_lock_release(flags);
+    syslog_publish(size);
 }
 
 static inline void syslog_init(void) {